@@ -14,3 +14,4 @@
 package ifneeded app-comp        1.0 [list source [file join $dir comp_startup.tcl]]
 package ifneeded procomp         1.0 [list source [file join $dir procomp.tcl]]
 package ifneeded procomp::config 1.0 [list source [file join $dir procomp_config.tcl]]
+package ifneeded procomp::server 1.0 [list source [file join $dir procomp_server.tcl]]
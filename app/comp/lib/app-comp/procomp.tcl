@@ -42,7 +42,9 @@ namespace eval procomp {
     variable headerType auto 
     variable byteCodeExtension .tbc
     variable forceWrite 0
-    variable input      cmdline ;# Where input comes from (files on the cmdline, or stdin)
+    variable cacheDir   {}      ;# Compile cache directory, {} if none
+    variable input      cmdline ;# Where input comes from (files on the cmdline, stdin, or server)
+    variable server     {}      ;# Compile server spec (stdio), {} if none
 
     # This is the tag pattern that is recognized by the 'tag' header type.
     # The tag must appear on a comment line by itself.
@@ -64,6 +66,9 @@ namespace eval procomp {
   -             Take input from stdin instead of from files on the command line.
                 If -out is present in this mode the result will be written to
                 this file, else it will be written to stdout.
+  -cache dir	keep the compiled files in the cache directory 'dir', and
+		reuse them for unchanged input files instead of compiling
+		them again.
   -force	force overwrite; if the output file exists, delete it.
   -help		print this help message.
   -nologo	suppress copyright banner.
@@ -89,6 +94,11 @@ namespace eval procomp {
 		Any other value for type is assumed to be a path to a
 		file that will be used as the output file prefix.
   -quiet	suppress warnings about non-existent files
+  -server spec	run as a compile server, accepting compile requests
+		instead of compiling files from the command line. 'spec'
+		must be 'stdio': requests are read from stdin and replies
+		written to stdout. The other options apply to all
+		requests.
   -verbose	verbose mode: messages are generated to log progress.
   pathN		one or more files to compile."
 }
@@ -108,11 +118,17 @@ proc procomp::run { {argList {}} } {
     variable fileList
     variable input
     variable outPath
+    variable server
 
     if {[init $argList] == 0} {
 	return 0
     }
 
+    if {[string equal $input server]} {
+	package require procomp::server
+	return [procomp::server::run $server]
+    }
+
     # Bugzilla 25844: New option '-', read code to compile from stdin,
     # and possibly write it to stdout.
 
@@ -176,12 +192,7 @@ proc procomp::run { {argList {}} } {
 	return 1
     }
 
-    foreach file $fileList {
-	if {![fileCompile $file]} {
-	    return 0
-	}
-    }
-    return 1
+    return [batchCompile $fileList]
 }
 
 # procomp::setLogProc --
@@ -241,8 +252,10 @@ proc procomp::init { {argList {}} } {
     variable tagValue
     variable logProc
     variable forceWrite
+    variable cacheDir
     variable usage
     variable input
+    variable server
 
     set quiet 0
 
@@ -266,10 +279,11 @@ proc procomp::init { {argList {}} } {
     # flags
 
     set optionList {
-	? f force h help n nologo o.arg out.arg p.arg prefix.arg
+	? c.arg cache.arg f force h help n nologo o.arg out.arg p.arg
+	prefix.arg
 	config.arg
 	%%.arg
-	q quiet v verbose {}
+	q quiet v verbose server.arg {}
     }
 
     set input cmdline
@@ -311,6 +325,10 @@ proc procomp::init { {argList {}} } {
 		    log $usage
 		    return 1
 		}
+		c -
+		cache {
+		    set cacheDir $arg
+		}
 		f -
 		force {
 		    set forceWrite 1
@@ -342,6 +360,15 @@ proc procomp::init { {argList {}} } {
 		    set isVerbose 1
 		}
 
+		server {
+		    # The banner would precede the first reply of a
+		    # server on stdio.
+
+		    set input server
+		    set server $arg
+		    set projectInfo::printCopyright 0
+		}
+
 		config {
 		    # Here we check existence of configuration files,
 		    # convert their contents into option sequences,
@@ -411,6 +438,15 @@ proc procomp::init { {argList {}} } {
 		return 0
 	    }
 	}
+    } elseif {[string equal $input server]} {
+	if {[llength $fileList] > 0} {
+	    logError "Running as a compile server is not consistent with specifying files to compile"
+	    return 0
+	}
+	if {[info exists outPath] && (($outPath eq "stdout") || ![file isdir $outPath])} {
+	    logError "-out must specify a directory when running as a compile server"
+	    return 0
+	}
     } else {
 	# Bugzilla 25844: New option '-', reading code to compile
 	#            from stdin, and possibly write it to stdout.
@@ -446,6 +482,20 @@ proc procomp::init { {argList {}} } {
 	}
     }
 
+    # Set up the compile cache, if requested and supported by the
+    # compiler package.
+
+    if {$cacheDir ne {}} {
+	if {![llength [info commands ::compiler::cache]]} {
+	    logError "warning: compile cache not supported, -cache ignored"
+	} elseif {[catch {
+	    ::compiler::cache configure -directory $cacheDir
+	} err] == 1} {
+	    logError "error: bad cache directory: $err"
+	    return 0
+	}
+    }
+
     return 1
 }
 
@@ -536,37 +586,152 @@ proc procomp::logError { msg } {
 #  Returns 1 on success, 0 on failure.
 
 proc procomp::fileCompile { path {outputFile {}} } {
-    variable outPath
-    variable byteCodeExtension
+    if {[catch {
+	set job [prepareCompile $path $outputFile]
+    } err] == 1} {
+	logError "compilation of \"$path\" failed: $err"
+	return 0
+    }
+    foreach {inputFile outputFile preamble tmpFile} $job break
+
+    set cmd [list ::compiler::compile]
+    if {[llength $preamble]} {
+	lappend cmd -preamble [lindex $preamble 0]
+    }
+    lappend cmd $inputFile $outputFile
+
+    # and finally run the compile
+    set ok [expr {![catch {uplevel #0 $cmd} err]}]
+
+    if {$tmpFile != {}} {
+	file delete $tmpFile
+    }
+    if {!$ok} {
+	logError "compilation of \"$path\" failed: $err"
+	return 0
+    }
+
+    log "compiled: $path to $outputFile"
+    return 1
+}
+
+# procomp::batchCompile --
+#
+#  Compiles a list of files with a single call to compiler::compileFiles,
+#  which shares the compiler setup between the files, or to
+#  compiler::compileParallel, which spreads them over one worker thread
+#  per processor, if the compiler package provides it. A failure does not
+#  stop the compilation of the remaining files.
+#
+# Arguments:
+#  paths	the paths to the files to compile.
+#
+# Results:
+#  Returns 1 on success, 0 if any file failed.
+
+proc procomp::batchCompile { paths } {
+    variable cacheDir
+
+    set ok 1
+    set jobs {}
+    set tmpFiles {}
+    set sources {}
+
+    foreach path $paths {
+	if {[catch {
+	    set job [prepareCompile $path]
+	} err] == 1} {
+	    logError "compilation of \"$path\" failed: $err"
+	    set ok 0
+	    continue
+	}
+	foreach {inputFile outputFile preamble tmpFile} $job break
+
+	lappend jobs [concat [list $inputFile $outputFile] $preamble]
+	lappend sources $path $outputFile
+	if {$tmpFile != {}} {
+	    lappend tmpFiles $tmpFile
+	}
+    }
+
+    if {[llength [info commands ::compiler::compileParallel]]} {
+	set cmd ::compiler::compileParallel
+    } else {
+	set cmd ::compiler::compileFiles
+    }
+    if {[catch {
+	set results [uplevel #0 [list $cmd $jobs]]
+    } err] == 1} {
+	logError "compilation failed: $err"
+	set results {}
+	set ok 0
+    }
+
+    # The results are in the order of the jobs.
+
+    foreach {path outputFile} $sources result $results {
+	if {$result eq {}} break
+
+	array set info $result
+	if {$info(status) eq "ok"} {
+	    log "compiled: $path to $outputFile"
+	} else {
+	    logError "compilation of \"$path\" failed: $info(error)"
+	    set ok 0
+	}
+	unset info
+    }
+
+    foreach tmpFile $tmpFiles {
+	file delete $tmpFile
+    }
+
+    if {($cacheDir ne {}) && [llength [info commands ::compiler::cache]]} {
+	array set stats [::compiler::cache stats]
+	log "compile cache: $stats(hits) hits, $stats(misses) misses"
+    }
+    return $ok
+}
+
+# procomp::prepareCompile --
+#
+#  Determines everything needed to compile a file: the actual input file
+#  (a temporary copy if the result has to be timebombed), the output file
+#  and the preamble.
+#
+# Arguments:
+#  path		the path to the file to compile.
+#  outputFile	(optional) the output file name, as for fileCompile.
+#
+# Results:
+#  Returns a list {inputFile outputFile preamble tmpFile}. The preamble
+#  is a list of zero or one elements; tmpFile is empty if no temporary
+#  file was created. Throws on error.
+
+proc procomp::prepareCompile { path {outputFile {}} } {
     variable headerType
     variable headerValue
     variable forceWrite
     variable code_bomb
 
-    set cmd ::compiler::compile
-
     # Get the preamble if any
 
-    if {[catch {
-	switch -- $headerType {
-	    none {
-	    }
+    switch -- $headerType {
+	none {
+	    set preamble {}
+	}
 
-	    auto {
-		lappend cmd -preamble [getAutoHeader $path]
-	    }
+	auto {
+	    set preamble [list [getAutoHeader $path]]
+	}
 
-	    tag {
-		lappend cmd -preamble [getTagHeader $path]
-	    }
+	tag {
+	    set preamble [list [getTagHeader $path]]
+	}
 
-	    default {
-		lappend cmd -preamble $headerValue
-	    }
+	default {
+	    set preamble [list $headerValue]
 	}
-    } err] == 1} {
-	logError "compilation of \"$path\" failed: $err"
-	return 0
     }
 
     set outputFile [generateOutFileName $path $outputFile]
@@ -584,28 +749,15 @@ proc procomp::fileCompile { path {outputFile {}} } {
 
 	set inputFile $newpath
     } else {
+	set newpath {}
 	set inputFile $path
     }
 
-    lappend cmd $inputFile $outputFile
-
-    # and finally run the compile
-    if {[catch {
-	if {$forceWrite == 1} {
-	    file delete -force $outputFile
-	}
-	uplevel #0 $cmd
-    } err] == 1} {
-	logError "compilation of \"$path\" failed: $err"
-	return 0
+    if {$forceWrite == 1} {
+	file delete -force $outputFile
     }
 
-    log "compiled: $path to $outputFile"
-
-    if {$code_bomb != {}} {
-	file delete $newpath
-    }
-    return 1
+    return [list $inputFile $outputFile $preamble $newpath]
 }
 
 # procomp::generateOutFileName --
@@ -0,0 +1,292 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+# procomp_server.tcl --
+#
+#  Compile server for the Tcl Dev Kit bytecode compiler. Keeps a compiler
+#  running and accepts compile requests on stdin, so that callers
+#  compiling single files (editor save hooks, incremental builds) do not
+#  pay the startup of the compiler for each. There is no socket mode: the
+#  server writes wherever its requests say, so only the process that
+#  started it may talk to it.
+#
+#  Requests and replies are Tcl lists, one per line. A request starts with
+#  an id chosen by the client, which the reply repeats:
+#
+#	id compile inputFile ?outputFile?
+#		Compiles a file, as the command line compiler would, with
+#		the options the server was started with (-prefix, -force,
+#		-out, -cache). The reply is
+#		    id status ok time usec elapsed usec output outputFile
+#		or
+#		    id status error time usec elapsed usec error message
+#		'time' is the compile time, 'elapsed' the time from the
+#		receipt of the request to the reply, both in microseconds.
+#	id ping
+#		Replies "id status ok".
+#	id shutdown
+#		Answers the queued requests, replies "id status ok" and
+#		stops the server.
+#
+#  Requests received while a compile is running are queued, and compiled
+#  together once it is done, on one thread per processor if the compiler
+#  package supports it. Concurrency is per batch, not per request: a
+#  request arriving while a batch runs waits for the whole batch to finish,
+#  however short its own compile, and its reply comes only after that.
+#
+
+package require procomp
+package provide procomp::server 1.0
+
+namespace eval procomp::server {
+    # The queue of compile requests, a list of {chan id start inputFile
+    # outputFile}, and whether a dispatch of the queue is scheduled.
+
+    variable queue {}
+    variable scheduled 0
+
+    # Set by the 'shutdown' request, or when stdin or stdout is closed.
+
+    variable done 0
+}
+
+# procomp::server::run --
+#
+#  Runs the compile server until it is shut down.
+#
+# Arguments:
+#  spec		"stdio", to read requests from stdin and write replies to
+#		stdout. No other transport is supported.
+#
+# Results:
+#  Returns 1 on success, 0 on failure.
+
+proc procomp::server::run { spec } {
+    variable done
+
+    if {$spec ne "stdio"} {
+	procomp::logError "bad compile server \"$spec\": must be stdio"
+	return 0
+    }
+    Listen stdin stdout
+
+    vwait [namespace current]::done
+    return 1
+}
+
+# procomp::server::Listen --
+#
+#  Starts reading requests from a channel.
+#
+# Arguments:
+#  in		the channel to read requests from.
+#  out		the channel to write replies to.
+#
+# Results:
+#  None.
+
+proc procomp::server::Listen { in out } {
+    fconfigure $in  -blocking 0 -buffering line
+    fconfigure $out -buffering line
+    fileevent $in readable [namespace code [list Receive $in $out]]
+}
+
+# procomp::server::Receive --
+#
+#  Reads the requests available on a channel. Compile requests are
+#  queued; the others are answered at once.
+#
+# Arguments:
+#  in		the channel to read requests from.
+#  out		the channel to write replies to.
+#
+# Results:
+#  None.
+
+proc procomp::server::Receive { in out } {
+    variable queue
+    variable scheduled
+    variable done
+
+    while {[gets $in line] >= 0} {
+	set start [clock clicks -microseconds]
+	if {[string trim $line] eq ""} continue
+
+	if {[catch {llength $line}] || ([llength $line] < 2)} {
+	    Reply $out [list {} status error error "bad request \"$line\""]
+	    continue
+	}
+	set id [lindex $line 0]
+	set args [lrange $line 2 end]
+
+	switch -exact -- [lindex $line 1] {
+	    compile {
+		if {([llength $args] < 1) || ([llength $args] > 2)} {
+		    Reply $out [list $id status error error \
+			    "wrong # args: should be \"id compile inputFile ?outputFile?\""]
+		    continue
+		}
+		lappend queue [list $out $id $start \
+			[lindex $args 0] [lindex $args 1]]
+		if {!$scheduled} {
+		    set scheduled 1
+		    after idle [namespace code Dispatch]
+		}
+	    }
+	    ping {
+		Reply $out [list $id status ok]
+	    }
+	    shutdown {
+		# Answer the queued requests first.
+		if {$scheduled} {
+		    Dispatch
+		}
+		Reply $out [list $id status ok]
+		set done 1
+	    }
+	    default {
+		Reply $out [list $id status error error \
+			"bad request \"[lindex $line 1]\": must be compile, ping, or shutdown"]
+	    }
+	}
+    }
+
+    if {[eof $in]} {
+	fileevent $in readable {}
+	if {$scheduled} {
+	    Dispatch
+	}
+	set done 1
+    }
+}
+
+# procomp::server::Dispatch --
+#
+#  Compiles the queued requests, as a single batch, and replies to each.
+#  Requests for the same output file are compiled once, and all get the
+#  same reply, so that no two workers write the same file.
+#
+# Arguments:
+#  None.
+#
+# Results:
+#  None.
+
+proc procomp::server::Dispatch {} {
+    variable queue
+    variable scheduled
+
+    set requests $queue
+    set queue {}
+    set scheduled 0
+
+    # Prepare the jobs. A request failing here is answered at once.
+    # 'pending' holds the output file and temporary file of each job, and
+    # 'waiting' the requests to answer with its result, a list of {out id
+    # start} for each job, indexed by the normalized output file.
+
+    set jobs {}
+    set pending {}
+    array set waiting {}
+    foreach request $requests {
+	foreach {out id start path outputFile} $request break
+	if {[catch {
+	    set job [procomp::prepareCompile $path $outputFile]
+	} err] == 1} {
+	    Reply $out [list $id status error time 0 \
+		    elapsed [Elapsed $start] error $err]
+	    continue
+	}
+	foreach {inputFile outputFile preamble tmpFile} $job break
+	set key [file normalize $outputFile]
+	if {![info exists waiting($key)]} {
+	    lappend jobs [concat [list $inputFile $outputFile] $preamble]
+	    lappend pending [list $key $outputFile $tmpFile]
+	} elseif {$tmpFile != {}} {
+	    file delete $tmpFile
+	}
+	lappend waiting($key) [list $out $id $start]
+    }
+    if {![llength $jobs]} return
+
+    # Several jobs are spread over worker threads, a single one is
+    # compiled right here.
+
+    if {([llength $jobs] > 1)
+	    && [llength [info commands ::compiler::compileParallel]]} {
+	set cmd ::compiler::compileParallel
+    } else {
+	set cmd ::compiler::compileFiles
+    }
+    set failure "no result from the compiler"
+    if {[catch {
+	set results [uplevel #0 [list $cmd $jobs]]
+    } err] == 1} {
+	set failure $err
+	set results {}
+    }
+
+    # The results are in the order of the jobs.
+
+    foreach item $pending result $results {
+	foreach {key outputFile tmpFile} $item break
+	if {$tmpFile != {}} {
+	    file delete $tmpFile
+	}
+	if {$result eq {}} {
+	    set reply [list status error time 0]
+	    set tail [list error $failure]
+	} else {
+	    array set info $result
+	    set reply [list status $info(status) time $info(time)]
+	    if {$info(status) eq "ok"} {
+		set tail [list output $outputFile]
+	    } else {
+		set tail [list error $info(error)]
+	    }
+	    unset info
+	}
+
+	foreach waiter $waiting($key) {
+	    foreach {out id start} $waiter break
+	    Reply $out [concat [list $id] $reply \
+		    [list elapsed [Elapsed $start]] $tail]
+	}
+    }
+}
+
+# procomp::server::Elapsed --
+#
+#  Computes the time elapsed since the receipt of a request.
+#
+# Arguments:
+#  start	the time of receipt, from [clock clicks -microseconds].
+#
+# Results:
+#  Returns the elapsed time in microseconds.
+
+proc procomp::server::Elapsed { start } {
+    return [expr {[clock clicks -microseconds] - $start}]
+}
+
+# procomp::server::Reply --
+#
+#  Writes a reply. If the client went away, the queued requests are
+#  dropped and the server stops.
+#
+# Arguments:
+#  out		the channel to write the reply to.
+#  reply	the reply, a list.
+#
+# Results:
+#  None.
+
+proc procomp::server::Reply { out reply } {
+    variable queue
+    variable done
+
+    if {[catch {puts $out $reply}]} {
+	set queue {}
+	set done 1
+    }
+}
@@ -65,9 +65,15 @@ typedef struct CmdTable
 
 static CONST CmdTable commands[] =
 {
+    { "bundle",			Compiler_BundleObjCmd,			1 },
+    { "cache",			Compiler_CacheObjCmd,			1 },
     { "compile",		Compiler_CompileObjCmd,			1 },
+    { "compileFiles",		Compiler_CompileFilesObjCmd,		1 },
+    { "compileParallel",	Compiler_CompileParallelObjCmd,		1 },
+    { "compileString",		Compiler_CompileStringObjCmd,		1 },
     { "getBytecodeExtension",	Compiler_GetBytecodeExtensionObjCmd,	1 },
     { "getTclVer",              Compiler_GetTclVerObjCmd,		1 },
+    { "memory",			Compiler_MemoryObjCmd,			1 },
     { 0, 0, 0 }
 };
 
@@ -27,8 +27,10 @@
  */
 #if (TCL_MAJOR_VERSION == 8) && (TCL_MINOR_VERSION < 6)
 #define ERRORLINE(interp) ((interp)->errorLine)
+#define SETERRORLINE(interp, line) ((interp)->errorLine = (line))
 #else
 #define ERRORLINE(interp) (Tcl_GetErrorLine(interp))
+#define SETERRORLINE(interp, line) (Tcl_SetErrorLine((interp), (line)))
 #endif
 
 /*
@@ -42,6 +44,7 @@ typedef struct ProcInfo {
     CompileProc *savedCompileProc;
 				/* A pointer to the original compile procedure
 				 * for the "proc" command. */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
 } ProcInfo;
 
 /*
@@ -67,25 +70,233 @@ typedef struct ObjRefInfo {
 } ObjRefInfo;
 
 /*
- * This struct holds the encoding context for a run of EmitByteSequence
+ * This struct holds the output context threaded through the Emit*
+ * procedures. Output is accumulated in a growable buffer; if a target
+ * channel is set, the buffer is written out to it in large blocks,
+ * otherwise all the output is kept in memory.
  */
 
-#define ENCODED_BUFFER_SIZE 72
+#define EMIT_BUFFER_SIZE 65536
 
-typedef struct A85EncodeContext {
-    Tcl_Channel target;		/* the target channel; when the encoding
-                                 * buffer is full, it is written out to it */
-    char *basePtr;		/* base of the encoding buffer */
-    char *curPtr;		/* current available position in the
-                                 * encoding buffer */
+/*
+ * With COMPILER_STREAM, the script is read STREAM_CHUNK_SIZE characters at
+ * a time, and its top-level commands are gathered into units of at least
+ * STREAM_UNIT_SIZE bytes of source, unless the script ends first. Each
+ * unit is compiled and written out before the next one is read.
+ */
+
+#define STREAM_CHUNK_SIZE 65536
+#define STREAM_UNIT_SIZE 65536
+
+typedef struct EmitContext {
+    Tcl_Channel target;		/* the target channel, or NULL if the output
+                                 * is to be kept in memory */
+    char *basePtr;		/* base of the output buffer */
+    char *curPtr;		/* current available position in the output
+                                 * buffer */
     char *endPtr;		/* one past the last available position in the
-                                 * buffer; when curPtr == endPtr, the buffer
-                                 * is full */
-    char separator;		/* written to the target channel after each
-                                 * flush of the encode buffer */
-    char encBuffer[ENCODED_BUFFER_SIZE];
-    				/* the encoding buffer */
-} A85EncodeContext;
+                                 * output buffer */
+    int flags;			/* OR-ed combination of COMPILER_* flags of
+                                 * the script being emitted */
+    Tcl_WideInt numWritten;	/* bytes written out to the target channel
+                                 * so far */
+} EmitContext;
+
+/*
+ * Makes sure that there is room for 'n' more bytes in the output buffer
+ * of an EmitContext; if not, the buffer is flushed or grown.
+ */
+
+#define EmitReserve(interp, emitPtr, n) \
+    ((((emitPtr)->endPtr - (emitPtr)->curPtr) >= (n)) ? TCL_OK \
+	    : EmitMakeRoom((interp), (emitPtr), (n)))
+
+/*
+ * The count of bytes emitted to an EmitContext so far.
+ */
+
+#define EmitTell(emitPtr) \
+    ((emitPtr)->numWritten + ((emitPtr)->curPtr - (emitPtr)->basePtr))
+
+/*
+ * The per-thread phase statistics, see Compiler_EnablePhaseStats. Time is
+ * charged to the current phase whenever the phase changes, so that nested
+ * phases are accounted exclusively. The bytes of a section are accounted
+ * the same way: 'counted' lets a section holding nested ByteCodes, such as
+ * the literals, subtract what those already accounted for.
+ */
+
+typedef struct PhaseStats {
+    int enabled;		/* non-zero if statistics are collected */
+    int phase;			/* the current COMPILER_PHASE_*, or -1 */
+    Tcl_Time mark;		/* when the current phase was last charged */
+    Tcl_WideInt counted;	/* bytes accounted to sections so far */
+    Compiler_PhaseStats totals;	/* the statistics */
+    struct CompileStats *collectPtr;
+				/* the compile statistics being collected,
+				 * see compiler::compile -stats; NULL if
+				 * none */
+} PhaseStats;
+
+static Tcl_ThreadDataKey phaseStatsKey;
+
+/*
+ * The structures of a compile's post-processing (the PostProcessInfo, the
+ * proc location list, the ProcBodyInfo array and the ObjRefInfo structs)
+ * are allocated from a per-thread arena, and released together at the end
+ * of the compile; compiles do not nest. The first block is kept for the
+ * next compile. See Compiler_MemoryObjCmd for the statistics.
+ */
+
+#define ARENA_BLOCK_SIZE	4096
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *nextPtr;	/* the block allocated before this one */
+    size_t size;		/* size of the data area */
+    size_t used;		/* bytes handed out from the data area */
+} ArenaBlock;
+
+#define ARENA_HEADER_SIZE	TCL_ALIGN(sizeof(ArenaBlock))
+
+typedef struct CompileArena {
+    ArenaBlock *blockPtr;	/* the current block, or NULL */
+    int exitHandler;		/* non-zero once the thread exit handler
+                                 * freeing the kept block is registered */
+    size_t used;		/* bytes handed out in the current compile */
+    size_t lastPeak;		/* bytes used by the last compile */
+    size_t maxPeak;		/* the most bytes used by one compile */
+    Tcl_WideInt numCompiles;	/* number of compiles released */
+} CompileArena;
+
+static Tcl_ThreadDataKey compileArenaKey;
+
+/*
+ * The statistics of a compile returned by compiler::compile -stats. They
+ * describe the ByteCodes as written out, after the literals are compacted
+ * and the optimizer has run; nested ByteCodes are counted separately.
+ */
+
+typedef struct CompileStats {
+    Tcl_WideInt instCounts[256];
+				/* number of instructions of each opcode */
+    int numByteCodes;		/* number of ByteCodes written out */
+    int numProcBodies;		/* number of precompiled proc bodies */
+    int numLiterals;		/* number of literals, not counting the
+                                 * nested ByteCodes and proc bodies */
+    Tcl_WideInt literalBytes;	/* bytes in the string reps of those */
+    int numExceptRanges;	/* number of exception ranges */
+    Tcl_HashTable auxDataTypes;	/* number of AuxData items, keyed by type
+                                 * name */
+    Tcl_WideInt bytes[COMPILER_NUM_PHASES];
+				/* bytes written in each EMIT_* phase */
+} CompileStats;
+
+/*
+ * A LiteralMap holds the literals of a ByteCode as they are written out:
+ * literals that no push instruction references are dropped, and identical
+ * literals are merged, with the push operands renumbered to match. The
+ * ByteCode itself is left alone; if nothing was dropped or merged, the map
+ * points to its arrays.
+ */
+
+typedef struct LiteralMap {
+    int numLitObjects;		/* number of literals written out */
+    Tcl_Obj **objArrayPtr;	/* the literals written out */
+    unsigned char *codeStart;	/* the bytecodes, with the push operands
+                                 * renumbered */
+} LiteralMap;
+
+/*
+ * A BinContext holds the state threaded through the BinEmit* procedures.
+ * With COMPILER_LAZY_PROCS, the proc bodies are not written inline but
+ * collected in a table, which is appended to the image after the ByteCode
+ * record; the table entries are filled in as the bodies are written.
+ */
+
+typedef struct BinContext {
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+    int numProcs;		/* number of entries in the proc table */
+    Tcl_DString procTable;	/* offset and length of each proc body */
+    Tcl_DString procBodies;	/* the proc body records */
+    Tcl_WideInt procCounted;	/* bytes of the proc body records accounted
+                                 * to the sections of their ByteCodes */
+} BinContext;
+
+/*
+ * A JumpEntry is one entry of a jump table as written out: the key and
+ * the offset of its arm. See JumptableEntries.
+ */
+
+typedef struct JumpEntry {
+    char *key;			/* the key, owned by the jump table */
+    int offset;			/* the offset of the arm, relative to the
+                                 * jumpTable instruction */
+} JumpEntry;
+
+/*
+ * An OptInst describes one instruction of the bytecodes being rewritten by
+ * OptimizeByteCodes. Offsets are in the original bytecodes; an instruction
+ * that is dropped gets size 0, so that its new offset is the one of the
+ * next instruction kept.
+ */
+
+typedef struct OptInst {
+    int offset;			/* offset of the instruction */
+    int target;			/* offset of the jump target, for jumps;
+                                 * else -1 */
+    int size;			/* size of the rewritten instruction, 0 if
+                                 * it is dropped */
+    int newOffset;		/* offset in the rewritten bytecodes */
+    int reachable;		/* non-zero if control can reach it */
+    int label;			/* non-zero if control can reach it other
+                                 * than from the previous instruction */
+} OptInst;
+
+/*
+ * A CompileJob describes one file of a compiler::compileParallel batch,
+ * and receives the outcome of its compilation. All the strings are owned
+ * by the job, so that the workers never touch the caller's objects.
+ */
+
+typedef struct CompileJob {
+    char *inFile;		/* input file (to be compiled) */
+    char *outFile;		/* output file, or NULL for the default */
+    char *preamble;		/* preamble for the generated script, or
+                                 * NULL */
+    int result;			/* TCL_OK or TCL_ERROR */
+    Tcl_WideInt usec;		/* compile time in microseconds */
+    char *errorMsg;		/* error message if result is TCL_ERROR */
+} CompileJob;
+
+/*
+ * A CompileBatch is the state shared by the workers of a parallel compile.
+ * Each worker repeatedly takes the next unclaimed job, so that the files
+ * are shared out dynamically between the workers.
+ */
+
+typedef struct CompileBatch {
+    CompileJob *jobs;		/* array of jobs */
+    int numJobs;		/* number of jobs in the array */
+    int nextJob;		/* index of the next unclaimed job */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+    Tcl_Mutex mutex;		/* protects nextJob */
+} CompileBatch;
+
+/*
+ * Length of the lines of ASCII85 characters written by EmitByteSequence,
+ * and how many input bytes it encodes per call to EmitReserve.
+ */
+
+#define ENCODED_LINE_LENGTH	72
+#define ENCODE_CHUNK_SIZE	16384
+
+/*
+ * Upper bound on the number of characters generated by EmitByteSequence
+ * for 'n' input bytes: 5 characters per 4-tuple, plus the newlines.
+ */
+
+#define ENCODED_MAX_SIZE(n) \
+    ((((n) + 3) / 4) * 5 + (((n) + 3) / 4) * 5 / ENCODED_LINE_LENGTH + 1)
 
 /*
  * Mask for rwx flags in struct stat's st_mode
@@ -126,7 +337,9 @@ static char signatureHeader[] = CMP_SIGNATURE_HEADER;
 static char tcExtension[] = CMP_TC_EXTENSION;
 
 /*
- * The following variables make up the pieces of the script preamble
+ * The following variables make up the pieces of the script preamble. With
+ * COMPILER_STREAM, each unit after the first starts with unitPreambleFormat
+ * instead.
  */
 
 #if USE_CATCH_WRAPPER
@@ -138,6 +351,10 @@ if {[catch {package require %s %s} err] == 1} {\n\
 if {[catch {%s::%s {\
 ";
 
+static char unitPreambleFormat[] = "\
+if {[catch {%s::%s {\
+";
+
 #else
 
 static char preambleFormat[] = "\
@@ -147,8 +364,114 @@ if {[catch {package require %s %s} err] == 1} {\n\
 %s::%s {\
 ";
 
+static char unitPreambleFormat[] = "\
+%s::%s {\
+";
+
 #endif
 
+/*
+ * The preamble for a binary container. The loader is handed the path of the
+ * script and locates the image after the ^Z character, which also stops
+ * "source" from reading any further. No released loader has "bceval
+ * -binary": tbcload 1.6 and 1.7 both reject it. The container therefore
+ * requires loader version 2.0, so that older loaders fail the "package
+ * require" with the standard loader error instead of a wrong # args error
+ * from the eval command.
+ */
+
+static char binaryPreambleFormat[] = "\
+if {[catch {package require %s %s} err] == 1} {\n\
+    return -code error \"[info script]: %s -- $err\"\n\
+}\n\
+%s::%s -binary [info script]";
+
+static char binaryLoaderVersion[] = "2.0";
+
+/*
+ * The pieces of a bundle, see Compiler_BundleObjCmd. The bundle preamble
+ * only requires the loader. Each file is then evaluated by its own loader
+ * call, with "info script" set to the path of the file relative to the
+ * bundle while it runs. A "return" ends the file, as it would when the
+ * file is sourced on its own.
+ */
+
+static char bundlePreambleFormat[] = "\
+if {[catch {package require %s %s} err] == 1} {\n\
+    return -code error \"[info script]: %s -- $err\"\n\
+}\
+";
+
+static char bundleFilePreambleFormat[] = "\
+info script [file join [file dirname [info script]] %s]\n\
+if {[catch {%s::%s {\
+";
+
+static char bundleFilePostambleFormat[] = "\
+}} err] == 1} {\n\
+    error $err $::errorInfo $::errorCode\n\
+}\n\
+info script [file join [file dirname [info script]] %s]\
+";
+
+/*
+ * The kinds of preamble written by EmitScriptPreamble.
+ */
+
+#define PREAMBLE_SCRIPT	0
+#define PREAMBLE_BINARY	1
+#define PREAMBLE_BUNDLE	2
+
+/*
+ * Layout of the binary container header: a 4 byte magic, the container
+ * version, the format version, 2 bytes of feature flags (BIN_FLAG_*), then
+ * the compiler and Tcl versions as length-prefixed strings. The ByteCode
+ * record follows.
+ */
+
+static char binaryMagic[] = "TBCB";
+
+#define BINARY_CONTAINER_VERSION	1
+
+/*
+ * Feature flags of a binary container.
+ *
+ * BIN_FLAG_VARINT_LOCMAP	The command location arrays are written as
+ *				LEB128 varints, one per command, instead of
+ *				Tcl's one-or-five byte encoding; the source
+ *				deltas are zigzag encoded, being signed. The
+ *				sizes in the ByteCode record remain those of
+ *				the arrays as Tcl encodes them.
+ * BIN_FLAG_LAZY_PROCS		Proc body literals hold an index into the
+ *				proc table, a section following the ByteCode
+ *				record, instead of the body record.
+ * BIN_FLAG_COMPACT_AUX		Jump tables are written as the arm offsets
+ *				followed by a block of NUL terminated keys,
+ *				both sorted by key, and foreach info as the
+ *				variable counts of all lists followed by all
+ *				their variable indices, so that the loader can
+ *				size and fill each structure in one go. See
+ *				BinEmitAuxDataArray.
+ */
+
+#define BIN_FLAG_VARINT_LOCMAP	(1<<0)
+#define BIN_FLAG_LAZY_PROCS	(1<<1)
+#define BIN_FLAG_COMPACT_AUX	(1<<2)
+
+/*
+ * Section tags in a binary ByteCode record, and of the proc table which
+ * follows the top-level record with BIN_FLAG_LAZY_PROCS. Each section is a
+ * tag byte followed by a 4 byte length and the payload, so that a loader
+ * can skip sections it does not need yet.
+ */
+
+#define BIN_CODE_SECTION	'C'
+#define BIN_LOCMAP_SECTION	'M'
+#define BIN_LITERAL_SECTION	'L'
+#define BIN_EXCRANGE_SECTION	'E'
+#define BIN_AUXDATA_SECTION	'A'
+#define BIN_PROCTABLE_SECTION	'P'
+
 static char loaderName[] = CMP_READER_PACKAGE;
 /*static char loaderVersion[] = CMP_VERSION;*/
 static char loaderVersion[] = "1.6"; /* Kept backward compat, no need to force 1.7 */
@@ -357,36 +680,162 @@ static int didLoadTypes = 0;
 static char dummyCommandName[] = "$$compiler$$dummy%d";
 static int dummyCommandCounter = 1;
 
+/*
+ * Protects the static data above against concurrent access by the worker
+ * threads of compiler::compileParallel.
+ */
+
+TCL_DECLARE_MUTEX(compilerMutex)
+
+/*
+ * The compile cache. If a cache directory is set, the compile commands look
+ * up each script in it before compiling, and store the compiled script in
+ * it afterwards. Entries are named after an MD5 digest of everything the
+ * compiled output depends on: the script, the preamble, the COMPILER_*
+ * flags, the Tcl version and the version of this package. The cache is
+ * shared by all the interpreters and threads of the process.
+ */
+
+#define CACHE_DEFAULT_MAX_SIZE	((Tcl_WideInt) 64 * 1024 * 1024)
+#define CACHE_KEY_LENGTH	32
+
+typedef struct CompileCache {
+    char *directory;		/* normalized path of the cache directory,
+                                 * or NULL if the cache is off */
+    Tcl_WideInt maxSize;	/* maximum size in bytes of the entries, or
+                                 * 0 for no limit */
+    Tcl_WideInt size;		/* current size in bytes of the entries */
+    int numEntries;		/* current number of entries */
+    long hits;			/* lookups that found an entry */
+    long misses;		/* lookups that did not */
+    long stores;		/* entries added */
+    long evictions;		/* entries removed to respect maxSize */
+} CompileCache;
+
+static CompileCache compileCache = {
+    NULL, CACHE_DEFAULT_MAX_SIZE, 0, 0, 0, 0, 0, 0
+};
+
+/*
+ * A CacheEntry describes one file of the cache directory, as collected by
+ * CacheScan.
+ */
+
+typedef struct CacheEntry {
+    Tcl_Obj *pathPtr;		/* path of the entry */
+    Tcl_WideInt size;		/* size in bytes */
+    long mtime;			/* last modification time; entries are
+                                 * touched on every hit */
+} CacheEntry;
+
+/*
+ * A CacheDigest holds the state of the MD5 digest (RFC 1321) that names the
+ * cache entries. A hit copies the entry without looking at the script
+ * again, so the name must not collide for different inputs.
+ */
+
+typedef struct CacheDigest {
+    unsigned int state[4];	/* the A, B, C and D words */
+    Tcl_WideUInt length;	/* number of bytes added so far */
+    unsigned char block[64];	/* the bytes of the current, partial block */
+} CacheDigest;
+
+TCL_DECLARE_MUTEX(cacheMutex)
+
 /*
  * Prototypes for procedures defined later in this file:
  */
 
-static int	A85EmitChar _ANSI_ARGS_((Tcl_Interp *interp,
-			char toEmit, A85EncodeContext *ctxPtr));
-static int	A85EncodeBytes _ANSI_ARGS_((Tcl_Interp *interp,
-			unsigned char *bytesPtr, int numBytes,
-			A85EncodeContext *ctxPtr));
-static int	A85Flush _ANSI_ARGS_((Tcl_Interp *interp,
-			A85EncodeContext *ctxPtr));
-static void	A85InitEncodeContext _ANSI_ARGS_((Tcl_Channel target,
-			char separator, A85EncodeContext *ctxPtr));
 static void	AppendInstLocList _ANSI_ARGS_((Tcl_Interp *interp,
 			CompileEnv *envPtr));
+static VOID *	ArenaAlloc _ANSI_ARGS_((size_t size));
+static void	ArenaRelease _ANSI_ARGS_((void));
+static void	ArenaThreadExit _ANSI_ARGS_((ClientData clientData));
+static void	BinAppendInt _ANSI_ARGS_((Tcl_DString *dsPtr, int value));
+static void	BinAppendSection _ANSI_ARGS_((Tcl_DString *dsPtr, char tag,
+			Tcl_DString *sectionPtr));
+static void	BinAppendString _ANSI_ARGS_((Tcl_DString *dsPtr,
+			CONST char *src, int length));
+static void	BinEmitAuxDataArray _ANSI_ARGS_((ByteCode *codePtr,
+			BinContext *binPtr, Tcl_DString *dsPtr));
+static void	BinEmitByteCode _ANSI_ARGS_((ByteCode *codePtr,
+			BinContext *binPtr, Tcl_DString *dsPtr));
+static void	BinEmitCompiledLocal _ANSI_ARGS_((CompiledLocal *localPtr,
+			BinContext *binPtr, Tcl_DString *dsPtr));
+static int	BinEmitCompiledObject _ANSI_ARGS_((Tcl_Interp *interp,
+			Tcl_Obj *objPtr, EmitContext *emitPtr));
+static void	BinEmitExcRangeArray _ANSI_ARGS_((ByteCode *codePtr,
+			Tcl_DString *dsPtr));
+static void	BinAppendLocArray _ANSI_ARGS_((Tcl_DString *dsPtr,
+			unsigned char *bytes, int numCommands, int isSigned));
+static void	BinEmitObject _ANSI_ARGS_((Tcl_Obj *objPtr,
+			BinContext *binPtr, Tcl_DString *dsPtr));
+static void	BinEmitProcBody _ANSI_ARGS_((Proc *procPtr,
+			BinContext *binPtr, Tcl_DString *dsPtr));
+static void	BinEmitProcTable _ANSI_ARGS_((BinContext *binPtr,
+			Tcl_DString *dsPtr));
+static int	BundleOneFile _ANSI_ARGS_((Tcl_Interp *interp,
+			Tcl_Obj *fileObjPtr, Tcl_Obj *dirObjPtr,
+			Tcl_Obj *bundleObjPtr, int flags,
+			EmitContext *emitPtr));
+static int	CacheCompareEntries _ANSI_ARGS_((CONST VOID *first,
+			CONST VOID *second));
+static int	CacheCopyFile _ANSI_ARGS_((Tcl_Interp *interp,
+			CONST char *srcName, CONST char *dstName, int mode));
+static void	CacheDigestBlock _ANSI_ARGS_((unsigned int state[4],
+			CONST unsigned char *block));
+static void	CacheDigestFinal _ANSI_ARGS_((CacheDigest *digestPtr,
+			unsigned char result[16]));
+static void	CacheDigestInit _ANSI_ARGS_((CacheDigest *digestPtr));
+static void	CacheDigestUpdate _ANSI_ARGS_((CacheDigest *digestPtr,
+			CONST char *bytes, int length));
+static int	CacheEntryName _ANSI_ARGS_((Tcl_Obj *cmdObjPtr,
+			char *preamblePtr, int flags, Tcl_DString *namePtr));
+static void	CacheEvict _ANSI_ARGS_((Tcl_Interp *interp));
+static int	CacheFetch _ANSI_ARGS_((Tcl_Interp *interp,
+			CONST char *entryName, CONST char *outFileName,
+			int mode));
+static void	CacheFreeEntries _ANSI_ARGS_((CacheEntry *entries,
+			int numEntries));
+static int	CacheMakeDirectory _ANSI_ARGS_((Tcl_Obj *dirPtr));
+static int	CacheScan _ANSI_ARGS_((Tcl_Interp *interp,
+			CONST char *directory, CacheEntry **entriesPtr,
+			int *numEntriesPtr, Tcl_WideInt *sizePtr));
+static void	CacheStore _ANSI_ARGS_((Tcl_Interp *interp,
+			CONST char *entryName, CONST char *outFileName));
 static int	CalculateLocArrayLength _ANSI_ARGS_((unsigned char* bytes,
 			int numCommands));
 static void	CalculateLocMapSizes _ANSI_ARGS_((ByteCode *codePtr,
 			LocMapSizes *sizes));
+static int	CheckFileList _ANSI_ARGS_((Tcl_Interp *interp,
+			Tcl_Obj *listObjPtr, int *numFilesPtr));
 static void	CleanObjRefInfoTable
 			_ANSI_ARGS_((PostProcessInfo *locInfoPtr));
 static void	CleanCompilerContext _ANSI_ARGS_((ClientData clientData,
 			Tcl_Interp *interp));
+static void	CompactLiterals _ANSI_ARGS_((ByteCode *codePtr, int flags,
+			LiteralMap *mapPtr));
+#ifdef TCL_85_PLUS
+static int	CompareJumpEntries _ANSI_ARGS_((CONST VOID *first,
+			CONST VOID *second));
+#endif
+static int	CompareOffsets _ANSI_ARGS_((CONST VOID *first,
+			CONST VOID *second));
 static int	CompileObject _ANSI_ARGS_((Tcl_Interp *interp,
-			Tcl_Obj *objPtr));
+			Tcl_Obj *objPtr, int flags));
+static int	CompileOneFile _ANSI_ARGS_((Tcl_Interp *interp,
+			char *inFilePtr, char *outFilePtr, char *preamblePtr,
+			int flags, EmitContext *emitPtr));
 static int	CompileOneProcBody _ANSI_ARGS_((Tcl_Interp *interp,
 			ProcBodyInfo *infoPtr, CompilerContext *ctxPtr,
-			CompileEnv *compEnvPtr));
+			CompileEnv *compEnvPtr, int flags));
 static int	CompileProcBodies _ANSI_ARGS_((Tcl_Interp *interp,
-			CompileEnv *compEnvPtr));
+			CompileEnv *compEnvPtr, int flags));
+#ifdef TCL_THREADS
+static Tcl_ThreadCreateType
+		CompileWorkerThread _ANSI_ARGS_((ClientData clientData));
+#endif
+static char *	CopyString _ANSI_ARGS_((CONST char *src));
 static void	CreateProcBodyInfoArray
 			_ANSI_ARGS_((PostProcessInfo *locInfoPtr,
 			CompileEnv *compEnvPtr, ProcBodyInfo *** arrayPtrPtr));
@@ -400,55 +849,89 @@ static int	DummyInterpProc _ANSI_ARGS_((ClientData clientData,
 static int	DummyObjInterpProc _ANSI_ARGS_((ClientData clientData,
 			Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
 static int	EmitAuxDataArray _ANSI_ARGS_((Tcl_Interp *interp,
-			ByteCode *codePtr, Tcl_Channel chan));
+			ByteCode *codePtr, EmitContext *emitPtr));
+static int	EmitBundleFormat _ANSI_ARGS_((Tcl_Interp *interp,
+			char *format, Tcl_Obj *relObjPtr,
+			EmitContext *emitPtr));
+static int	EmitBytes _ANSI_ARGS_((Tcl_Interp *interp,
+			CONST char *src, int length, EmitContext *emitPtr));
 static int	EmitByteCode _ANSI_ARGS_((Tcl_Interp *interp,
-			ByteCode *codePtr, Tcl_Channel chan));
+			ByteCode *codePtr, EmitContext *emitPtr));
 static int	EmitByteSequence _ANSI_ARGS_((Tcl_Interp *interp,
 			unsigned char *bytesPtr, int length,
-			Tcl_Channel chan));
+			EmitContext *emitPtr));
 static int	EmitChar _ANSI_ARGS_((Tcl_Interp *interp, char value,
-			char separator, Tcl_Channel chan));
+			char separator, EmitContext *emitPtr));
 static int	EmitCompiledLocal _ANSI_ARGS_((Tcl_Interp *interp,
-			CompiledLocal* localPtr, Tcl_Channel chan));
+			CompiledLocal* localPtr, EmitContext *emitPtr));
 static int	EmitCompiledObject _ANSI_ARGS_((Tcl_Interp *interp,
-			Tcl_Obj *objPtr, Tcl_Channel chan));
+			Tcl_Obj *objPtr, EmitContext *emitPtr));
+static int	EmitCompiledScript _ANSI_ARGS_((Tcl_Interp *interp,
+			Tcl_Obj *cmdObjPtr, char *preamblePtr, int flags,
+			EmitContext *emitPtr));
 static int	EmitExcRangeArray _ANSI_ARGS_((Tcl_Interp *interp,
-			ByteCode *codePtr, Tcl_Channel chan));
+			ByteCode *codePtr, EmitContext *emitPtr));
+static int	EmitFlushContext _ANSI_ARGS_((Tcl_Interp *interp,
+			EmitContext *emitPtr));
+static void	EmitFreeContext _ANSI_ARGS_((EmitContext *emitPtr));
 static int	EmitForeachInfo _ANSI_ARGS_((Tcl_Interp *interp,
-			ForeachInfo *infoPtr, Tcl_Channel chan));
+			ForeachInfo *infoPtr, EmitContext *emitPtr));
 #ifdef TCL_85_PLUS
 static int	EmitJumptableInfo _ANSI_ARGS_((Tcl_Interp *interp,
-			JumptableInfo *infoPtr, Tcl_Channel chan));
+			JumptableInfo *infoPtr, EmitContext *emitPtr));
 #endif
 #ifdef TCL_86_PLUS
 static int	EmitDictUpdateInfo _ANSI_ARGS_((Tcl_Interp *interp,
-			DictUpdateInfo *infoPtr, Tcl_Channel chan));
+			DictUpdateInfo *infoPtr, EmitContext *emitPtr));
 #endif
 #ifdef TCL_862_PLUS
 static int	EmitNewForeachInfo _ANSI_ARGS_((Tcl_Interp *interp,
-			ForeachInfo *infoPtr, Tcl_Channel chan));
+			ForeachInfo *infoPtr, EmitContext *emitPtr));
 #endif
+static void	EmitInitContext _ANSI_ARGS_((Tcl_Channel target,
+			EmitContext *emitPtr));
 static int	EmitInteger _ANSI_ARGS_((Tcl_Interp *interp, int value,
-			char separator, Tcl_Channel chan));
+			char separator, EmitContext *emitPtr));
+static int	EmitMakeRoom _ANSI_ARGS_((Tcl_Interp *interp,
+			EmitContext *emitPtr, int size));
 static int	EmitObjArray _ANSI_ARGS_((Tcl_Interp *interp,
-			ByteCode *codePtr, Tcl_Channel chan));
+			LiteralMap *litMapPtr, EmitContext *emitPtr));
 static int	EmitObject _ANSI_ARGS_((Tcl_Interp *interp,
-			Tcl_Obj* objPtr, Tcl_Channel chan));
+			Tcl_Obj* objPtr, EmitContext *emitPtr));
 static int	EmitProcBody _ANSI_ARGS_((Tcl_Interp *interp,
-			Proc *procPtr, Tcl_Channel chan));
+			Proc *procPtr, EmitContext *emitPtr));
 static int	EmitScriptPostamble _ANSI_ARGS_((Tcl_Interp *interp,
-			Tcl_Channel chan));
+			EmitContext *emitPtr));
 static int	EmitScriptPreamble _ANSI_ARGS_((Tcl_Interp *interp,
-			Tcl_Channel chan));
+			int kind, EmitContext *emitPtr));
 static int	EmitSignature _ANSI_ARGS_((Tcl_Interp *interp,
-			Tcl_Channel chan));
+			EmitContext *emitPtr));
+static int	EmitStreamedScript _ANSI_ARGS_((Tcl_Interp *interp,
+			Tcl_Channel inChan, Tcl_Obj *scriptObjPtr,
+			char *preamblePtr, int flags, EmitContext *emitPtr));
 static int	EmitString _ANSI_ARGS_((Tcl_Interp *interp, char *src,
-			int length, char separator, Tcl_Channel chan));
+			int length, char separator, EmitContext *emitPtr));
+static int	EmitUnitPreamble _ANSI_ARGS_((Tcl_Interp *interp,
+			EmitContext *emitPtr));
+static Tcl_WideInt
+		ElapsedTime _ANSI_ARGS_((Tcl_Time *startPtr,
+			Tcl_Time *stopPtr));
 static void	FreeProcBodyInfoArray _ANSI_ARGS_((PostProcessInfo *infoPtr));
+static void	FreeLiteralMap _ANSI_ARGS_((ByteCode *codePtr,
+			LiteralMap *mapPtr));
 static void	FreePostProcessInfo _ANSI_ARGS_((PostProcessInfo *infoPtr));
+static int	GetProcessorCount _ANSI_ARGS_((void));
 static int	GetSharedIndex _ANSI_ARGS_((unsigned char *pc));
 static void	InitCompilerContext _ANSI_ARGS_((Tcl_Interp *interp));
 static void	InitTypes _ANSI_ARGS_((void));
+#ifdef TCL_85_PLUS
+static JumpEntry *
+		JumptableEntries _ANSI_ARGS_((JumptableInfo *infoPtr,
+			int flags, int *numEntriesPtr));
+#endif
+static Tcl_Obj *
+		LiteralKey _ANSI_ARGS_((Tcl_Obj *objPtr, int flags));
+static char	LiteralTypeCode _ANSI_ARGS_((Tcl_Obj *objPtr, int flags));
 static void	LoadObjRefInfoTable _ANSI_ARGS_((PostProcessInfo *locInfoPtr,
 			CompileEnv *compEnvPtr));
 static void	LoadProcBodyInfo _ANSI_ARGS_((InstLocList *locInfoPtr,
@@ -462,15 +945,61 @@ static int 	LocalProcCompileProc _ANSI_ARGS_((Tcl_Interp *interp,
 			Tcl_Parse *parsePtr, struct CompileEnv *compEnvPtr));
 #endif
 static char	NameFromExcRange _ANSI_ARGS_((ExceptionRangeType type));
+static Tcl_Obj *
+		NewCompileInfoObj _ANSI_ARGS_((int result, Tcl_WideInt usec,
+			Tcl_Obj *errorObjPtr));
+static Tcl_Obj *
+		NewCompileStatsObj _ANSI_ARGS_((CompileStats *collectPtr));
+static void	NoCompiledScript _ANSI_ARGS_((Tcl_Interp *interp));
+static AuxData *
+		OptimizeAuxData _ANSI_ARGS_((CompileEnv *compEnvPtr,
+			unsigned char *pc, CONST AuxDataType *typePtr));
+static void	OptimizeByteCodes _ANSI_ARGS_((CompileEnv *compEnvPtr));
+static int	OptimizeIndex _ANSI_ARGS_((int *instIndex, int limit,
+			int offset));
+static int	OptimizeOffset _ANSI_ARGS_((OptInst *insts, int *instIndex,
+			int offset));
+static int	OptimizeProcBody _ANSI_ARGS_((Tcl_Interp *interp,
+			struct CompileEnv *compEnvPtr, ClientData clientData));
+static void	OptimizeReach _ANSI_ARGS_((OptInst *insts, int index,
+			int isLabel, int *stack, int *numStackPtr));
+static void	PhaseAddBytes _ANSI_ARGS_((int phase,
+			Tcl_WideInt numBytes));
+static Tcl_WideInt
+		PhaseCountedBytes _ANSI_ARGS_((void));
+static int	PhaseEnter _ANSI_ARGS_((int phase));
+static void	PhaseLeave _ANSI_ARGS_((int savedPhase));
+static void	PhaseResetCountedBytes _ANSI_ARGS_((Tcl_WideInt counted));
 static int	PostProcessCompile _ANSI_ARGS_((Tcl_Interp *interp,
 			struct CompileEnv *compEnvPtr, ClientData clientData));
+static int	ParseCompileOptions _ANSI_ARGS_((Tcl_Interp *interp,
+			int objc, Tcl_Obj *CONST objv[], int *flagsPtr,
+			char **preamblePtrPtr, int *threadsPtr,
+			int *statsPtr, int *indexPtr));
 static void	PrependResult _ANSI_ARGS_((Tcl_Interp *interp, char *msgPtr));
 static void	ReleaseCompilerContext _ANSI_ARGS_((Tcl_Interp *interp));
-static int	ReplacePushIndex _ANSI_ARGS_((int commandIndex,
-        		unsigned char *pc,
-			int newIndex, CompileEnv *compEnvPtr));
-static void	ShiftByteCodes _ANSI_ARGS_((int commandIndex, int startOffset,
-        		int shiftCount,	CompileEnv *compEnvPtr));
+static Tcl_Obj *
+		RelativePath _ANSI_ARGS_((Tcl_Obj *dirObjPtr,
+			Tcl_Obj *pathObjPtr));
+static void	RestoreLiteralTable _ANSI_ARGS_((Interp *iPtr,
+			LiteralTable *savePtr));
+static void	RunCompileJobs _ANSI_ARGS_((Tcl_Interp *interp,
+			CompileBatch *batchPtr, int initResult));
+static int	RelocateOffset _ANSI_ARGS_((int offset, int *sites,
+			int numSites));
+static void	ReplacePushIndex _ANSI_ARGS_((unsigned char *pc,
+			int newIndex));
+static void	SaveLiteralTable _ANSI_ARGS_((Interp *iPtr,
+			LiteralTable *savePtr));
+static void	StatsAddByteCode _ANSI_ARGS_((ByteCode *codePtr,
+			LiteralMap *litMapPtr));
+static void	StatsAddProcBody _ANSI_ARGS_((void));
+static CompileStats *
+		StatsCollector _ANSI_ARGS_((void));
+static int	StreamOneFile _ANSI_ARGS_((Tcl_Interp *interp,
+			Tcl_Channel inChan, char *inFilePtr,
+			char *nativeOutName, int fileMode, char *preamblePtr,
+			int flags, EmitContext *emitPtr));
 static int	UnshareObject _ANSI_ARGS_((int origIndex,
 			CompileEnv *compEnvPtr));
 static void	UnshareProcBodies _ANSI_ARGS_((Tcl_Interp *interp,
@@ -478,6 +1007,11 @@ static void	UnshareProcBodies _ANSI_ARGS_((Tcl_Interp *interp,
 			CompileEnv *compEnvPtr));
 static void	UpdateByteCodes _ANSI_ARGS_((PostProcessInfo *infoPtr,
 			CompileEnv *compEnvPtr));
+static int	WriteBundleIndex _ANSI_ARGS_((Tcl_Interp *interp,
+			Tcl_Obj *indexObjPtr, char *package, char *version,
+			char *bundleName));
+static void	WidenPushInstructions _ANSI_ARGS_((int *sites, int numSites,
+			PostProcessInfo *infoPtr, CompileEnv *compEnvPtr));
 
 #ifdef DEBUG_REWRITE
 static void
@@ -495,9 +1029,33 @@ FormatInstruction(CompileEnv* compEnvPtr, unsigned char *pc);
  *  will have the same root as the input, with extension ".tbc".
  *
  *  Call format:
- *    compiler::compile ?-preamble value? inputFile ?outputFile?
+ *    compiler::compile ?-binary? ?-compactliterals? ?-deterministic?
+ *		?-lazyprocs? ?-nosrcmap? ?-optimize? ?-preamble value? ?-stream?
+ *		?-stats? inputFile ?outputFile?
  *  The -preamble flag specifies a chunk of code to be prepended to the
  *  generated compiled script.
+ *  The -binary flag selects the binary container layout instead of the
+ *  ASCII85 text stream. It is experimental: it requires tbcload 2.0, a
+ *  loader with "bceval -binary", which has not been released.
+ *  The -lazyprocs flag implies -binary, and moves the proc bodies to a
+ *  table at the end of the container, so that the loader can decode each
+ *  body on the first call of its proc.
+ *  The -nosrcmap flag drops the source offset maps, for scripts which are
+ *  shipped without their source.
+ *  The -deterministic flag makes the output depend on the script only,
+ *  and not on what was compiled before it in the same interpreter.
+ *  The -compactliterals flag drops the literals no longer referenced by
+ *  the bytecodes, and merges duplicates, before they are written out.
+ *  It has not been checked against tbcload 1.6 yet.
+ *  The -optimize flag runs a peephole optimizer over the bytecodes of the
+ *  script and of its proc bodies before they are written out.
+ *  The -stream flag reads the input file incrementally and writes the
+ *  top-level commands out in units as they are compiled, bounding the
+ *  memory used by large scripts; it requires the text layout, and
+ *  bypasses the compile cache.
+ *  The -stats flag makes the command return statistics about the
+ *  generated bytecodes, see NewCompileStatsObj. The compile cache is
+ *  bypassed, so that the statistics are always available.
  *
  * Results:
  *  Returns a standard TCL result code.
@@ -516,34 +1074,26 @@ Compiler_CompileObjCmd(dummy, interp, objc, objv)
     Tcl_Obj *CONST objv[];	/* Argument objects. */
 {
     static char argsMsg[]
-        = "?-preamble value? inputFileName ?outputFileName?";
+        = "?-binary? ?-compactliterals? ?-deterministic? ?-lazyprocs? "
+        "?-nosrcmap? ?-optimize? ?-preamble value? ?-stream? ?-stats? "
+        "inputFileName ?outputFileName?";
 
+    PhaseStats *phaseStatsPtr;
+    CompileStats collect;
     char *inFilePtr;
     char *outFilePtr = NULL;
     char *preamblePtr = NULL;
-    int fileIndex = 1;
-    int argCount = 2;
+    int flags = 0;
+    int fileIndex, wantStats, result;
 
     Tcl_ResetResult(interp);
 
-    if (objc < 2) {
-        Tcl_WrongNumArgs(interp, 1, objv, argsMsg);
+    if (ParseCompileOptions(interp, objc, objv, &flags, &preamblePtr,
+            NULL, &wantStats, &fileIndex) != TCL_OK) {
         return TCL_ERROR;
     }
 
-    if (!strcmp(objv[1]->bytes, "-preamble")) {
-        if (objc < 3) {
-            Tcl_AppendResult(interp,
-                    "missing value for the -preamble flag", NULL);
-            return TCL_ERROR;
-        }
-
-        preamblePtr = objv[2]->bytes;
-        fileIndex = 3;
-        argCount = 4;
-    }
-
-    if (objc < argCount) {
+    if ((objc - fileIndex < 1) || (objc - fileIndex > 2)) {
         Tcl_WrongNumArgs(interp, 1, objv, argsMsg);
         return TCL_ERROR;
     }
@@ -553,11 +1103,35 @@ Compiler_CompileObjCmd(dummy, interp, objc, objv)
      */
 
     inFilePtr = Tcl_GetStringFromObj(objv[fileIndex], (int *) NULL);
-    if (objc > argCount) {
+    if (objc - fileIndex > 1) {
         outFilePtr = Tcl_GetStringFromObj(objv[fileIndex+1], (int *) NULL);
     }
 
-    return Compiler_CompileFile(interp, inFilePtr, outFilePtr, preamblePtr);
+    if (!wantStats) {
+        return Compiler_CompileFileEx(interp, inFilePtr, outFilePtr,
+                preamblePtr, flags);
+    }
+
+    /*
+     * The statistics are collected by the Emit* procedures while the
+     * compiled script is written out.
+     */
+
+    memset(&collect, 0, sizeof(CompileStats));
+    Tcl_InitHashTable(&collect.auxDataTypes, TCL_STRING_KEYS);
+    phaseStatsPtr = (PhaseStats *)
+            Tcl_GetThreadData(&phaseStatsKey, (int) sizeof(PhaseStats));
+    phaseStatsPtr->collectPtr = &collect;
+
+    result = Compiler_CompileFileEx(interp, inFilePtr, outFilePtr,
+            preamblePtr, flags);
+
+    phaseStatsPtr->collectPtr = NULL;
+    if (result == TCL_OK) {
+        Tcl_SetObjResult(interp, NewCompileStatsObj(&collect));
+    }
+    Tcl_DeleteHashTable(&collect.auxDataTypes);
+    return result;
 }
 
 /*
@@ -591,6 +1165,176 @@ Compiler_GetBytecodeExtensionObjCmd(dummy, interp, objc, objv)
     return TCL_OK;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseCompileOptions --
+ *
+ *  Parses the options common to the compile commands:
+ *    ?-binary? ?-compactliterals? ?-deterministic? ?-lazyprocs?
+ *    ?-nosrcmap? ?-optimize? ?-preamble value? ?-stream? ?-threads count?
+ *    ?-stats? ?--?
+ *  The -threads option is only accepted if threadsPtr is not NULL, and
+ *  the -stats option only if statsPtr is not NULL. Parsing stops at the
+ *  first argument not starting with a "-".
+ *
+ * Results:
+ *  Returns a standard TCL result code. Stores the COMPILER_* flags, the
+ *  preamble (NULL if none), the thread count (0 if none), whether -stats
+ *  was given and the index of the first non-option argument in the output
+ *  arguments.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseCompileOptions(interp, objc, objv, flagsPtr, preamblePtrPtr, threadsPtr,
+        statsPtr, indexPtr)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    int objc;			/* Number of arguments. */
+    Tcl_Obj *CONST objv[];	/* Argument objects. */
+    int *flagsPtr;		/* Receives the COMPILER_* flags */
+    char **preamblePtrPtr;	/* Receives the preamble, or NULL */
+    int *threadsPtr;		/* Receives the thread count; NULL if the
+                                 * -threads option is not allowed */
+    int *statsPtr;		/* Receives non-zero if -stats was given;
+                                 * NULL if the option is not allowed */
+    int *indexPtr;		/* Receives the index of the first argument
+                                 * after the options */
+{
+    static CONST84 char *options[] = {
+	"-binary", "-preamble", "--", "-nosrcmap", "-lazyprocs", "-optimize",
+	"-stream", "-deterministic", "-compactliterals", "-threads", NULL
+    };
+    static CONST84 char *serialOptions[] = {
+	"-binary", "-preamble", "--", "-nosrcmap", "-lazyprocs", "-optimize",
+	"-stream", "-deterministic", "-compactliterals", NULL
+    };
+    static CONST84 char *statsOptions[] = {
+	"-binary", "-preamble", "--", "-nosrcmap", "-lazyprocs", "-optimize",
+	"-stream", "-deterministic", "-compactliterals", "-stats", NULL
+    };
+    enum options {
+	OPT_BINARY, OPT_PREAMBLE, OPT_LAST, OPT_NOSRCMAP, OPT_LAZYPROCS,
+	OPT_OPTIMIZE, OPT_STREAM, OPT_DETERMINISTIC, OPT_COMPACT_LITERALS,
+	OPT_THREADS, OPT_STATS
+    };
+    CONST84 char **optionTable = serialOptions;
+    int argIndex, index;
+
+    *flagsPtr = 0;
+    *preamblePtrPtr = NULL;
+    if (threadsPtr != NULL) {
+        *threadsPtr = 0;
+        optionTable = options;
+    }
+    if (statsPtr != NULL) {
+        *statsPtr = 0;
+        optionTable = statsOptions;
+    }
+
+    for (argIndex=1 ; argIndex < objc ; argIndex++) {
+        if (*Tcl_GetString(objv[argIndex]) != '-') {
+            break;
+        }
+        if (Tcl_GetIndexFromObj(interp, objv[argIndex], optionTable,
+                "option", 0, &index) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        /*
+         * -stats takes the slot of -threads in its table.
+         */
+
+        if ((optionTable == statsOptions) && (index == OPT_THREADS)) {
+            index = OPT_STATS;
+        }
+        if (index == OPT_LAST) {
+            argIndex += 1;
+            break;
+        }
+
+        switch ((enum options) index) {
+            case OPT_BINARY:
+                *flagsPtr |= COMPILER_BINARY;
+                break;
+
+            case OPT_NOSRCMAP:
+                *flagsPtr |= COMPILER_NO_SRCMAP;
+                break;
+
+            case OPT_LAZYPROCS:
+                *flagsPtr |= COMPILER_BINARY | COMPILER_LAZY_PROCS;
+                break;
+
+            case OPT_OPTIMIZE:
+                *flagsPtr |= COMPILER_OPTIMIZE;
+                break;
+
+            case OPT_STREAM:
+                *flagsPtr |= COMPILER_STREAM;
+                break;
+
+            case OPT_DETERMINISTIC:
+                *flagsPtr |= COMPILER_DETERMINISTIC;
+                break;
+
+            case OPT_COMPACT_LITERALS:
+                *flagsPtr |= COMPILER_COMPACT_LITERALS;
+                break;
+
+            case OPT_PREAMBLE:
+                if (argIndex + 1 >= objc) {
+                    Tcl_AppendResult(interp,
+                            "missing value for the -preamble flag", NULL);
+                    return TCL_ERROR;
+                }
+                argIndex += 1;
+                *preamblePtrPtr = Tcl_GetString(objv[argIndex]);
+                break;
+
+            case OPT_THREADS:
+                if (argIndex + 1 >= objc) {
+                    Tcl_AppendResult(interp,
+                            "missing value for the -threads flag", NULL);
+                    return TCL_ERROR;
+                }
+                argIndex += 1;
+                if (Tcl_GetIntFromObj(interp, objv[argIndex], threadsPtr)
+                        != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (*threadsPtr < 1) {
+                    Tcl_AppendResult(interp, "bad thread count \"",
+                            Tcl_GetString(objv[argIndex]),
+                            "\": must be a positive integer", NULL);
+                    return TCL_ERROR;
+                }
+                break;
+
+            case OPT_STATS:
+                *statsPtr = 1;
+                break;
+
+            case OPT_LAST:
+                break;
+        }
+    }
+
+    if ((*flagsPtr & COMPILER_STREAM) && (*flagsPtr & COMPILER_BINARY)) {
+        Tcl_AppendResult(interp,
+                "-stream cannot be combined with -binary or -lazyprocs",
+                NULL);
+        return TCL_ERROR;
+    }
+
+    *indexPtr = argIndex;
+    return TCL_OK;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -627,25 +1371,110 @@ Compiler_CompileFile(interp, inFilePtr, outFilePtr, preamblePtr)
     char *outFilePtr;	/* the generated ByteCode struct will be written
                          * to this file */
     char *preamblePtr;	/* Preamble for the generated script */
+{
+    return Compiler_CompileFileEx(interp, inFilePtr, outFilePtr, preamblePtr,
+            0);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Compiler_CompileFileEx --
+ *
+ *  Like Compiler_CompileFile, with an additional set of COMPILER_* flags
+ *  controlling the layout of the generated compiled script. Currently
+ *  COMPILER_BINARY selects the binary container instead of the ASCII85
+ *  text stream.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Compiler_CompileFileEx(interp, inFilePtr, outFilePtr, preamblePtr, flags)
+    Tcl_Interp *interp;	/* Current interpreter. */
+    char *inFilePtr;	/* input file (to be compiled) */
+    char *outFilePtr;	/* the generated ByteCode struct will be written
+                         * to this file */
+    char *preamblePtr;	/* Preamble for the generated script */
+    int flags;		/* OR-ed combination of COMPILER_* flags */
 {
     Interp *iPtr = (Interp *) interp;
-    Tcl_DString inBuffer, outBuffer;
-    char *nativeInName;
-    char *nativeOutName;
-    Tcl_Channel chan;
-    int result;
-    struct stat statBuf;
-	unsigned short fileMode;
-    Tcl_Obj *cmdObjPtr;
     LiteralTable glt; /* Save buffer for global literals */
+    EmitContext emitCtx;
+    int result;
 
-    Tcl_ResetResult(interp);
+    /*
+     * Saving state of interpreter literals, then reinitializing
+     * for compiler. Prevents interference between application
+     * running the compiler and compiler itself.
+     */
 
-    Tcl_DStringInit(&inBuffer);
-    Tcl_DStringInit(&outBuffer);
+    SaveLiteralTable(iPtr, &glt);
+    EmitInitContext((Tcl_Channel) NULL, &emitCtx);
 
-    nativeInName = Tcl_TranslateFileName(interp, inFilePtr, &inBuffer);
-    if (nativeInName == NULL) {
+    result = CompileOneFile(interp, inFilePtr, outFilePtr, preamblePtr, flags,
+            &emitCtx);
+
+    EmitFreeContext(&emitCtx);
+    RestoreLiteralTable(iPtr, &glt);
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompileOneFile --
+ *
+ *  Does the work of Compiler_CompileFileEx, given an already prepared
+ *  literal table and output buffer. Used to share that setup between
+ *  the files of a batch.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CompileOneFile(interp, inFilePtr, outFilePtr, preamblePtr, flags, emitPtr)
+    Tcl_Interp *interp;	/* Current interpreter. */
+    char *inFilePtr;	/* input file (to be compiled) */
+    char *outFilePtr;	/* the generated ByteCode struct will be written
+                         * to this file */
+    char *preamblePtr;	/* Preamble for the generated script */
+    int flags;		/* OR-ed combination of COMPILER_* flags */
+    EmitContext *emitPtr;
+			/* Output buffer; retargeted to the output file
+			 * for the duration of the call */
+{
+    Interp *iPtr = (Interp *) interp;
+    Tcl_DString inBuffer, outBuffer, cacheBuffer;
+    char *nativeInName;
+    char *nativeOutName;
+    Tcl_Channel chan;
+    int result;
+    struct stat statBuf;
+	unsigned short fileMode;
+    Tcl_Obj *cmdObjPtr;
+
+    Tcl_ResetResult(interp);
+
+    Tcl_DStringInit(&inBuffer);
+    Tcl_DStringInit(&outBuffer);
+    Tcl_DStringInit(&cacheBuffer);
+
+    nativeInName = Tcl_TranslateFileName(interp, inFilePtr, &inBuffer);
+    if (nativeInName == NULL) {
         goto error;
     }
 
@@ -709,6 +1538,20 @@ Compiler_CompileFile(interp, inFilePtr, outFilePtr, preamblePtr)
                 "\": ", Tcl_PosixError(interp), (char *) NULL);
         goto error;
     }
+
+    /*
+     * A streamed script is never read as a whole, and so is not cached.
+     */
+
+    if (flags & COMPILER_STREAM) {
+        result = StreamOneFile(interp, chan, inFilePtr, nativeOutName,
+                fileMode, preamblePtr, flags, emitPtr);
+        Tcl_DStringFree(&inBuffer);
+        Tcl_DStringFree(&outBuffer);
+        Tcl_DStringFree(&cacheBuffer);
+        return result;
+    }
+
     cmdObjPtr = Tcl_NewObj();
     result = Tcl_ReadChars(chan, cmdObjPtr, -1, 0);
     if (result < 0) {
@@ -721,32 +1564,26 @@ Compiler_CompileFile(interp, inFilePtr, outFilePtr, preamblePtr)
         goto error;
     }
 
-    /*
-     * Saving state of interpreter literals, then reinitializing
-     * for compiler. Prevents interference between application
-     * running the compiler and compiler itself.
-     */
-
-    memcpy (&glt,
-	    &iPtr->literalTable,
-	    sizeof(LiteralTable));
+    Tcl_IncrRefCount(cmdObjPtr);
 
-    /* Inlined copy of "TclInitLiteralTable (&iPtr->literalTable);"
-     * This function is not in the stub table of Tcl, not even in
-     * the internal one. This causes link problems.
+    /*
+     * Reuse the output of an earlier compile of the same script, if the
+     * compile cache has it. Not when statistics are collected, as those
+     * come from the compile.
      */
-#define REBUILD_MULTIPLIER	3
 
-    iPtr->literalTable.buckets = iPtr->literalTable.staticBuckets;
-    iPtr->literalTable.staticBuckets[0] = iPtr->literalTable.staticBuckets[1] = 0;
-    iPtr->literalTable.staticBuckets[2] = iPtr->literalTable.staticBuckets[3] = 0;
-    iPtr->literalTable.numBuckets = TCL_SMALL_HASH_TABLE;
-    iPtr->literalTable.numEntries = 0;
-    iPtr->literalTable.rebuildSize = TCL_SMALL_HASH_TABLE*REBUILD_MULTIPLIER;
-    iPtr->literalTable.mask = 3;
+    if ((StatsCollector() == NULL)
+            && CacheEntryName(cmdObjPtr, preamblePtr, flags, &cacheBuffer)
+            && CacheFetch(interp, Tcl_DStringValue(&cacheBuffer),
+                    nativeOutName, fileMode)) {
+        Tcl_DecrRefCount(cmdObjPtr);
+        Tcl_DStringFree(&inBuffer);
+        Tcl_DStringFree(&outBuffer);
+        Tcl_DStringFree(&cacheBuffer);
+        return TCL_OK;
+    }
 
-    Tcl_IncrRefCount(cmdObjPtr);
-    result = Compiler_CompileObj(interp, cmdObjPtr);
+    result = Compiler_CompileObjEx(interp, cmdObjPtr, flags);
     if (result == TCL_RETURN) {
         result = TclUpdateReturnInfo(iPtr);
     } else if (result == TCL_ERROR) {
@@ -768,13 +1605,11 @@ Compiler_CompileFile(interp, inFilePtr, outFilePtr, preamblePtr)
                     (char *) NULL);
             result = TCL_ERROR;
         } else {
-            result = TCL_OK;
-            if (preamblePtr) {
-                result = EmitString(interp, preamblePtr, -1, '\n', chan);
-            }
-            if (result == TCL_OK) {
-                result = EmitCompiledObject(interp, cmdObjPtr, chan);
-            }
+            emitPtr->target = chan;
+            emitPtr->curPtr = emitPtr->basePtr;
+            result = EmitCompiledScript(interp, cmdObjPtr, preamblePtr, flags,
+                    emitPtr);
+            emitPtr->target = (Tcl_Channel) NULL;
             if (Tcl_Close(interp, chan) != TCL_OK) {
                 Tcl_AppendResult(interp, "error closing bytecode stream: ",
                         Tcl_PosixError(interp),
@@ -782,6 +1617,10 @@ Compiler_CompileFile(interp, inFilePtr, outFilePtr, preamblePtr)
                 result = TCL_ERROR;
             }
         }
+        if ((result == TCL_OK) && (Tcl_DStringLength(&cacheBuffer) > 0)) {
+            CacheStore(interp, Tcl_DStringValue(&cacheBuffer),
+                    nativeOutName);
+        }
     }
     if (result != TCL_ERROR) {
 	/*
@@ -792,24 +1631,16 @@ Compiler_CompileFile(interp, inFilePtr, outFilePtr, preamblePtr)
 	Tcl_DecrRefCount(cmdObjPtr);
     }
 
-    /*
-     * Restore interpreter literals from save buffer. Can't delete the
-     * transient table, causes crashes.
-     */
-
-    /* ** TclDeleteLiteralTable (interp,&iPtr->literalTable); ** */
-    memcpy (&iPtr->literalTable,
-	    &glt,
-	    sizeof(LiteralTable));
-
     Tcl_DStringFree(&inBuffer);
     Tcl_DStringFree(&outBuffer);
+    Tcl_DStringFree(&cacheBuffer);
 
     return result;
 
     error:
     Tcl_DStringFree(&inBuffer);
     Tcl_DStringFree(&outBuffer);
+    Tcl_DStringFree(&cacheBuffer);
 
     return TCL_ERROR;
 }
@@ -817,304 +1648,431 @@ Compiler_CompileFile(interp, inFilePtr, outFilePtr, preamblePtr)
 /*
  *----------------------------------------------------------------------
  *
- * Compiler_CompileObj --
- *
- *  Compile Tcl commands stored in a Tcl object. These commands are
- *  compiled into bytecodes.
+ * StreamOneFile --
  *
- *  Scarfed from Tcl_EvalObj, where we run the compilation step but not
- *  the execution step.
+ *  Does the work of CompileOneFile for COMPILER_STREAM: compiles the
+ *  script read from an open channel into the output file unit by unit,
+ *  see EmitStreamedScript.
  *
  * Results:
- *  The return value is one of the return codes defined in tcl.h
- *  (such as TCL_OK), and the interpreter's result contains a value
- *  to supplement the return code.
+ *  Returns a standard TCL result code.
  *
  * Side effects:
- *  The object is converted to a ByteCode object that holds the bytecode
- *  instructions for the commands.
+ *  Closes inChan. The output file is deleted if the compile fails, as it
+ *  may hold the first units of the script.
  *
  *----------------------------------------------------------------------
  */
 
-int
-Compiler_CompileObj(interp, objPtr)
-    Tcl_Interp *interp;		/* Token for command interpreter
-                                 * (returned by a previous call to
-                                 * Tcl_CreateInterp). */
-    Tcl_Obj *objPtr;		/* Pointer to object containing
-                                 * commands to compile. */
+static int
+StreamOneFile(interp, inChan, inFilePtr, nativeOutName, fileMode,
+        preamblePtr, flags, emitPtr)
+    Tcl_Interp *interp;	/* Current interpreter. */
+    Tcl_Channel inChan;	/* the input file, open for reading */
+    char *inFilePtr;	/* input file name, for error messages */
+    char *nativeOutName;
+			/* native name of the output file */
+    int fileMode;	/* permissions of the output file */
+    char *preamblePtr;	/* Preamble for the generated script */
+    int flags;		/* OR-ed combination of COMPILER_* flags */
+    EmitContext *emitPtr;
+			/* Output buffer; retargeted to the output file
+			 * for the duration of the call */
 {
-    Interp *iPtr = (Interp *) interp;
-    ByteCode* codePtr;		/* Tcl Internal type of bytecode. */
-    int result = TCL_OK;
-
-    /*
-     * If the interpreter has been deleted, return an error.
-     */
+    Tcl_Channel outChan;
+    Tcl_Obj *pathPtr;
+    int result;
 
-    if (iPtr->flags & DELETED) {
+    outChan = Tcl_OpenFileChannel(interp, nativeOutName, "w", fileMode);
+    if (outChan == (Tcl_Channel) NULL) {
+        Tcl_Close(NULL, inChan);
         Tcl_ResetResult(interp);
-        Tcl_AppendToObj(Tcl_GetObjResult(interp),
-                "attempt to call compile in deleted interpreter", -1);
-        Tcl_SetErrorCode(interp, "COMPILER", "COMPILE",
-                "attempt to call compile in deleted interpreter",
+        Tcl_AppendResult(interp, "couldn't create output file \"",
+                nativeOutName, "\": ", Tcl_PosixError(interp),
                 (char *) NULL);
         return TCL_ERROR;
     }
 
-    /*
-     * We force a recompilation even though this object may already be
-     * compiled. However, we do not attempt to recompile an object that had
-     * been generated from a compiled script.
-     */
-
-    if (objPtr->typePtr == cmpByteCodeType) {
-        codePtr = (ByteCode *) objPtr->internalRep.otherValuePtr;
+    emitPtr->target = outChan;
+    emitPtr->curPtr = emitPtr->basePtr;
+    result = EmitStreamedScript(interp, inChan, NULL, preamblePtr, flags,
+            emitPtr);
+    emitPtr->target = (Tcl_Channel) NULL;
 
-        if (codePtr->flags & TCL_BYTECODE_PRECOMPILED) {
-            return TCL_OK;
-        }
+    if (result == TCL_RETURN) {
+        result = TclUpdateReturnInfo((Interp *) interp);
+    } else if (result == TCL_ERROR) {
+        char msg[200];
 
-        cmpByteCodeType->freeIntRepProc(objPtr);
-	objPtr->typePtr = (Tcl_ObjType *) NULL;
+        sprintf(msg, "\n    (file \"%.150s\" line %d)", inFilePtr,
+                ERRORLINE(interp));
+        Tcl_AddErrorInfo(interp, msg);
     }
-    if (objPtr->typePtr != cmpByteCodeType) {
-        /*
-         * First reset any error line number information.
-         */
 
-#if (TCL_MAJOR_VERSION == 8) && (TCL_MINOR_VERSION < 6)
-        iPtr->errorLine = 1;   /* no correct line # information yet */
-#else
-	Tcl_SetErrorLine(interp, 1);
-#endif
-        result = CompileObject(interp, objPtr);
+    Tcl_Close(NULL, inChan);
+    if ((Tcl_Close(interp, outChan) != TCL_OK) && (result != TCL_ERROR)) {
+        Tcl_AppendResult(interp, "error closing bytecode stream: ",
+                Tcl_PosixError(interp),
+                (char *) NULL);
+        result = TCL_ERROR;
+    }
+    if (result == TCL_ERROR) {
+        pathPtr = Tcl_NewStringObj(nativeOutName, -1);
+        Tcl_IncrRefCount(pathPtr);
+        Tcl_FSDeleteFile(pathPtr);
+        Tcl_DecrRefCount(pathPtr);
     }
-
     return result;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitCompiledObject --
+ * Compiler_BundleObjCmd --
  *
- *  Emits the contents of a ByteCode structure to a Tcl_Channel to generate
- *  a TCL "object file".
- *  There are three parts to the object file:
- *   - a header containing information about the ByteCode structure.
- *   - the dump of the bytecodes
- *   - the dump of the support arrays; this includes the dump of all the
- *     objects used by the byte code itself.
+ *  Compiles the files of a package into a single bundle, and writes a
+ *  pkgIndex.tcl sourcing the bundle next to it.
+ *  Call format:
+ *    compiler::bundle ?-compactliterals? ?-deterministic? ?-nosrcmap?
+ *		?-optimize? ?-preamble value? package version fileList
+ *		outputFile
+ *  fileList holds the files in the order in which the package sources
+ *  them. The bundle requires the loader once, then evaluates the files in
+ *  turn, each with its own loader call and with "info script" set to the
+ *  file, at the same path relative to the bundle as at compile time. The
+ *  literal table setup is shared, as by compiler::compileFiles, but each
+ *  file still has its own literal array in the bundle: literals are not
+ *  deduplicated across files.
  *
  * Results:
- *  Returns a TCL result code.
+ *  Returns a standard TCL result code. The bundle is deleted if a file
+ *  fails to compile.
  *
  * Side effects:
- *  Appends an error message to the TCL error.
+ *  Adds the bundle to the pkgIndex.tcl of the directory of outputFile,
+ *  keeping the entries of other packages.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-EmitCompiledObject(interp, objPtr, chan)
-    Tcl_Interp *interp;		/* Token for command interpreter
-                                 * (returned by a previous call to
-                                 * Tcl_CreateInterp). */
-    Tcl_Obj *objPtr;		/* Pointer to the object whose bytecode
-                                 * structure is to be written to file */
-    Tcl_Channel chan;		/* the Tcl_Channel to which we want to emit */
+int
+Compiler_BundleObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;		/* Not used. */
+    Tcl_Interp *interp;		/* Current interpreter. */
+    int objc;			/* Number of arguments. */
+    Tcl_Obj *CONST objv[];	/* Argument objects. */
 {
-    if ((EmitScriptPreamble(interp, chan) != TCL_OK)
-            || (EmitSignature(interp, chan) != TCL_OK)) {
+    Interp *iPtr = (Interp *) interp;
+    char *preamblePtr = NULL;
+    int flags, argIndex, numFiles, i, result, savedPhase;
+    Tcl_Obj *listObjPtr, *outObjPtr, *bundleObjPtr, *dirObjPtr;
+    Tcl_Obj *fileObjPtr, *indexObjPtr;
+    Tcl_Obj **partsObjv;
+    int numParts;
+    Tcl_Channel chan;
+    LiteralTable glt; /* Save buffer for global literals */
+    EmitContext emitCtx;
+
+    if (ParseCompileOptions(interp, objc, objv, &flags, &preamblePtr,
+            NULL, NULL, &argIndex) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (objc - argIndex != 4) {
+        Tcl_WrongNumArgs(interp, 1, objv,
+                "?-compactliterals? ?-deterministic? ?-nosrcmap? ?-optimize? "
+                "?-preamble value? package version fileList outputFile");
+        return TCL_ERROR;
+    }
+    if (flags & (COMPILER_BINARY | COMPILER_STREAM)) {
+        Tcl_AppendResult(interp, "-binary, -lazyprocs and -stream cannot ",
+                "be used for a bundle", NULL);
+        return TCL_ERROR;
+    }
+    if (Tcl_ListObjLength(interp, objv[argIndex + 2], &numFiles) != TCL_OK) {
         return TCL_ERROR;
     }
 
-    if (EmitByteCode(interp, (ByteCode *) objPtr->internalRep.otherValuePtr,
-            chan) != TCL_OK) {
-        PrependResult(interp, "error writing bytecode stream: ");
+    /*
+     * The paths in the bundle are relative to the directory of the
+     * bundle, so both are needed in components.
+     */
+
+    outObjPtr = objv[argIndex + 3];
+    if (Tcl_FSGetNormalizedPath(interp, outObjPtr) == NULL) {
         return TCL_ERROR;
     }
+    bundleObjPtr = Tcl_FSSplitPath(Tcl_FSGetNormalizedPath(interp, outObjPtr),
+            NULL);
+    Tcl_IncrRefCount(bundleObjPtr);
+    Tcl_ListObjGetElements(NULL, bundleObjPtr, &numParts, &partsObjv);
+    dirObjPtr = Tcl_NewListObj(numParts - 1, partsObjv);
+    Tcl_IncrRefCount(dirObjPtr);
 
-    if (EmitScriptPostamble(interp, chan) != TCL_OK) {
+    chan = Tcl_OpenFileChannel(interp, Tcl_GetString(outObjPtr), "w", 0644);
+    if (chan == (Tcl_Channel) NULL) {
+        Tcl_ResetResult(interp);
+        Tcl_AppendResult(interp, "couldn't create output file \"",
+                Tcl_GetString(outObjPtr), "\": ", Tcl_PosixError(interp),
+                (char *) NULL);
+        Tcl_DecrRefCount(bundleObjPtr);
+        Tcl_DecrRefCount(dirObjPtr);
         return TCL_ERROR;
     }
 
-    if (Tcl_Flush(chan) != TCL_OK) {
-        Tcl_AppendResult(interp,
-                "error flushing bytecode stream: Tcl_Flush: ",
+    listObjPtr = objv[argIndex + 2];
+    Tcl_IncrRefCount(listObjPtr);
+    SaveLiteralTable(iPtr, &glt);
+    EmitInitContext(chan, &emitCtx);
+    emitCtx.flags = flags;
+
+    savedPhase = PhaseEnter(COMPILER_PHASE_EMIT);
+    result = TCL_OK;
+    if (preamblePtr && (EmitString(interp, preamblePtr, -1, '\n',
+            &emitCtx) != TCL_OK)) {
+        result = TCL_ERROR;
+    } else {
+        result = EmitScriptPreamble(interp, PREAMBLE_BUNDLE, &emitCtx);
+    }
+    PhaseLeave(savedPhase);
+
+    for (i=0 ; (result == TCL_OK) && (i < numFiles) ; i++) {
+        /*
+         * Copy the name, the compile may shimmer the list.
+         */
+
+        Tcl_ListObjIndex(NULL, listObjPtr, i, &fileObjPtr);
+        fileObjPtr = Tcl_NewStringObj(Tcl_GetString(fileObjPtr), -1);
+        Tcl_IncrRefCount(fileObjPtr);
+        result = BundleOneFile(interp, fileObjPtr, dirObjPtr, bundleObjPtr,
+                flags, &emitCtx);
+        Tcl_DecrRefCount(fileObjPtr);
+    }
+
+    if ((result == TCL_OK)
+            && (EmitFlushContext(interp, &emitCtx) != TCL_OK)) {
+        PrependResult(interp, "error writing bytecode stream: ");
+        result = TCL_ERROR;
+    }
+    emitCtx.target = (Tcl_Channel) NULL;
+    EmitFreeContext(&emitCtx);
+    RestoreLiteralTable(iPtr, &glt);
+    Tcl_DecrRefCount(listObjPtr);
+
+    if ((Tcl_Close(interp, chan) != TCL_OK) && (result != TCL_ERROR)) {
+        Tcl_AppendResult(interp, "error closing bytecode stream: ",
                 Tcl_PosixError(interp),
                 (char *) NULL);
-        return TCL_ERROR;
+        result = TCL_ERROR;
+    }
+    if (result != TCL_OK) {
+        Tcl_FSDeleteFile(outObjPtr);
+    } else {
+        /*
+         * The index sources the bundle from the directory it is in.
+         */
+
+        Tcl_ListObjGetElements(NULL, bundleObjPtr, &numParts, &partsObjv);
+        Tcl_ListObjAppendElement(NULL, dirObjPtr,
+                Tcl_NewStringObj("pkgIndex.tcl", -1));
+        indexObjPtr = Tcl_FSJoinPath(dirObjPtr, -1);
+        Tcl_IncrRefCount(indexObjPtr);
+        result = WriteBundleIndex(interp, indexObjPtr,
+                Tcl_GetString(objv[argIndex]),
+                Tcl_GetString(objv[argIndex + 1]),
+                Tcl_GetString(partsObjv[numParts - 1]));
+        Tcl_DecrRefCount(indexObjPtr);
     }
 
-    return TCL_OK;
+    Tcl_DecrRefCount(bundleObjPtr);
+    Tcl_DecrRefCount(dirObjPtr);
+    return result;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitByteCode --
+ * BundleOneFile --
  *
- *  Emits the contents of a ByteCode structure to a Tcl_Channel.
- *  There are three parts to the dumped information:
- *   - a header containing information about the ByteCode structure.
- *   - the dump of the bytecodes
- *   - the dump of the support arrays; this includes the dump of all the
- *     objects used by the byte code itself.
+ *  Compiles one file of a bundle and emits it: the loader call, with
+ *  "info script" set to the file before, and back to the bundle after.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  Returns a standard TCL result code.
  *
  * Side effects:
- *  None.
+ *  Appends the file and line to the error info on a compile error.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-EmitByteCode(interp, codePtr, chan)
-    Tcl_Interp *interp;		/* the current interpreter */
-    ByteCode *codePtr;		/* Pointer to the ByteCode structure to be
-                                 * emitted */
-    Tcl_Channel chan;		/* the Tcl_Channel to which we want to emit */
+BundleOneFile(interp, fileObjPtr, dirObjPtr, bundleObjPtr, flags, emitPtr)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    Tcl_Obj *fileObjPtr;	/* the file to compile */
+    Tcl_Obj *dirObjPtr;		/* components of the directory of the
+                                 * bundle */
+    Tcl_Obj *bundleObjPtr;	/* components of the path of the bundle */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
 {
-    LocMapSizes locMapSizes;
-
-    /*
-     * Emit the sizes of the various components of the ByteCode struct,
-     * so that the size can be recalculated at read time.
-     * These fields are currently written out as 0 always:
-     * numSrcChars
-     */
-
-    CalculateLocMapSizes(codePtr, &locMapSizes);
+    char *fileName = Tcl_GetString(fileObjPtr);
+    Tcl_Channel chan;
+    Tcl_Obj *cmdObjPtr, *pathObjPtr, *fileDirObjPtr, *relObjPtr;
+    Tcl_Obj **partsObjv;
+    int numParts, result, savedPhase;
 
-    if ((EmitInteger(interp, codePtr->numCommands, ' ', chan) != TCL_OK)
-            || (EmitInteger(interp, 0, ' ', chan) != TCL_OK) /* numSrcChars */
-            || (EmitInteger(interp, codePtr->numCodeBytes, ' ', chan)
-                    != TCL_OK)
-            || (EmitInteger(interp, codePtr->numLitObjects, ' ', chan) != TCL_OK)
-            || (EmitInteger(interp, codePtr->numExceptRanges, ' ', chan)
-                    != TCL_OK)
-            || (EmitInteger(interp, codePtr->numAuxDataItems, ' ', chan)
-                    != TCL_OK)
-            || (EmitInteger(interp, codePtr->numCmdLocBytes, ' ', chan)
-                    != TCL_OK)
-            || (EmitInteger(interp, codePtr->maxExceptDepth, ' ', chan)
-                    != TCL_OK)
-            || (EmitInteger(interp, codePtr->maxStackDepth, ' ', chan)
-                    != TCL_OK)) {
+    chan = Tcl_OpenFileChannel(interp, fileName, "r", 0644);
+    if (chan == (Tcl_Channel) NULL) {
+        Tcl_ResetResult(interp);
+        Tcl_AppendResult(interp, "couldn't read file \"", fileName,
+                "\": ", Tcl_PosixError(interp), (char *) NULL);
         return TCL_ERROR;
     }
-
-#if EMIT_SRCMAP
-    if ((EmitInteger(interp, locMapSizes.codeDeltaSize, ' ', chan) != TCL_OK)
-            || (EmitInteger(interp, locMapSizes.codeLengthSize, ' ', chan)
-                    != TCL_OK)
-            || (EmitInteger(interp, locMapSizes.srcDeltaSize, ' ', chan)
-                    != TCL_OK)
-            || (EmitInteger(interp, locMapSizes.srcLengthSize, '\n', chan)
-                    != TCL_OK)) {
+    cmdObjPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(cmdObjPtr);
+    if (Tcl_ReadChars(chan, cmdObjPtr, -1, 0) < 0) {
+        Tcl_Close(NULL, chan);
+        Tcl_AppendResult(interp, "couldn't read file \"", fileName,
+                "\": ", Tcl_PosixError(interp), (char *) NULL);
+        Tcl_DecrRefCount(cmdObjPtr);
         return TCL_ERROR;
     }
-#else
-    if ((EmitInteger(interp, locMapSizes.codeDeltaSize, ' ', chan) != TCL_OK)
-            || (EmitInteger(interp, locMapSizes.codeLengthSize, ' ', chan)
-                    != TCL_OK)
-            || (EmitInteger(interp, -1, ' ', chan) != TCL_OK)
-            || (EmitInteger(interp, -1, '\n', chan) != TCL_OK)) {
+    if (Tcl_Close(interp, chan) != TCL_OK) {
+        Tcl_DecrRefCount(cmdObjPtr);
         return TCL_ERROR;
     }
-#endif
-
-    /*
-     * The byte code dumps
-     */
 
-    if (EmitByteSequence(interp, codePtr->codeStart, codePtr->numCodeBytes,
-            chan) != TCL_OK) {
-        return TCL_ERROR;
+    result = Compiler_CompileObjEx(interp, cmdObjPtr, flags);
+    if (result == TCL_RETURN) {
+        result = TclUpdateReturnInfo((Interp *) interp);
     }
+    if (result != TCL_OK) {
+        if (result == TCL_ERROR) {
+            char msg[200];
 
-    if ((EmitByteSequence(interp, codePtr->codeDeltaStart,
-            locMapSizes.codeDeltaSize, chan) != TCL_OK)
-            || (EmitByteSequence(interp, codePtr->codeLengthStart,
-                    locMapSizes.codeLengthSize, chan) != TCL_OK)) {
-        return TCL_ERROR;
-    }
-#if EMIT_SRCMAP
-    if ((EmitByteSequence(interp, codePtr->srcDeltaStart,
-            locMapSizes.srcDeltaSize, chan) != TCL_OK)
-            || (EmitByteSequence(interp, codePtr->srcLengthStart,
-                    locMapSizes.srcLengthSize, chan) != TCL_OK)) {
-        return TCL_ERROR;
+            /*
+             * The script is not released, see CompileOneFile.
+             * [AS Bug 20078]
+             */
+
+            sprintf(msg, "\n    (file \"%.150s\" line %d)", fileName,
+                    ERRORLINE(interp));
+            Tcl_AddErrorInfo(interp, msg);
+        } else {
+            Tcl_DecrRefCount(cmdObjPtr);
+        }
+        return result;
     }
-#endif
 
     /*
-     * the support arrays
+     * The file's path relative to the bundle, and the bundle's relative to
+     * the directory of the file.
      */
 
-    if ((EmitObjArray(interp, codePtr, chan) != TCL_OK)
-            || (EmitExcRangeArray(interp, codePtr, chan) != TCL_OK)
-            || (EmitAuxDataArray(interp, codePtr, chan) != TCL_OK)) {
+    if (Tcl_FSGetNormalizedPath(interp, fileObjPtr) == NULL) {
+        Tcl_DecrRefCount(cmdObjPtr);
         return TCL_ERROR;
     }
+    pathObjPtr = Tcl_FSSplitPath(Tcl_FSGetNormalizedPath(interp, fileObjPtr),
+            NULL);
+    Tcl_IncrRefCount(pathObjPtr);
+    Tcl_ListObjGetElements(NULL, pathObjPtr, &numParts, &partsObjv);
+    fileDirObjPtr = Tcl_NewListObj(numParts - 1, partsObjv);
+    Tcl_IncrRefCount(fileDirObjPtr);
+
+    savedPhase = PhaseEnter(COMPILER_PHASE_EMIT);
+    relObjPtr = RelativePath(dirObjPtr, pathObjPtr);
+    result = EmitBundleFormat(interp, bundleFilePreambleFormat, relObjPtr,
+            emitPtr);
+    if ((result == TCL_OK)
+            && (EmitSignature(interp, emitPtr) != TCL_OK)) {
+        result = TCL_ERROR;
+    }
+    if ((result == TCL_OK) && (EmitByteCode(interp,
+            (ByteCode *) cmdObjPtr->internalRep.otherValuePtr, emitPtr)
+            != TCL_OK)) {
+        PrependResult(interp, "error writing bytecode stream: ");
+        result = TCL_ERROR;
+    }
+    if (result == TCL_OK) {
+        relObjPtr = RelativePath(fileDirObjPtr, bundleObjPtr);
+        result = EmitBundleFormat(interp, bundleFilePostambleFormat,
+                relObjPtr, emitPtr);
+    }
+    PhaseLeave(savedPhase);
 
-    return TCL_OK;
+    Tcl_DecrRefCount(pathObjPtr);
+    Tcl_DecrRefCount(fileDirObjPtr);
+    Tcl_DecrRefCount(cmdObjPtr);
+    return result;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitChar --
+ * EmitBundleFormat --
  *
- *  Emits a character value to a Tcl_Channel.
- *  The separator argument specifies a character to be emitted after the
- *  integer.
+ *  Emits one of the pieces around a file in a bundle, given the relative
+ *  path to insert into it.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  Returns TCL_OK on success, TCL_ERROR on error.
  *
  * Side effects:
- *  None.
+ *  Frees relObjPtr, if unshared.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-EmitChar(interp, value, separator, chan)
-    Tcl_Interp *interp;		/* the current interpreter */
-    char value;			/* the value to emit */
-    char separator;		/* the separator character */
-    Tcl_Channel chan;		/* the Tcl_Channel to which we want to emit */
+EmitBundleFormat(interp, format, relObjPtr, emitPtr)
+    Tcl_Interp *interp;		/* the current TCL interpreter */
+    char *format;		/* bundleFilePreambleFormat or
+                                 * bundleFilePostambleFormat */
+    Tcl_Obj *relObjPtr;		/* the relative path, as a list of
+                                 * components */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
 {
-    char buf[2];
+    Tcl_Obj *pathObjPtr;
+    Tcl_DString word;
+    char *buf;
+    int result;
 
-    buf[0] = value;
-    buf[1] = separator;
-    if (Tcl_Write(chan, buf, 2) < 0) {
-        Tcl_AppendResult(interp, "Tcl_Write: ", Tcl_PosixError(interp),
-                (char *) NULL);
-        return TCL_ERROR;
+    /*
+     * The path is inserted as a single, quoted, word.
+     */
+
+    Tcl_IncrRefCount(relObjPtr);
+    pathObjPtr = Tcl_FSJoinPath(relObjPtr, -1);
+    Tcl_IncrRefCount(pathObjPtr);
+    Tcl_DStringInit(&word);
+    Tcl_DStringAppendElement(&word, Tcl_GetString(pathObjPtr));
+
+    buf = ckalloc(strlen(format) + Tcl_DStringLength(&word)
+            + strlen(loaderName) + strlen(evalCommand) + 1);
+    sprintf(buf, format, Tcl_DStringValue(&word), loaderName, evalCommand);
+    result = EmitString(interp, buf, -1, '\n', emitPtr);
+    if (result != TCL_OK) {
+        PrependResult(interp, "error writing bundle: ");
     }
 
-    return TCL_OK;
+    ckfree(buf);
+    Tcl_DStringFree(&word);
+    Tcl_DecrRefCount(pathObjPtr);
+    Tcl_DecrRefCount(relObjPtr);
+    return result;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitInteger --
+ * RelativePath --
  *
- *  Emits an integer value to a Tcl_Channel.
- *  The separator argument specifies a character to be emitted after the
- *  integer.
+ *  Computes the relative path from a directory to a path, both given as
+ *  the components of normalized paths.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  A new list of the components of the relative path.
  *
  * Side effects:
  *  None.
@@ -1122,97 +2080,175 @@ EmitChar(interp, value, separator, chan)
  *----------------------------------------------------------------------
  */
 
-static int
-EmitInteger(interp, value, separator, chan)
-    Tcl_Interp *interp;		/* the current interpreter */
-    int value;			/* the value to emit */
-    char separator;		/* the separator character */
-    Tcl_Channel chan;		/* the Tcl_Channel to which we want to emit */
+static Tcl_Obj *
+RelativePath(dirObjPtr, pathObjPtr)
+    Tcl_Obj *dirObjPtr;		/* components of the directory */
+    Tcl_Obj *pathObjPtr;	/* components of the path */
 {
-    char buf[32];
-
-    sprintf(buf, "%d%c", value, separator);
-    if (Tcl_Write(chan, buf, strlen(buf)) < 0) {
-        Tcl_AppendResult(interp, "Tcl_Write: ", Tcl_PosixError(interp),
-                (char *) NULL);
-        return TCL_ERROR;
+    Tcl_Obj **dirObjv, **pathObjv;
+    Tcl_Obj *relObjPtr;
+    int dirc, pathc, common, i;
+
+    Tcl_ListObjGetElements(NULL, dirObjPtr, &dirc, &dirObjv);
+    Tcl_ListObjGetElements(NULL, pathObjPtr, &pathc, &pathObjv);
+    for (common=0 ; (common < dirc) && (common < pathc) ; common++) {
+        if (strcmp(Tcl_GetString(dirObjv[common]),
+                Tcl_GetString(pathObjv[common])) != 0) {
+            break;
+        }
     }
 
-    return TCL_OK;
+    relObjPtr = Tcl_NewObj();
+    for (i=common ; i < dirc ; i++) {
+        Tcl_ListObjAppendElement(NULL, relObjPtr, Tcl_NewStringObj("..", 2));
+    }
+    for (i=common ; i < pathc ; i++) {
+        Tcl_ListObjAppendElement(NULL, relObjPtr, pathObjv[i]);
+    }
+    return relObjPtr;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitString --
+ * WriteBundleIndex --
  *
- *  Emits a string value to a Tcl_Channel.
- *  If the length is passed as -1, it is calculated with strlen.
- *  The separator argument specifies a character to be emitted after the
- *  string.
+ *  Writes the pkgIndex.tcl for a bundle. The lines of an existing index
+ *  are kept, except an ifneeded line for the same package and version,
+ *  which is replaced.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  Returns a standard TCL result code.
  *
  * Side effects:
- *  None.
+ *  Creates or rewrites the index file.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-EmitString(interp, src, length, separator, chan)
-    Tcl_Interp *interp;		/* the current TCL interpreter */
-    char *src;			/* the string to emit */
-    int length;			/* the length of the string to emit */
-    char separator;		/* the separator character */
-    Tcl_Channel chan;		/* the Tcl_Channel to which we want to emit */
+WriteBundleIndex(interp, indexObjPtr, package, version, bundleName)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    Tcl_Obj *indexObjPtr;	/* the path of the index file */
+    char *package;		/* the name of the package */
+    char *version;		/* its version */
+    char *bundleName;		/* the name of the bundle, in the directory
+                                 * of the index */
 {
-    char buf[4];
+    Tcl_DString line, index;
+    Tcl_Channel chan;
+    Tcl_Obj *oldObjPtr;
+    char *start, *end;
+    int prefixLength, length;
+    int result = TCL_OK;
 
-    if (length < 0) {
-        length = strlen(src);
-    }
+    Tcl_DStringInit(&line);
+    Tcl_DStringAppend(&line, "package ifneeded", -1);
+    Tcl_DStringAppendElement(&line, package);
+    Tcl_DStringAppendElement(&line, version);
+    Tcl_DStringAppend(&line, " ", -1);
+    prefixLength = Tcl_DStringLength(&line);
+    Tcl_DStringAppend(&line, "[list source [file join $dir", -1);
+    Tcl_DStringAppendElement(&line, bundleName);
+    Tcl_DStringAppend(&line, "]]\n", -1);
 
-    if ((length > 0) && (Tcl_Write(chan, src, length) < 0)) {
-        Tcl_AppendResult(interp, "Tcl_Write: ", Tcl_PosixError(interp),
-                (char *) NULL);
-        return TCL_ERROR;
+    /*
+     * Other packages may share the directory, so their lines of an existing
+     * index are copied over.
+     */
+
+    Tcl_DStringInit(&index);
+    if (Tcl_FSAccess(indexObjPtr, F_OK) == 0) {
+        chan = Tcl_FSOpenFileChannel(interp, indexObjPtr, "r", 0);
+        if (chan == (Tcl_Channel) NULL) {
+            Tcl_ResetResult(interp);
+            Tcl_AppendResult(interp, "couldn't read package index \"",
+                    Tcl_GetString(indexObjPtr), "\": ",
+                    Tcl_PosixError(interp), (char *) NULL);
+            Tcl_DStringFree(&line);
+            return TCL_ERROR;
+        }
+        oldObjPtr = Tcl_NewObj();
+        Tcl_IncrRefCount(oldObjPtr);
+        if (Tcl_ReadChars(chan, oldObjPtr, -1, 0) < 0) {
+            Tcl_AppendResult(interp, "error reading package index: ",
+                    Tcl_PosixError(interp), (char *) NULL);
+            result = TCL_ERROR;
+        }
+        if ((Tcl_Close(interp, chan) != TCL_OK) && (result == TCL_OK)) {
+            result = TCL_ERROR;
+        }
+        start = Tcl_GetStringFromObj(oldObjPtr, &length);
+        while ((result == TCL_OK) && (*start != '\0')) {
+            end = strchr(start, '\n');
+            end = (end == NULL) ? (start + strlen(start)) : (end + 1);
+            if ((end - start < prefixLength) || strncmp(start,
+                    Tcl_DStringValue(&line), (size_t) prefixLength)) {
+                Tcl_DStringAppend(&index, start, end - start);
+                if (end[-1] != '\n') {
+                    Tcl_DStringAppend(&index, "\n", 1);
+                }
+            }
+            start = end;
+        }
+        Tcl_DecrRefCount(oldObjPtr);
+        if (result != TCL_OK) {
+            Tcl_DStringFree(&index);
+            Tcl_DStringFree(&line);
+            return result;
+        }
     }
+    Tcl_DStringAppend(&index, Tcl_DStringValue(&line),
+            Tcl_DStringLength(&line));
 
-    sprintf(buf, "%c", separator);
-    if (Tcl_Write(chan, buf, strlen(buf)) < 0) {
-        Tcl_AppendResult(interp, "Tcl_Write: ", Tcl_PosixError(interp),
+    chan = Tcl_FSOpenFileChannel(interp, indexObjPtr, "w", 0644);
+    if (chan == (Tcl_Channel) NULL) {
+        Tcl_ResetResult(interp);
+        Tcl_AppendResult(interp, "couldn't create package index \"",
+                Tcl_GetString(indexObjPtr), "\": ", Tcl_PosixError(interp),
                 (char *) NULL);
-        return TCL_ERROR;
+        result = TCL_ERROR;
+    } else {
+        if (Tcl_WriteChars(chan, Tcl_DStringValue(&index),
+                Tcl_DStringLength(&index)) < 0) {
+            Tcl_AppendResult(interp, "error writing package index: ",
+                    Tcl_PosixError(interp), (char *) NULL);
+            result = TCL_ERROR;
+        }
+        if ((Tcl_Close(interp, chan) != TCL_OK) && (result == TCL_OK)) {
+            result = TCL_ERROR;
+        }
     }
 
-    return TCL_OK;
+    Tcl_DStringFree(&index);
+    Tcl_DStringFree(&line);
+    return result;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitByteSequence --
+ * Compiler_CompileFilesObjCmd --
  *
- *  Emits an array of bytes to a Tcl_Channel, in ASCII85.
- *  This procedure encodes its input with a modified version of the ASCII85
- *  encode filter.
- *  There are two differences from the standard ASCII85 algorithm:
- *	- the encoding characters are obtained from a table rather than
- *	  being generated arithmetically. This is done because we want to
- *	  avoid using Tcl special characters.
- *	- the order in which bytes in a 4-tuple are encoded is the opposite
- *	  of the standard order. This lets us drop ! bytes in the encoded
- *	  5-tuple, which buys us better encoding with short strings.
- *  As a consequence, this encoder is not general purpose; only a similarly
- *  specialized decoder can extract the bytes back.
+ *  Compiles a batch of files. The literal table setup and the output
+ *  buffer are shared by all the files, and an error in one file does not
+ *  stop the compilation of the others.
  *
- *  The format is a line containing the byte count, then lines each containing
- *  72 ASCII characters, or fewer for the last line.
+ *  Call format:
+ *    compiler::compileFiles ?-binary? ?-compactliterals? ?-deterministic?
+ *		?-lazyprocs? ?-nosrcmap? ?-optimize? ?-preamble value?
+ *		?-stream? fileList
+ *  Each element of fileList is a list {inputFile outputFile ?preamble?}.
+ *  An empty outputFile selects the default output name, as for
+ *  compiler::compile, and a per-file preamble overrides the -preamble
+ *  flag.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  Returns a standard TCL result code. On success the result is a list
+ *  with one element per element of fileList, in the same order, so that
+ *  a file listed twice gets a result for each. Each element is a
+ *  dictionary with keys "status" (ok or error), "time" (the compile time
+ *  in microseconds) and, for failed files, "error" (the error message).
  *
  * Side effects:
  *  None.
@@ -1220,177 +2256,382 @@ EmitString(interp, src, length, separator, chan)
  *----------------------------------------------------------------------
  */
 
-static int
-EmitByteSequence(interp, bytesPtr, length, chan)
-    Tcl_Interp *interp;		/* the current interpreter */
-    unsigned char *bytesPtr;	/* the sequence of bytes to write out */
-    int length;			/* how many bytes to write out */
-    Tcl_Channel chan;		/* the Tcl_Channel to which we want to emit */
+int
+Compiler_CompileFilesObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;		/* Not used. */
+    Tcl_Interp *interp;		/* Current interpreter. */
+    int objc;			/* Number of arguments. */
+    Tcl_Obj *CONST objv[];	/* Argument objects. */
 {
-    A85EncodeContext encodeCtx;
-    unsigned char bytes[4];
-    int numBytes = 0;
+    Interp *iPtr = (Interp *) interp;
+    char *preamblePtr = NULL;
+    char *outFilePtr;
+    int flags = 0;
+    int listIndex, numFiles, numFields, i, result;
+    Tcl_Obj *listObjPtr, *entryObjPtr, *inObjPtr;
+    Tcl_Obj **fieldObjv;
+    Tcl_Obj *resultObjPtr;
+    LiteralTable glt; /* Save buffer for global literals */
+    EmitContext emitCtx;
+    Tcl_Time start, stop;
 
-    if (EmitInteger(interp, length, '\n', chan) != TCL_OK) {
+    if (ParseCompileOptions(interp, objc, objv, &flags, &preamblePtr,
+            NULL, NULL, &listIndex) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (objc - listIndex != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv,
+                "?-binary? ?-compactliterals? ?-deterministic? ?-lazyprocs? "
+                "?-nosrcmap? ?-optimize? ?-preamble value? ?-stream? "
+                "fileList");
         return TCL_ERROR;
     }
 
-    A85InitEncodeContext(chan, '\n', &encodeCtx);
+    /*
+     * Check the whole list before compiling anything.
+     */
 
-    while (length > 0) {
-        bytes[numBytes] = *bytesPtr;
+    listObjPtr = objv[listIndex];
+    if (CheckFileList(interp, listObjPtr, &numFiles) != TCL_OK) {
+        return TCL_ERROR;
+    }
 
-        if (numBytes == 3) {
-            if (A85EncodeBytes(interp, bytes, 4, &encodeCtx) != TCL_OK) {
-                return TCL_ERROR;
-            }
-            numBytes = -1;
+    Tcl_IncrRefCount(listObjPtr);
+    resultObjPtr = Tcl_NewObj();
+
+    SaveLiteralTable(iPtr, &glt);
+    EmitInitContext((Tcl_Channel) NULL, &emitCtx);
+
+    for (i=0 ; i < numFiles ; i++) {
+        /*
+         * Refetch the entry each time, the compile may have shimmered the
+         * list. The entry is held while its strings are in use.
+         */
+
+        Tcl_ListObjIndex(NULL, listObjPtr, i, &entryObjPtr);
+        Tcl_IncrRefCount(entryObjPtr);
+        Tcl_ListObjGetElements(NULL, entryObjPtr, &numFields, &fieldObjv);
+        inObjPtr = fieldObjv[0];
+        Tcl_IncrRefCount(inObjPtr);
+
+        outFilePtr = Tcl_GetString(fieldObjv[1]);
+        if (*outFilePtr == '\0') {
+            outFilePtr = NULL;
         }
 
-        numBytes += 1;
-        bytesPtr += 1;
-        length -= 1;
+        Tcl_GetTime(&start);
+        result = CompileOneFile(interp, Tcl_GetString(inObjPtr), outFilePtr,
+                (numFields > 2) ? Tcl_GetString(fieldObjv[2]) : preamblePtr,
+                flags, &emitCtx);
+        Tcl_GetTime(&stop);
+        Tcl_DecrRefCount(entryObjPtr);
+
+        Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                NewCompileInfoObj(result, ElapsedTime(&start, &stop),
+                    (result == TCL_OK) ? NULL : Tcl_GetObjResult(interp)));
+        Tcl_DecrRefCount(inObjPtr);
+        Tcl_ResetResult(interp);
     }
 
-    if ((numBytes != 0) && (A85EncodeBytes(interp, bytes, numBytes,
-            &encodeCtx) != TCL_OK)) {
-        return TCL_ERROR;
-    }
+    EmitFreeContext(&emitCtx);
+    RestoreLiteralTable(iPtr, &glt);
 
-    return A85Flush(interp, &encodeCtx);
+    Tcl_DecrRefCount(listObjPtr);
+    Tcl_SetObjResult(interp, resultObjPtr);
+    return TCL_OK;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CalculateLocMapSizes --
+ * Compiler_CompileParallelObjCmd --
  *
- *  Calculates the lengths of the location map arrays in a ByteCode
- *  struct and places them in the LocMapSizes argument.
- *  Note that, although it could use pointer arithmetic for all but the
- *  last one (because the arrays are contiguous), we elect to do it by
- *  scanning the arrays in all cases.
+ *  Compiles a list of files on a pool of worker threads. Each worker
+ *  creates its own interpreter with the Compiler package loaded in it,
+ *  and takes files from the list until all have been compiled.
+ *  Call format:
+ *    compiler::compileParallel ?-binary? ?-compactliterals?
+ *		?-deterministic? ?-lazyprocs? ?-nosrcmap? ?-optimize?
+ *		?-preamble value? ?-stream?
+ *		?-threads count? fileList
+ *  fileList is as for compiler::compileFiles. The number of threads
+ *  defaults to the number of processors, and is never more than the
+ *  number of files. If Tcl was built without thread support, or no
+ *  worker could be started, the files are compiled in the current
+ *  interpreter instead.
  *
  * Results:
- *  None.
+ *  Returns a standard TCL result code. On success the result is the same
+ *  list as returned by compiler::compileFiles, in the order of fileList
+ *  whatever the order in which the files were compiled.
  *
  * Side effects:
- *  Fills in the fields of the LocMapSizes struct.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
-static void
-CalculateLocMapSizes(codePtr, sizes)
-    ByteCode *codePtr;		/* The ByteCode for which we want to
-                                 * calculate lengths */
-    LocMapSizes *sizes;		/* Size struct to be filled in */
+
+int
+Compiler_CompileParallelObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;		/* Not used. */
+    Tcl_Interp *interp;		/* Current interpreter. */
+    int objc;			/* Number of arguments. */
+    Tcl_Obj *CONST objv[];	/* Argument objects. */
 {
+    char *preamblePtr = NULL;
+    int flags = 0;
+    int numThreads = 0;
+    int listIndex, numFiles, numFields, i;
+    Tcl_Obj *listObjPtr, *resultObjPtr, *errorObjPtr;
+    Tcl_Obj **fileObjv, **fieldObjv;
+    CompileBatch batch;
+    CompileJob *jobPtr;
+#ifdef TCL_THREADS
+    Tcl_ThreadId *threadIds;
+    int numStarted, status;
+#endif
+
+    if (ParseCompileOptions(interp, objc, objv, &flags, &preamblePtr,
+            &numThreads, NULL, &listIndex) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (objc - listIndex != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv,
+                "?-binary? ?-compactliterals? ?-deterministic? ?-lazyprocs? "
+                "?-nosrcmap? ?-optimize? ?-preamble value? ?-stream? "
+                "?-threads count? "
+                "fileList");
+        return TCL_ERROR;
+    }
+
+    listObjPtr = objv[listIndex];
+    if (CheckFileList(interp, listObjPtr, &numFiles) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (numFiles == 0) {
+        Tcl_ResetResult(interp);
+        return TCL_OK;
+    }
+    if (numThreads == 0) {
+        numThreads = GetProcessorCount();
+    }
+    if (numThreads > numFiles) {
+        numThreads = numFiles;
+    }
+
     /*
-     * EMIL for all but the last, we could do sanity checking by using
-     * pointer arithmetic.
+     * Copy the file names into the jobs; the workers must not use the
+     * objects of this thread.
      */
 
-    sizes->codeDeltaSize = CalculateLocArrayLength(codePtr->codeDeltaStart,
-            codePtr->numCommands);
-    sizes->codeLengthSize = CalculateLocArrayLength(codePtr->codeLengthStart,
-            codePtr->numCommands);
-    sizes->srcDeltaSize = CalculateLocArrayLength(codePtr->srcDeltaStart,
-            codePtr->numCommands);
-    sizes->srcLengthSize = CalculateLocArrayLength(codePtr->srcLengthStart,
-            codePtr->numCommands);
+    batch.jobs = (CompileJob *) ckalloc(numFiles * sizeof(CompileJob));
+    batch.numJobs = numFiles;
+    batch.nextJob = 0;
+    batch.flags = flags;
+    batch.mutex = (Tcl_Mutex) NULL;
+
+    Tcl_ListObjGetElements(NULL, listObjPtr, &numFiles, &fileObjv);
+    for (i=0 ; i < numFiles ; i++) {
+        jobPtr = &batch.jobs[i];
+        Tcl_ListObjGetElements(NULL, fileObjv[i], &numFields, &fieldObjv);
+        jobPtr->inFile = CopyString(Tcl_GetString(fieldObjv[0]));
+        jobPtr->outFile = (*Tcl_GetString(fieldObjv[1]) == '\0') ? NULL
+                : CopyString(Tcl_GetString(fieldObjv[1]));
+        jobPtr->preamble = (numFields > 2)
+                ? CopyString(Tcl_GetString(fieldObjv[2]))
+                : CopyString(preamblePtr);
+        jobPtr->result = TCL_OK;
+        jobPtr->usec = 0;
+        jobPtr->errorMsg = NULL;
+    }
+
+#ifdef TCL_THREADS
+    if (numThreads > 1) {
+        threadIds = (Tcl_ThreadId *)
+                ckalloc(numThreads * sizeof(Tcl_ThreadId));
+        for (numStarted=0 ; numStarted < numThreads ; numStarted++) {
+            if (Tcl_CreateThread(&threadIds[numStarted], CompileWorkerThread,
+                    (ClientData) &batch, TCL_THREAD_STACK_DEFAULT,
+                    TCL_THREAD_JOINABLE) != TCL_OK) {
+                break;
+            }
+        }
+        for (i=0 ; i < numStarted ; i++) {
+            Tcl_JoinThread(threadIds[i], &status);
+        }
+        ckfree((char *) threadIds);
+    }
+#endif
+
+    /*
+     * Compile whatever the workers left over; that is all of the files if
+     * no worker was started.
+     */
+
+    if (batch.nextJob < batch.numJobs) {
+        RunCompileJobs(interp, &batch, TCL_OK);
+    }
+    Tcl_MutexFinalize(&batch.mutex);
+
+    resultObjPtr = Tcl_NewObj();
+    for (i=0 ; i < numFiles ; i++) {
+        jobPtr = &batch.jobs[i];
+        errorObjPtr = (jobPtr->errorMsg == NULL) ? NULL
+                : Tcl_NewStringObj(jobPtr->errorMsg, -1);
+        Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                NewCompileInfoObj(jobPtr->result, jobPtr->usec,
+                    errorObjPtr));
+
+        ckfree(jobPtr->inFile);
+        if (jobPtr->outFile != NULL) {
+            ckfree(jobPtr->outFile);
+        }
+        if (jobPtr->preamble != NULL) {
+            ckfree(jobPtr->preamble);
+        }
+        if (jobPtr->errorMsg != NULL) {
+            ckfree(jobPtr->errorMsg);
+        }
+    }
+    ckfree((char *) batch.jobs);
+
+    Tcl_SetObjResult(interp, resultObjPtr);
+    return TCL_OK;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CalculateLocArrayLength --
+ * RunCompileJobs --
  *
- *  Calculates the length of the given location array; numCommands is the
- *  number of commands in the ByteCode structure.
+ *  The body of a compiler::compileParallel worker: takes the jobs of a
+ *  batch one at a time and compiles them, until no job is left. If
+ *  initResult is not TCL_OK the interpreter could not be set up, and the
+ *  jobs taken are failed with the error message left in it.
  *
  * Results:
- *  Returns the length, in bytes, of the array.
+ *  None. The outcome of each job is stored in it.
  *
  * Side effects:
- *  None.
+ *  Writes the compiled files.
  *
  *----------------------------------------------------------------------
  */
-static int
-CalculateLocArrayLength(bytes, numCommands)
-    unsigned char* bytes;	/* the location array */
-    int numCommands;		/* count of commands in the bytecode */
+
+static void
+RunCompileJobs(interp, batchPtr, initResult)
+    Tcl_Interp *interp;		/* Interpreter to compile in. */
+    CompileBatch *batchPtr;	/* The batch to take the jobs from. */
+    int initResult;		/* Result of the interpreter setup. */
 {
-    register int i;
-    int length = 0;
+    Interp *iPtr = (Interp *) interp;
+    CompileJob *jobPtr;
+    LiteralTable glt; /* Save buffer for global literals */
+    EmitContext emitCtx;
+    Tcl_Time start, stop;
+    char *msgPtr;
+    int length;
 
-    /*
-     * array is encoded as either a single byte, or a four-byte sequence
-     * preceded by the 0xff tag
-     */
+    if (initResult == TCL_OK) {
+        SaveLiteralTable(iPtr, &glt);
+        EmitInitContext((Tcl_Channel) NULL, &emitCtx);
+    }
 
-    for (i=0 ; i < numCommands ; i++) {
-        if (*bytes == 0xff) {
-            length += 5;
-            bytes += 5;
+    while (1) {
+        Tcl_MutexLock(&batchPtr->mutex);
+        if (batchPtr->nextJob < batchPtr->numJobs) {
+            jobPtr = &batchPtr->jobs[batchPtr->nextJob];
+            batchPtr->nextJob += 1;
         } else {
-            length += 1;
-            bytes += 1;
+            jobPtr = NULL;
+        }
+        Tcl_MutexUnlock(&batchPtr->mutex);
+
+        if (jobPtr == NULL) {
+            break;
+        }
+
+        if (initResult == TCL_OK) {
+            Tcl_GetTime(&start);
+            jobPtr->result = CompileOneFile(interp, jobPtr->inFile,
+                    jobPtr->outFile, jobPtr->preamble, batchPtr->flags,
+                    &emitCtx);
+            Tcl_GetTime(&stop);
+            jobPtr->usec = ElapsedTime(&start, &stop);
+        } else {
+            jobPtr->result = TCL_ERROR;
+        }
+
+        if (jobPtr->result != TCL_OK) {
+            msgPtr = Tcl_GetStringFromObj(Tcl_GetObjResult(interp), &length);
+            jobPtr->errorMsg = CopyString(msgPtr);
+        }
+        if (initResult == TCL_OK) {
+            Tcl_ResetResult(interp);
         }
     }
 
-    return length;
+    if (initResult == TCL_OK) {
+        EmitFreeContext(&emitCtx);
+        RestoreLiteralTable(iPtr, &glt);
+    }
 }
-
+
+#ifdef TCL_THREADS
 /*
  *----------------------------------------------------------------------
  *
- * EmitObjArray --
+ * CompileWorkerThread --
  *
- *  Emits the object array for a ByteCode struct to a Tcl_Channel.
+ *  Thread procedure of the compiler::compileParallel workers. Creates an
+ *  interpreter, initializes the Tcl library and the Compiler package in
+ *  it, and runs the jobs of the batch.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  None.
  *
  * Side effects:
- *  None.
+ *  Writes the compiled files; the thread exits when no job is left.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-EmitObjArray(interp, codePtr, chan)
-    Tcl_Interp *interp;	/* the current interpreter */
-    ByteCode *codePtr;	/* The ByteCode containing the object array */
-    Tcl_Channel chan;	/* The Tcl_channel to which the array is emitted */
+static Tcl_ThreadCreateType
+CompileWorkerThread(clientData)
+    ClientData clientData;	/* The CompileBatch of the workers. */
 {
-    int i, result;
-    int numLitObjects = codePtr->numLitObjects;
-    Tcl_Obj **objArrayPtr = &codePtr->objArrayPtr[0];
+    Tcl_Interp *interp;
+    int result;
 
-    if (EmitInteger(interp, numLitObjects, '\n', chan) != TCL_OK) {
-        return TCL_ERROR;
-    }
+    /*
+     * The workers must compile in the same environment as a regular
+     * interpreter: whether some commands are compiled inline depends on
+     * what is defined by the Tcl library.
+     */
 
-    for (i=0 ; i < numLitObjects ; i++) {
-        result = EmitObject(interp, objArrayPtr[i], chan);
-        if (result != TCL_OK) {
-            return result;
-        }
+    interp = Tcl_CreateInterp();
+    result = Tcl_Init(interp);
+    if (result == TCL_OK) {
+        result = Tclcompiler_Init(interp);
     }
+    RunCompileJobs(interp, (CompileBatch *) clientData, result);
+    Tcl_DeleteInterp(interp);
 
-    return TCL_OK;
+    Tcl_ExitThread(TCL_OK);
+    TCL_THREAD_CREATE_RETURN;
 }
-
+#endif
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitObject --
+ * GetProcessorCount --
  *
- *  Emits a Tcl_Obj to a Tcl_Channel.
+ *  Returns the number of processors available, which is the default
+ *  number of threads used by compiler::compileParallel.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  The processor count, or 1 if it cannot be determined.
  *
  * Side effects:
  *  None.
@@ -1399,68 +2640,34 @@ EmitObjArray(interp, codePtr, chan)
  */
 
 static int
-EmitObject(interp, objPtr, chan)
-    Tcl_Interp *interp;	/* the current interpreter */
-    Tcl_Obj* objPtr;	/* the object to emit */
-    Tcl_Channel chan;	/* The Tcl_channel to which the array is emitted */
+GetProcessorCount()
 {
-    const Tcl_ObjType *objTypePtr;
-    char *objBytes;
-    int objLength;
-    char typeCode = CMP_STRING_CODE;
-    int emitCount = 1;
-
-    objTypePtr = objPtr->typePtr;
-    objBytes = Tcl_GetStringFromObj(objPtr, &objLength);
-    if (!objBytes) {
-        objBytes = "";
-        objLength = 0;
-    }
+#if defined(_WIN32)
+    SYSTEM_INFO info;
 
-    if (objTypePtr == cmpIntType) {
-        typeCode = CMP_INT_CODE;
-        emitCount = 0;
-    } else if (objTypePtr == cmpDoubleType) {
-        typeCode = CMP_DOUBLE_CODE;
-        emitCount = 0;
-    } else if (objTypePtr == cmpByteCodeType) {
-        if (EmitChar(interp, CMP_BYTECODE_CODE, '\n', chan) != TCL_OK) {
-            return TCL_ERROR;
-        }
-        return EmitByteCode(interp,
-                (ByteCode *) objPtr->internalRep.otherValuePtr, chan);
-    } else if (objTypePtr == cmpProcBodyType) {
-        if (EmitChar(interp, CMP_PROCBODY_CODE, '\n', chan) != TCL_OK) {
-            return TCL_ERROR;
-        }
-        return EmitProcBody(interp,
-                (Proc *) objPtr->internalRep.otherValuePtr, chan);
-    } else {
-        if (EmitChar(interp, CMP_XSTRING_CODE, '\n', chan) != TCL_OK) {
-            return TCL_ERROR;
-        }
-        return EmitByteSequence(interp, (unsigned char *) objBytes,
-                objLength, chan);
-    }
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 0)
+            ? (int) info.dwNumberOfProcessors : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
 
-    if (EmitChar(interp, typeCode, '\n', chan) != TCL_OK) {
-        return TCL_ERROR;
-    }
-    if (emitCount && (EmitInteger(interp, objLength, '\n', chan) != TCL_OK)) {
-        return TCL_ERROR;
-    }
-    return EmitString(interp, objBytes, objLength, '\n', chan);
+    return (count > 0) ? (int) count : 1;
+#else
+    return 1;
+#endif
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitExcRangeArray --
+ * CheckFileList --
  *
- *  Emits the exception range array for a ByteCode struct to a Tcl_Channel.
+ *  Checks the file list argument of the batch compile commands: each
+ *  element must be a list {inputFile outputFile ?preamble?}.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  Returns a standard TCL result code, and stores the number of files
+ *  in numFilesPtr.
  *
  * Side effects:
  *  None.
@@ -1469,57 +2676,45 @@ EmitObject(interp, objPtr, chan)
  */
 
 static int
-EmitExcRangeArray(interp, codePtr, chan)
-    Tcl_Interp *interp;	/* the current interpreter */
-    ByteCode *codePtr;	/* The ByteCode containing the object array */
-    Tcl_Channel chan;	/* The Tcl_channel to which the array is emitted */
+CheckFileList(interp, listObjPtr, numFilesPtr)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    Tcl_Obj *listObjPtr;	/* The file list. */
+    int *numFilesPtr;		/* Receives the number of files. */
 {
-    int i;
-    int numExceptRanges = codePtr->numExceptRanges;
-    ExceptionRange *excArrayPtr = codePtr->exceptArrayPtr;
-    char excName;
+    Tcl_Obj **fileObjv, **fieldObjv;
+    int numFields, i;
 
-    if (EmitInteger(interp, numExceptRanges, '\n', chan) != TCL_OK) {
+    if (Tcl_ListObjGetElements(interp, listObjPtr, numFilesPtr, &fileObjv)
+            != TCL_OK) {
         return TCL_ERROR;
     }
-
-    for (i=0 ; i < numExceptRanges ; i++) {
-        excName = NameFromExcRange(excArrayPtr->type);
-        if (excName == '\0') {
-            return -1;
+    for (i=0 ; i < *numFilesPtr ; i++) {
+        if (Tcl_ListObjGetElements(interp, fileObjv[i], &numFields,
+                &fieldObjv) != TCL_OK) {
+            return TCL_ERROR;
         }
-
-        if ((EmitChar(interp, excName, ' ', chan) != TCL_OK)
-                || (EmitInteger(interp, excArrayPtr->nestingLevel, ' ', chan)
-                        != TCL_OK)
-                || (EmitInteger(interp, excArrayPtr->codeOffset, ' ', chan)
-                        != TCL_OK)
-                || (EmitInteger(interp, excArrayPtr->numCodeBytes, ' ', chan)
-                        != TCL_OK)
-                || (EmitInteger(interp, excArrayPtr->breakOffset, ' ', chan)
-                        != TCL_OK)
-                || (EmitInteger(interp, excArrayPtr->continueOffset, ' ', chan)
-                        != TCL_OK)
-                || (EmitInteger(interp, excArrayPtr->catchOffset, '\n', chan)
-                        != TCL_OK)) {
+        if ((numFields < 2) || (numFields > 3)) {
+            Tcl_AppendResult(interp, "bad file entry \"",
+                    Tcl_GetString(fileObjv[i]),
+                    "\": must be {inputFile outputFile ?preamble?}",
+                    (char *) NULL);
             return TCL_ERROR;
         }
-
-        excArrayPtr += 1;
     }
-
     return TCL_OK;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitAuxDataArray --
+ * NewCompileInfoObj --
  *
- *  Emits the AuxData array for a ByteCode struct to a Tcl_Channel.
+ *  Creates the per-file result of the batch compile commands: a
+ *  dictionary with keys "status", "time" and, if errorObjPtr is not
+ *  NULL, "error".
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  A new object with a reference count of 0.
  *
  * Side effects:
  *  None.
@@ -1527,98 +2722,154 @@ EmitExcRangeArray(interp, codePtr, chan)
  *----------------------------------------------------------------------
  */
 
-static int
-EmitAuxDataArray(interp, codePtr, chan)
-    Tcl_Interp *interp;	/* the current interpreter */
-    ByteCode *codePtr;	/* The ByteCode containing the object array */
-    Tcl_Channel chan;	/* The Tcl_channel to which the array is emitted */
+static Tcl_Obj *
+NewCompileInfoObj(result, usec, errorObjPtr)
+    int result;			/* TCL_OK or TCL_ERROR */
+    Tcl_WideInt usec;		/* compile time in microseconds */
+    Tcl_Obj *errorObjPtr;	/* error message, or NULL */
 {
-    int i, result;
-    int numAuxDataItems = codePtr->numAuxDataItems;
-    AuxData *auxDataPtr = codePtr->auxDataArrayPtr;
-    const AuxDataType *typePtr;
-
-    if (EmitInteger(interp, numAuxDataItems, '\n', chan) != TCL_OK) {
-        return TCL_ERROR;
-    }
-
-    for (i=0 ; i < numAuxDataItems ; i++) {
-        /*
-         * write out the type, then switch based on the AuxData type
-         */
+    Tcl_Obj *infoObjPtr = Tcl_NewObj();
+
+    Tcl_ListObjAppendElement(NULL, infoObjPtr,
+            Tcl_NewStringObj("status", -1));
+    Tcl_ListObjAppendElement(NULL, infoObjPtr,
+            Tcl_NewStringObj((result == TCL_OK) ? "ok" : "error", -1));
+    Tcl_ListObjAppendElement(NULL, infoObjPtr,
+            Tcl_NewStringObj("time", -1));
+    Tcl_ListObjAppendElement(NULL, infoObjPtr, Tcl_NewWideIntObj(usec));
+    if (errorObjPtr != NULL) {
+        Tcl_ListObjAppendElement(NULL, infoObjPtr,
+                Tcl_NewStringObj("error", -1));
+        Tcl_ListObjAppendElement(NULL, infoObjPtr, errorObjPtr);
+    }
+    return infoObjPtr;
+}
 
-        typePtr = auxDataPtr->type;
-        if (typePtr == cmpForeachInfoType) {
-            result = EmitChar(interp, CMP_FOREACH_INFO, '\n', chan);
-            if (result != TCL_OK) {
-                return result;
-            }
+/*
+ *----------------------------------------------------------------------
+ *
+ * NewCompileStatsObj --
+ *
+ *  Creates the result of compiler::compile -stats: a dictionary with keys
+ *	instructions	the number of instructions of each opcode used,
+ *			keyed by instruction name
+ *	byteCodes	the number of ByteCodes written out
+ *	procBodies	the number of precompiled proc bodies
+ *	literals	the number of literals
+ *	literalBytes	the bytes in the string reps of the literals
+ *	exceptRanges	the number of exception ranges
+ *	auxData		the number of AuxData items, keyed by type name
+ *	sections	the bytes written for the code, locmap, literals,
+ *			excranges and auxdata sections of all ByteCodes,
+ *			and for the proctable section of -lazyprocs, if
+ *			any
+ *
+ * Results:
+ *  A new object with a reference count of 0.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-            result = EmitForeachInfo(interp,
-                    (ForeachInfo *) auxDataPtr->clientData, chan);
-            if (result != TCL_OK) {
-                return result;
-            }
-#ifdef TCL_85_PLUS
-	} else if (typePtr == cmpJumptableInfoType) {
-            result = EmitChar(interp, CMP_JUMPTABLE_INFO, '\n', chan);
-            if (result != TCL_OK) {
-                return result;
-            }
+static Tcl_Obj *
+NewCompileStatsObj(collectPtr)
+    CompileStats *collectPtr;	/* the statistics */
+{
+    static struct {
+        char *name;		/* key in the sections dictionary */
+        int phase;		/* the matching COMPILER_PHASE_EMIT_* */
+    } sections[] = {
+        {"code",	COMPILER_PHASE_EMIT_CODE},
+        {"locmap",	COMPILER_PHASE_EMIT_LOCMAP},
+        {"literals",	COMPILER_PHASE_EMIT_LITERALS},
+        {"excranges",	COMPILER_PHASE_EMIT_EXCRANGES},
+        {"auxdata",	COMPILER_PHASE_EMIT_AUXDATA},
+        {"proctable",	COMPILER_PHASE_EMIT_PROCTABLE},
+        {NULL,		0}
+    };
+    InstructionDesc *opCodesTablePtr =
+            (InstructionDesc *) TclGetInstructionTable();
+    Tcl_Obj *statsObjPtr = Tcl_NewObj();
+    Tcl_Obj *objPtr;
+    Tcl_HashEntry *entryPtr;
+    Tcl_HashSearch search;
+    int i;
 
-            result = EmitJumptableInfo(interp,
-                    (JumptableInfo *) auxDataPtr->clientData, chan);
-            if (result != TCL_OK) {
-                return result;
-            }
-#endif
-#ifdef TCL_86_PLUS
-	} else if (typePtr == cmpDictUpdateInfoType) {
-            result = EmitChar(interp, CMP_DICTUPDATE_INFO, '\n', chan);
-            if (result != TCL_OK) {
-                return result;
-            }
+    objPtr = Tcl_NewObj();
+    for (i=0 ; i < 256 ; i++) {
+        if (collectPtr->instCounts[i] > 0) {
+            Tcl_ListObjAppendElement(NULL, objPtr,
+                    Tcl_NewStringObj(opCodesTablePtr[i].name, -1));
+            Tcl_ListObjAppendElement(NULL, objPtr,
+                    Tcl_NewWideIntObj(collectPtr->instCounts[i]));
+        }
+    }
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewStringObj("instructions", -1));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr, objPtr);
+
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewStringObj("byteCodes", -1));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewIntObj(collectPtr->numByteCodes));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewStringObj("procBodies", -1));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewIntObj(collectPtr->numProcBodies));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewStringObj("literals", -1));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewIntObj(collectPtr->numLiterals));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewStringObj("literalBytes", -1));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewWideIntObj(collectPtr->literalBytes));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewStringObj("exceptRanges", -1));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewIntObj(collectPtr->numExceptRanges));
 
-            result = EmitDictUpdateInfo(interp,
-                    (DictUpdateInfo *) auxDataPtr->clientData, chan);
-            if (result != TCL_OK) {
-                return result;
-            }
-#endif
-#ifdef TCL_862_PLUS
-	} else if (typePtr == cmpNewForeachInfoType) {
-            result = EmitChar(interp, CMP_FOREACH_INFO_2, '\n', chan);
-            if (result != TCL_OK) {
-                return result;
-            }
+    objPtr = Tcl_NewObj();
+    for (entryPtr=Tcl_FirstHashEntry(&collectPtr->auxDataTypes, &search) ;
+            entryPtr != NULL ; entryPtr=Tcl_NextHashEntry(&search)) {
+        Tcl_ListObjAppendElement(NULL, objPtr, Tcl_NewStringObj(
+                Tcl_GetHashKey(&collectPtr->auxDataTypes, entryPtr), -1));
+        Tcl_ListObjAppendElement(NULL, objPtr,
+                Tcl_NewIntObj(PTR2INT(Tcl_GetHashValue(entryPtr))));
+    }
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewStringObj("auxData", -1));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr, objPtr);
 
-            result = EmitNewForeachInfo(interp,
-                    (ForeachInfo *) auxDataPtr->clientData, chan);
-            if (result != TCL_OK) {
-                return result;
-            }
-#endif
-        } else {
-            panic("EmitAuxDataArray: unknown AuxType \"%s\"",
-                    typePtr->name);
+    objPtr = Tcl_NewObj();
+    for (i=0 ; sections[i].name != NULL ; i++) {
+        if ((sections[i].phase == COMPILER_PHASE_EMIT_PROCTABLE)
+                && (collectPtr->bytes[sections[i].phase] == 0)) {
+            continue;
         }
-
-        auxDataPtr += 1;
+        Tcl_ListObjAppendElement(NULL, objPtr,
+                Tcl_NewStringObj(sections[i].name, -1));
+        Tcl_ListObjAppendElement(NULL, objPtr,
+                Tcl_NewWideIntObj(collectPtr->bytes[sections[i].phase]));
     }
+    Tcl_ListObjAppendElement(NULL, statsObjPtr,
+            Tcl_NewStringObj("sections", -1));
+    Tcl_ListObjAppendElement(NULL, statsObjPtr, objPtr);
 
-    return TCL_OK;
+    return statsObjPtr;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitSignature --
+ * ElapsedTime --
  *
- *  Emit a signature string to be used in the header of a compiled TCL
- *  script. The signature is used to mark the file as a compiled TCL script.
+ *  Returns the time between two Tcl_GetTime readings.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on error.
+ *  The elapsed time in microseconds.
  *
  * Side effects:
  *  None.
@@ -1626,33 +2877,24 @@ EmitAuxDataArray(interp, codePtr, chan)
  *----------------------------------------------------------------------
  */
 
-static int
-EmitSignature(interp, chan)
-    Tcl_Interp *interp;	/* the current TCL interpreter */
-    Tcl_Channel chan;	/* the channel to which the signature is to be
-                         * emitted */
-{
-    if ((EmitString(interp, signatureHeader, -1, ' ', chan) != TCL_OK)
-            || (EmitInteger(interp, formatVersion, ' ', chan) != TCL_OK)
-            || (EmitInteger(interp, buildNumber, ' ', chan) != TCL_OK)
-            || (EmitString(interp, CMP_VERSION, -1, ' ', chan) != TCL_OK)
-            || (EmitString(interp, TCL_VERSION, -1, '\n', chan) != TCL_OK)) {
-        PrependResult(interp, "error writing signature: ");
-        return TCL_ERROR;
-    }
-    return TCL_OK;
+static Tcl_WideInt
+ElapsedTime(startPtr, stopPtr)
+    Tcl_Time *startPtr;		/* the earlier reading */
+    Tcl_Time *stopPtr;		/* the later reading */
+{
+    return ((Tcl_WideInt) (stopPtr->sec - startPtr->sec)) * 1000000
+            + (stopPtr->usec - startPtr->usec);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * NameFromExcRange --
+ * CopyString --
  *
- *  Given an ExceptionRangeType enum, return the corresponding name.
+ *  Returns a ckalloc'ed copy of a string.
  *
  * Results:
- *  Returns the name if it was successful at converting the enum value to
- *  a name, '\0' otherwise.
+ *  The copy, or NULL if src is NULL.
  *
  * Side effects:
  *  None.
@@ -1660,133 +2902,90 @@ EmitSignature(interp, chan)
  *----------------------------------------------------------------------
  */
 
-static char
-NameFromExcRange(type)
-    ExceptionRangeType type;	/* the enum for which to get a name */
+static char *
+CopyString(src)
+    CONST char *src;		/* the string to copy, or NULL */
 {
-    CONST ExcRangeMap *mapPtr;
+    char *dst;
 
-    for (mapPtr=&excRangeMap[0] ; mapPtr->name != 0 ; mapPtr++) {
-        if (mapPtr->type == type) {
-            return mapPtr->name;
-        }
+    if (src == NULL) {
+        return NULL;
     }
-
-    return '\0';
+    dst = ckalloc(strlen(src) + 1);
+    strcpy(dst, src);
+    return dst;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * InitTypes --
+ * Compiler_EnablePhaseStats --
  *
- *  Uses Tcl_GetObjType to load pointers to known object types into static
- *  variables, which can then be used instead of the known objects themselves.
+ *  Turns the collection of phase statistics on or off for the current
+ *  thread. Turning it on resets the statistics.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  None.
+ *  While enabled, every phase change reads the clock.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-InitTypes()
+void
+Compiler_EnablePhaseStats(enable)
+    int enable;			/* non-zero to collect statistics */
 {
-    if (didLoadTypes == 0) {
-        cmpProcBodyType = Tcl_GetObjType(CMP_PROCBODY_OBJ_TYPE_NEW);
-        if (!cmpProcBodyType) {
-            panic("InitTypes: failed to find the %s type",
-                    CMP_PROCBODY_OBJ_TYPE_NEW);
-        }
+    PhaseStats *statsPtr = (PhaseStats *)
+            Tcl_GetThreadData(&phaseStatsKey, (int) sizeof(PhaseStats));
 
-        cmpByteCodeType = Tcl_GetObjType("bytecode");
-        if (!cmpByteCodeType) {
-            panic("InitTypes: failed to find the bytecode type");
-        }
+    if (enable) {
+        memset(statsPtr, 0, sizeof(PhaseStats));
+        statsPtr->phase = -1;
+    }
+    statsPtr->enabled = enable;
+}
 
-        cmpDoubleType = Tcl_GetObjType("double");
-        if (!cmpByteCodeType) {
-            panic("InitTypes: failed to find the double type");
-        }
-
-        cmpIntType = Tcl_GetObjType("int");
-        if (!cmpByteCodeType) {
-            panic("InitTypes: failed to find the int type");
-        }
-
-        cmpForeachInfoType = TclGetAuxDataType("ForeachInfo");
-        if (!cmpForeachInfoType) {
-            panic("InitTypes: failed to find the ForeachInfo AuxData type");
-        }
-#ifdef TCL_85_PLUS
-        cmpJumptableInfoType = TclGetAuxDataType("JumptableInfo");
-        if (!cmpJumptableInfoType) {
-            panic("InitTypes: failed to find the JumptableInfo AuxData type");
-        }
-#endif
-#ifdef TCL_86_PLUS
-        cmpDictUpdateInfoType = TclGetAuxDataType("DictUpdateInfo");
-        if (!cmpDictUpdateInfoType) {
-            panic("InitTypes: failed to find the DictUpdateInfo AuxData type");
-        }
-#endif
-#ifdef TCL_862_PLUS
-        cmpNewForeachInfoType = TclGetAuxDataType("NewForeachInfo");
-        if (!cmpNewForeachInfoType) {
-            panic("InitTypes: failed to find the NewForeachInfo AuxData type");
-        }
-#endif
-        didLoadTypes = 1;
-    }
-}
-
 /*
  *----------------------------------------------------------------------
  *
- * PrependResult --
+ * Compiler_GetPhaseStats --
  *
- *  Prepends the string in msgPtr to the current result value. Used by error
- *  reporting to augment a generic error string.
+ *  Returns the phase statistics collected in the current thread since
+ *  they were enabled: the time spent in each COMPILER_PHASE_*, and the
+ *  bytes written for each emitted section.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  None.
+ *  Fills in *resultPtr.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-PrependResult(interp, msgPtr)
-    Tcl_Interp *interp;		/* The current interpreter */
-    char *msgPtr;		/* string to prepend to the current result */
+void
+Compiler_GetPhaseStats(resultPtr)
+    Compiler_PhaseStats *resultPtr;	/* receives the statistics */
 {
-    Tcl_DString buf;
-    Tcl_Obj *resultPtr = Tcl_GetObjResult(interp);
-
-    Tcl_DStringInit(&buf);
-    Tcl_DStringAppend(&buf, msgPtr, -1);
-    Tcl_DStringAppend(&buf, resultPtr->bytes, resultPtr->length);
+    PhaseStats *statsPtr = (PhaseStats *)
+            Tcl_GetThreadData(&phaseStatsKey, (int) sizeof(PhaseStats));
 
-    resultPtr = Tcl_NewStringObj(Tcl_DStringValue(&buf),
-            Tcl_DStringLength(&buf));
-    Tcl_SetObjResult(interp, resultPtr);
+    *resultPtr = statsPtr->totals;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitScriptPreamble --
+ * PhaseEnter --
  *
- *  Emit the preamble for the compiled script. Writes out the TCL boilerplate
- *  that requires the loader package and evals the bytecodes.
+ *  Charges the time since the last phase change to the current phase, and
+ *  makes 'phase' the current one. Does nothing unless phase statistics
+ *  are enabled.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on error.
+ *  The phase to restore with PhaseLeave.
  *
  * Side effects:
  *  None.
@@ -1795,56 +2994,40 @@ PrependResult(interp, msgPtr)
  */
 
 static int
-EmitScriptPreamble(interp, chan)
-    Tcl_Interp *interp;		/* the current TCL interpreter */
-    Tcl_Channel chan;		/* the channel to which the signature is to be
-                                 * emitted */
+PhaseEnter(phase)
+    int phase;			/* the COMPILER_PHASE_* being entered */
 {
-    char buf[256];
-    char *errMsgPtr;
-    int result = TCL_OK;
-    Tcl_Obj *errObjPtr = 0;
-
-    /*
-     * Extract the loader error message from the package itself, and if not
-     * present use the default value. This lets us modify the error message
-     * in a script.
-     */
-
-    sprintf(buf, "variable %s ; set %s", errorVariable, errorVariable);
-    if (Tcl_Eval(interp, buf) != TCL_OK) {
-        errMsgPtr = errorMessage;
-    } else {
-        Tcl_Obj *errObjPtr = Tcl_GetObjResult(interp);
-        Tcl_IncrRefCount(errObjPtr);
-        errMsgPtr = errObjPtr->bytes;
-    }
+    PhaseStats *statsPtr = (PhaseStats *)
+            Tcl_GetThreadData(&phaseStatsKey, (int) sizeof(PhaseStats));
+    Tcl_Time now;
+    int savedPhase;
 
-    sprintf(buf, preambleFormat, loaderName, loaderVersion, errMsgPtr,
-            loaderName, evalCommand);
-    if (EmitString(interp, buf, -1, '\n', chan) != TCL_OK) {
-        PrependResult(interp, "error writing script preamble: ");
-        result = TCL_ERROR;
+    if (!statsPtr->enabled) {
+        return -1;
     }
 
-    if (errObjPtr) {
-        Tcl_DecrRefCount(errObjPtr);
+    Tcl_GetTime(&now);
+    if (statsPtr->phase >= 0) {
+        statsPtr->totals.usec[statsPtr->phase] +=
+                ElapsedTime(&statsPtr->mark, &now);
     }
-    Tcl_ResetResult(interp);
+    statsPtr->mark = now;
 
-    return result;
+    savedPhase = statsPtr->phase;
+    statsPtr->phase = phase;
+    return savedPhase;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitScriptPostamble --
+ * PhaseLeave --
  *
- *  Emit the postamble for the compiled script. Writes out the TCL boilerplate
- *  that requires the loader package and evals the bytecodes.
+ *  Charges the time since the last phase change to the current phase, and
+ *  goes back to the phase returned by the matching PhaseEnter.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on error.
+ *  None.
  *
  * Side effects:
  *  None.
@@ -1852,38 +3035,27 @@ EmitScriptPreamble(interp, chan)
  *----------------------------------------------------------------------
  */
 
-static int
-EmitScriptPostamble(interp, chan)
-    Tcl_Interp *interp;		/* the current TCL interpreter */
-    Tcl_Channel chan;		/* the channel to which the signature is to be
-                                 * emitted */
+static void
+PhaseLeave(savedPhase)
+    int savedPhase;		/* the phase returned by PhaseEnter */
 {
-    char buf[256];
+    PhaseStats *statsPtr = (PhaseStats *)
+            Tcl_GetThreadData(&phaseStatsKey, (int) sizeof(PhaseStats));
 
-#if USE_CATCH_WRAPPER
-    sprintf(buf, postambleFormat, errorInfoMarker);
-#else
-    strcpy(buf, postambleFormat);
-#endif
-    if (EmitString(interp, buf, -1, '\n', chan) != TCL_OK) {
-        PrependResult(interp, "error writing script postamble: ");
-        return TCL_ERROR;
+    if (statsPtr->enabled) {
+        PhaseEnter(savedPhase);
     }
-    return TCL_OK;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * LocalProcCompileProc --
+ * PhaseAddBytes --
  *
- *  This procedure is registered as the CompileProc for the "proc" command,
- *  and is used to make a record of where in the bytecodes the calls to
- *  "proc" have been emitted. This information is used in a post-processing
- *  pass to compile the procedure bodies.
+ *  Accounts bytes written for a section to a phase.
  *
  * Results:
- *  Returns TCL_OUT_LINE_COMPILE, to make the compiler create non-inline code.
+ *  None.
  *
  * Side effects:
  *  None.
@@ -1891,123 +3063,86 @@ EmitScriptPostamble(interp, chan)
  *----------------------------------------------------------------------
  */
 
-static int
-LocalProcCompileProc(interp, parsePtr,
-#ifdef TCL_85_PLUS
-		     cmdPtr,
-#endif
-		     compEnvPtr)
-    Tcl_Interp *interp;		/* Used for error reporting. */
-    Tcl_Parse *parsePtr;	/* The parsed command information. */
-#ifdef TCL_85_PLUS
-    Command* cmdPtr;            /* The command to be compiled */
-#endif
-    CompileEnv *compEnvPtr;	/* Holds resulting instructions. */
+static void
+PhaseAddBytes(phase, numBytes)
+    int phase;			/* the COMPILER_PHASE_EMIT_* of the section */
+    Tcl_WideInt numBytes;	/* how many bytes were written */
 {
-    AppendInstLocList(interp, compEnvPtr);
+    PhaseStats *statsPtr = (PhaseStats *)
+            Tcl_GetThreadData(&phaseStatsKey, (int) sizeof(PhaseStats));
 
-    return TCL_OUT_LINE_COMPILE;
+    if (statsPtr->enabled) {
+        statsPtr->totals.bytes[phase] += numBytes;
+    }
+    if (statsPtr->collectPtr != NULL) {
+        statsPtr->collectPtr->bytes[phase] += numBytes;
+    }
+    statsPtr->counted += numBytes;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CompilerInit --
+ * PhaseCountedBytes --
  *
- *  Initializes the internal structures used by the Compiler package.
- *  Must be called before the public interfaces to the Compiler package;
- *  this is done typically in the package registration proc (Compiler_Init).
+ *  Returns how many bytes PhaseAddBytes accounted for so far, so that a
+ *  section can subtract the bytes of the sections nested in it.
  *
  * Results:
- *  None.
+ *  The count of bytes.
  *
  * Side effects:
- *  Initializes a number of internal data structures used by the Compiler
- *  implementation.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-void
-CompilerInit(interp)
-    Tcl_Interp *interp;			/* the active interpreter */
+static Tcl_WideInt
+PhaseCountedBytes()
 {
-    CompilerContext *ctxPtr;
-    int major, minor;
-
-    /*
-     * Determine the format version of compiled code.  8.0-8.3 is v1,
-     * 8.4+ is v2 (new bytecode instructions).
-     */
-
-    Tcl_GetVersion(&major, &minor, NULL, NULL);
-
-    if ((major == 8) && (minor <= 3)) {
-	formatVersion = 1;
-    } else {
-	formatVersion = 2;
-    }
-
-    /*
-     * Initialize the local copies of pointers to some built-in object types.
-     * We need to do it because the built-in types are not exported by the
-     * windows Tcl DLL.
-     */
-
-    InitTypes();
-
-    /*
-     * Create the compiler context structure and attach it to the interp
-     */
+    PhaseStats *statsPtr = (PhaseStats *)
+            Tcl_GetThreadData(&phaseStatsKey, (int) sizeof(PhaseStats));
 
-    ctxPtr = (CompilerContext *) ckalloc(sizeof(CompilerContext));
-    Tcl_SetAssocData(interp, CMP_ASSOC_KEY, CleanCompilerContext,
-            (ClientData) ctxPtr);
-    ctxPtr->ppi = (PostProcessInfo *) NULL;
-    ctxPtr->numProcs = 0;
-    ctxPtr->numCompiledBodies = 0;
-    ctxPtr->numUnsharedBodies = 0;
-    ctxPtr->numUnshares = 0;
+    return statsPtr->counted;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CleanCompilerContext --
+ * PhaseResetCountedBytes --
  *
- *  Cleans up the compiler context.
- *  Frees the post-processing info if any is present, then frees the context
- *  struct itself.
+ *  Resets the count returned by PhaseCountedBytes. Used when nested
+ *  sections were written elsewhere than in the enclosing section, so
+ *  that the latter does not subtract them.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  See above.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-CleanCompilerContext(clientData, interp)
-    ClientData clientData;		/* not used */
-    Tcl_Interp *interp;			/* the active interpreter */
+PhaseResetCountedBytes(counted)
+    Tcl_WideInt counted;	/* a count from PhaseCountedBytes */
 {
-    CompilerContext *ctxPtr = (CompilerContext *) clientData;
+    PhaseStats *statsPtr = (PhaseStats *)
+            Tcl_GetThreadData(&phaseStatsKey, (int) sizeof(PhaseStats));
 
-    FreePostProcessInfo(ctxPtr->ppi);
-    ckfree((char *) ctxPtr);
+    statsPtr->counted = counted;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CompilerGetContext --
+ * StatsCollector --
  *
- *  Returns a pointer to the CompilerContext struct for the given interp.
+ *  Returns the compile statistics being collected in the current thread.
  *
  * Results:
- *  See above.
+ *  The statistics, or NULL if none are being collected.
  *
  * Side effects:
  *  None.
@@ -2015,57 +3150,84 @@ CleanCompilerContext(clientData, interp)
  *----------------------------------------------------------------------
  */
 
-CompilerContext *
-CompilerGetContext(interp)
-    Tcl_Interp *interp;			/* the active interpreter */
+static CompileStats *
+StatsCollector()
 {
-    CompilerContext *ctxPtr =
-        (CompilerContext *) Tcl_GetAssocData(interp, CMP_ASSOC_KEY, NULL);
-
-    if (!ctxPtr) {
-        panic("unregistered compiler context!");
-    }
+    PhaseStats *statsPtr = (PhaseStats *)
+            Tcl_GetThreadData(&phaseStatsKey, (int) sizeof(PhaseStats));
 
-    return ctxPtr;
+    return statsPtr->collectPtr;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * InitCompilerContext --
+ * StatsAddByteCode --
  *
- *  Initializes the compiler context for a given interpreter.
+ *  Accounts a ByteCode being written out to the compile statistics, if
+ *  they are being collected: its instructions, literals, exception ranges
+ *  and AuxData items.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  Allocates a new PostProcessInfo, and frees the old one.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-InitCompilerContext(interp)
-    Tcl_Interp *interp;		/* interpreter for which to initialize the
-                                 * proc list */
+StatsAddByteCode(codePtr, litMapPtr)
+    ByteCode *codePtr;		/* the ByteCode being written out */
+    LiteralMap *litMapPtr;	/* its literals, as written out */
 {
-    CompilerContext *ctxPtr = CompilerGetContext(interp);
+    CompileStats *collectPtr = StatsCollector();
+    InstructionDesc *opCodesTablePtr;
+    unsigned char *pc, *codeEnd;
+    Tcl_HashEntry *entryPtr;
+    Tcl_Obj *objPtr;
+    int i, isNew, length;
 
-    FreePostProcessInfo(ctxPtr->ppi);
-    ctxPtr->ppi = CreatePostProcessInfo();
-    ctxPtr->numProcs = 0;
-    ctxPtr->numCompiledBodies = 0;
-    ctxPtr->numUnsharedBodies = 0;
-    ctxPtr->numUnshares = 0;
+    if (collectPtr == NULL) {
+        return;
+    }
+    collectPtr->numByteCodes++;
+
+    opCodesTablePtr = (InstructionDesc *) TclGetInstructionTable();
+    codeEnd = litMapPtr->codeStart + codePtr->numCodeBytes;
+    for (pc=litMapPtr->codeStart ; pc < codeEnd ;
+            pc += opCodesTablePtr[*pc].numBytes) {
+        collectPtr->instCounts[*pc]++;
+    }
+
+    for (i=0 ; i < litMapPtr->numLitObjects ; i++) {
+        objPtr = litMapPtr->objArrayPtr[i];
+        if ((objPtr->typePtr != cmpByteCodeType)
+                && (objPtr->typePtr != cmpProcBodyType)) {
+            Tcl_GetStringFromObj(objPtr, &length);
+            collectPtr->numLiterals++;
+            collectPtr->literalBytes += length;
+        }
+    }
+
+    collectPtr->numExceptRanges += codePtr->numExceptRanges;
+
+    for (i=0 ; i < codePtr->numAuxDataItems ; i++) {
+        entryPtr = Tcl_CreateHashEntry(&collectPtr->auxDataTypes,
+                codePtr->auxDataArrayPtr[i].type->name, &isNew);
+        Tcl_SetHashValue(entryPtr, INT2PTR(1 + (isNew ? 0
+                : PTR2INT(Tcl_GetHashValue(entryPtr)))));
+    }
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * ReleaseCompilerContext --
+ * StatsAddProcBody --
  *
- *  Frees the post-processing info associated with the compiler context.
+ *  Counts a precompiled proc body being written out in the compile
+ *  statistics, if they are being collected.
  *
  * Results:
  *  None.
@@ -2077,68 +3239,244 @@ InitCompilerContext(interp)
  */
 
 static void
-ReleaseCompilerContext(interp)
-    Tcl_Interp *interp;		/* interpreter for which to remove the
-                                 * proc list */
+StatsAddProcBody()
 {
-    CompilerContext *ctxPtr = CompilerGetContext(interp);
+    CompileStats *collectPtr = StatsCollector();
 
-    FreePostProcessInfo(ctxPtr->ppi);
-    ctxPtr->ppi = (PostProcessInfo *) NULL;
+    if (collectPtr != NULL) {
+        collectPtr->numProcBodies++;
+    }
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CreateInstLocList --
+ * Compiler_CacheObjCmd --
  *
- *  Creates a InstLocList struct.
+ *  Configures and queries the compile cache.
+ *  Call format:
+ *    compiler::cache configure ?-directory path? ?-maxsize bytes?
+ *    compiler::cache stats
+ *    compiler::cache clear
+ *  An empty -directory turns the cache off, which is the default; setting
+ *  a directory creates it and its missing parents if needed, and resets
+ *  the counters. A -maxsize of 0 removes the size limit. The cache only
+ *  counts and deletes the files named like its entries, so that it may
+ *  share a directory with other files.
  *
  * Results:
- *  Returns a ckalloc'ed InstLocList, initialized with the next field set to
- *  0, and the bytecodeOffset to the given value..
+ *  Returns a standard TCL result code. "configure" without options
+ *  returns the current settings; "stats" returns a dictionary with the
+ *  keys hits, misses, stores, evictions, entries and size.
  *
  * Side effects:
- *  None.
+ *  "clear" deletes all the entries of the cache.
  *
  *----------------------------------------------------------------------
  */
 
-static InstLocList *
-CreateInstLocList(CompileEnv *envPtr)
-{
-    InstLocList *listPtr = (InstLocList *) ckalloc(sizeof(struct InstLocList));
-    listPtr->next = (InstLocList *) NULL;
-    listPtr->bytecodeOffset = envPtr->codeNext - envPtr->codeStart;
-    listPtr->commandIndex = envPtr->numCommands - 1;
-#ifdef TCL_85_PLUS
-    if ((listPtr->bytecodeOffset >= 9) &&
-	(INST_START_CMD == *(envPtr->codeNext-9))) {
-      /*
-       * Tcl 8.5 core. Did emit an INST_START_CMD instruction. This
-       * instruction goes away again due to us forcing the outline
-       * compile in our caller (LocalProcCompileProc), so we have to
-       * adjust the remembered offset. Irrelevant for the first
-       * command (offset 0).
-       *
-       * 9 = 1byte ISC opcode + 2 4byte ISC operands.
-       */
-      listPtr->bytecodeOffset -= 9;
+int
+Compiler_CacheObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;		/* Not used. */
+    Tcl_Interp *interp;		/* Current interpreter. */
+    int objc;			/* Number of arguments. */
+    Tcl_Obj *CONST objv[];	/* Argument objects. */
+{
+    static CONST84 char *subCmds[] = {
+	"clear", "configure", "stats", NULL
+    };
+    enum subCmds {
+	CACHE_CLEAR, CACHE_CONFIGURE, CACHE_STATS
+    };
+    static CONST84 char *options[] = {
+	"-directory", "-maxsize", NULL
+    };
+    enum options {
+	OPT_DIRECTORY, OPT_MAXSIZE
+    };
+    CacheEntry *entries;
+    Tcl_Obj *dirPtr, *resultObjPtr;
+    Tcl_WideInt maxSize, size;
+    CONST char *dirName;
+    int index, argIndex, numEntries, i;
+    int result = TCL_OK;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+        return TCL_ERROR;
     }
-#endif
-    return listPtr;
+    if (Tcl_GetIndexFromObj(interp, objv[1], subCmds, "option", 0, &index)
+            != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch ((enum subCmds) index) {
+        case CACHE_CLEAR:
+            if (objc != 2) {
+                Tcl_WrongNumArgs(interp, 2, objv, NULL);
+                return TCL_ERROR;
+            }
+            Tcl_MutexLock(&cacheMutex);
+            if ((compileCache.directory != NULL)
+                    && (CacheScan(interp, compileCache.directory, &entries,
+                            &numEntries, &size) == TCL_OK)) {
+                for (i=0 ; i < numEntries ; i++) {
+                    Tcl_FSDeleteFile(entries[i].pathPtr);
+                }
+                CacheFreeEntries(entries, numEntries);
+                compileCache.size = 0;
+                compileCache.numEntries = 0;
+            }
+            Tcl_MutexUnlock(&cacheMutex);
+            break;
+
+        case CACHE_CONFIGURE:
+            if ((objc % 2) != 0) {
+                Tcl_WrongNumArgs(interp, 2, objv,
+                        "?-directory path? ?-maxsize bytes?");
+                return TCL_ERROR;
+            }
+            for (argIndex=2 ; argIndex < objc ; argIndex += 2) {
+                if (Tcl_GetIndexFromObj(interp, objv[argIndex], options,
+                        "option", 0, &index) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if ((enum options) index == OPT_MAXSIZE) {
+                    if (Tcl_GetWideIntFromObj(interp, objv[argIndex+1],
+                            &maxSize) != TCL_OK) {
+                        return TCL_ERROR;
+                    }
+                    if (maxSize < 0) {
+                        Tcl_AppendResult(interp, "bad cache size \"",
+                                Tcl_GetString(objv[argIndex+1]),
+                                "\": must be a non-negative integer",
+                                (char *) NULL);
+                        return TCL_ERROR;
+                    }
+                    Tcl_MutexLock(&cacheMutex);
+                    compileCache.maxSize = maxSize;
+                    if ((compileCache.directory != NULL)
+                            && (maxSize > 0)
+                            && (compileCache.size > maxSize)) {
+                        CacheEvict(interp);
+                    }
+                    Tcl_MutexUnlock(&cacheMutex);
+                    continue;
+                }
+
+                /*
+                 * -directory: make sure the directory exists before
+                 * switching to it.
+                 */
+
+                dirName = NULL;
+                if (*Tcl_GetString(objv[argIndex+1]) != '\0') {
+                    dirPtr = Tcl_FSGetNormalizedPath(interp,
+                            objv[argIndex+1]);
+                    if (dirPtr == NULL) {
+                        return TCL_ERROR;
+                    }
+                    if (CacheMakeDirectory(dirPtr) != TCL_OK) {
+                        Tcl_AppendResult(interp,
+                                "couldn't create cache directory \"",
+                                Tcl_GetString(objv[argIndex+1]), "\": ",
+                                Tcl_PosixError(interp), (char *) NULL);
+                        return TCL_ERROR;
+                    }
+                    dirName = Tcl_GetString(dirPtr);
+                    if (CacheScan(interp, dirName, &entries, &numEntries,
+                            &size) != TCL_OK) {
+                        return TCL_ERROR;
+                    }
+                    CacheFreeEntries(entries, numEntries);
+                }
+
+                Tcl_MutexLock(&cacheMutex);
+                if (compileCache.directory != NULL) {
+                    ckfree(compileCache.directory);
+                }
+                compileCache.directory = CopyString(dirName);
+                compileCache.size = (dirName == NULL) ? 0 : size;
+                compileCache.numEntries = (dirName == NULL) ? 0 : numEntries;
+                compileCache.hits = 0;
+                compileCache.misses = 0;
+                compileCache.stores = 0;
+                compileCache.evictions = 0;
+                if ((dirName != NULL) && (compileCache.maxSize > 0)
+                        && (compileCache.size > compileCache.maxSize)) {
+                    CacheEvict(interp);
+                }
+                Tcl_MutexUnlock(&cacheMutex);
+            }
+
+            if (objc == 2) {
+                resultObjPtr = Tcl_NewObj();
+                Tcl_MutexLock(&cacheMutex);
+                Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                        Tcl_NewStringObj("-directory", -1));
+                Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                        Tcl_NewStringObj((compileCache.directory == NULL)
+                            ? "" : compileCache.directory, -1));
+                Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                        Tcl_NewStringObj("-maxsize", -1));
+                Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                        Tcl_NewWideIntObj(compileCache.maxSize));
+                Tcl_MutexUnlock(&cacheMutex);
+                Tcl_SetObjResult(interp, resultObjPtr);
+            }
+            break;
+
+        case CACHE_STATS:
+            if (objc != 2) {
+                Tcl_WrongNumArgs(interp, 2, objv, NULL);
+                return TCL_ERROR;
+            }
+            resultObjPtr = Tcl_NewObj();
+            Tcl_MutexLock(&cacheMutex);
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewStringObj("hits", -1));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewLongObj(compileCache.hits));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewStringObj("misses", -1));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewLongObj(compileCache.misses));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewStringObj("stores", -1));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewLongObj(compileCache.stores));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewStringObj("evictions", -1));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewLongObj(compileCache.evictions));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewStringObj("entries", -1));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewIntObj(compileCache.numEntries));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewStringObj("size", -1));
+            Tcl_ListObjAppendElement(NULL, resultObjPtr,
+                    Tcl_NewWideIntObj(compileCache.size));
+            Tcl_MutexUnlock(&cacheMutex);
+            Tcl_SetObjResult(interp, resultObjPtr);
+            break;
+    }
+
+    return result;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CreatePostProcessInfo --
+ * CacheEntryName --
  *
- *  Creates a PostProcessInfo struct.
+ *  Computes the name of the cache entry for a script: the cache directory
+ *  joined with the MD5 digest, in hex, of the package and Tcl versions,
+ *  the flags, the preamble and the script.
  *
  * Results:
- *  Returns a ckalloc'ed InstLocList, initialized with the list field set to
- *  0, and the numProcs field set to 0.
+ *  Returns 1 and appends the name to namePtr if the cache is on, 0
+ *  otherwise.
  *
  * Side effects:
  *  None.
@@ -2146,411 +3484,456 @@ CreateInstLocList(CompileEnv *envPtr)
  *----------------------------------------------------------------------
  */
 
-static PostProcessInfo *
-CreatePostProcessInfo()
+static int
+CacheEntryName(cmdObjPtr, preamblePtr, flags, namePtr)
+    Tcl_Obj *cmdObjPtr;		/* the script to be compiled */
+    char *preamblePtr;		/* Preamble for the generated script, or
+                                 * NULL */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+    Tcl_DString *namePtr;	/* Receives the name of the entry */
 {
-    PostProcessInfo *infoPtr
-        = (PostProcessInfo *) ckalloc(sizeof(PostProcessInfo));
-    infoPtr->procs = (InstLocList *) NULL;
-    infoPtr->numProcs = 0;
-    Tcl_InitHashTable(&infoPtr->objTable, TCL_ONE_WORD_KEYS);
-    infoPtr->infoArrayPtr = (ProcBodyInfo **) NULL;
-    infoPtr->numUnshares = 0;
-    infoPtr->numCompiledBodies = 0;
+    CacheDigest digest;
+    unsigned char result[16];
+    char buf[100];
+    char *bytes;
+    int i, length, major, minor, patchLevel, type;
 
-    return infoPtr;
+    Tcl_MutexLock(&cacheMutex);
+    if (compileCache.directory == NULL) {
+        Tcl_MutexUnlock(&cacheMutex);
+        return 0;
+    }
+    Tcl_DStringAppend(namePtr, compileCache.directory, -1);
+    Tcl_MutexUnlock(&cacheMutex);
+
+    CacheDigestInit(&digest);
+
+    Tcl_GetVersion(&major, &minor, &patchLevel, &type);
+    sprintf(buf, "%s %s %d.%d.%d.%d %d", PACKAGE_VERSION, TCL_VERSION,
+            major, minor, patchLevel, type, flags);
+    CacheDigestUpdate(&digest, buf, strlen(buf) + 1);
+
+    /*
+     * A NULL preamble and an empty one do not give the same output.
+     */
+
+    if (preamblePtr == NULL) {
+        CacheDigestUpdate(&digest, "n", 1);
+    } else {
+        CacheDigestUpdate(&digest, "p", 1);
+        CacheDigestUpdate(&digest, preamblePtr, strlen(preamblePtr) + 1);
+    }
+
+    bytes = Tcl_GetStringFromObj(cmdObjPtr, &length);
+    CacheDigestUpdate(&digest, bytes, length);
+    CacheDigestFinal(&digest, result);
+
+    buf[0] = '/';
+    for (i = 0; i < 16; i++) {
+        sprintf(buf + 1 + 2 * i, "%02x", result[i]);
+    }
+    Tcl_DStringAppend(namePtr, buf, -1);
+    Tcl_DStringAppend(namePtr, tcExtension, -1);
+    return 1;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * FreePostProcessInfo --
+ * CacheDigestInit --
  *
- *  Frees all entries in the proc location list, then the info itself.
+ *  Starts an MD5 digest, for CacheEntryName.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  None.
+ *  Initializes the digest state.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-FreePostProcessInfo(infoPtr)
-    PostProcessInfo *infoPtr;	/* the list to free up */
+CacheDigestInit(digestPtr)
+    CacheDigest *digestPtr;	/* the digest to initialize */
 {
-    if (infoPtr) {
-        InstLocList *nextPtr;
-        InstLocList *listPtr;
-
-        for (listPtr=infoPtr->procs ; listPtr ; listPtr=nextPtr) {
-            nextPtr = listPtr->next;
-            ckfree((char *) listPtr);
-        }
-
-        FreeProcBodyInfoArray(infoPtr);
-
-        Tcl_DeleteHashTable(&infoPtr->objTable);
-
-        ckfree((char *) infoPtr);
-    }
+    digestPtr->state[0] = 0x67452301;
+    digestPtr->state[1] = 0xefcdab89;
+    digestPtr->state[2] = 0x98badcfe;
+    digestPtr->state[3] = 0x10325476;
+    digestPtr->length = 0;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * AppendInstLocList --
+ * CacheDigestUpdate --
  *
- *  Appends the given bytecode offset to the proc location list for a given
- *  interpreter.
+ *  Adds a sequence of bytes to an MD5 digest.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  None.
+ *  Updates the digest state.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-AppendInstLocList(interp, compEnvPtr)
-    Tcl_Interp *interp;		/* interpreter for which to append the proc
-                                 * location to the proc list */
-    CompileEnv *compEnvPtr;	/* the compilation environment */
+CacheDigestUpdate(digestPtr, bytes, length)
+    CacheDigest *digestPtr;	/* the digest to update */
+    CONST char *bytes;		/* the bytes to add */
+    int length;			/* the number of bytes */
 {
-    CompilerContext *ctxPtr = CompilerGetContext(interp);
-    PostProcessInfo *infoPtr = ctxPtr->ppi;
-    InstLocList *newPtr = CreateInstLocList(compEnvPtr);
-    InstLocList *listPtr = infoPtr->procs;
+    int used = (int) (digestPtr->length & 63);
+    int count;
 
-    if (listPtr) {
-        while (listPtr->next) {
-            listPtr = listPtr->next;
+    digestPtr->length += length;
+    while (length > 0) {
+        count = 64 - used;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(digestPtr->block + used, bytes, (size_t) count);
+        used += count;
+        bytes += count;
+        length -= count;
+        if (used == 64) {
+            CacheDigestBlock(digestPtr->state, digestPtr->block);
+            used = 0;
         }
-        listPtr->next = newPtr;
-    } else {
-        infoPtr->procs = newPtr;
     }
-
-    infoPtr->numProcs += 1;
-    ctxPtr->numProcs += 1;
 }
-
+
 /*
- *-----------------------------------------------------------------------
- *
- * CompileObject --
- *
- *  Lifted from SetByteCodeFromAny in tclCompile.c, does pretty much the
- *  same thing, except that it postprocesses the compiled string to also
- *  compile any procedure bodies. It needs to have access to the compile
- *  environment, because it may have to add objects to the list that was
- *  created by the compiler.
+ *----------------------------------------------------------------------
  *
- *  The rest of this comment block comes from the SetByteCodeFromAny header.
+ * CacheDigestFinal --
  *
- *  Part of the bytecode Tcl object type implementation. Attempts to
- *  generate an byte code internal form for the Tcl object "objPtr" by
- *  compiling its string representation.
+ *  Pads the bytes of an MD5 digest and computes its value.
  *
  * Results:
- *  The return value is a standard Tcl object result. If an error occurs
- *  during compilation, an error message is left in the interpreter's
- *  result unless "interp" is NULL.
+ *  Stores the 16 bytes of the digest in result.
  *
  * Side effects:
- *  Frees the old internal representation. If no error occurs, then the
- *  compiled code is stored as "objPtr"s bytecode representation.
- *  Also, if debugging, initializes the "tcl_traceCompile" Tcl variable
- *  used to trace compilations.
+ *  The digest state can no longer be updated.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-CompileObject(interp, objPtr)
-    Tcl_Interp *interp;		/* The interpreter for which the code is
-                                 * compiled. */
-    Tcl_Obj *objPtr;		/* The object to convert. */
+static void
+CacheDigestFinal(digestPtr, result)
+    CacheDigest *digestPtr;	/* the digest to finish */
+    unsigned char result[16];	/* receives the digest */
 {
-    int result;
-    ProcInfo info;
-
-    /*
-     * Before starting the compile, temporarily override the Command struct
-     * for the "proc" command to use our CompileProc. This lets us trap
-     * calls to "proc" during compilation, from which we can compile the
-     * procedure bodies
-     */
-
-    info.procCmdPtr = (Command *) Tcl_FindCommand(interp, "proc",
-	    (Tcl_Namespace *) NULL, /*flags*/ 0);
-
-    if (info.procCmdPtr) {
-        /*
-         * For the time being, we don't need to make sure that this is really
-         * the builtin "proc" command because we are running the compiler from
-         * our own script in our own executable, and therefore nobody has
-         * had a chance to redefine "proc"
-         */
-
-	/*
-         * EMIL we need to save the current value somewhere where
-         * LocalProcCompileProc can find it and, if it is not 0,
-         * call it.
-         * Probably a global hash table keyed by interpreter
-         */
+    static CONST char padding[64] = { (char) 0x80 };
+    unsigned char bits[8];
+    Tcl_WideUInt numBits = digestPtr->length << 3;
+    int used = (int) (digestPtr->length & 63);
+    int i;
 
-        info.savedCompileProc = info.procCmdPtr->compileProc;
-        info.procCmdPtr->compileProc = LocalProcCompileProc;
+    for (i = 0; i < 8; i++) {
+        bits[i] = (unsigned char) (numBits >> (8 * i));
     }
+    CacheDigestUpdate(digestPtr, padding,
+            (used < 56) ? (56 - used) : (120 - used));
+    CacheDigestUpdate(digestPtr, (CONST char *) bits, 8);
 
-    /*
-     * Initialize the compiler context struct. This includes the proc location
-     * list for this interpreter; this list will be populated by the local
-     * compile proc and used later to compile the procedure bodies
-     */
-
-    InitCompilerContext(interp);
-
-    result = TclSetByteCodeFromAny(interp, objPtr,
-	    PostProcessCompile, (ClientData) &info);
-
-    /*
-     * Restore the "proc" command compile procedure.  This may be unnecessary
-     * since PostProcessCompile will normally restore the function, but in
-     * error cases it may never be called.
-     */
-
-    if (info.procCmdPtr) {
-        info.procCmdPtr->compileProc = info.savedCompileProc;
+    for (i = 0; i < 16; i++) {
+        result[i] = (unsigned char) (digestPtr->state[i / 4] >> (8 * (i % 4)));
     }
-
-    ReleaseCompilerContext(interp);
-
-    return result;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * PostProcessCompile --
+ * CacheDigestBlock --
  *
- *  Runs the postprocessing step on a compilation environment.
+ *  Runs the MD5 compression function over one 64 byte block.
  *
  * Results:
- *  A standard TCL error code.
+ *  None.
  *
  * Side effects:
- *  The various postprocessing steps may have side effects.
+ *  Updates the four state words.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-PostProcessCompile(interp, compEnvPtr, clientData)
-    Tcl_Interp *interp;			/* the active interpreter */
-    struct CompileEnv *compEnvPtr;	/* the compilation environment to
-                                         * postprocess */
-    ClientData clientData;		/* Saved compileproc info. */
-{
-    int result;
-    ProcInfo *infoPtr = (ProcInfo *)clientData;
-
-    /*
-     * restore the original compile proc for "proc" before we postprocess
-     * the compiled environment. If we don't, and there are procedures that
-     * call "proc" in their bodies, the numProc field in the post
-     * process info gets corrupted (it is bumped up, which makes it
-     * inconsistent with the number of process info struct stored).
-     */
-
-    if (infoPtr->procCmdPtr) {
-        infoPtr->procCmdPtr->compileProc = infoPtr->savedCompileProc;
-    }
-
-    /*
-     * Only postprocessing so far is the compilation of procedure bodies
-     */
-
-    result = CompileProcBodies(interp, compEnvPtr);
-    if (result != TCL_OK) {
-        return result;
-    }
+#define MD5_ROTATE(x, n) ((((x) << (n)) | ((x) >> (32 - (n)))) & 0xffffffff)
 
-    return result;
+static void
+CacheDigestBlock(state, block)
+    unsigned int state[4];	/* the state words to update */
+    CONST unsigned char *block;	/* the 64 bytes of the block */
+{
+    static CONST unsigned int sines[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+        0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+        0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+        0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+        0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+        0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+        0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+        0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+        0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+    };
+    static CONST int shifts[16] = {
+        7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+    };
+    unsigned int words[16];
+    unsigned int a, b, c, d, f, tmp;
+    int i, g;
+
+    for (i = 0; i < 16; i++) {
+        words[i] = (unsigned int) block[4 * i]
+                | ((unsigned int) block[4 * i + 1] << 8)
+                | ((unsigned int) block[4 * i + 2] << 16)
+                | ((unsigned int) block[4 * i + 3] << 24);
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    for (i = 0; i < 64; i++) {
+        switch (i / 16) {
+            case 0:
+                f = (b & c) | (~b & d);
+                g = i;
+                break;
+            case 1:
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) & 15;
+                break;
+            case 2:
+                f = b ^ c ^ d;
+                g = (3 * i + 5) & 15;
+                break;
+            default:
+                f = c ^ (b | ~d);
+                g = (7 * i) & 15;
+                break;
+        }
+        tmp = d;
+        d = c;
+        c = b;
+        b = (b + MD5_ROTATE((a + f + sines[i] + words[g]) & 0xffffffff,
+                shifts[(i / 16) * 4 + (i & 3)])) & 0xffffffff;
+        a = tmp;
+    }
+    state[0] = (state[0] + a) & 0xffffffff;
+    state[1] = (state[1] + b) & 0xffffffff;
+    state[2] = (state[2] + c) & 0xffffffff;
+    state[3] = (state[3] + d) & 0xffffffff;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CompileProcBodies --
+ * CacheFetch --
  *
- *  Compiles the procedure bodies present in a compilation environment.
+ *  Looks up a cache entry, and copies it to the output file if found.
  *
  * Results:
- *  A standard TCL error code.
+ *  Returns 1 on a hit, 0 on a miss.
  *
  * Side effects:
- *  Compiles procedure bodies if any; the objects will have an internal
- *  bytecode representation. Additionally, if the procedure bodies were
- *  shared objects, it creates a new copy of the body object in order to
- *  make them unshared. In this case, it will modify both the bytecodes and
- *  the object table.
- *  May set the TCL result object on error.
+ *  On a hit the output file is written and the entry is touched, so
+ *  that CacheEvict sees it as recently used. Updates the counters.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-CompileProcBodies(interp, compEnvPtr)
-    Tcl_Interp *interp;			/* the active interpreter */
-    CompileEnv *compEnvPtr;		/* the compilation environment to
-                                         * postprocess */
+CacheFetch(interp, entryName, outFileName, mode)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    CONST char *entryName;	/* name of the cache entry */
+    CONST char *outFileName;	/* name of the output file */
+    int mode;			/* permissions of the output file */
 {
-    CompilerContext *ctxPtr = CompilerGetContext(interp);
-    PostProcessInfo *infoPtr = ctxPtr->ppi;
-    ProcBodyInfo **infoArrayPtr;
-    int result = TCL_OK;
-    int i;
-
-    if (!infoPtr) {
-        panic("CompileProcBodies: no postprocess info for interpreter");
-        return TCL_ERROR;
+    Tcl_Obj *pathPtr;
+    struct utimbuf tval;
+    int hit;
+
+    hit = (CacheCopyFile(interp, entryName, outFileName, mode) == TCL_OK);
+    if (hit) {
+        pathPtr = Tcl_NewStringObj(entryName, -1);
+        Tcl_IncrRefCount(pathPtr);
+        tval.actime = tval.modtime = time(NULL);
+        Tcl_FSUtime(pathPtr, &tval);
+        Tcl_DecrRefCount(pathPtr);
+    } else {
+        Tcl_ResetResult(interp);
     }
 
-    if (infoPtr->numProcs < 1) {
-        return TCL_OK;
+    Tcl_MutexLock(&cacheMutex);
+    if (hit) {
+        compileCache.hits += 1;
+    } else {
+        compileCache.misses += 1;
     }
+    Tcl_MutexUnlock(&cacheMutex);
 
-    CreateProcBodyInfoArray(infoPtr, compEnvPtr, &infoArrayPtr);
-    LoadObjRefInfoTable(infoPtr, compEnvPtr);
+    return hit;
+}
 
-    /*
-     * Before compiling, check for shared objects and, if there are any,
-     * copy them to new objects.
-     */
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheStore --
+ *
+ *  Adds a compiled file to the cache. The file is first copied to a name
+ *  unique to this process and thread, then renamed into place, so that
+ *  concurrent compilers never see a partial entry. Failures are ignored:
+ *  the cache only ever saves work.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Creates the cache entry, and evicts old entries if the cache grows
+ *  over its maximum size. Updates the counters.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    UnshareProcBodies(interp, ctxPtr, compEnvPtr);
+static void
+CacheStore(interp, entryName, outFileName)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    CONST char *entryName;	/* name of the cache entry */
+    CONST char *outFileName;	/* name of the compiled file */
+{
+    Tcl_DString tmpName;
+    Tcl_Obj *tmpPathPtr, *pathPtr;
+    Tcl_StatBuf statBuf;
+    Tcl_WideInt oldSize;
+    char buf[40];
+    int result, exists;
+
+    Tcl_DStringInit(&tmpName);
+    Tcl_DStringAppend(&tmpName, entryName, -1);
+#ifdef _WIN32
+    sprintf(buf, ".%lx.%lx", (unsigned long) GetCurrentProcessId(),
+            (unsigned long) Tcl_GetCurrentThread());
+#else
+    sprintf(buf, ".%lx.%lx", (unsigned long) getpid(),
+            (unsigned long) Tcl_GetCurrentThread());
+#endif
+    Tcl_DStringAppend(&tmpName, buf, -1);
 
-    /*
-     * Compile the procedure bodies.
-     */
+    tmpPathPtr = Tcl_NewStringObj(Tcl_DStringValue(&tmpName), -1);
+    Tcl_IncrRefCount(tmpPathPtr);
+    pathPtr = Tcl_NewStringObj(entryName, -1);
+    Tcl_IncrRefCount(pathPtr);
 
-    infoPtr->numCompiledBodies = 0;
-    for (i=0 ; i < infoPtr->numProcs ; i++) {
-        if (infoArrayPtr[i]->bodyNewIndex != -1) {
-            result =
-                CompileOneProcBody(interp, infoArrayPtr[i], ctxPtr,
-                        compEnvPtr);
-            if (result != TCL_OK) {
-                goto return_result;
-            }
-            infoPtr->numCompiledBodies++;
-        }
-    }
+    result = CacheCopyFile(interp, outFileName, Tcl_DStringValue(&tmpName),
+            0644);
 
     /*
-     * If some procedure bodies have been compiled, we need to modify the
-     * bytecodes and related data structures
+     * The rename replaces an entry stored meanwhile by another compiler,
+     * which must not be counted twice.
      */
 
-    UpdateByteCodes(infoPtr, compEnvPtr);
+    exists = 0;
+    oldSize = 0;
+    if (result == TCL_OK) {
+        if (Tcl_FSStat(pathPtr, &statBuf) == 0) {
+            exists = 1;
+            oldSize = statBuf.st_size;
+        }
+        result = Tcl_FSRenameFile(tmpPathPtr, pathPtr);
+    }
+    if ((result == TCL_OK) && (Tcl_FSStat(pathPtr, &statBuf) == 0)) {
+        Tcl_MutexLock(&cacheMutex);
+        compileCache.stores += 1;
+        if (!exists) {
+            compileCache.numEntries += 1;
+        }
+        compileCache.size += statBuf.st_size - oldSize;
+        if ((compileCache.maxSize > 0)
+                && (compileCache.size > compileCache.maxSize)) {
+            CacheEvict(interp);
+        }
+        Tcl_MutexUnlock(&cacheMutex);
+    } else {
+        Tcl_FSDeleteFile(tmpPathPtr);
+    }
+    Tcl_ResetResult(interp);
 
-    return_result:
-    return result;
+    Tcl_DecrRefCount(pathPtr);
+    Tcl_DecrRefCount(tmpPathPtr);
+    Tcl_DStringFree(&tmpName);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CreateProcBodyInfoArray --
+ * CacheEvict --
  *
- *  Allocate and populate an array of ProcBodyInfo structs.
- *  This is a NULL-terminated array of pointers to ProcBodyInfo, each
- *  initialized from the corresponding procedure body.
- *  The allocated array is placed in the infoArrayPtr field of locInfoPtr,
- *  and is owned by it; it will be released when locInfoPtr is freed.
+ *  Deletes the least recently used entries of the cache, until its size
+ *  is down to 7/8 of the maximum; the slack keeps the following stores
+ *  from rescanning the directory each time. Must be called with
+ *  cacheMutex held.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  panics on error.
+ *  Deletes cache entries, and resynchronizes the size and entry count
+ *  with the contents of the directory.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-CreateProcBodyInfoArray(locInfoPtr, compEnvPtr, arrayPtrPtr)
-    PostProcessInfo *locInfoPtr;	/* info about the locations of the proc
-                                         * commands in the bytecodes */
-    CompileEnv *compEnvPtr;		/* the compilation environment to
-                                         * postprocess */
-    ProcBodyInfo ***arrayPtrPtr;	/* if non-NULL, the pointer to the
-                                         * allocated array will be placed
-                                         * here */
+CacheEvict(interp)
+    Tcl_Interp *interp;		/* Current interpreter. */
 {
-    int i;
-    int allocSize, arraySize;
-    int numProcs = locInfoPtr->numProcs;
-    char *allocPtr;
-    ProcBodyInfo **infoAryPtr;
-    ProcBodyInfo *infoPtr;
-    InstLocList *locPtr;
-
-    FreeProcBodyInfoArray(locInfoPtr);
-
-    /*
-     * allocate a single area, used for both the array of pointers and the
-     * info structs
-     */
-
-    arraySize = (numProcs + 1) * sizeof(ProcBodyInfo *);
-    arraySize += TCL_ALIGN(arraySize);		/* align the info array */
-    allocSize = arraySize + (numProcs * sizeof(ProcBodyInfo));
-    allocPtr = ckalloc(allocSize);
+    CacheEntry *entries;
+    Tcl_WideInt size, lowWater;
+    int numEntries, i;
 
-    locInfoPtr->infoArrayPtr = (ProcBodyInfo **) allocPtr;
-    infoAryPtr = locInfoPtr->infoArrayPtr;
-    for (i=0 ; i <= numProcs ; i++) {
-        *infoAryPtr = (ProcBodyInfo *) NULL;
-        infoAryPtr += 1;
+    if (CacheScan(interp, compileCache.directory, &entries, &numEntries,
+            &size) != TCL_OK) {
+        Tcl_ResetResult(interp);
+        return;
     }
 
-    /*
-     * get the object indexes for the body and args objects,
-     * and the push offsets
-     */
+    qsort((VOID *) entries, (size_t) numEntries, sizeof(CacheEntry),
+            CacheCompareEntries);
 
-    infoPtr = (ProcBodyInfo *) (allocPtr + arraySize);
-    infoAryPtr = locInfoPtr->infoArrayPtr;
-    locPtr = locInfoPtr->procs;
-    for (i=0 ; i < numProcs ; i++) {
-        *infoAryPtr = infoPtr;
-        LoadProcBodyInfo(locPtr, compEnvPtr, infoPtr);
-        infoAryPtr += 1;
-        infoPtr += 1;
-        locPtr = locPtr->next;
+    lowWater = compileCache.maxSize - compileCache.maxSize / 8;
+    for (i=0 ; (i < numEntries) && (size > lowWater) ; i++) {
+        if (Tcl_FSDeleteFile(entries[i].pathPtr) == TCL_OK) {
+            size -= entries[i].size;
+            compileCache.evictions += 1;
+        }
     }
+    compileCache.size = size;
+    compileCache.numEntries = numEntries - i;
 
-    if (arrayPtrPtr != NULL) {
-        *arrayPtrPtr = locInfoPtr->infoArrayPtr;
-    }
+    CacheFreeEntries(entries, numEntries);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * FreeProcBodyInfoArray --
+ * CacheCompareEntries --
  *
- *  Frees the array of ProcBodyInfo structs in the PostProcessInfo struct.
+ *  qsort comparison procedure ordering cache entries from the least to
+ *  the most recently used.
  *
  * Results:
- *  None.
+ *  <0, 0 or >0 as for strcmp.
  *
  * Side effects:
  *  None.
@@ -2558,652 +3941,724 @@ CreateProcBodyInfoArray(locInfoPtr, compEnvPtr, arrayPtrPtr)
  *----------------------------------------------------------------------
  */
 
-static void
-FreeProcBodyInfoArray(infoPtr)
-    PostProcessInfo *infoPtr;	/* info about the locations of the proc
-                                 * commands in the bytecodes */
+static int
+CacheCompareEntries(first, second)
+    CONST VOID *first;		/* the first CacheEntry */
+    CONST VOID *second;		/* the second CacheEntry */
 {
-    if (infoPtr->infoArrayPtr) {
-        ckfree((char *) infoPtr->infoArrayPtr);
-    }
-    infoPtr->infoArrayPtr = (ProcBodyInfo **) NULL;
+    long mtime1 = ((CacheEntry *) first)->mtime;
+    long mtime2 = ((CacheEntry *) second)->mtime;
+
+    return (mtime1 < mtime2) ? -1 : ((mtime1 > mtime2) ? 1 : 0);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * LoadProcBodyInfo --
+ * CacheMakeDirectory --
  *
- *	Populate a ProcBodyInfo struct.  This function determines if a
- *	procedure body should be compiled or not; see the comments in
- *	the body, below, for a description of the algorithm.  A
- *	procedure body that should not be compiled has its
- *	bodyNewIndex field set to -1.
+ *  Creates a cache directory, and its missing parent directories, as
+ *  "file mkdir" does.
  *
  * Results:
- *	None.
+ *  Returns a standard TCL result code; on error, errno is set.
  *
  * Side effects:
- *	None.
+ *  Creates directories.
  *
- *---------------------------------------------------------------------- */
+ *----------------------------------------------------------------------
+ */
 
-static void
-LoadProcBodyInfo(locInfoPtr, compEnvPtr, infoPtr)
-    InstLocList *locInfoPtr;	/* info about the locations of the proc
-                                 * command in the bytecodes */
-    CompileEnv *compEnvPtr;	/* the compilation environment to
-                                 * postprocess */
-    ProcBodyInfo *infoPtr;	/* pointer to the struct to populate */
+static int
+CacheMakeDirectory(dirPtr)
+    Tcl_Obj *dirPtr;		/* the normalized path of the directory */
 {
-    unsigned char *pc = compEnvPtr->codeStart + locInfoPtr->bytecodeOffset;
-
-    /*
-     * Here is where we scan the bytecodes and figure out where the args
-     * and the procedure body are put on the stack.
-     *
-     * Currently, we only detect the simplest (and most common) case, where
-     * all arguments to proc are pushed as literals, like this:
-     *		proc a { a1 a2 } { return [list $a1 $a2] }
-     * This corresponds to an expected sequence of commands like this:
-     * 		PUSH, PUSH, PUSH, PUSH, INVOKE_STK1
-     * where PUSH can be either PUSH1 or PUSH4, but INVOKE_STK1 only is
-     * expected (because there are only 4 arguments).
-     * The operand of the first PUSH is the index to the "proc" string,
-     * for the second it is the procedure name, for the third the argument
-     * list, and for the fourth the procedure body.
-     *
-     * If the args or the body are not pushed as literals, then the PUSH
-     * should be followed by different opcodes; for example, something like
-     * this
-     *		set body { return [list $a1 $a2] }
-     *		proc a { a1 a2 } $b
-     * generates a sequence like (PUSH "b"; LOAD) when the body is loaded,
-     * and we shouldn't compile "b" (of course!) and neither the object
-     * loaded as "b" (because it may not be a literal).
-     *
-     * The tough part is how do we detect stuff like this:
-     *		proc $procName { a1 a2 ] { return [list $a1 $a2] }
-     */
+    Tcl_Obj *partsPtr, *parentPtr;
+    int numParts, result;
 
-    infoPtr->commandIndex = locInfoPtr->commandIndex;
-    infoPtr->procOffset = (pc - compEnvPtr->codeStart);
-    infoPtr->nameIndex = -1;
-    infoPtr->argsIndex = -1;
-    infoPtr->bodyOrigIndex = -1;
-    infoPtr->bodyNewIndex = -1;
-    infoPtr->bodyOffset = -1; /* Bugzilla 89467 */
+    if ((Tcl_FSCreateDirectory(dirPtr) == TCL_OK)
+            || (Tcl_GetErrno() == EEXIST)) {
+        return TCL_OK;
+    }
+    if (Tcl_GetErrno() != ENOENT) {
+        return TCL_ERROR;
+    }
 
-    /*
-     * Skip the "proc" string
-     */
+    partsPtr = Tcl_FSSplitPath(dirPtr, &numParts);
+    Tcl_IncrRefCount(partsPtr);
+    if (numParts < 2) {
+        Tcl_DecrRefCount(partsPtr);
+        Tcl_SetErrno(ENOENT);
+        return TCL_ERROR;
+    }
+    parentPtr = Tcl_FSJoinPath(partsPtr, numParts - 1);
+    Tcl_IncrRefCount(parentPtr);
+    Tcl_DecrRefCount(partsPtr);
+    result = CacheMakeDirectory(parentPtr);
+    Tcl_DecrRefCount(parentPtr);
+    if (result != TCL_OK) {
+        return TCL_ERROR;
+    }
 
-    switch (*pc) {
-        case INST_PUSH1:
-            pc += 2;
-            break;
+    if ((Tcl_FSCreateDirectory(dirPtr) != TCL_OK)
+            && (Tcl_GetErrno() != EEXIST)) {
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
 
-        case INST_PUSH4:
-            pc += 5;
-            break;
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheScan --
+ *
+ *  Lists the entries of a cache directory, with their size and time of
+ *  last use. Only the files named as by CacheEntryName, 32 hex digits
+ *  and the extension, are entries; the directory may hold other files,
+ *  which must be left alone.
+ *
+ * Results:
+ *  Returns a standard TCL result code. On success stores a ckalloc'ed
+ *  array of entries, to be freed with CacheFreeEntries, the number of
+ *  entries and their total size in the output arguments.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        default:
-            return;
+static int
+CacheScan(interp, directory, entriesPtr, numEntriesPtr, sizePtr)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    CONST char *directory;	/* the cache directory */
+    CacheEntry **entriesPtr;	/* Receives the entries */
+    int *numEntriesPtr;		/* Receives the number of entries */
+    Tcl_WideInt *sizePtr;	/* Receives the total size of the entries */
+{
+    Tcl_GlobTypeData types;
+    Tcl_StatBuf statBuf;
+    Tcl_Obj *dirPtr, *listPtr;
+    Tcl_Obj **pathv;
+    CacheEntry *entryPtr;
+    char pattern[32 * 8 + 20];
+    int numPaths, i;
+
+    types.type = TCL_GLOB_TYPE_FILE;
+    types.perm = 0;
+    types.macType = NULL;
+    types.macCreator = NULL;
+    pattern[0] = '\0';
+    for (i=0 ; i < 32 ; i++) {
+        strcat(pattern, "[0-9a-f]");
+    }
+    strcat(pattern, tcExtension);
+
+    dirPtr = Tcl_NewStringObj(directory, -1);
+    Tcl_IncrRefCount(dirPtr);
+    listPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(listPtr);
+
+    if ((Tcl_FSMatchInDirectory(interp, listPtr, dirPtr, pattern, &types)
+            != TCL_OK)
+            || (Tcl_ListObjGetElements(interp, listPtr, &numPaths, &pathv)
+            != TCL_OK)) {
+        Tcl_DecrRefCount(listPtr);
+        Tcl_DecrRefCount(dirPtr);
+        return TCL_ERROR;
     }
 
-    /*
-     * get the index of the proc name
-     */
+    *entriesPtr = (CacheEntry *)
+            ckalloc((numPaths + 1) * sizeof(CacheEntry));
+    *numEntriesPtr = 0;
+    *sizePtr = 0;
+    for (i=0 ; i < numPaths ; i++) {
+        if (Tcl_FSStat(pathv[i], &statBuf) != 0) {
+            continue;
+        }
+        entryPtr = &(*entriesPtr)[*numEntriesPtr];
+        entryPtr->pathPtr = pathv[i];
+        Tcl_IncrRefCount(entryPtr->pathPtr);
+        entryPtr->size = statBuf.st_size;
+        entryPtr->mtime = (long) statBuf.st_mtime;
+        *numEntriesPtr += 1;
+        *sizePtr += statBuf.st_size;
+    }
 
-    switch (*pc) {
-        case INST_PUSH1:
-            infoPtr->nameIndex = TclGetUInt1AtPtr(pc+1);
-            pc += 2;
-            break;
+    Tcl_DecrRefCount(listPtr);
+    Tcl_DecrRefCount(dirPtr);
+    return TCL_OK;
+}
 
-        case INST_PUSH4:
-            infoPtr->nameIndex = TclGetUInt4AtPtr(pc+1);
-            pc += 5;
-            break;
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheFreeEntries --
+ *
+ *  Frees an array of entries returned by CacheScan.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        default:
-            return;
-    }
+static void
+CacheFreeEntries(entries, numEntries)
+    CacheEntry *entries;	/* the array of entries */
+    int numEntries;		/* the number of entries */
+{
+    int i;
 
-    /*
-     * get the index of the argument list
-     */
+    for (i=0 ; i < numEntries ; i++) {
+        Tcl_DecrRefCount(entries[i].pathPtr);
+    }
+    ckfree((char *) entries);
+}
 
-    switch (*pc) {
-        case INST_PUSH1:
-            infoPtr->argsIndex = TclGetUInt1AtPtr(pc+1);
-            pc += 2;
-            break;
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheCopyFile --
+ *
+ *  Copies a file byte for byte; used to fetch and store cache entries.
+ *
+ * Results:
+ *  Returns a standard TCL result code.
+ *
+ * Side effects:
+ *  Creates or overwrites the destination file.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        case INST_PUSH4:
-            infoPtr->argsIndex = TclGetUInt4AtPtr(pc+1);
-            pc += 5;
-            break;
+static int
+CacheCopyFile(interp, srcName, dstName, mode)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    CONST char *srcName;	/* the file to copy */
+    CONST char *dstName;	/* the file to create */
+    int mode;			/* permissions of the created file */
+{
+    Tcl_Channel inChan, outChan;
+    char *buffer;
+    int count;
+    int result = TCL_OK;
 
-        default:
-            return;
+    inChan = Tcl_OpenFileChannel(interp, srcName, "r", 0);
+    if (inChan == (Tcl_Channel) NULL) {
+        return TCL_ERROR;
     }
+    outChan = Tcl_OpenFileChannel(interp, dstName, "w", mode);
+    if (outChan == (Tcl_Channel) NULL) {
+        Tcl_Close(NULL, inChan);
+        return TCL_ERROR;
+    }
+    Tcl_SetChannelOption(NULL, inChan, "-translation", "binary");
+    Tcl_SetChannelOption(NULL, outChan, "-translation", "binary");
 
-    /*
-     * get the index of the procedure body, and save the offset to the
-     * push instruction.
-     */
-
-    infoPtr->bodyOffset = (pc - compEnvPtr->codeStart);
-    switch (*pc) {
-        case INST_PUSH1:
-            infoPtr->bodyOrigIndex = TclGetUInt1AtPtr(pc+1);
-            pc += 2;
-            break;
-
-        case INST_PUSH4:
-            infoPtr->bodyOrigIndex = TclGetUInt4AtPtr(pc+1);
-            pc += 5;
+    buffer = ckalloc(EMIT_BUFFER_SIZE);
+    while ((count = Tcl_Read(inChan, buffer, EMIT_BUFFER_SIZE)) > 0) {
+        if (Tcl_Write(outChan, buffer, count) != count) {
             break;
-
-        default:
-            return;
+        }
     }
-
-    /*
-     * (****)
-     */
-
-    infoPtr->bodyNewIndex = infoPtr->bodyOrigIndex;
-
-    /*
-     * finally, check if the following instruction is a INVOKE_STK1 with
-     * argument 4
-     */
-
-    if ((*pc != INST_INVOKE_STK1) || (TclGetUInt1AtPtr(pc+1) != 4)) {
-        infoPtr->nameIndex = -1;
-        infoPtr->argsIndex = -1;
-        infoPtr->bodyOrigIndex = -1;
-        infoPtr->bodyNewIndex = -1;
+    if (count != 0) {
+        Tcl_AppendResult(interp, "error copying \"", srcName, "\" to \"",
+                dstName, "\": ", Tcl_PosixError(interp), (char *) NULL);
+        result = TCL_ERROR;
     }
+    ckfree(buffer);
 
-    return;
+    Tcl_Close(NULL, inChan);
+    if ((Tcl_Close(interp, outChan) != TCL_OK) && (result == TCL_OK)) {
+        result = TCL_ERROR;
+    }
+    return result;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * LoadObjRefInfoTable --
+ * Compiler_CompileToObj --
  *
- *  Load the object reference table.
+ *  Compile a Tcl script held in an object, and return the compiled script
+ *  as a new byte array object, instead of writing it to a file. The
+ *  preamblePtr and flags arguments are as for Compiler_CompileFileEx.
+ *  The script object itself is not modified.
  *
  * Results:
- *  None.
+ *  Returns a new object with a reference count of 0 holding the compiled
+ *  script, or NULL on error, in which case an error message is left in
+ *  the interpreter result.
  *
  * Side effects:
- *  Populates the objTable field of the locInfoPtr struct.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-LoadObjRefInfoTable(locInfoPtr, compEnvPtr)
-    PostProcessInfo *locInfoPtr;	/* info about the locations of the proc
-                                         * commands in the bytecodes */
-    CompileEnv *compEnvPtr;		/* the compilation environment to
-                                         * postprocess */
+Tcl_Obj *
+Compiler_CompileToObj(interp, scriptObjPtr, preamblePtr, flags)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    Tcl_Obj *scriptObjPtr;	/* The script to compile */
+    char *preamblePtr;		/* Preamble for the generated script */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
 {
-    Tcl_HashTable *objTablePtr;
-    ProcBodyInfo **infoAryPtr;
-    ProcBodyInfo *infoPtr;
-    Tcl_HashEntry *entryPtr;
-    int isNew, objIndex;
-    ObjRefInfo *refInfoPtr;
-    InstructionDesc *opCodesTablePtr;
-    unsigned char *pc;
+    Interp *iPtr = (Interp *) interp;
+    Tcl_Obj *cmdObjPtr;
+    Tcl_Obj *resultObjPtr = NULL;
+    EmitContext emitCtx;
+    LiteralTable glt; /* Save buffer for global literals */
+    char *script;
+    int length, result;
 
-    CleanObjRefInfoTable(locInfoPtr);
+    Tcl_ResetResult(interp);
 
     /*
-     * count how many references to this object as a procedure body
+     * Compile a private copy, so that the caller's object does not get the
+     * compiler's ByteCode as internal representation.
      */
 
-    objTablePtr = &locInfoPtr->objTable;
-    for (infoAryPtr=locInfoPtr->infoArrayPtr ; *infoAryPtr ; infoAryPtr++) {
-        infoPtr = *infoAryPtr;
+    SaveLiteralTable(iPtr, &glt);
 
-        entryPtr = Tcl_CreateHashEntry(objTablePtr,
-                (char *) infoPtr->bodyOrigIndex, &isNew);
-        if (isNew) {
-            refInfoPtr = (ObjRefInfo *) ckalloc(sizeof(ObjRefInfo));
-            refInfoPtr->numReferences = 0;
-            refInfoPtr->numProcReferences = 0;
-            refInfoPtr->numUnshares = 0;
+    if (flags & COMPILER_STREAM) {
+        EmitInitContext((Tcl_Channel) NULL, &emitCtx);
+        result = EmitStreamedScript(interp, NULL, scriptObjPtr, preamblePtr,
+                flags, &emitCtx);
+        if (result == TCL_RETURN) {
+            result = TclUpdateReturnInfo(iPtr);
+        } else if (result == TCL_ERROR) {
+            char msg[64];
 
-            Tcl_SetHashValue(entryPtr, (ClientData) refInfoPtr);
-        } else {
-            refInfoPtr = (ObjRefInfo *) Tcl_GetHashValue(entryPtr);
+            sprintf(msg, "\n    (compiled script line %d)",
+                    ERRORLINE(interp));
+            Tcl_AddErrorInfo(interp, msg);
         }
-
-        refInfoPtr->numProcReferences += 1;
+        if (result == TCL_OK) {
+            resultObjPtr = Tcl_NewByteArrayObj(
+                    (unsigned char *) emitCtx.basePtr,
+                    emitCtx.curPtr - emitCtx.basePtr);
+        }
+        EmitFreeContext(&emitCtx);
+        RestoreLiteralTable(iPtr, &glt);
+        if ((resultObjPtr == NULL) && (result != TCL_ERROR)) {
+            NoCompiledScript(interp);
+        }
+        return resultObjPtr;
     }
 
-    /*
-     * now scan the bytecodes and count the references from the bytecodes.
-     * Note that this count includes references from the PUSH instructions
-     * in the "proc" call.
-     */
+    script = Tcl_GetStringFromObj(scriptObjPtr, &length);
+    cmdObjPtr = Tcl_NewStringObj(script, length);
 
-    opCodesTablePtr = (InstructionDesc*) TclGetInstructionTable();
-    for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
-        objIndex = GetSharedIndex(pc);
-        if (objIndex >= 0) {
-            entryPtr = Tcl_FindHashEntry(objTablePtr, (char *) objIndex);
-            if (entryPtr) {
-                /*
-                 * this is a reference to a known procedure body
-                 */
+    Tcl_IncrRefCount(cmdObjPtr);
+    result = Compiler_CompileObjEx(interp, cmdObjPtr, flags);
+    if (result == TCL_RETURN) {
+        result = TclUpdateReturnInfo(iPtr);
+    } else if (result == TCL_ERROR) {
+        char msg[64];
 
-                refInfoPtr = (ObjRefInfo *) Tcl_GetHashValue(entryPtr);
-                refInfoPtr->numReferences += 1;
-            }
+        sprintf(msg, "\n    (compiled script line %d)", ERRORLINE(interp));
+        Tcl_AddErrorInfo(interp, msg);
+    } else {
+        EmitInitContext((Tcl_Channel) NULL, &emitCtx);
+        result = EmitCompiledScript(interp, cmdObjPtr, preamblePtr, flags,
+                &emitCtx);
+        if (result == TCL_OK) {
+            resultObjPtr = Tcl_NewByteArrayObj(
+                    (unsigned char *) emitCtx.basePtr,
+                    emitCtx.curPtr - emitCtx.basePtr);
         }
+        EmitFreeContext(&emitCtx);
+    }
+    if (result != TCL_ERROR) {
+	/*
+	 * See Compiler_CompileFileEx. [AS Bug 20078]
+	 */
+	Tcl_DecrRefCount(cmdObjPtr);
+    }
 
-        pc += opCodesTablePtr[*pc].numBytes;
+    RestoreLiteralTable(iPtr, &glt);
+
+    if ((result != TCL_OK) && (resultObjPtr != NULL)) {
+        Tcl_DecrRefCount(resultObjPtr);
+        resultObjPtr = NULL;
     }
+    if ((resultObjPtr == NULL) && (result != TCL_ERROR)) {
+        NoCompiledScript(interp);
+    }
+    return resultObjPtr;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CleanObjRefInfoTable --
+ * NoCompiledScript --
  *
- *  Releases all entries in the object reference table.
+ *  Leaves an error in the interpreter for Compiler_CompileToObj, when
+ *  the compile did not fail but produced no compiled script, as when the
+ *  script compiled returned a non-error code.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  See above.
+ *  The interpreter result is set.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-CleanObjRefInfoTable(locInfoPtr)
-    PostProcessInfo *locInfoPtr;	/* info about the locations of the proc
-                                         * commands in the bytecodes */
+NoCompiledScript(interp)
+    Tcl_Interp *interp;		/* Current interpreter. */
 {
-    Tcl_HashSearch iterCtx;		/* the iteration context */
-    Tcl_HashEntry *entryPtr;
-    ObjRefInfo *refInfoPtr;
-
-    for (entryPtr=Tcl_FirstHashEntry(&locInfoPtr->objTable, &iterCtx) ;
-         entryPtr ;
-         entryPtr=Tcl_NextHashEntry(&iterCtx)) {
-        refInfoPtr = (ObjRefInfo *) Tcl_GetHashValue(entryPtr);
-        ckfree((char *) refInfoPtr);
-    }
+    Tcl_ResetResult(interp);
+    Tcl_AppendResult(interp, "compile produced no compiled script",
+            (char *) NULL);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CompileOneProcBody --
+ * Compiler_CompileStringObjCmd --
  *
- *  Compiles a procedure body.
- *  Much of this code is derived from Tcl_ProcObjCmd and TclObjInterpProc.
+ *  Compiles a script passed as argument, and returns the compiled script
+ *  as a byte array.
+ *
+ *  Call format:
+ *    compiler::compileString ?-binary? ?-compactliterals?
+ *		?-deterministic? ?-lazyprocs? ?-nosrcmap? ?-optimize?
+ *		?-preamble value? ?-stream? script
+ *  The options are as for compiler::compile.
  *
  * Results:
- *  A standard TCL error code.
+ *  Returns a standard TCL result code.
  *
  * Side effects:
- *  If the call succeeds, the objects will have an internal bytecode
- *  representation. Additionally, if the object was shared, a new copy is
- *  created in order to make it unshared; in this case, the new object is
- *  added to the object table and the new index field in infoPtr is updated.
- *  May set the TCL result object on error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-CompileOneProcBody(interp, infoPtr, ctxPtr, compEnvPtr)
-    Tcl_Interp *interp;		/* the active interpreter */
-    ProcBodyInfo *infoPtr;	/* compilation info for the body to compile */
-    CompilerContext *ctxPtr;	/* compiler context struct, here used for
-                                 * updating statistics */
-    CompileEnv *compEnvPtr;	/* the compilation environment to
-                                 * postprocess */
+int
+Compiler_CompileStringObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;		/* Not used. */
+    Tcl_Interp *interp;		/* Current interpreter. */
+    int objc;			/* Number of arguments. */
+    Tcl_Obj *CONST objv[];	/* Argument objects. */
 {
-    int result = TCL_OK;
-    Interp *iPtr = (Interp *) interp;
-    Proc *procPtr = (Proc *) NULL;
-    Proc *saveProcPtr;
-    Tcl_Obj *bodyPtr;
-    char *fullName, *args;
-    CONST84 char *p;
-    int numArgs, i;
-    CONST84 char **argArray = NULL;
-    CompiledLocal *localPtr;
-    Tcl_Command cmd = (Tcl_Command) NULL;
-    Tcl_Obj *procObjPtr;
-    char cmdNameBuf[64];
+    char *preamblePtr = NULL;
+    int flags = 0;
+    int scriptIndex;
+    Tcl_Obj *resultObjPtr;
 
-    if (infoPtr->bodyNewIndex == -1) {
-        return TCL_OK;
+    if (ParseCompileOptions(interp, objc, objv, &flags, &preamblePtr,
+            NULL, NULL, &scriptIndex) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (objc - scriptIndex != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv,
+                "?-binary? ?-compactliterals? ?-deterministic? ?-lazyprocs? "
+                "?-nosrcmap? ?-optimize? ?-preamble value? ?-stream? "
+                "script");
+        return TCL_ERROR;
     }
 
-    /*
-     * Here we get the current namespace. We have to do it differently
-     * than Tcl_ProcObjCmd does, because the current namespace is NOT the one
-     * that is current at the time this proc is executed (we are compiling the
-     * file).
-     *
-     * For the time being, the full name is the one that was pushed.
-     */
-
-    fullName = Tcl_GetString(
-	compEnvPtr->literalArrayPtr[infoPtr->nameIndex].objPtr);
-
-    /*
-     * the newIndex is the one of the unshared object, so there is no need
-     * to do any shared checks here
-     */
+    resultObjPtr = Compiler_CompileToObj(interp, objv[scriptIndex],
+            preamblePtr, flags);
+    if (resultObjPtr == NULL) {
+        return TCL_ERROR;
+    }
 
-    bodyPtr = compEnvPtr->literalArrayPtr[infoPtr->bodyNewIndex].objPtr;
+    Tcl_SetObjResult(interp, resultObjPtr);
+    return TCL_OK;
+}
 
-    /*
-     * Create and initialize a Proc structure for the procedure. Note that
-     * we initialize its cmdPtr field below after we've created the command
-     * for the procedure. HOWEVER, differently from Tcl_ProcObjCmd, the
-     * command we create is just a dummy for use by the compiler code; it will
-     * be deleted after the compilation.
-     * We increment the ref count of the procedure's body object since there
-     * will be a reference to it in the Proc structure.
-     */
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitCompiledScript --
+ *
+ *  Emits the optional user preamble and the compiled script for an
+ *  object compiled by Compiler_CompileObj, in the layout selected by the
+ *  COMPILER_* flags.
+ *
+ * Results:
+ *  Returns a TCL result code.
+ *
+ * Side effects:
+ *  Appends an error message to the TCL error.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    Tcl_IncrRefCount(bodyPtr);
+static int
+EmitCompiledScript(interp, cmdObjPtr, preamblePtr, flags, emitPtr)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    Tcl_Obj *cmdObjPtr;		/* The compiled script object */
+    char *preamblePtr;		/* Preamble for the generated script, or
+                                 * NULL */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
+{
+    int result, savedPhase;
 
-    procPtr = (Proc *) ckalloc(sizeof(Proc));
-    procPtr->iPtr = iPtr;
-    procPtr->refCount = 1;
-    procPtr->bodyPtr = bodyPtr;
-    procPtr->numArgs  = 0;	/* actual argument count is set below. */
-    procPtr->numCompiledLocals = 0;
-    procPtr->firstLocalPtr = NULL;
-    procPtr->lastLocalPtr = NULL;
+    savedPhase = PhaseEnter(COMPILER_PHASE_EMIT);
+    if (preamblePtr
+            && (EmitString(interp, preamblePtr, -1, '\n', emitPtr) != TCL_OK)) {
+        result = TCL_ERROR;
+    } else {
+        emitPtr->flags = flags;
+        if (flags & COMPILER_BINARY) {
+            result = BinEmitCompiledObject(interp, cmdObjPtr, emitPtr);
+        } else {
+            result = EmitCompiledObject(interp, cmdObjPtr, emitPtr);
+        }
+    }
+    PhaseLeave(savedPhase);
 
-    /*
-     * Break up the argument list into argument specifiers, then process
-     * each argument specifier.
-     */
+    return result;
+}
 
-    args = Tcl_GetString(
-	compEnvPtr->literalArrayPtr[infoPtr->argsIndex].objPtr);
-    result = Tcl_SplitList(interp, args, &numArgs, &argArray);
-    if (result != TCL_OK) {
-        goto cleanAndReturn;
-    }
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitStreamedScript --
+ *
+ *  Compiles a script and emits it as a sequence of units, for
+ *  COMPILER_STREAM. The top-level commands of the script are gathered into
+ *  units of about STREAM_UNIT_SIZE bytes; each unit is compiled on its own
+ *  and written out as a call to the loader before the next one is read.
+ *  Sourcing the units in sequence evaluates the commands in the same
+ *  order, and a "return" or an error in one unit stops the script as
+ *  before. Only the current unit is held in memory, so a command larger
+ *  than STREAM_UNIT_SIZE makes a unit of its own.
+ *
+ * Results:
+ *  Returns a TCL result code. On a compile error the error line is the
+ *  one in the whole script.
+ *
+ * Side effects:
+ *  Reads inChan to its end. Appends an error message to the TCL error.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    procPtr->numArgs = numArgs;
-    procPtr->numCompiledLocals = numArgs;
-    for (i=0 ; i < numArgs ; i++) {
-        int fieldCount, nameLength, valueLength;
-        CONST84 char **fieldValues;
+static int
+EmitStreamedScript(interp, inChan, scriptObjPtr, preamblePtr, flags, emitPtr)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    Tcl_Channel inChan;		/* the channel to read the script from, or
+                                 * NULL */
+    Tcl_Obj *scriptObjPtr;	/* the script, if inChan is NULL */
+    char *preamblePtr;		/* Preamble for the generated script, or
+                                 * NULL */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
+{
+    Tcl_DString pending;	/* the source read but not compiled yet */
+    Tcl_Obj *chunkObjPtr, *unitObjPtr;
+    Tcl_Parse parse;
+    CONST char *start, *end;
+    char *script;
+    int length, scanned, unitEnd, toRead, isEof, numUnits, lineOffset;
+    int i, result, savedPhase;
+
+    Tcl_DStringInit(&pending);
+    chunkObjPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(chunkObjPtr);
+    isEof = (inChan == NULL);
+    if (isEof) {
+        script = Tcl_GetStringFromObj(scriptObjPtr, &length);
+        Tcl_DStringAppend(&pending, script, length);
+    }
+
+    emitPtr->flags = flags;
+    savedPhase = PhaseEnter(COMPILER_PHASE_EMIT);
+    result = TCL_OK;
+    if (preamblePtr
+            && (EmitString(interp, preamblePtr, -1, '\n', emitPtr) != TCL_OK)) {
+        result = TCL_ERROR;
+    }
 
+    scanned = 0;
+    numUnits = 0;
+    lineOffset = 0;
+    toRead = STREAM_CHUNK_SIZE;
+    while (result == TCL_OK) {
         /*
-         * Now divide the specifier up into name and default.
+         * Find the end of the complete commands read so far. A command
+         * ending at the end of the buffer may still continue in the
+         * input; so may one that does not parse.
          */
 
-        result = Tcl_SplitList(interp, argArray[i], &fieldCount, &fieldValues);
-        if (result != TCL_OK) {
-            goto cleanAndReturn;
-        }
-        if (fieldCount > 2) {
-            ckfree((char *) fieldValues);
-            Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-                    "compilation of procedure \"", fullName,
-                    "\" failed: too many fields in argument specifier \"",
-                    argArray[i], "\"", (char *) NULL);
-            result = TCL_ERROR;
-            goto cleanAndReturn;
+        start = Tcl_DStringValue(&pending);
+        length = Tcl_DStringLength(&pending);
+        unitEnd = scanned;
+        while ((unitEnd < STREAM_UNIT_SIZE) && (unitEnd < length)) {
+            if (Tcl_ParseCommand(NULL, start + unitEnd, length - unitEnd, 0,
+                    &parse) != TCL_OK) {
+                if (isEof) {
+                    unitEnd = length;
+                }
+                break;
+            }
+            end = parse.commandStart + parse.commandSize;
+            Tcl_FreeParse(&parse);
+            if (!isEof && (end == start + length)) {
+                break;
+            }
+            unitEnd = end - start;
         }
+        scanned = unitEnd;
 
-        if ((fieldCount == 0) || (*fieldValues[0] == 0)) {
-            ckfree((char *) fieldValues);
-            Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-                    "compilation of procedure \"", fullName,
-                    "\" failed: argument with no name", (char *) NULL);
-            result = TCL_ERROR;
-            goto cleanAndReturn;
-        }
+        if ((unitEnd < STREAM_UNIT_SIZE) && !isEof) {
+            /*
+             * Read more. The size read doubles while a single command does
+             * not fit, so that its start is not parsed too many times.
+             */
 
-        nameLength = strlen(fieldValues[0]);
-        if (fieldCount == 2) {
-            valueLength = strlen(fieldValues[1]);
-        } else {
-            valueLength = 0;
+            if (unitEnd > 0) {
+                toRead = STREAM_CHUNK_SIZE;
+            } else if (length >= toRead) {
+                toRead *= 2;
+            }
+            if (Tcl_ReadChars(inChan, chunkObjPtr, toRead, 0) < 0) {
+                Tcl_AppendResult(interp, "couldn't read script: ",
+                        Tcl_PosixError(interp), (char *) NULL);
+                result = TCL_ERROR;
+                break;
+            }
+            script = Tcl_GetStringFromObj(chunkObjPtr, &length);
+            Tcl_DStringAppend(&pending, script, length);
+            isEof = Tcl_Eof(inChan);
+            continue;
+        }
+        if ((unitEnd == 0) && (numUnits > 0)) {
+            break;
         }
 
         /*
-         * Check that the formal parameter name is a scalar.
+         * Compile the unit and write it out. The first unit is compiled
+         * even if empty, so that there is always one.
          */
 
-        p = fieldValues[0];
-        while (*p != '\0') {
-            if (*p == '(') {
-                CONST84 char *q = p;
-                do {
-                    q++;
-                } while (*q != '\0');
-                q--;
-                if (*q == ')') { /* we have an array element */
-                    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-                            "compilation of procedure \"", fullName,
-                            "\" failed: formal parameter \"", fieldValues[0],
-                            "\" is an array element",
-                            (char *) NULL);
-                    ckfree((char *) fieldValues);
-                    result = TCL_ERROR;
-                    goto cleanAndReturn;
-                }
+        unitObjPtr = Tcl_NewStringObj(start, unitEnd);
+        Tcl_IncrRefCount(unitObjPtr);
+        result = Compiler_CompileObjEx(interp, unitObjPtr, flags);
+        if (result != TCL_OK) {
+            /*
+             * The unit is not released, see Compiler_CompileFileEx.
+             * [AS Bug 20078]
+             */
+
+            if (result == TCL_ERROR) {
+                SETERRORLINE(interp, ERRORLINE(interp) + lineOffset);
             }
-            p++;
+            break;
         }
 
-        /*
-         * Allocate an entry in the runtime procedure frame's array of local
-         * variables for the argument.
-         */
-
-        localPtr = (CompiledLocal *) ckalloc((unsigned)
-                (sizeof(CompiledLocal) - sizeof(localPtr->name)
-                        + nameLength+1));
-        if (procPtr->firstLocalPtr == NULL) {
-            procPtr->firstLocalPtr = procPtr->lastLocalPtr = localPtr;
-        } else {
-            procPtr->lastLocalPtr->nextPtr = localPtr;
-            procPtr->lastLocalPtr = localPtr;
+        if (((numUnits == 0)
+                        ? EmitScriptPreamble(interp, PREAMBLE_SCRIPT, emitPtr)
+                        : EmitUnitPreamble(interp, emitPtr)) != TCL_OK
+                || (EmitSignature(interp, emitPtr) != TCL_OK)) {
+            result = TCL_ERROR;
+        } else if (EmitByteCode(interp,
+                (ByteCode *) unitObjPtr->internalRep.otherValuePtr, emitPtr)
+                != TCL_OK) {
+            PrependResult(interp, "error writing bytecode stream: ");
+            result = TCL_ERROR;
+        } else if (EmitScriptPostamble(interp, emitPtr) != TCL_OK) {
+            result = TCL_ERROR;
         }
-        localPtr->nextPtr = NULL;
-        localPtr->nameLength = nameLength;
-        localPtr->frameIndex = i;
-#ifdef TCL_85_PLUS
-	localPtr->flags = VAR_ARGUMENT;
-#else
-        localPtr->flags = VAR_SCALAR | VAR_ARGUMENT;
-#endif
- 	localPtr->resolveInfo = NULL;
+        Tcl_DecrRefCount(unitObjPtr);
+        numUnits++;
 
-        if (fieldCount == 2) {
-            localPtr->defValuePtr =
-                Tcl_NewStringObj(fieldValues[1], valueLength);
-            Tcl_IncrRefCount(localPtr->defValuePtr);
-        } else {
-            localPtr->defValuePtr = NULL;
+        for (i=0 ; i < unitEnd ; i++) {
+            if (start[i] == '\n') {
+                lineOffset++;
+            }
         }
-        strcpy(localPtr->name, fieldValues[0]);
-
-        ckfree((char *) fieldValues);
+        memmove(Tcl_DStringValue(&pending), start + unitEnd,
+                (size_t) (length - unitEnd));
+        Tcl_DStringSetLength(&pending, length - unitEnd);
+        scanned = 0;
     }
 
-    /*
-     * Now create a command for the procedure. This will initially be in
-     * the current namespace unless the procedure's name included namespace
-     * qualifiers. To create the new command in the right namespace, we
-     * generate a fully qualified name for it.
-     */
-
-    /*
-     * EMIL this needs to be looked into; can't really do this, must use
-     * the namespace from the code we are compiling, not the current one
-
-    Tcl_DString ds;
-
-    Tcl_DStringInit(&ds);
-    if (nsPtr != iPtr->globalNsPtr) {
-        Tcl_DStringAppend(&ds, nsPtr->fullName, -1);
-        Tcl_DStringAppend(&ds, "::", 2);
+    if (result == TCL_OK) {
+        if (EmitFlushContext(interp, emitPtr) != TCL_OK) {
+            PrependResult(interp, "error writing bytecode stream: ");
+            result = TCL_ERROR;
+        } else if ((emitPtr->target != NULL)
+                && (Tcl_Flush(emitPtr->target) != TCL_OK)) {
+            Tcl_AppendResult(interp,
+                    "error flushing bytecode stream: Tcl_Flush: ",
+                    Tcl_PosixError(interp),
+                    (char *) NULL);
+            result = TCL_ERROR;
+        }
     }
-    Tcl_DStringAppend(&ds, procName, -1);
-
-    Tcl_CreateCommand(interp, Tcl_DStringValue(&ds), InterpProc,
-	    (ClientData) procPtr, ProcDeleteProc);
-    cmd = Tcl_CreateObjCommand(interp, Tcl_DStringValue(&ds),
-	    TclObjInterpProc, (ClientData) procPtr, ProcDeleteProc);
-     */
+    PhaseLeave(savedPhase);
 
-    /*
-     * Make sure that the temporary name is not already used
-     */
+    Tcl_DecrRefCount(chunkObjPtr);
+    Tcl_DStringFree(&pending);
+    return result;
+}
 
-    do {
-        sprintf(cmdNameBuf, dummyCommandName, dummyCommandCounter);
-        cmd = Tcl_FindCommand(interp, dummyCommandName,
-                (Tcl_Namespace *) NULL, TCL_GLOBAL_ONLY);
-        dummyCommandCounter += 1;
-    } while (cmd != (Tcl_Command) NULL);
+/*
+ *----------------------------------------------------------------------
+ *
+ * SaveLiteralTable --
+ *
+ *  Saves the literal table of the interpreter into a buffer, and
+ *  reinitializes it for the compiler. This prevents interference between
+ *  the application running the compiler and the compiler itself.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  The interpreter gets an empty literal table, until the saved one is
+ *  put back with RestoreLiteralTable.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    Tcl_CreateCommand(interp, cmdNameBuf, (Tcl_CmdProc*) DummyInterpProc,
-            (ClientData) procPtr, CmpDeleteProc);
-    cmd = Tcl_CreateObjCommand(interp, cmdNameBuf,
-            DummyObjInterpProc, (ClientData) procPtr, CmpDeleteProc);
-    if (cmd == (Tcl_Command) NULL) {
-        result = TCL_ERROR;
-        goto cleanAndReturn;
-    }
+static void
+SaveLiteralTable(iPtr, savePtr)
+    Interp *iPtr;		/* the interpreter */
+    LiteralTable *savePtr;	/* the save buffer */
+{
+    memcpy (savePtr,
+	    &iPtr->literalTable,
+	    sizeof(LiteralTable));
 
-    /*
-     * Now initialize the new procedure's cmdPtr field. This will be used
-     * later when the procedure is called to determine what namespace the
-     * procedure will run in. This will be different than the current
-     * namespace if the proc was renamed into a different namespace.
+    /* Inlined copy of "TclInitLiteralTable (&iPtr->literalTable);"
+     * This function is not in the stub table of Tcl, not even in
+     * the internal one. This causes link problems.
      */
+#define REBUILD_MULTIPLIER	3
 
-    procPtr->cmdPtr = (Command *) cmd;
+    iPtr->literalTable.buckets = iPtr->literalTable.staticBuckets;
+    iPtr->literalTable.staticBuckets[0] = iPtr->literalTable.staticBuckets[1] = 0;
+    iPtr->literalTable.staticBuckets[2] = iPtr->literalTable.staticBuckets[3] = 0;
+    iPtr->literalTable.numBuckets = TCL_SMALL_HASH_TABLE;
+    iPtr->literalTable.numEntries = 0;
+    iPtr->literalTable.rebuildSize = TCL_SMALL_HASH_TABLE*REBUILD_MULTIPLIER;
+    iPtr->literalTable.mask = 3;
+}
 
-    /*
-     * At this stage, we are ready to compile the procedure body.
-     * Much of this code is derived from TclObjInterpProc.
-     *
-     * We force a recompilation of the body, even if the body is already
-     * of bytecode type.
-     */
-
-    if (bodyPtr->typePtr) {
-        bodyPtr->typePtr->freeIntRepProc(bodyPtr);
-        bodyPtr->typePtr = (Tcl_ObjType *) NULL;
-    }
-
-    saveProcPtr = iPtr->compiledProcPtr;
-    iPtr->compiledProcPtr = procPtr;
-    result = cmpByteCodeType->setFromAnyProc(interp, bodyPtr);
-    iPtr->compiledProcPtr = saveProcPtr;
-
-    if (result != TCL_OK) {
-        if (result == TCL_ERROR) {
-            char buf[100];
-            int numChars;
-            char *ellipsis;
-
-            /*
-             * Prepend the procedure name to the error object
-             */
-
-            sprintf(buf, "compilation of procedure \"%s\" failed: ", fullName);
-            PrependResult(interp, buf);
-
-            numChars = strlen(fullName);
-            ellipsis = "";
-            if (numChars > 50) {
-                numChars = 50;
-                ellipsis = "...";
-            }
-            sprintf(buf, "\n    (compiling body of proc \"%.*s%s\", line %d)",
-                    numChars, fullName, ellipsis, ERRORLINE(interp));
-            Tcl_AddObjErrorInfo(interp, buf, -1);
-	    }
-        goto cleanAndReturn;
-    }
-
-    ctxPtr->numCompiledBodies += 1;
-
-    /*
-     * Now that we have compiled the procedure, create a new TCL object
-     * containing both the bytecodes and the info stored in the Proc struct.
-     * this info is usually generated at run time during the compilation of
-     * the procedure body, but of course this won't be possible in our case
-     * (the body is already compiled). So, we use this strategy:
-     *   1. compile the body, then save the relevant parts of Proc into a
-     *      procbody object. This object replaces the proc body object
-     *      in the object table.
-     *   2. tweak the name of the command to call from "proc" to
-     *      "loader::bcproc". This is our version of "proc" that knows how
-     *      to reconstruct the Proc struct from the TclProProcBody object.
-     *
-     * Note: 8.0.3 interpreters don't define a "procbody" object, so that the
-     * writer/reader code used to create instances of "TclProProcBody". These
-     * objects are the same as "procbody", but provided by the compiler;
-     * because the layout in the .tbc file (and the internal representation)
-     * are the same, we no longer create "TclProProcBody" objects, but rather
-     * "procbody". The tbcload package, on the other hand, still contains
-     * support for "TclProProcBody" so that it can be loaded in a 8.0.3
-     * interpreter.
-     */
-
-    procObjPtr = TclNewProcBodyObj(procPtr);
-    Tcl_IncrRefCount(procObjPtr);
-    compEnvPtr->literalArrayPtr[infoPtr->bodyNewIndex].objPtr = procObjPtr;
-    Tcl_DecrRefCount(bodyPtr);
-
-    cleanAndReturn:
-    if (argArray != NULL) {
-        ckfree((char *) argArray);
-    }
-    if (cmd) {
-        /*
-         * This will delete the Proc struct
-         */
-
-        Tcl_DeleteCommand(interp, cmdNameBuf);
-    } else {
-        TclProcCleanupProc(procPtr);
-    }
-
-    return result;
-}
-
 /*
  *----------------------------------------------------------------------
  *
- * DummyInterpProc --
+ * RestoreLiteralTable --
  *
- *  Dummy, used to supply a nonzero value to the dummyCommand object.
+ *  Restores the interpreter literals saved by SaveLiteralTable. Can't
+ *  delete the transient table, causes crashes.
  *
  * Results:
- *  Returns TCL_OK.
+ *  None.
  *
  * Side effects:
  *  None.
@@ -3211,187 +4666,372 @@ CompileOneProcBody(interp, infoPtr, ctxPtr, compEnvPtr)
  *----------------------------------------------------------------------
  */
 
-static int
-DummyInterpProc(clientData, interp, argc, argv)
-    ClientData clientData;	/* context, unused */
-    Tcl_Interp *interp;		/* current interpreter, unused */
-    int argc;			/* argument count, unused */
-    char *argv[];		/* arguments, unused */
+static void
+RestoreLiteralTable(iPtr, savePtr)
+    Interp *iPtr;		/* the interpreter */
+    LiteralTable *savePtr;	/* the save buffer */
 {
-    return TCL_OK;
+    /* ** TclDeleteLiteralTable (interp,&iPtr->literalTable); ** */
+    memcpy (&iPtr->literalTable,
+	    savePtr,
+	    sizeof(LiteralTable));
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * DummyObjInterpProc --
+ * Compiler_CompileObj --
  *
- *  Dummy, used to supply a nonzero value to the dummyCommand object.
+ *  Compile Tcl commands stored in a Tcl object. These commands are
+ *  compiled into bytecodes.
+ *
+ *  Scarfed from Tcl_EvalObj, where we run the compilation step but not
+ *  the execution step.
  *
  * Results:
- *  Returns TCL_OK.
+ *  The return value is one of the return codes defined in tcl.h
+ *  (such as TCL_OK), and the interpreter's result contains a value
+ *  to supplement the return code.
  *
  * Side effects:
- *  None.
+ *  The object is converted to a ByteCode object that holds the bytecode
+ *  instructions for the commands.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-DummyObjInterpProc(clientData, interp, objc, objv)
-    ClientData clientData;	/* Record describing procedure to be
-                                 * interpreted. */
-    Tcl_Interp *interp;		/* Interpreter in which procedure was
-                                 * invoked. */
-    int objc;			/* Count of number of arguments to this
-                                 * procedure. */
-    Tcl_Obj *CONST objv[];	/* Argument value objects. */
+int
+Compiler_CompileObj(interp, objPtr)
+    Tcl_Interp *interp;		/* Token for command interpreter
+                                 * (returned by a previous call to
+                                 * Tcl_CreateInterp). */
+    Tcl_Obj *objPtr;		/* Pointer to object containing
+                                 * commands to compile. */
 {
-    return TCL_OK;
+    return Compiler_CompileObjEx(interp, objPtr, 0);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CmpDeleteProc --
- *
- *  From ProcDeleteProc in tclProc.c; the rest of the header is the one for
- *  ProcDeleteProc.
+ * Compiler_CompileObjEx --
  *
- *  This procedure is invoked just before a command procedure is
- *  removed from an interpreter.  Its job is to release all the
- *  resources allocated to the procedure.
+ *  Like Compiler_CompileObj, with an additional set of COMPILER_* flags.
+ *  Of these, only COMPILER_OPTIMIZE affects the compilation itself; the
+ *  others select the layout of the compiled script when it is emitted.
  *
  * Results:
- *  None.
+ *  The return value is one of the return codes defined in tcl.h
+ *  (such as TCL_OK), and the interpreter's result contains a value
+ *  to supplement the return code.
  *
  * Side effects:
- *  Memory gets freed, unless the procedure is actively being
- *  executed.  In this case the cleanup is delayed until the
- *  last call to the current procedure completes.
+ *  The object is converted to a ByteCode object that holds the bytecode
+ *  instructions for the commands.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-CmpDeleteProc(clientData)
-    ClientData clientData;		/* Procedure to be deleted. */
+int
+Compiler_CompileObjEx(interp, objPtr, flags)
+    Tcl_Interp *interp;		/* Token for command interpreter
+                                 * (returned by a previous call to
+                                 * Tcl_CreateInterp). */
+    Tcl_Obj *objPtr;		/* Pointer to object containing
+                                 * commands to compile. */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
 {
-    Proc *procPtr = (Proc *) clientData;
+    Interp *iPtr = (Interp *) interp;
+    ByteCode* codePtr;		/* Tcl Internal type of bytecode. */
+    int result = TCL_OK;
 
-    procPtr->refCount--;
-    if (procPtr->refCount <= 0) {
-        TclProcCleanupProc(procPtr);
+    /*
+     * If the interpreter has been deleted, return an error.
+     */
+
+    if (iPtr->flags & DELETED) {
+        Tcl_ResetResult(interp);
+        Tcl_AppendToObj(Tcl_GetObjResult(interp),
+                "attempt to call compile in deleted interpreter", -1);
+        Tcl_SetErrorCode(interp, "COMPILER", "COMPILE",
+                "attempt to call compile in deleted interpreter",
+                (char *) NULL);
+        return TCL_ERROR;
+    }
+
+    /*
+     * We force a recompilation even though this object may already be
+     * compiled. However, we do not attempt to recompile an object that had
+     * been generated from a compiled script.
+     */
+
+    if (objPtr->typePtr == cmpByteCodeType) {
+        codePtr = (ByteCode *) objPtr->internalRep.otherValuePtr;
+
+        if (codePtr->flags & TCL_BYTECODE_PRECOMPILED) {
+            return TCL_OK;
+        }
+
+        cmpByteCodeType->freeIntRepProc(objPtr);
+	objPtr->typePtr = (Tcl_ObjType *) NULL;
+    }
+    if (objPtr->typePtr != cmpByteCodeType) {
+        /*
+         * First reset any error line number information.
+         */
+
+#if (TCL_MAJOR_VERSION == 8) && (TCL_MINOR_VERSION < 6)
+        iPtr->errorLine = 1;   /* no correct line # information yet */
+#else
+	Tcl_SetErrorLine(interp, 1);
+#endif
+        result = CompileObject(interp, objPtr, flags);
     }
+
+    return result;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * UnshareProcBodies --
+ * EmitCompiledObject --
  *
- *  If any of the procedure bodies are shared, create duplicate objects so
- *  that they are no longer shared. The index to the new object is stored in
- *  the info structs for later use by the compilation procedure.
+ *  Emits the contents of a ByteCode structure to an EmitContext to generate
+ *  a TCL "object file".
+ *  There are three parts to the object file:
+ *   - a header containing information about the ByteCode structure.
+ *   - the dump of the bytecodes
+ *   - the dump of the support arrays; this includes the dump of all the
+ *     objects used by the byte code itself.
  *
  * Results:
- *  None.
+ *  Returns a TCL result code.
  *
  * Side effects:
- *  May add objects to the object table for the compilation environment.
- *  Panics on error.
+ *  Appends an error message to the TCL error.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-UnshareProcBodies(interp, ctxPtr, compEnvPtr)
-    Tcl_Interp *interp;		/* the active interpreter */
-    CompilerContext *ctxPtr;	/* compiler context struct, contains
-                                 * the post-processing info struct */
-    CompileEnv *compEnvPtr;	/* the compilation environment to
-                                 * postprocess */
+static int
+EmitCompiledObject(interp, objPtr, emitPtr)
+    Tcl_Interp *interp;		/* Token for command interpreter
+                                 * (returned by a previous call to
+                                 * Tcl_CreateInterp). */
+    Tcl_Obj *objPtr;		/* Pointer to the object whose bytecode
+                                 * structure is to be written to file */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
 {
-    PostProcessInfo *infoPtr = ctxPtr->ppi;
-    ProcBodyInfo **infoArrayPtr;
-    ProcBodyInfo *bodyInfoPtr;
-    int origIndex;
-    Tcl_HashTable *objTablePtr;
-    Tcl_HashEntry *entryPtr;
-    ObjRefInfo *refInfoPtr;
+    if ((EmitScriptPreamble(interp, PREAMBLE_SCRIPT, emitPtr) != TCL_OK)
+            || (EmitSignature(interp, emitPtr) != TCL_OK)) {
+        return TCL_ERROR;
+    }
 
-    infoPtr->numUnshares = 0;
+    if (EmitByteCode(interp, (ByteCode *) objPtr->internalRep.otherValuePtr,
+            emitPtr) != TCL_OK) {
+        PrependResult(interp, "error writing bytecode stream: ");
+        return TCL_ERROR;
+    }
 
-    if (infoPtr->numProcs < 1) {
-        return;
+    if (EmitScriptPostamble(interp, emitPtr) != TCL_OK) {
+        return TCL_ERROR;
     }
 
-    objTablePtr = &infoPtr->objTable;
-    for (infoArrayPtr=infoPtr->infoArrayPtr ; *infoArrayPtr ; infoArrayPtr++) {
-        bodyInfoPtr = *infoArrayPtr;
-        origIndex = bodyInfoPtr->bodyOrigIndex;
-        if (origIndex != -1) {
-            entryPtr = Tcl_FindHashEntry(objTablePtr, (char *) origIndex);
-            if (!entryPtr) {
-                panic("UnshareProcBodies: no ObjRefInfo entry in objTable!");
-            }
-            refInfoPtr = (ObjRefInfo *) Tcl_GetHashValue(entryPtr);
+    if (EmitFlushContext(interp, emitPtr) != TCL_OK) {
+        PrependResult(interp, "error writing bytecode stream: ");
+        return TCL_ERROR;
+    }
 
-            if (refInfoPtr->numReferences < 2) {
-                /*
-                 * Not a shared object, but we still need to remove
-		 * the object from the literal hash table so it
-		 * doesn't show up as a local literal without a global.
-                 */
+    if ((emitPtr->target != NULL) && (Tcl_Flush(emitPtr->target) != TCL_OK)) {
+        Tcl_AppendResult(interp,
+                "error flushing bytecode stream: Tcl_Flush: ",
+                Tcl_PosixError(interp),
+                (char *) NULL);
+        return TCL_ERROR;
+    }
 
-		TclHideLiteral(interp, compEnvPtr, bodyInfoPtr->bodyNewIndex);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitByteCode --
+ *
+ *  Emits the contents of a ByteCode structure to an EmitContext.
+ *  There are three parts to the dumped information:
+ *   - a header containing information about the ByteCode structure.
+ *   - the dump of the bytecodes
+ *   - the dump of the support arrays; this includes the dump of all the
+ *     objects used by the byte code itself.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-                continue;
-            }
+static int
+EmitByteCode(interp, codePtr, emitPtr)
+    Tcl_Interp *interp;		/* the current interpreter */
+    ByteCode *codePtr;		/* Pointer to the ByteCode structure to be
+                                 * emitted */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
+{
+    LocMapSizes locMapSizes;
+    LiteralMap litMap;
+    Tcl_WideInt start, counted;
+    int emitSrcMap, savedPhase;
 
-            /*
-             * If the only sharing is among procedure bodies, then we can
-             * copy N - 1 objects, and compile one in place.
-             * But if at least one other entity is sharing, then we must
-             * unshare all the procedure bodies.
-             */
+    /*
+     * The source maps are only useful to a loader when the script source is
+     * shipped alongside; COMPILER_NO_SRCMAP drops them, as if the compiler
+     * had been built without EMIT_SRCMAP.
+     */
 
-            if ((refInfoPtr->numReferences == refInfoPtr->numProcReferences)
-                    && (refInfoPtr->numUnshares < 1)) {
-                /*
-                 * do not copy the first occurrence, just remove it from
-		 * the global and local literal hash tables
-                 */
+#if EMIT_SRCMAP
+    emitSrcMap = !(emitPtr->flags & COMPILER_NO_SRCMAP);
+#else
+    emitSrcMap = 0;
+#endif
 
-		TclHideLiteral(interp, compEnvPtr, bodyInfoPtr->bodyNewIndex);
-                refInfoPtr->numUnshares = 1;
-            } else {
-		/* (xxxx) */
+    /*
+     * Emit the sizes of the various components of the ByteCode struct,
+     * so that the size can be recalculated at read time.
+     * These fields are currently written out as 0 always:
+     * numSrcChars
+     */
 
-                bodyInfoPtr->bodyNewIndex
-                    = UnshareObject(origIndex, compEnvPtr);
-                refInfoPtr->numUnshares += 1;
-                infoPtr->numUnshares += 1;
-                ctxPtr->numUnshares += 1;
-            }
+    savedPhase = PhaseEnter(COMPILER_PHASE_EMIT_LITERALS);
+    CompactLiterals(codePtr, emitPtr->flags, &litMap);
+    PhaseEnter(COMPILER_PHASE_EMIT);
+    CalculateLocMapSizes(codePtr, &locMapSizes);
+    StatsAddByteCode(codePtr, &litMap);
 
-            if (refInfoPtr->numUnshares == 1) {
-                ctxPtr->numUnsharedBodies += 1;
-            }
+    if ((EmitInteger(interp, codePtr->numCommands, ' ', emitPtr) != TCL_OK)
+            || (EmitInteger(interp, 0, ' ', emitPtr)
+                    != TCL_OK) /* numSrcChars */
+            || (EmitInteger(interp, codePtr->numCodeBytes, ' ', emitPtr)
+                    != TCL_OK)
+            || (EmitInteger(interp, litMap.numLitObjects, ' ', emitPtr)
+                    != TCL_OK)
+            || (EmitInteger(interp, codePtr->numExceptRanges, ' ', emitPtr)
+                    != TCL_OK)
+            || (EmitInteger(interp, codePtr->numAuxDataItems, ' ', emitPtr)
+                    != TCL_OK)
+            || (EmitInteger(interp, codePtr->numCmdLocBytes, ' ', emitPtr)
+                    != TCL_OK)
+            || (EmitInteger(interp, codePtr->maxExceptDepth, ' ', emitPtr)
+                    != TCL_OK)
+            || (EmitInteger(interp, codePtr->maxStackDepth, ' ', emitPtr)
+                    != TCL_OK)) {
+        goto error;
+    }
+
+    if (emitSrcMap) {
+        if ((EmitInteger(interp, locMapSizes.codeDeltaSize, ' ', emitPtr)
+                        != TCL_OK)
+                || (EmitInteger(interp, locMapSizes.codeLengthSize, ' ',
+                        emitPtr) != TCL_OK)
+                || (EmitInteger(interp, locMapSizes.srcDeltaSize, ' ',
+                        emitPtr) != TCL_OK)
+                || (EmitInteger(interp, locMapSizes.srcLengthSize, '\n',
+                        emitPtr) != TCL_OK)) {
+            goto error;
+        }
+    } else {
+        if ((EmitInteger(interp, locMapSizes.codeDeltaSize, ' ', emitPtr)
+                        != TCL_OK)
+                || (EmitInteger(interp, locMapSizes.codeLengthSize, ' ',
+                        emitPtr) != TCL_OK)
+                || (EmitInteger(interp, -1, ' ', emitPtr) != TCL_OK)
+                || (EmitInteger(interp, -1, '\n', emitPtr) != TCL_OK)) {
+            goto error;
         }
     }
+
+    /*
+     * The byte code dumps
+     */
+
+    PhaseEnter(COMPILER_PHASE_EMIT_CODE);
+    start = EmitTell(emitPtr);
+    if (EmitByteSequence(interp, litMap.codeStart, codePtr->numCodeBytes,
+            emitPtr) != TCL_OK) {
+        goto error;
+    }
+    PhaseAddBytes(COMPILER_PHASE_EMIT_CODE, EmitTell(emitPtr) - start);
+
+    PhaseEnter(COMPILER_PHASE_EMIT_LOCMAP);
+    start = EmitTell(emitPtr);
+    if ((EmitByteSequence(interp, codePtr->codeDeltaStart,
+            locMapSizes.codeDeltaSize, emitPtr) != TCL_OK)
+            || (EmitByteSequence(interp, codePtr->codeLengthStart,
+                    locMapSizes.codeLengthSize, emitPtr) != TCL_OK)) {
+        goto error;
+    }
+    if (emitSrcMap
+            && ((EmitByteSequence(interp, codePtr->srcDeltaStart,
+                    locMapSizes.srcDeltaSize, emitPtr) != TCL_OK)
+                || (EmitByteSequence(interp, codePtr->srcLengthStart,
+                        locMapSizes.srcLengthSize, emitPtr) != TCL_OK))) {
+        goto error;
+    }
+
+    PhaseAddBytes(COMPILER_PHASE_EMIT_LOCMAP, EmitTell(emitPtr) - start);
+
+    /*
+     * the support arrays; the literals may hold nested ByteCodes, which
+     * account for their own sections.
+     */
+
+    PhaseEnter(COMPILER_PHASE_EMIT_LITERALS);
+    start = EmitTell(emitPtr);
+    counted = PhaseCountedBytes();
+    if (EmitObjArray(interp, &litMap, emitPtr) != TCL_OK) {
+        goto error;
+    }
+    PhaseAddBytes(COMPILER_PHASE_EMIT_LITERALS, EmitTell(emitPtr) - start
+            - (PhaseCountedBytes() - counted));
+
+    PhaseEnter(COMPILER_PHASE_EMIT_EXCRANGES);
+    start = EmitTell(emitPtr);
+    if (EmitExcRangeArray(interp, codePtr, emitPtr) != TCL_OK) {
+        goto error;
+    }
+    PhaseAddBytes(COMPILER_PHASE_EMIT_EXCRANGES, EmitTell(emitPtr) - start);
+
+    PhaseEnter(COMPILER_PHASE_EMIT_AUXDATA);
+    start = EmitTell(emitPtr);
+    if (EmitAuxDataArray(interp, codePtr, emitPtr) != TCL_OK) {
+        goto error;
+    }
+    PhaseAddBytes(COMPILER_PHASE_EMIT_AUXDATA, EmitTell(emitPtr) - start);
+
+    FreeLiteralMap(codePtr, &litMap);
+    PhaseLeave(savedPhase);
+    return TCL_OK;
+
+    error:
+    FreeLiteralMap(codePtr, &litMap);
+    PhaseLeave(savedPhase);
+    return TCL_ERROR;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * UnshareObject --
+ * EmitChar --
  *
- *  Creates a copy of an object, and adds it to the object table for the
- *  compilation environment.
+ *  Emits a character value to an EmitContext.
+ *  The separator argument specifies a character to be emitted after the
+ *  integer.
  *
  * Results:
- *  Returns the index to the newly created object.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
  *  None.
@@ -3400,951 +5040,5432 @@ UnshareProcBodies(interp, ctxPtr, compEnvPtr)
  */
 
 static int
-UnshareObject(origIndex, compEnvPtr)
-    int origIndex;		/* the index in the object array of the
-                                 * object to duplicate */
-    CompileEnv *compEnvPtr;	/* the compilation environment to
-                                 * postprocess */
+EmitChar(interp, value, separator, emitPtr)
+    Tcl_Interp *interp;		/* the current interpreter */
+    char value;			/* the value to emit */
+    char separator;		/* the separator character */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
 {
-    return TclAddLiteralObj(compEnvPtr,
-	    Tcl_DuplicateObj(compEnvPtr->literalArrayPtr[origIndex].objPtr),
-	    NULL);
+    if (EmitReserve(interp, emitPtr, 2) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    emitPtr->curPtr[0] = value;
+    emitPtr->curPtr[1] = separator;
+    emitPtr->curPtr += 2;
+
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * UpdateByteCodes --
+ * EmitInteger --
  *
- *  If any of the procedure bodies have been compiled, or have been unshared
- *  (if they are unshared then they also were compiled), we need to modify the
- *  bytecodes so that the correct object index is pushed on the stack.
- *  There are two cases where we need to modify the bytecodes:
- *    1. A procedure body that has been compiled is stored as a TclProBodyType
- *       Tcl_Obj; this is an object that contains the ByteCode, and also some
- *       fields from the Proc struct, which need to be loaded at runtime
- *       (they cannot be regenerated at runtime because the body is already
- *       compiled, and the compiler does that work at runtime). In this case,
- *       we need to push the name of the loader package's bcproc command,
- *       which is a modified version of proc which knows how to handle the
- *       TclProBodyType object.
- *    2. If the body has been unshared, we have to make sure the the correct
- *       index in the object table is used; the original one refers to the
- *       shared object.
+ *  Emits an integer value to an EmitContext.
+ *  The separator argument specifies a character to be emitted after the
+ *  integer.
  *
  * Results:
- *  None.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
- *  May modify the bytecodes, possibly reallocating the bytecode array; may
- *  also modify support data structures in the compilation environment.
- *  Panics on error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-UpdateByteCodes(infoPtr, compEnvPtr)
-    PostProcessInfo *infoPtr;	/* postprocess info, contains the list of
-                                 * calls to "proc" */
-    CompileEnv *compEnvPtr;	/* the compilation environment to
-                                 * postprocess */
+static int
+EmitInteger(interp, value, separator, emitPtr)
+    Tcl_Interp *interp;		/* the current interpreter */
+    int value;			/* the value to emit */
+    char separator;		/* the separator character */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
 {
-    ProcBodyInfo **infoArrayPtr;
-    ProcBodyInfo *bodyInfoPtr;
-    int newIndex;
-    unsigned char *pc;
-    int offset, delta;
-    int procNameObjIndex;
-    Tcl_Obj *objPtr;
-
-    if (infoPtr->numCompiledBodies == 0) {
-        return;
-    }
+    char buf[16];
+    char *p = buf + sizeof(buf);
+    unsigned int u = (value < 0) ? -(unsigned int) value : (unsigned int) value;
 
     /*
-     * Some bodies were compiled: create a new string object containing the
-     * name of the loader package's proc command, add it to the object table,
-     * and use its index as the operand to the first PUSH instruction.
+     * Format the digits right to left, equivalent to sprintf("%d").
      */
 
-    objPtr = Tcl_NewObj();
-    Tcl_IncrRefCount(objPtr);
-    Tcl_AppendStringsToObj(objPtr, loaderName, "::", procCommand, NULL);
-    procNameObjIndex = TclAddLiteralObj(compEnvPtr, objPtr, NULL);
-    Tcl_DecrRefCount(objPtr);
+    do {
+        *(--p) = (char) ('0' + (u % 10));
+        u /= 10;
+    } while (u != 0);
+    if (value < 0) {
+        *(--p) = '-';
+    }
 
-#ifdef DEBUG_REWRITE
-    fprintf (stdout,"tbcload::bcproc @ %d\n",procNameObjIndex);fflush(stdout);
-#endif
-    if (procNameObjIndex >= 255) {
-	/*
-	 * This literal index signals that all the primary INST_PUSH
-	 * instructions (for the proc command name) will be rewritten from
-	 * push1 to push4, growing the bytecode (by 3 bytes per compiled
-	 * procedure). This means that any JUMP instructions around procedure
-	 * definitions require updates to their offsets to avoid having them
-	 * jumping into the middle of an instruction. Assuming that there are
-	 * jump instructions.
-	 *
-	 * The easiest way of doing that is to not only record where all jump
-	 * instructions are, but to rewrite them all to jump4. Otherwise we
-	 * would have to do some iterative rewriting where changing the offset
-	 * of a jump makes it larger, forcing more jump instructions to be
-	 * rewritten. It is likely easier to simply convert them all to the
-	 * large form.
-	 *
-	 * First we have to scan the bytecode and check if there are jump
-	 * instructions. If not then there is no need to run the complex jump
-	 * compensation code and the regular rewrite below (at %%%%) is fine.
-	 *
-	 * If jump instructions are present we have to scan a second time,
-	 * recording where all instructions are, and how much they are shifted
-	 * by instruction expansion, applied to _ALL_ jump and push
-	 * instructions. Then we scan a third time and build the expanded
-	 * bytecode, compensating for the shift in all jump instructions. This
-	 * includes updating all the auxiliary structures recording
-	 * instruction offsets and size.
-	 *
-	 * At last the expanded bytecode goes into the regular rewrite at
-	 * (%%%%). There no expansion will happen any longer, as all the
-	 * relevant instructions are already in their push4 forms, and any
-	 * jump offsets are corrected already as well.
+    if (EmitReserve(interp, emitPtr, (buf + sizeof(buf) - p) + 1) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    memcpy(emitPtr->curPtr, p, (size_t) (buf + sizeof(buf) - p));
+    emitPtr->curPtr += buf + sizeof(buf) - p;
+    if (separator != '\0') {
+        *(emitPtr->curPtr++) = separator;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitString --
+ *
+ *  Emits a string value to an EmitContext.
+ *  If the length is passed as -1, it is calculated with strlen.
+ *  The separator argument specifies a character to be emitted after the
+ *  string.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitString(interp, src, length, separator, emitPtr)
+    Tcl_Interp *interp;		/* the current TCL interpreter */
+    char *src;			/* the string to emit */
+    int length;			/* the length of the string to emit */
+    char separator;		/* the separator character */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
+{
+    if (length < 0) {
+        length = strlen(src);
+    }
+
+    if (EmitBytes(interp, src, length, emitPtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (separator != '\0') {
+        if (EmitReserve(interp, emitPtr, 1) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        *(emitPtr->curPtr++) = separator;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitBytes --
+ *
+ *  Emits a sequence of bytes, as is, to an EmitContext.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitBytes(interp, src, length, emitPtr)
+    Tcl_Interp *interp;		/* the current TCL interpreter */
+    CONST char *src;		/* the bytes to emit */
+    int length;			/* how many bytes to emit */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
+{
+    int toCopy;
+
+    while (length > 0) {
+        if (EmitReserve(interp, emitPtr, 1) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        /*
+         * Large blocks are copied in pieces when writing to a channel, so
+         * that the buffer does not have to grow beyond its initial size.
+         */
+
+        toCopy = emitPtr->endPtr - emitPtr->curPtr;
+        if (toCopy > length) {
+            toCopy = length;
+        } else if (emitPtr->target == NULL) {
+            if (EmitReserve(interp, emitPtr, length) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            toCopy = length;
+        }
+
+        memcpy(emitPtr->curPtr, src, (size_t) toCopy);
+        emitPtr->curPtr += toCopy;
+        src += toCopy;
+        length -= toCopy;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitInitContext --
+ *
+ *  Initialize an EmitContext struct. If 'target' is NULL, the output is
+ *  accumulated in memory, otherwise it is written out to the channel
+ *  whenever the buffer fills up, and by EmitFlushContext.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Allocates the output buffer; it is released by EmitFreeContext.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+EmitInitContext(target, emitPtr)
+    Tcl_Channel target;		/* the target channel, or NULL */
+    EmitContext *emitPtr;	/* pointer to the context to initialize */
+{
+    emitPtr->target = target;
+    emitPtr->basePtr = ckalloc(EMIT_BUFFER_SIZE);
+    emitPtr->curPtr = emitPtr->basePtr;
+    emitPtr->endPtr = emitPtr->basePtr + EMIT_BUFFER_SIZE;
+    emitPtr->flags = 0;
+    emitPtr->numWritten = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitFreeContext --
+ *
+ *  Releases the output buffer of an EmitContext. Any output that was not
+ *  flushed is discarded.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+EmitFreeContext(emitPtr)
+    EmitContext *emitPtr;	/* the context to release */
+{
+    ckfree(emitPtr->basePtr);
+    emitPtr->basePtr = emitPtr->curPtr = emitPtr->endPtr = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitMakeRoom --
+ *
+ *  Makes room for at least 'size' bytes in the output buffer of an
+ *  EmitContext. The buffer is written out to the target channel if there
+ *  is one, and grown if it still cannot hold the request. Called through
+ *  the EmitReserve macro.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR if the write failed.
+ *
+ * Side effects:
+ *  May reallocate the buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitMakeRoom(interp, emitPtr, size)
+    Tcl_Interp *interp;		/* the current TCL interpreter */
+    EmitContext *emitPtr;	/* the context */
+    int size;			/* how many bytes are needed */
+{
+    int used, allocated;
+
+    if ((emitPtr->target != NULL)
+            && (EmitFlushContext(interp, emitPtr) != TCL_OK)) {
+        return TCL_ERROR;
+    }
+
+    used = emitPtr->curPtr - emitPtr->basePtr;
+    allocated = emitPtr->endPtr - emitPtr->basePtr;
+    if (allocated - used >= size) {
+        return TCL_OK;
+    }
+
+    while (allocated - used < size) {
+        allocated *= 2;
+    }
+    emitPtr->basePtr = ckrealloc(emitPtr->basePtr, (unsigned) allocated);
+    emitPtr->curPtr = emitPtr->basePtr + used;
+    emitPtr->endPtr = emitPtr->basePtr + allocated;
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitFlushContext --
+ *
+ *  Writes out the buffered output of an EmitContext to its target channel.
+ *  Does nothing for an in-memory context.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  Empties the output buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitFlushContext(interp, emitPtr)
+    Tcl_Interp *interp;		/* the current TCL interpreter */
+    EmitContext *emitPtr;	/* the context to flush */
+{
+    int toWrite = emitPtr->curPtr - emitPtr->basePtr;
+
+    if ((emitPtr->target == NULL) || (toWrite == 0)) {
+        return TCL_OK;
+    }
+
+    if (Tcl_Write(emitPtr->target, emitPtr->basePtr, toWrite) < 0) {
+        Tcl_AppendResult(interp, "Tcl_Write: ", Tcl_PosixError(interp),
+                (char *) NULL);
+        return TCL_ERROR;
+    }
+    emitPtr->numWritten += toWrite;
+    emitPtr->curPtr = emitPtr->basePtr;
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitByteSequence --
+ *
+ *  Emits an array of bytes to an EmitContext, in ASCII85.
+ *  This procedure encodes its input with a modified version of the ASCII85
+ *  encode filter.
+ *  There are two differences from the standard ASCII85 algorithm:
+ *	- the encoding characters are obtained from a table rather than
+ *	  being generated arithmetically. This is done because we want to
+ *	  avoid using Tcl special characters.
+ *	- the order in which bytes in a 4-tuple are encoded is the opposite
+ *	  of the standard order. This lets us drop ! bytes in the encoded
+ *	  5-tuple, which buys us better encoding with short strings.
+ *  As a consequence, this encoder is not general purpose; only a similarly
+ *  specialized decoder can extract the bytes back.
+ *
+ *  The format is a line containing the byte count, then lines each containing
+ *  72 ASCII characters, or fewer for the last line.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitByteSequence(interp, bytesPtr, length, emitPtr)
+    Tcl_Interp *interp;		/* the current interpreter */
+    unsigned char *bytesPtr;	/* the sequence of bytes to write out */
+    int length;			/* how many bytes to write out */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
+{
+    unsigned char *endPtr = bytesPtr + length;
+    unsigned char *chunkEndPtr;
+    char *dstPtr;
+    unsigned int word;
+    int lineLength = 0;
+    int numBytes, i;
+    char toEmit[5];
+
+    if (EmitInteger(interp, length, '\n', emitPtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    /*
+     * Encode chunk by chunk, writing straight into the output buffer of the
+     * context. Each chunk is a multiple of 4 bytes, except for the last one.
+     */
+
+    while (bytesPtr < endPtr) {
+        chunkEndPtr = bytesPtr + ENCODE_CHUNK_SIZE;
+        if (chunkEndPtr > endPtr) {
+            chunkEndPtr = endPtr;
+        }
+        if (EmitReserve(interp, emitPtr,
+                ENCODED_MAX_SIZE(chunkEndPtr - bytesPtr)) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        dstPtr = emitPtr->curPtr;
+
+        while (bytesPtr < chunkEndPtr) {
+            /*
+             * The 4-tuple is read least significant byte first; a partial
+             * last tuple is zero padded.
+             */
+
+            numBytes = chunkEndPtr - bytesPtr;
+            if (numBytes >= 4) {
+                numBytes = 4;
+                word = (unsigned int) bytesPtr[0]
+                        | ((unsigned int) bytesPtr[1] << 8)
+                        | ((unsigned int) bytesPtr[2] << 16)
+                        | ((unsigned int) bytesPtr[3] << 24);
+            } else {
+                word = 0;
+                for (i=numBytes-1 ; i >= 0 ; i--) {
+                    word = (word << 8) | bytesPtr[i];
+                }
+            }
+            bytesPtr += numBytes;
+
+            if (word == 0) {
+                *dstPtr++ = 'z';
+                if (++lineLength == ENCODED_LINE_LENGTH) {
+                    *dstPtr++ = '\n';
+                    lineLength = 0;
+                }
+                continue;
+            }
+
+            /*
+             * We emit from least significant to most significant char, so
+             * that the 0 chars from an incomplete 4-tuple are the last ones
+             * in the sequence and can be omitted. Only 'numBytes+1' chars
+             * are emitted, the decoder reconstructs the missing '!'s.
+             */
+
+            toEmit[0] = EN(word % 85);
+            word /= 85;
+            toEmit[1] = EN(word % 85);
+            word /= 85;
+            toEmit[2] = EN(word % 85);
+            word /= 85;
+            toEmit[3] = EN(word % 85);
+            toEmit[4] = EN(word / 85);
+
+            if ((numBytes == 4)
+                    && (lineLength + 5 < ENCODED_LINE_LENGTH)) {
+                dstPtr[0] = toEmit[0];
+                dstPtr[1] = toEmit[1];
+                dstPtr[2] = toEmit[2];
+                dstPtr[3] = toEmit[3];
+                dstPtr[4] = toEmit[4];
+                dstPtr += 5;
+                lineLength += 5;
+            } else {
+                for (i=0 ; i <= numBytes ; i++) {
+                    *dstPtr++ = toEmit[i];
+                    if (++lineLength == ENCODED_LINE_LENGTH) {
+                        *dstPtr++ = '\n';
+                        lineLength = 0;
+                    }
+                }
+            }
+        }
+
+        emitPtr->curPtr = dstPtr;
+    }
+
+    /*
+     * The last line is always terminated, even if it is empty.
+     */
+
+    return EmitString(interp, "", 0, '\n', emitPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CalculateLocMapSizes --
+ *
+ *  Calculates the lengths of the location map arrays in a ByteCode
+ *  struct and places them in the LocMapSizes argument.
+ *  Note that, although it could use pointer arithmetic for all but the
+ *  last one (because the arrays are contiguous), we elect to do it by
+ *  scanning the arrays in all cases.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Fills in the fields of the LocMapSizes struct.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+CalculateLocMapSizes(codePtr, sizes)
+    ByteCode *codePtr;		/* The ByteCode for which we want to
+                                 * calculate lengths */
+    LocMapSizes *sizes;		/* Size struct to be filled in */
+{
+    /*
+     * EMIL for all but the last, we could do sanity checking by using
+     * pointer arithmetic.
+     */
+
+    sizes->codeDeltaSize = CalculateLocArrayLength(codePtr->codeDeltaStart,
+            codePtr->numCommands);
+    sizes->codeLengthSize = CalculateLocArrayLength(codePtr->codeLengthStart,
+            codePtr->numCommands);
+    sizes->srcDeltaSize = CalculateLocArrayLength(codePtr->srcDeltaStart,
+            codePtr->numCommands);
+    sizes->srcLengthSize = CalculateLocArrayLength(codePtr->srcLengthStart,
+            codePtr->numCommands);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CalculateLocArrayLength --
+ *
+ *  Calculates the length of the given location array; numCommands is the
+ *  number of commands in the ByteCode structure.
+ *
+ * Results:
+ *  Returns the length, in bytes, of the array.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+CalculateLocArrayLength(bytes, numCommands)
+    unsigned char* bytes;	/* the location array */
+    int numCommands;		/* count of commands in the bytecode */
+{
+    register int i;
+    int length = 0;
+
+    /*
+     * array is encoded as either a single byte, or a four-byte sequence
+     * preceded by the 0xff tag
+     */
+
+    for (i=0 ; i < numCommands ; i++) {
+        if (*bytes == 0xff) {
+            length += 5;
+            bytes += 5;
+        } else {
+            length += 1;
+            bytes += 1;
+        }
+    }
+
+    return length;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitObjArray --
+ *
+ *  Emits the object array for a ByteCode struct to an EmitContext, as
+ *  compacted by CompactLiterals.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitObjArray(interp, litMapPtr, emitPtr)
+    Tcl_Interp *interp;	/* the current interpreter */
+    LiteralMap *litMapPtr;	/* The literals of the ByteCode */
+    EmitContext *emitPtr;	/* The context to which the array is emitted */
+{
+    int i, result;
+    int numLitObjects = litMapPtr->numLitObjects;
+    Tcl_Obj **objArrayPtr = litMapPtr->objArrayPtr;
+
+    if (EmitInteger(interp, numLitObjects, '\n', emitPtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    for (i=0 ; i < numLitObjects ; i++) {
+        result = EmitObject(interp, objArrayPtr[i], emitPtr);
+        if (result != TCL_OK) {
+            return result;
+        }
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompactLiterals --
+ *
+ *  Computes the literals of a ByteCode as they are to be written out.
+ *  Literals that no push instruction references are dropped; these are
+ *  left behind when UpdateByteCodes redirects the push of a proc body or
+ *  of the "proc" command name. Literals that would be written out
+ *  identically are merged, except for compiled scripts and procedure
+ *  bodies, which must stay distinct objects. The push operands are
+ *  renumbered in a copy of the bytecodes; since the new indices are
+ *  never larger than the old ones, every operand still fits, and no
+ *  instruction changes size. The literals are left as they are unless
+ *  COMPILER_COMPACT_LITERALS is set.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Fills in the LiteralMap, which must be released with FreeLiteralMap.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CompactLiterals(codePtr, flags, mapPtr)
+    ByteCode *codePtr;		/* The ByteCode to compact */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+    LiteralMap *mapPtr;		/* Receives the compacted literals */
+{
+    InstructionDesc *opCodesTablePtr;
+    int numLitObjects = codePtr->numLitObjects;
+    unsigned char *codeEnd = codePtr->codeStart + codePtr->numCodeBytes;
+    unsigned char *pc;
+    int *newIndex;
+    Tcl_Obj **objArrayPtr;
+    Tcl_Obj *keyPtr;
+    Tcl_HashTable dupTable;
+    Tcl_HashEntry *entryPtr;
+    int i, index, isNew;
+    int numKept = 0;
+
+    mapPtr->numLitObjects = numLitObjects;
+    mapPtr->objArrayPtr = codePtr->objArrayPtr;
+    mapPtr->codeStart = codePtr->codeStart;
+
+    if ((numLitObjects == 0) || !(flags & COMPILER_COMPACT_LITERALS)) {
+        return;
+    }
+
+    /*
+     * Mark the literals referenced by the bytecodes. Leave everything
+     * as is if an operand is out of range.
+     */
+
+    opCodesTablePtr = (InstructionDesc *) TclGetInstructionTable();
+    newIndex = (int *) ckalloc(numLitObjects * sizeof(int));
+    for (i=0 ; i < numLitObjects ; i++) {
+        newIndex[i] = -1;
+    }
+    for (pc=codePtr->codeStart ; pc < codeEnd ;
+            pc += opCodesTablePtr[*pc].numBytes) {
+        if (*pc == INST_PUSH1) {
+            index = TclGetUInt1AtPtr(pc+1);
+        } else if (*pc == INST_PUSH4) {
+            index = TclGetUInt4AtPtr(pc+1);
+        } else {
+            continue;
+        }
+        if ((index < 0) || (index >= numLitObjects)) {
+            ckfree((char *) newIndex);
+            return;
+        }
+        newIndex[index] = 0;
+    }
+
+    /*
+     * Number the literals kept, in their original order.
+     */
+
+    objArrayPtr = (Tcl_Obj **) ckalloc(numLitObjects * sizeof(Tcl_Obj *));
+    Tcl_InitObjHashTable(&dupTable);
+    for (i=0 ; i < numLitObjects ; i++) {
+        if (newIndex[i] == -1) {
+            continue;
+        }
+        keyPtr = LiteralKey(codePtr->objArrayPtr[i], flags);
+        if (keyPtr != NULL) {
+            Tcl_IncrRefCount(keyPtr);
+            entryPtr = Tcl_CreateHashEntry(&dupTable, (char *) keyPtr,
+                    &isNew);
+            Tcl_DecrRefCount(keyPtr);
+            if (!isNew) {
+                newIndex[i] = PTR2INT(Tcl_GetHashValue(entryPtr));
+                continue;
+            }
+            Tcl_SetHashValue(entryPtr, INT2PTR(numKept));
+        }
+        newIndex[i] = numKept;
+        objArrayPtr[numKept] = codePtr->objArrayPtr[i];
+        numKept += 1;
+    }
+    Tcl_DeleteHashTable(&dupTable);
+
+    for (i=0 ; i < numLitObjects ; i++) {
+        if (newIndex[i] != i) {
+            break;
+        }
+    }
+    if (i == numLitObjects) {
+        ckfree((char *) objArrayPtr);
+        ckfree((char *) newIndex);
+        return;
+    }
+
+    /*
+     * Renumber the push operands in a copy of the bytecodes.
+     */
+
+    mapPtr->numLitObjects = numKept;
+    mapPtr->objArrayPtr = objArrayPtr;
+    mapPtr->codeStart = (unsigned char *) ckalloc(codePtr->numCodeBytes);
+    memcpy(mapPtr->codeStart, codePtr->codeStart,
+            (size_t) codePtr->numCodeBytes);
+
+    codeEnd = mapPtr->codeStart + codePtr->numCodeBytes;
+    for (pc=mapPtr->codeStart ; pc < codeEnd ;
+            pc += opCodesTablePtr[*pc].numBytes) {
+        if (*pc == INST_PUSH1) {
+            index = newIndex[TclGetUInt1AtPtr(pc+1)];
+            TclStoreInt1AtPtr(index, pc+1);
+        } else if (*pc == INST_PUSH4) {
+            index = newIndex[TclGetUInt4AtPtr(pc+1)];
+            TclStoreInt4AtPtr(index, pc+1);
+        }
+    }
+
+    ckfree((char *) newIndex);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LiteralKey --
+ *
+ *  Returns the key under which CompactLiterals merges a literal: its
+ *  string representation, prefixed by a character telling how it is
+ *  written out.
+ *
+ * Results:
+ *  A new object with a reference count of 0, or NULL if the literal is a
+ *  compiled script or a procedure body, which are never merged.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+LiteralKey(objPtr, flags)
+    Tcl_Obj *objPtr;		/* the literal */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+{
+    Tcl_Obj *keyPtr;
+    char *bytes;
+    char typeCode;
+    int length;
+
+    if ((objPtr->typePtr == cmpByteCodeType)
+            || (objPtr->typePtr == cmpProcBodyType)) {
+        return NULL;
+    }
+
+    typeCode = LiteralTypeCode(objPtr, flags);
+    keyPtr = Tcl_NewStringObj(&typeCode, 1);
+    bytes = Tcl_GetStringFromObj(objPtr, &length);
+    Tcl_AppendToObj(keyPtr, bytes, length);
+    return keyPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LiteralTypeCode --
+ *
+ *  Returns the type code under which a literal other than a compiled
+ *  script or procedure body is written out: CMP_INT_CODE or
+ *  CMP_DOUBLE_CODE if it has an integer or double internal rep, which the
+ *  loader then restores, else CMP_STRING_CODE. The internal rep depends on
+ *  what the literal was used for by earlier compiles sharing the literal
+ *  table, so COMPILER_DETERMINISTIC always selects CMP_STRING_CODE.
+ *
+ * Results:
+ *  The type code.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char
+LiteralTypeCode(objPtr, flags)
+    Tcl_Obj *objPtr;		/* the literal */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+{
+    if (flags & COMPILER_DETERMINISTIC) {
+        return CMP_STRING_CODE;
+    } else if (objPtr->typePtr == cmpIntType) {
+        return CMP_INT_CODE;
+    } else if (objPtr->typePtr == cmpDoubleType) {
+        return CMP_DOUBLE_CODE;
+    }
+    return CMP_STRING_CODE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeLiteralMap --
+ *
+ *  Releases the arrays of a LiteralMap filled in by CompactLiterals.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeLiteralMap(codePtr, mapPtr)
+    ByteCode *codePtr;		/* The ByteCode the map was computed for */
+    LiteralMap *mapPtr;		/* The map to release */
+{
+    if (mapPtr->codeStart != codePtr->codeStart) {
+        ckfree((char *) mapPtr->codeStart);
+    }
+    if (mapPtr->objArrayPtr != codePtr->objArrayPtr) {
+        ckfree((char *) mapPtr->objArrayPtr);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitObject --
+ *
+ *  Emits a Tcl_Obj to an EmitContext.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitObject(interp, objPtr, emitPtr)
+    Tcl_Interp *interp;	/* the current interpreter */
+    Tcl_Obj* objPtr;	/* the object to emit */
+    EmitContext *emitPtr;	/* The context to which the array is emitted */
+{
+    const Tcl_ObjType *objTypePtr;
+    char *objBytes;
+    int objLength;
+    char typeCode;
+
+    objTypePtr = objPtr->typePtr;
+    objBytes = Tcl_GetStringFromObj(objPtr, &objLength);
+    if (!objBytes) {
+        objBytes = "";
+        objLength = 0;
+    }
+
+    typeCode = LiteralTypeCode(objPtr, emitPtr->flags);
+
+    if (objTypePtr == cmpByteCodeType) {
+        if (EmitChar(interp, CMP_BYTECODE_CODE, '\n', emitPtr) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        return EmitByteCode(interp,
+                (ByteCode *) objPtr->internalRep.otherValuePtr, emitPtr);
+    } else if (objTypePtr == cmpProcBodyType) {
+        if (EmitChar(interp, CMP_PROCBODY_CODE, '\n', emitPtr) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        return EmitProcBody(interp,
+                (Proc *) objPtr->internalRep.otherValuePtr, emitPtr);
+    } else if (typeCode == CMP_STRING_CODE) {
+        if (EmitChar(interp, CMP_XSTRING_CODE, '\n', emitPtr) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        return EmitByteSequence(interp, (unsigned char *) objBytes,
+                objLength, emitPtr);
+    }
+
+    /*
+     * Integers and doubles are written as their string rep, without a
+     * count.
+     */
+
+    if (EmitChar(interp, typeCode, '\n', emitPtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    return EmitString(interp, objBytes, objLength, '\n', emitPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitExcRangeArray --
+ *
+ *  Emits the exception range array for a ByteCode struct to an EmitContext.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitExcRangeArray(interp, codePtr, emitPtr)
+    Tcl_Interp *interp;	/* the current interpreter */
+    ByteCode *codePtr;	/* The ByteCode containing the object array */
+    EmitContext *emitPtr;	/* The context to which the array is emitted */
+{
+    int i;
+    int numExceptRanges = codePtr->numExceptRanges;
+    ExceptionRange *excArrayPtr = codePtr->exceptArrayPtr;
+    char excName;
+
+    if (EmitInteger(interp, numExceptRanges, '\n', emitPtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    for (i=0 ; i < numExceptRanges ; i++) {
+        excName = NameFromExcRange(excArrayPtr->type);
+        if (excName == '\0') {
+            return -1;
+        }
+
+        if ((EmitChar(interp, excName, ' ', emitPtr) != TCL_OK)
+                || (EmitInteger(interp, excArrayPtr->nestingLevel, ' ',
+                        emitPtr) != TCL_OK)
+                || (EmitInteger(interp, excArrayPtr->codeOffset, ' ', emitPtr)
+                        != TCL_OK)
+                || (EmitInteger(interp, excArrayPtr->numCodeBytes, ' ',
+                        emitPtr) != TCL_OK)
+                || (EmitInteger(interp, excArrayPtr->breakOffset, ' ', emitPtr)
+                        != TCL_OK)
+                || (EmitInteger(interp, excArrayPtr->continueOffset, ' ',
+                        emitPtr) != TCL_OK)
+                || (EmitInteger(interp, excArrayPtr->catchOffset, '\n',
+                        emitPtr) != TCL_OK)) {
+            return TCL_ERROR;
+        }
+
+        excArrayPtr += 1;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitAuxDataArray --
+ *
+ *  Emits the AuxData array for a ByteCode struct to an EmitContext.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitAuxDataArray(interp, codePtr, emitPtr)
+    Tcl_Interp *interp;	/* the current interpreter */
+    ByteCode *codePtr;	/* The ByteCode containing the object array */
+    EmitContext *emitPtr;	/* The context to which the array is emitted */
+{
+    int i, result;
+    int numAuxDataItems = codePtr->numAuxDataItems;
+    AuxData *auxDataPtr = codePtr->auxDataArrayPtr;
+    const AuxDataType *typePtr;
+
+    if (EmitInteger(interp, numAuxDataItems, '\n', emitPtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    for (i=0 ; i < numAuxDataItems ; i++) {
+        /*
+         * write out the type, then switch based on the AuxData type
+         */
+
+        typePtr = auxDataPtr->type;
+        if (typePtr == cmpForeachInfoType) {
+            result = EmitChar(interp, CMP_FOREACH_INFO, '\n', emitPtr);
+            if (result != TCL_OK) {
+                return result;
+            }
+
+            result = EmitForeachInfo(interp,
+                    (ForeachInfo *) auxDataPtr->clientData, emitPtr);
+            if (result != TCL_OK) {
+                return result;
+            }
+#ifdef TCL_85_PLUS
+	} else if (typePtr == cmpJumptableInfoType) {
+            result = EmitChar(interp, CMP_JUMPTABLE_INFO, '\n', emitPtr);
+            if (result != TCL_OK) {
+                return result;
+            }
+
+            result = EmitJumptableInfo(interp,
+                    (JumptableInfo *) auxDataPtr->clientData, emitPtr);
+            if (result != TCL_OK) {
+                return result;
+            }
+#endif
+#ifdef TCL_86_PLUS
+	} else if (typePtr == cmpDictUpdateInfoType) {
+            result = EmitChar(interp, CMP_DICTUPDATE_INFO, '\n', emitPtr);
+            if (result != TCL_OK) {
+                return result;
+            }
+
+            result = EmitDictUpdateInfo(interp,
+                    (DictUpdateInfo *) auxDataPtr->clientData, emitPtr);
+            if (result != TCL_OK) {
+                return result;
+            }
+#endif
+#ifdef TCL_862_PLUS
+	} else if (typePtr == cmpNewForeachInfoType) {
+            result = EmitChar(interp, CMP_FOREACH_INFO_2, '\n', emitPtr);
+            if (result != TCL_OK) {
+                return result;
+            }
+
+            result = EmitNewForeachInfo(interp,
+                    (ForeachInfo *) auxDataPtr->clientData, emitPtr);
+            if (result != TCL_OK) {
+                return result;
+            }
+#endif
+        } else {
+            panic("EmitAuxDataArray: unknown AuxType \"%s\"",
+                    typePtr->name);
+        }
+
+        auxDataPtr += 1;
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitSignature --
+ *
+ *  Emit a signature string to be used in the header of a compiled TCL
+ *  script. The signature is used to mark the file as a compiled TCL script.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on error.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitSignature(interp, emitPtr)
+    Tcl_Interp *interp;	/* the current TCL interpreter */
+    EmitContext *emitPtr;	/* the context to which the signature is to be
+                                 * emitted */
+{
+    if ((EmitString(interp, signatureHeader, -1, ' ', emitPtr) != TCL_OK)
+            || (EmitInteger(interp, formatVersion, ' ', emitPtr) != TCL_OK)
+            || (EmitInteger(interp, buildNumber, ' ', emitPtr) != TCL_OK)
+            || (EmitString(interp, CMP_VERSION, -1, ' ', emitPtr) != TCL_OK)
+            || (EmitString(interp, TCL_VERSION, -1, '\n', emitPtr)
+                    != TCL_OK)) {
+        PrependResult(interp, "error writing signature: ");
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NameFromExcRange --
+ *
+ *  Given an ExceptionRangeType enum, return the corresponding name.
+ *
+ * Results:
+ *  Returns the name if it was successful at converting the enum value to
+ *  a name, '\0' otherwise.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char
+NameFromExcRange(type)
+    ExceptionRangeType type;	/* the enum for which to get a name */
+{
+    CONST ExcRangeMap *mapPtr;
+
+    for (mapPtr=&excRangeMap[0] ; mapPtr->name != 0 ; mapPtr++) {
+        if (mapPtr->type == type) {
+            return mapPtr->name;
+        }
+    }
+
+    return '\0';
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitTypes --
+ *
+ *  Uses Tcl_GetObjType to load pointers to known object types into static
+ *  variables, which can then be used instead of the known objects themselves.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+InitTypes()
+{
+    Tcl_MutexLock(&compilerMutex);
+    if (didLoadTypes == 0) {
+        cmpProcBodyType = Tcl_GetObjType(CMP_PROCBODY_OBJ_TYPE_NEW);
+        if (!cmpProcBodyType) {
+            panic("InitTypes: failed to find the %s type",
+                    CMP_PROCBODY_OBJ_TYPE_NEW);
+        }
+
+        cmpByteCodeType = Tcl_GetObjType("bytecode");
+        if (!cmpByteCodeType) {
+            panic("InitTypes: failed to find the bytecode type");
+        }
+
+        cmpDoubleType = Tcl_GetObjType("double");
+        if (!cmpByteCodeType) {
+            panic("InitTypes: failed to find the double type");
+        }
+
+        cmpIntType = Tcl_GetObjType("int");
+        if (!cmpByteCodeType) {
+            panic("InitTypes: failed to find the int type");
+        }
+
+        cmpForeachInfoType = TclGetAuxDataType("ForeachInfo");
+        if (!cmpForeachInfoType) {
+            panic("InitTypes: failed to find the ForeachInfo AuxData type");
+        }
+#ifdef TCL_85_PLUS
+        cmpJumptableInfoType = TclGetAuxDataType("JumptableInfo");
+        if (!cmpJumptableInfoType) {
+            panic("InitTypes: failed to find the JumptableInfo AuxData type");
+        }
+#endif
+#ifdef TCL_86_PLUS
+        cmpDictUpdateInfoType = TclGetAuxDataType("DictUpdateInfo");
+        if (!cmpDictUpdateInfoType) {
+            panic("InitTypes: failed to find the DictUpdateInfo AuxData type");
+        }
+#endif
+#ifdef TCL_862_PLUS
+        cmpNewForeachInfoType = TclGetAuxDataType("NewForeachInfo");
+        if (!cmpNewForeachInfoType) {
+            panic("InitTypes: failed to find the NewForeachInfo AuxData type");
+        }
+#endif
+        didLoadTypes = 1;
+    }
+    Tcl_MutexUnlock(&compilerMutex);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrependResult --
+ *
+ *  Prepends the string in msgPtr to the current result value. Used by error
+ *  reporting to augment a generic error string.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrependResult(interp, msgPtr)
+    Tcl_Interp *interp;		/* The current interpreter */
+    char *msgPtr;		/* string to prepend to the current result */
+{
+    Tcl_DString buf;
+    Tcl_Obj *resultPtr = Tcl_GetObjResult(interp);
+
+    Tcl_DStringInit(&buf);
+    Tcl_DStringAppend(&buf, msgPtr, -1);
+    Tcl_DStringAppend(&buf, resultPtr->bytes, resultPtr->length);
+
+    resultPtr = Tcl_NewStringObj(Tcl_DStringValue(&buf),
+            Tcl_DStringLength(&buf));
+    Tcl_SetObjResult(interp, resultPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitScriptPreamble --
+ *
+ *  Emit the preamble for the compiled script. Writes out the TCL boilerplate
+ *  that requires the loader package and evals the bytecodes. The preamble
+ *  of a bundle stops after the package require.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on error.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitScriptPreamble(interp, kind, emitPtr)
+    Tcl_Interp *interp;		/* the current TCL interpreter */
+    int kind;			/* PREAMBLE_SCRIPT, PREAMBLE_BINARY for the
+                                 * binary container or PREAMBLE_BUNDLE for a
+                                 * bundle */
+    EmitContext *emitPtr;	/* the context to which the signature is to be
+                                 * emitted */
+{
+    char buf[256];
+    char *errMsgPtr;
+    int result = TCL_OK;
+    Tcl_Obj *errObjPtr = 0;
+
+    /*
+     * Extract the loader error message from the package itself, and if not
+     * present use the default value. This lets us modify the error message
+     * in a script.
+     */
+
+    sprintf(buf, "variable %s ; set %s", errorVariable, errorVariable);
+    if (Tcl_Eval(interp, buf) != TCL_OK) {
+        errMsgPtr = errorMessage;
+    } else {
+        Tcl_Obj *errObjPtr = Tcl_GetObjResult(interp);
+        Tcl_IncrRefCount(errObjPtr);
+        errMsgPtr = errObjPtr->bytes;
+    }
+
+    if (kind == PREAMBLE_BINARY) {
+        /*
+         * The binary image is separated from the script by a ^Z, where
+         * "source" stops reading.
+         */
+
+        sprintf(buf, binaryPreambleFormat, loaderName, binaryLoaderVersion,
+                errMsgPtr, loaderName, evalCommand);
+        result = EmitString(interp, buf, -1, '\n', emitPtr);
+        if (result == TCL_OK) {
+            result = EmitString(interp, "", 0, '\032', emitPtr);
+        }
+    } else if (kind == PREAMBLE_BUNDLE) {
+        sprintf(buf, bundlePreambleFormat, loaderName, loaderVersion,
+                errMsgPtr);
+        result = EmitString(interp, buf, -1, '\n', emitPtr);
+    } else {
+        sprintf(buf, preambleFormat, loaderName, loaderVersion, errMsgPtr,
+                loaderName, evalCommand);
+        result = EmitString(interp, buf, -1, '\n', emitPtr);
+    }
+    if (result != TCL_OK) {
+        PrependResult(interp, "error writing script preamble: ");
+        result = TCL_ERROR;
+    }
+
+    if (errObjPtr) {
+        Tcl_DecrRefCount(errObjPtr);
+    }
+    Tcl_ResetResult(interp);
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitScriptPostamble --
+ *
+ *  Emit the postamble for the compiled script. Writes out the TCL boilerplate
+ *  that requires the loader package and evals the bytecodes.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on error.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitScriptPostamble(interp, emitPtr)
+    Tcl_Interp *interp;		/* the current TCL interpreter */
+    EmitContext *emitPtr;	/* the context to which the signature is to be
+                                 * emitted */
+{
+    char buf[256];
+
+#if USE_CATCH_WRAPPER
+    sprintf(buf, postambleFormat, errorInfoMarker);
+#else
+    strcpy(buf, postambleFormat);
+#endif
+    if (EmitString(interp, buf, -1, '\n', emitPtr) != TCL_OK) {
+        PrependResult(interp, "error writing script postamble: ");
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitUnitPreamble --
+ *
+ *  Emit the preamble for a unit of a streamed script other than the first
+ *  one: the start of the call to the loader, without the package require
+ *  of the script preamble.
+ *
+ * Results:
+ *  Returns TCL_OK on success, TCL_ERROR on error.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmitUnitPreamble(interp, emitPtr)
+    Tcl_Interp *interp;		/* the current TCL interpreter */
+    EmitContext *emitPtr;	/* the context to which the preamble is to be
+                                 * emitted */
+{
+    char buf[256];
+
+    sprintf(buf, unitPreambleFormat, loaderName, evalCommand);
+    if (EmitString(interp, buf, -1, '\n', emitPtr) != TCL_OK) {
+        PrependResult(interp, "error writing script preamble: ");
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LocalProcCompileProc --
+ *
+ *  This procedure is registered as the CompileProc for the "proc" command,
+ *  and is used to make a record of where in the bytecodes the calls to
+ *  "proc" have been emitted. This information is used in a post-processing
+ *  pass to compile the procedure bodies.
+ *
+ * Results:
+ *  Returns TCL_OUT_LINE_COMPILE, to make the compiler create non-inline code.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+LocalProcCompileProc(interp, parsePtr,
+#ifdef TCL_85_PLUS
+		     cmdPtr,
+#endif
+		     compEnvPtr)
+    Tcl_Interp *interp;		/* Used for error reporting. */
+    Tcl_Parse *parsePtr;	/* The parsed command information. */
+#ifdef TCL_85_PLUS
+    Command* cmdPtr;            /* The command to be compiled */
+#endif
+    CompileEnv *compEnvPtr;	/* Holds resulting instructions. */
+{
+    AppendInstLocList(interp, compEnvPtr);
+
+    return TCL_OUT_LINE_COMPILE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompilerInit --
+ *
+ *  Initializes the internal structures used by the Compiler package.
+ *  Must be called before the public interfaces to the Compiler package;
+ *  this is done typically in the package registration proc (Compiler_Init).
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Initializes a number of internal data structures used by the Compiler
+ *  implementation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+CompilerInit(interp)
+    Tcl_Interp *interp;			/* the active interpreter */
+{
+    CompilerContext *ctxPtr;
+    int major, minor;
+
+    /*
+     * Determine the format version of compiled code.  8.0-8.3 is v1,
+     * 8.4+ is v2 (new bytecode instructions).
+     */
+
+    Tcl_GetVersion(&major, &minor, NULL, NULL);
+
+    if ((major == 8) && (minor <= 3)) {
+	formatVersion = 1;
+    } else {
+	formatVersion = 2;
+    }
+
+    /*
+     * Initialize the local copies of pointers to some built-in object types.
+     * We need to do it because the built-in types are not exported by the
+     * windows Tcl DLL.
+     */
+
+    InitTypes();
+
+    /*
+     * Create the compiler context structure and attach it to the interp
+     */
+
+    ctxPtr = (CompilerContext *) ckalloc(sizeof(CompilerContext));
+    Tcl_SetAssocData(interp, CMP_ASSOC_KEY, CleanCompilerContext,
+            (ClientData) ctxPtr);
+    ctxPtr->ppi = (PostProcessInfo *) NULL;
+    ctxPtr->numProcs = 0;
+    ctxPtr->numCompiledBodies = 0;
+    ctxPtr->numUnsharedBodies = 0;
+    ctxPtr->numUnshares = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CleanCompilerContext --
+ *
+ *  Cleans up the compiler context.
+ *  Frees the post-processing info if any is present, then frees the context
+ *  struct itself.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  See above.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CleanCompilerContext(clientData, interp)
+    ClientData clientData;		/* not used */
+    Tcl_Interp *interp;			/* the active interpreter */
+{
+    CompilerContext *ctxPtr = (CompilerContext *) clientData;
+
+    FreePostProcessInfo(ctxPtr->ppi);
+    ckfree((char *) ctxPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompilerGetContext --
+ *
+ *  Returns a pointer to the CompilerContext struct for the given interp.
+ *
+ * Results:
+ *  See above.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+CompilerContext *
+CompilerGetContext(interp)
+    Tcl_Interp *interp;			/* the active interpreter */
+{
+    CompilerContext *ctxPtr =
+        (CompilerContext *) Tcl_GetAssocData(interp, CMP_ASSOC_KEY, NULL);
+
+    if (!ctxPtr) {
+        panic("unregistered compiler context!");
+    }
+
+    return ctxPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitCompilerContext --
+ *
+ *  Initializes the compiler context for a given interpreter.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Allocates a new PostProcessInfo, and frees the old one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+InitCompilerContext(interp)
+    Tcl_Interp *interp;		/* interpreter for which to initialize the
+                                 * proc list */
+{
+    CompilerContext *ctxPtr = CompilerGetContext(interp);
+
+    FreePostProcessInfo(ctxPtr->ppi);
+    ctxPtr->ppi = CreatePostProcessInfo();
+    ctxPtr->numProcs = 0;
+    ctxPtr->numCompiledBodies = 0;
+    ctxPtr->numUnsharedBodies = 0;
+    ctxPtr->numUnshares = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReleaseCompilerContext --
+ *
+ *  Frees the post-processing info associated with the compiler context.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReleaseCompilerContext(interp)
+    Tcl_Interp *interp;		/* interpreter for which to remove the
+                                 * proc list */
+{
+    CompilerContext *ctxPtr = CompilerGetContext(interp);
+
+    FreePostProcessInfo(ctxPtr->ppi);
+    ctxPtr->ppi = (PostProcessInfo *) NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ArenaAlloc --
+ *
+ *  Allocates memory from the compile arena of the current thread. The
+ *  memory is released by ArenaRelease, at the end of the compile.
+ *
+ * Results:
+ *  A pointer to the memory, aligned as by ckalloc.
+ *
+ * Side effects:
+ *  May allocate a new block; a request larger than a block gets a block
+ *  of its own.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VOID *
+ArenaAlloc(size)
+    size_t size;		/* number of bytes to allocate */
+{
+    CompileArena *arenaPtr = (CompileArena *)
+            Tcl_GetThreadData(&compileArenaKey, (int) sizeof(CompileArena));
+    ArenaBlock *blockPtr = arenaPtr->blockPtr;
+    size_t blockSize;
+    char *resultPtr;
+
+    size = TCL_ALIGN(size);
+    if ((blockPtr == NULL) || (blockPtr->used + size > blockPtr->size)) {
+        blockSize = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        blockPtr = (ArenaBlock *) ckalloc(ARENA_HEADER_SIZE + blockSize);
+        blockPtr->nextPtr = arenaPtr->blockPtr;
+        blockPtr->size = blockSize;
+        blockPtr->used = 0;
+        arenaPtr->blockPtr = blockPtr;
+
+        if (!arenaPtr->exitHandler) {
+            Tcl_CreateThreadExitHandler(ArenaThreadExit, (ClientData) NULL);
+            arenaPtr->exitHandler = 1;
+        }
+    }
+
+    resultPtr = (char *) blockPtr + ARENA_HEADER_SIZE + blockPtr->used;
+    blockPtr->used += size;
+    arenaPtr->used += size;
+    return (VOID *) resultPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ArenaRelease --
+ *
+ *  Releases all the memory allocated from the compile arena of the
+ *  current thread, and records how much the compile used. The first
+ *  block is kept for the next compile, unless it was an oversized one.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Frees the other blocks.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ArenaRelease()
+{
+    CompileArena *arenaPtr = (CompileArena *)
+            Tcl_GetThreadData(&compileArenaKey, (int) sizeof(CompileArena));
+    ArenaBlock *blockPtr, *nextPtr;
+
+    blockPtr = arenaPtr->blockPtr;
+    if (blockPtr == NULL) {
+        return;
+    }
+    while (blockPtr->nextPtr) {
+        nextPtr = blockPtr->nextPtr;
+        ckfree((char *) blockPtr);
+        blockPtr = nextPtr;
+    }
+    if (blockPtr->size == ARENA_BLOCK_SIZE) {
+        blockPtr->used = 0;
+    } else {
+        ckfree((char *) blockPtr);
+        blockPtr = NULL;
+    }
+    arenaPtr->blockPtr = blockPtr;
+
+    arenaPtr->lastPeak = arenaPtr->used;
+    if (arenaPtr->used > arenaPtr->maxPeak) {
+        arenaPtr->maxPeak = arenaPtr->used;
+    }
+    arenaPtr->numCompiles++;
+    arenaPtr->used = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ArenaThreadExit --
+ *
+ *  Thread exit handler, frees the block kept by the compile arena of the
+ *  exiting thread.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  See above.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ArenaThreadExit(clientData)
+    ClientData clientData;	/* not used */
+{
+    CompileArena *arenaPtr = (CompileArena *)
+            Tcl_GetThreadData(&compileArenaKey, (int) sizeof(CompileArena));
+    ArenaBlock *blockPtr, *nextPtr;
+
+    for (blockPtr=arenaPtr->blockPtr ; blockPtr ; blockPtr=nextPtr) {
+        nextPtr = blockPtr->nextPtr;
+        ckfree((char *) blockPtr);
+    }
+    arenaPtr->blockPtr = NULL;
+    arenaPtr->exitHandler = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Compiler_MemoryObjCmd --
+ *
+ *  Returns the memory statistics of the compile arena, for the compiles
+ *  run in the current thread. Call format:
+ *    compiler::memory
+ *  The result is a dictionary with the keys:
+ *    compiles		the number of compiles
+ *    lastPeakBytes	the bytes of post-processing structures used by the
+ *			last compile
+ *    maxPeakBytes	the most bytes used by one compile
+ *    reservedBytes	the bytes kept allocated between compiles
+ *  The bytes are those handed out by the arena; the hash table of the
+ *  object references is allocated by Tcl, and is not counted.
+ *
+ * Results:
+ *  A standard TCL result.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Compiler_MemoryObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;		/* Not used. */
+    Tcl_Interp *interp;		/* Current interpreter. */
+    int objc;			/* Number of arguments. */
+    Tcl_Obj *CONST objv[];	/* Argument objects. */
+{
+    CompileArena *arenaPtr = (CompileArena *)
+            Tcl_GetThreadData(&compileArenaKey, (int) sizeof(CompileArena));
+    Tcl_Obj *resultObjPtr;
+    Tcl_WideInt reserved = 0;
+    ArenaBlock *blockPtr;
+
+    if (objc != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, NULL);
+        return TCL_ERROR;
+    }
+
+    for (blockPtr=arenaPtr->blockPtr ; blockPtr ; blockPtr=blockPtr->nextPtr) {
+        reserved += ARENA_HEADER_SIZE + blockPtr->size;
+    }
+
+    resultObjPtr = Tcl_NewObj();
+    Tcl_ListObjAppendElement(NULL, resultObjPtr,
+            Tcl_NewStringObj("compiles", -1));
+    Tcl_ListObjAppendElement(NULL, resultObjPtr,
+            Tcl_NewWideIntObj(arenaPtr->numCompiles));
+    Tcl_ListObjAppendElement(NULL, resultObjPtr,
+            Tcl_NewStringObj("lastPeakBytes", -1));
+    Tcl_ListObjAppendElement(NULL, resultObjPtr,
+            Tcl_NewWideIntObj((Tcl_WideInt) arenaPtr->lastPeak));
+    Tcl_ListObjAppendElement(NULL, resultObjPtr,
+            Tcl_NewStringObj("maxPeakBytes", -1));
+    Tcl_ListObjAppendElement(NULL, resultObjPtr,
+            Tcl_NewWideIntObj((Tcl_WideInt) arenaPtr->maxPeak));
+    Tcl_ListObjAppendElement(NULL, resultObjPtr,
+            Tcl_NewStringObj("reservedBytes", -1));
+    Tcl_ListObjAppendElement(NULL, resultObjPtr,
+            Tcl_NewWideIntObj(reserved));
+
+    Tcl_SetObjResult(interp, resultObjPtr);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CreateInstLocList --
+ *
+ *  Creates a InstLocList struct.
+ *
+ * Results:
+ *  Returns an InstLocList allocated from the compile arena, initialized
+ *  with the next field set to 0, and the bytecodeOffset to the given
+ *  value..
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static InstLocList *
+CreateInstLocList(CompileEnv *envPtr)
+{
+    InstLocList *listPtr = (InstLocList *) ArenaAlloc(sizeof(InstLocList));
+    listPtr->next = (InstLocList *) NULL;
+    listPtr->bytecodeOffset = envPtr->codeNext - envPtr->codeStart;
+    listPtr->commandIndex = envPtr->numCommands - 1;
+#ifdef TCL_85_PLUS
+    if ((listPtr->bytecodeOffset >= 9) &&
+	(INST_START_CMD == *(envPtr->codeNext-9))) {
+      /*
+       * Tcl 8.5 core. Did emit an INST_START_CMD instruction. This
+       * instruction goes away again due to us forcing the outline
+       * compile in our caller (LocalProcCompileProc), so we have to
+       * adjust the remembered offset. Irrelevant for the first
+       * command (offset 0).
+       *
+       * 9 = 1byte ISC opcode + 2 4byte ISC operands.
+       */
+      listPtr->bytecodeOffset -= 9;
+    }
+#endif
+    return listPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CreatePostProcessInfo --
+ *
+ *  Creates a PostProcessInfo struct.
+ *
+ * Results:
+ *  Returns a PostProcessInfo allocated from the compile arena, initialized
+ *  with the list field set to 0, and the numProcs field set to 0.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static PostProcessInfo *
+CreatePostProcessInfo()
+{
+    PostProcessInfo *infoPtr
+        = (PostProcessInfo *) ArenaAlloc(sizeof(PostProcessInfo));
+    infoPtr->procs = (InstLocList *) NULL;
+    infoPtr->numProcs = 0;
+    Tcl_InitHashTable(&infoPtr->objTable, TCL_ONE_WORD_KEYS);
+    infoPtr->infoArrayPtr = (ProcBodyInfo **) NULL;
+    infoPtr->numUnshares = 0;
+    infoPtr->numCompiledBodies = 0;
+
+    return infoPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreePostProcessInfo --
+ *
+ *  Frees the post-processing info: the object table, then the compile
+ *  arena holding the info itself and everything hanging off it.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreePostProcessInfo(infoPtr)
+    PostProcessInfo *infoPtr;	/* the list to free up */
+{
+    if (infoPtr) {
+        Tcl_DeleteHashTable(&infoPtr->objTable);
+        ArenaRelease();
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendInstLocList --
+ *
+ *  Appends the given bytecode offset to the proc location list for a given
+ *  interpreter.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AppendInstLocList(interp, compEnvPtr)
+    Tcl_Interp *interp;		/* interpreter for which to append the proc
+                                 * location to the proc list */
+    CompileEnv *compEnvPtr;	/* the compilation environment */
+{
+    CompilerContext *ctxPtr = CompilerGetContext(interp);
+    PostProcessInfo *infoPtr = ctxPtr->ppi;
+    InstLocList *newPtr = CreateInstLocList(compEnvPtr);
+    InstLocList *listPtr = infoPtr->procs;
+
+    if (listPtr) {
+        while (listPtr->next) {
+            listPtr = listPtr->next;
+        }
+        listPtr->next = newPtr;
+    } else {
+        infoPtr->procs = newPtr;
+    }
+
+    infoPtr->numProcs += 1;
+    ctxPtr->numProcs += 1;
+}
+
+/*
+ *-----------------------------------------------------------------------
+ *
+ * CompileObject --
+ *
+ *  Lifted from SetByteCodeFromAny in tclCompile.c, does pretty much the
+ *  same thing, except that it postprocesses the compiled string to also
+ *  compile any procedure bodies. It needs to have access to the compile
+ *  environment, because it may have to add objects to the list that was
+ *  created by the compiler.
+ *
+ *  The rest of this comment block comes from the SetByteCodeFromAny header.
+ *
+ *  Part of the bytecode Tcl object type implementation. Attempts to
+ *  generate an byte code internal form for the Tcl object "objPtr" by
+ *  compiling its string representation.
+ *
+ * Results:
+ *  The return value is a standard Tcl object result. If an error occurs
+ *  during compilation, an error message is left in the interpreter's
+ *  result unless "interp" is NULL.
+ *
+ * Side effects:
+ *  Frees the old internal representation. If no error occurs, then the
+ *  compiled code is stored as "objPtr"s bytecode representation.
+ *  Also, if debugging, initializes the "tcl_traceCompile" Tcl variable
+ *  used to trace compilations.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CompileObject(interp, objPtr, flags)
+    Tcl_Interp *interp;		/* The interpreter for which the code is
+                                 * compiled. */
+    Tcl_Obj *objPtr;		/* The object to convert. */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+{
+    int result, savedPhase;
+    ProcInfo info;
+
+    info.flags = flags;
+
+    /*
+     * Before starting the compile, temporarily override the Command struct
+     * for the "proc" command to use our CompileProc. This lets us trap
+     * calls to "proc" during compilation, from which we can compile the
+     * procedure bodies
+     */
+
+    info.procCmdPtr = (Command *) Tcl_FindCommand(interp, "proc",
+	    (Tcl_Namespace *) NULL, /*flags*/ 0);
+
+    if (info.procCmdPtr) {
+        /*
+         * For the time being, we don't need to make sure that this is really
+         * the builtin "proc" command because we are running the compiler from
+         * our own script in our own executable, and therefore nobody has
+         * had a chance to redefine "proc"
+         */
+
+	/*
+         * EMIL we need to save the current value somewhere where
+         * LocalProcCompileProc can find it and, if it is not 0,
+         * call it.
+         * Probably a global hash table keyed by interpreter
+         */
+
+        info.savedCompileProc = info.procCmdPtr->compileProc;
+        info.procCmdPtr->compileProc = LocalProcCompileProc;
+    }
+
+    /*
+     * Initialize the compiler context struct. This includes the proc location
+     * list for this interpreter; this list will be populated by the local
+     * compile proc and used later to compile the procedure bodies
+     */
+
+    InitCompilerContext(interp);
+
+    savedPhase = PhaseEnter(COMPILER_PHASE_COMPILE);
+    result = TclSetByteCodeFromAny(interp, objPtr,
+	    PostProcessCompile, (ClientData) &info);
+    PhaseLeave(savedPhase);
+
+    /*
+     * Restore the "proc" command compile procedure.  This may be unnecessary
+     * since PostProcessCompile will normally restore the function, but in
+     * error cases it may never be called.
+     */
+
+    if (info.procCmdPtr) {
+        info.procCmdPtr->compileProc = info.savedCompileProc;
+    }
+
+    ReleaseCompilerContext(interp);
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PostProcessCompile --
+ *
+ *  Runs the postprocessing step on a compilation environment.
+ *
+ * Results:
+ *  A standard TCL error code.
+ *
+ * Side effects:
+ *  The various postprocessing steps may have side effects.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+PostProcessCompile(interp, compEnvPtr, clientData)
+    Tcl_Interp *interp;			/* the active interpreter */
+    struct CompileEnv *compEnvPtr;	/* the compilation environment to
+                                         * postprocess */
+    ClientData clientData;		/* Saved compileproc info. */
+{
+    int result, savedPhase;
+    ProcInfo *infoPtr = (ProcInfo *)clientData;
+
+    /*
+     * restore the original compile proc for "proc" before we postprocess
+     * the compiled environment. If we don't, and there are procedures that
+     * call "proc" in their bodies, the numProc field in the post
+     * process info gets corrupted (it is bumped up, which makes it
+     * inconsistent with the number of process info struct stored).
+     */
+
+    if (infoPtr->procCmdPtr) {
+        infoPtr->procCmdPtr->compileProc = infoPtr->savedCompileProc;
+    }
+
+    /*
+     * Compile the procedure bodies, then optimize the bytecodes. The
+     * optimizer has to run last, as the compilation of the bodies relies
+     * on the offsets recorded when the script was compiled.
+     */
+
+    savedPhase = PhaseEnter(COMPILER_PHASE_PROCBODIES);
+    result = CompileProcBodies(interp, compEnvPtr, infoPtr->flags);
+    PhaseLeave(savedPhase);
+    if (result != TCL_OK) {
+        return result;
+    }
+
+    if (infoPtr->flags & COMPILER_OPTIMIZE) {
+        OptimizeByteCodes(compEnvPtr);
+    }
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompileProcBodies --
+ *
+ *  Compiles the procedure bodies present in a compilation environment.
+ *
+ * Results:
+ *  A standard TCL error code.
+ *
+ * Side effects:
+ *  Compiles procedure bodies if any; the objects will have an internal
+ *  bytecode representation. Additionally, if the procedure bodies were
+ *  shared objects, it creates a new copy of the body object in order to
+ *  make them unshared. In this case, it will modify both the bytecodes and
+ *  the object table.
+ *  May set the TCL result object on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CompileProcBodies(interp, compEnvPtr, flags)
+    Tcl_Interp *interp;			/* the active interpreter */
+    CompileEnv *compEnvPtr;		/* the compilation environment to
+                                         * postprocess */
+    int flags;				/* OR-ed combination of COMPILER_*
+                                         * flags */
+{
+    CompilerContext *ctxPtr = CompilerGetContext(interp);
+    PostProcessInfo *infoPtr = ctxPtr->ppi;
+    ProcBodyInfo **infoArrayPtr;
+    int result = TCL_OK;
+    int i, savedPhase;
+
+    if (!infoPtr) {
+        panic("CompileProcBodies: no postprocess info for interpreter");
+        return TCL_ERROR;
+    }
+
+    if (infoPtr->numProcs < 1) {
+        return TCL_OK;
+    }
+
+    CreateProcBodyInfoArray(infoPtr, compEnvPtr, &infoArrayPtr);
+    LoadObjRefInfoTable(infoPtr, compEnvPtr);
+
+    /*
+     * Before compiling, check for shared objects and, if there are any,
+     * copy them to new objects.
+     */
+
+    UnshareProcBodies(interp, ctxPtr, compEnvPtr);
+
+    /*
+     * Compile the procedure bodies.
+     */
+
+    infoPtr->numCompiledBodies = 0;
+    for (i=0 ; i < infoPtr->numProcs ; i++) {
+        if (infoArrayPtr[i]->bodyNewIndex != -1) {
+            result =
+                CompileOneProcBody(interp, infoArrayPtr[i], ctxPtr,
+                        compEnvPtr, flags);
+            if (result != TCL_OK) {
+                goto return_result;
+            }
+            infoPtr->numCompiledBodies++;
+        }
+    }
+
+    /*
+     * If some procedure bodies have been compiled, we need to modify the
+     * bytecodes and related data structures
+     */
+
+    savedPhase = PhaseEnter(COMPILER_PHASE_UPDATE);
+    UpdateByteCodes(infoPtr, compEnvPtr);
+    PhaseLeave(savedPhase);
+
+    return_result:
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CreateProcBodyInfoArray --
+ *
+ *  Allocate and populate an array of ProcBodyInfo structs.
+ *  This is a NULL-terminated array of pointers to ProcBodyInfo, each
+ *  initialized from the corresponding procedure body.
+ *  The allocated array is placed in the infoArrayPtr field of locInfoPtr,
+ *  and is owned by it; it will be released when locInfoPtr is freed.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  panics on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CreateProcBodyInfoArray(locInfoPtr, compEnvPtr, arrayPtrPtr)
+    PostProcessInfo *locInfoPtr;	/* info about the locations of the proc
+                                         * commands in the bytecodes */
+    CompileEnv *compEnvPtr;		/* the compilation environment to
+                                         * postprocess */
+    ProcBodyInfo ***arrayPtrPtr;	/* if non-NULL, the pointer to the
+                                         * allocated array will be placed
+                                         * here */
+{
+    int i;
+    int allocSize, arraySize;
+    int numProcs = locInfoPtr->numProcs;
+    char *allocPtr;
+    ProcBodyInfo **infoAryPtr;
+    ProcBodyInfo *infoPtr;
+    InstLocList *locPtr;
+
+    FreeProcBodyInfoArray(locInfoPtr);
+
+    /*
+     * allocate a single area, used for both the array of pointers and the
+     * info structs
+     */
+
+    arraySize = (numProcs + 1) * sizeof(ProcBodyInfo *);
+    arraySize += TCL_ALIGN(arraySize);		/* align the info array */
+    allocSize = arraySize + (numProcs * sizeof(ProcBodyInfo));
+    allocPtr = (char *) ArenaAlloc((size_t) allocSize);
+
+    locInfoPtr->infoArrayPtr = (ProcBodyInfo **) allocPtr;
+    infoAryPtr = locInfoPtr->infoArrayPtr;
+    for (i=0 ; i <= numProcs ; i++) {
+        *infoAryPtr = (ProcBodyInfo *) NULL;
+        infoAryPtr += 1;
+    }
+
+    /*
+     * get the object indexes for the body and args objects,
+     * and the push offsets
+     */
+
+    infoPtr = (ProcBodyInfo *) (allocPtr + arraySize);
+    infoAryPtr = locInfoPtr->infoArrayPtr;
+    locPtr = locInfoPtr->procs;
+    for (i=0 ; i < numProcs ; i++) {
+        *infoAryPtr = infoPtr;
+        LoadProcBodyInfo(locPtr, compEnvPtr, infoPtr);
+        infoAryPtr += 1;
+        infoPtr += 1;
+        locPtr = locPtr->next;
+    }
+
+    if (arrayPtrPtr != NULL) {
+        *arrayPtrPtr = locInfoPtr->infoArrayPtr;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeProcBodyInfoArray --
+ *
+ *  Drops the array of ProcBodyInfo structs in the PostProcessInfo struct.
+ *  Its memory stays in the compile arena until the end of the compile.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeProcBodyInfoArray(infoPtr)
+    PostProcessInfo *infoPtr;	/* info about the locations of the proc
+                                 * commands in the bytecodes */
+{
+    infoPtr->infoArrayPtr = (ProcBodyInfo **) NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoadProcBodyInfo --
+ *
+ *	Populate a ProcBodyInfo struct.  This function determines if a
+ *	procedure body should be compiled or not; see the comments in
+ *	the body, below, for a description of the algorithm.  A
+ *	procedure body that should not be compiled has its
+ *	bodyNewIndex field set to -1.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *---------------------------------------------------------------------- */
+
+static void
+LoadProcBodyInfo(locInfoPtr, compEnvPtr, infoPtr)
+    InstLocList *locInfoPtr;	/* info about the locations of the proc
+                                 * command in the bytecodes */
+    CompileEnv *compEnvPtr;	/* the compilation environment to
+                                 * postprocess */
+    ProcBodyInfo *infoPtr;	/* pointer to the struct to populate */
+{
+    unsigned char *pc = compEnvPtr->codeStart + locInfoPtr->bytecodeOffset;
+
+    /*
+     * Here is where we scan the bytecodes and figure out where the args
+     * and the procedure body are put on the stack.
+     *
+     * Currently, we only detect the simplest (and most common) case, where
+     * all arguments to proc are pushed as literals, like this:
+     *		proc a { a1 a2 } { return [list $a1 $a2] }
+     * This corresponds to an expected sequence of commands like this:
+     * 		PUSH, PUSH, PUSH, PUSH, INVOKE_STK1
+     * where PUSH can be either PUSH1 or PUSH4, but INVOKE_STK1 only is
+     * expected (because there are only 4 arguments).
+     * The operand of the first PUSH is the index to the "proc" string,
+     * for the second it is the procedure name, for the third the argument
+     * list, and for the fourth the procedure body.
+     *
+     * If the args or the body are not pushed as literals, then the PUSH
+     * should be followed by different opcodes; for example, something like
+     * this
+     *		set body { return [list $a1 $a2] }
+     *		proc a { a1 a2 } $b
+     * generates a sequence like (PUSH "b"; LOAD) when the body is loaded,
+     * and we shouldn't compile "b" (of course!) and neither the object
+     * loaded as "b" (because it may not be a literal).
+     *
+     * The tough part is how do we detect stuff like this:
+     *		proc $procName { a1 a2 ] { return [list $a1 $a2] }
+     */
+
+    infoPtr->commandIndex = locInfoPtr->commandIndex;
+    infoPtr->procOffset = (pc - compEnvPtr->codeStart);
+    infoPtr->nameIndex = -1;
+    infoPtr->argsIndex = -1;
+    infoPtr->bodyOrigIndex = -1;
+    infoPtr->bodyNewIndex = -1;
+    infoPtr->bodyOffset = -1; /* Bugzilla 89467 */
+
+    /*
+     * Skip the "proc" string
+     */
+
+    switch (*pc) {
+        case INST_PUSH1:
+            pc += 2;
+            break;
+
+        case INST_PUSH4:
+            pc += 5;
+            break;
+
+        default:
+            return;
+    }
+
+    /*
+     * get the index of the proc name
+     */
+
+    switch (*pc) {
+        case INST_PUSH1:
+            infoPtr->nameIndex = TclGetUInt1AtPtr(pc+1);
+            pc += 2;
+            break;
+
+        case INST_PUSH4:
+            infoPtr->nameIndex = TclGetUInt4AtPtr(pc+1);
+            pc += 5;
+            break;
+
+        default:
+            return;
+    }
+
+    /*
+     * get the index of the argument list
+     */
+
+    switch (*pc) {
+        case INST_PUSH1:
+            infoPtr->argsIndex = TclGetUInt1AtPtr(pc+1);
+            pc += 2;
+            break;
+
+        case INST_PUSH4:
+            infoPtr->argsIndex = TclGetUInt4AtPtr(pc+1);
+            pc += 5;
+            break;
+
+        default:
+            return;
+    }
+
+    /*
+     * get the index of the procedure body, and save the offset to the
+     * push instruction.
+     */
+
+    infoPtr->bodyOffset = (pc - compEnvPtr->codeStart);
+    switch (*pc) {
+        case INST_PUSH1:
+            infoPtr->bodyOrigIndex = TclGetUInt1AtPtr(pc+1);
+            pc += 2;
+            break;
+
+        case INST_PUSH4:
+            infoPtr->bodyOrigIndex = TclGetUInt4AtPtr(pc+1);
+            pc += 5;
+            break;
+
+        default:
+            return;
+    }
+
+    /*
+     * (****)
+     */
+
+    infoPtr->bodyNewIndex = infoPtr->bodyOrigIndex;
+
+    /*
+     * finally, check if the following instruction is a INVOKE_STK1 with
+     * argument 4
+     */
+
+    if ((*pc != INST_INVOKE_STK1) || (TclGetUInt1AtPtr(pc+1) != 4)) {
+        infoPtr->nameIndex = -1;
+        infoPtr->argsIndex = -1;
+        infoPtr->bodyOrigIndex = -1;
+        infoPtr->bodyNewIndex = -1;
+    }
+
+    return;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoadObjRefInfoTable --
+ *
+ *  Load the object reference table.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Populates the objTable field of the locInfoPtr struct.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+LoadObjRefInfoTable(locInfoPtr, compEnvPtr)
+    PostProcessInfo *locInfoPtr;	/* info about the locations of the proc
+                                         * commands in the bytecodes */
+    CompileEnv *compEnvPtr;		/* the compilation environment to
+                                         * postprocess */
+{
+    Tcl_HashTable *objTablePtr;
+    ProcBodyInfo **infoAryPtr;
+    ProcBodyInfo *infoPtr;
+    Tcl_HashEntry *entryPtr;
+    int isNew, objIndex;
+    ObjRefInfo *refInfoPtr;
+    InstructionDesc *opCodesTablePtr;
+    unsigned char *pc;
+
+    CleanObjRefInfoTable(locInfoPtr);
+
+    /*
+     * count how many references to this object as a procedure body
+     */
+
+    objTablePtr = &locInfoPtr->objTable;
+    for (infoAryPtr=locInfoPtr->infoArrayPtr ; *infoAryPtr ; infoAryPtr++) {
+        infoPtr = *infoAryPtr;
+
+        entryPtr = Tcl_CreateHashEntry(objTablePtr,
+                (char *) infoPtr->bodyOrigIndex, &isNew);
+        if (isNew) {
+            refInfoPtr = (ObjRefInfo *) ArenaAlloc(sizeof(ObjRefInfo));
+            refInfoPtr->numReferences = 0;
+            refInfoPtr->numProcReferences = 0;
+            refInfoPtr->numUnshares = 0;
+
+            Tcl_SetHashValue(entryPtr, (ClientData) refInfoPtr);
+        } else {
+            refInfoPtr = (ObjRefInfo *) Tcl_GetHashValue(entryPtr);
+        }
+
+        refInfoPtr->numProcReferences += 1;
+    }
+
+    /*
+     * now scan the bytecodes and count the references from the bytecodes.
+     * Note that this count includes references from the PUSH instructions
+     * in the "proc" call.
+     */
+
+    opCodesTablePtr = (InstructionDesc*) TclGetInstructionTable();
+    for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
+        objIndex = GetSharedIndex(pc);
+        if (objIndex >= 0) {
+            entryPtr = Tcl_FindHashEntry(objTablePtr, (char *) objIndex);
+            if (entryPtr) {
+                /*
+                 * this is a reference to a known procedure body
+                 */
+
+                refInfoPtr = (ObjRefInfo *) Tcl_GetHashValue(entryPtr);
+                refInfoPtr->numReferences += 1;
+            }
+        }
+
+        pc += opCodesTablePtr[*pc].numBytes;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CleanObjRefInfoTable --
+ *
+ *  Releases all entries in the object reference table. The ObjRefInfo
+ *  structs stay in the compile arena until the end of the compile.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  See above.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CleanObjRefInfoTable(locInfoPtr)
+    PostProcessInfo *locInfoPtr;	/* info about the locations of the proc
+                                         * commands in the bytecodes */
+{
+    Tcl_DeleteHashTable(&locInfoPtr->objTable);
+    Tcl_InitHashTable(&locInfoPtr->objTable, TCL_ONE_WORD_KEYS);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompileOneProcBody --
+ *
+ *  Compiles a procedure body.
+ *  Much of this code is derived from Tcl_ProcObjCmd and TclObjInterpProc.
+ *
+ * Results:
+ *  A standard TCL error code.
+ *
+ * Side effects:
+ *  If the call succeeds, the objects will have an internal bytecode
+ *  representation. Additionally, if the object was shared, a new copy is
+ *  created in order to make it unshared; in this case, the new object is
+ *  added to the object table and the new index field in infoPtr is updated.
+ *  May set the TCL result object on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CompileOneProcBody(interp, infoPtr, ctxPtr, compEnvPtr, flags)
+    Tcl_Interp *interp;		/* the active interpreter */
+    ProcBodyInfo *infoPtr;	/* compilation info for the body to compile */
+    CompilerContext *ctxPtr;	/* compiler context struct, here used for
+                                 * updating statistics */
+    CompileEnv *compEnvPtr;	/* the compilation environment to
+                                 * postprocess */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+{
+    int result = TCL_OK;
+    Interp *iPtr = (Interp *) interp;
+    Proc *procPtr = (Proc *) NULL;
+    Proc *saveProcPtr;
+    Tcl_Obj *bodyPtr;
+    char *fullName, *args;
+    CONST84 char *p;
+    int numArgs, i;
+    CONST84 char **argArray = NULL;
+    CompiledLocal *localPtr;
+    Tcl_Command cmd = (Tcl_Command) NULL;
+    Tcl_Obj *procObjPtr;
+    char cmdNameBuf[64];
+
+    if (infoPtr->bodyNewIndex == -1) {
+        return TCL_OK;
+    }
+
+    /*
+     * Here we get the current namespace. We have to do it differently
+     * than Tcl_ProcObjCmd does, because the current namespace is NOT the one
+     * that is current at the time this proc is executed (we are compiling the
+     * file).
+     *
+     * For the time being, the full name is the one that was pushed.
+     */
+
+    fullName = Tcl_GetString(
+	compEnvPtr->literalArrayPtr[infoPtr->nameIndex].objPtr);
+
+    /*
+     * the newIndex is the one of the unshared object, so there is no need
+     * to do any shared checks here
+     */
+
+    bodyPtr = compEnvPtr->literalArrayPtr[infoPtr->bodyNewIndex].objPtr;
+
+    /*
+     * Create and initialize a Proc structure for the procedure. Note that
+     * we initialize its cmdPtr field below after we've created the command
+     * for the procedure. HOWEVER, differently from Tcl_ProcObjCmd, the
+     * command we create is just a dummy for use by the compiler code; it will
+     * be deleted after the compilation.
+     * We increment the ref count of the procedure's body object since there
+     * will be a reference to it in the Proc structure.
+     */
+
+    Tcl_IncrRefCount(bodyPtr);
+
+    procPtr = (Proc *) ckalloc(sizeof(Proc));
+    procPtr->iPtr = iPtr;
+    procPtr->refCount = 1;
+    procPtr->bodyPtr = bodyPtr;
+    procPtr->numArgs  = 0;	/* actual argument count is set below. */
+    procPtr->numCompiledLocals = 0;
+    procPtr->firstLocalPtr = NULL;
+    procPtr->lastLocalPtr = NULL;
+
+    /*
+     * Break up the argument list into argument specifiers, then process
+     * each argument specifier.
+     */
+
+    args = Tcl_GetString(
+	compEnvPtr->literalArrayPtr[infoPtr->argsIndex].objPtr);
+    result = Tcl_SplitList(interp, args, &numArgs, &argArray);
+    if (result != TCL_OK) {
+        goto cleanAndReturn;
+    }
+
+    procPtr->numArgs = numArgs;
+    procPtr->numCompiledLocals = numArgs;
+    for (i=0 ; i < numArgs ; i++) {
+        int fieldCount, nameLength, valueLength;
+        CONST84 char **fieldValues;
+
+        /*
+         * Now divide the specifier up into name and default.
+         */
+
+        result = Tcl_SplitList(interp, argArray[i], &fieldCount, &fieldValues);
+        if (result != TCL_OK) {
+            goto cleanAndReturn;
+        }
+        if (fieldCount > 2) {
+            ckfree((char *) fieldValues);
+            Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+                    "compilation of procedure \"", fullName,
+                    "\" failed: too many fields in argument specifier \"",
+                    argArray[i], "\"", (char *) NULL);
+            result = TCL_ERROR;
+            goto cleanAndReturn;
+        }
+
+        if ((fieldCount == 0) || (*fieldValues[0] == 0)) {
+            ckfree((char *) fieldValues);
+            Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+                    "compilation of procedure \"", fullName,
+                    "\" failed: argument with no name", (char *) NULL);
+            result = TCL_ERROR;
+            goto cleanAndReturn;
+        }
+
+        nameLength = strlen(fieldValues[0]);
+        if (fieldCount == 2) {
+            valueLength = strlen(fieldValues[1]);
+        } else {
+            valueLength = 0;
+        }
+
+        /*
+         * Check that the formal parameter name is a scalar.
+         */
+
+        p = fieldValues[0];
+        while (*p != '\0') {
+            if (*p == '(') {
+                CONST84 char *q = p;
+                do {
+                    q++;
+                } while (*q != '\0');
+                q--;
+                if (*q == ')') { /* we have an array element */
+                    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+                            "compilation of procedure \"", fullName,
+                            "\" failed: formal parameter \"", fieldValues[0],
+                            "\" is an array element",
+                            (char *) NULL);
+                    ckfree((char *) fieldValues);
+                    result = TCL_ERROR;
+                    goto cleanAndReturn;
+                }
+            }
+            p++;
+        }
+
+        /*
+         * Allocate an entry in the runtime procedure frame's array of local
+         * variables for the argument.
+         */
+
+        localPtr = (CompiledLocal *) ckalloc((unsigned)
+                (sizeof(CompiledLocal) - sizeof(localPtr->name)
+                        + nameLength+1));
+        if (procPtr->firstLocalPtr == NULL) {
+            procPtr->firstLocalPtr = procPtr->lastLocalPtr = localPtr;
+        } else {
+            procPtr->lastLocalPtr->nextPtr = localPtr;
+            procPtr->lastLocalPtr = localPtr;
+        }
+        localPtr->nextPtr = NULL;
+        localPtr->nameLength = nameLength;
+        localPtr->frameIndex = i;
+#ifdef TCL_85_PLUS
+	localPtr->flags = VAR_ARGUMENT;
+#else
+        localPtr->flags = VAR_SCALAR | VAR_ARGUMENT;
+#endif
+ 	localPtr->resolveInfo = NULL;
+
+        if (fieldCount == 2) {
+            localPtr->defValuePtr =
+                Tcl_NewStringObj(fieldValues[1], valueLength);
+            Tcl_IncrRefCount(localPtr->defValuePtr);
+        } else {
+            localPtr->defValuePtr = NULL;
+        }
+        strcpy(localPtr->name, fieldValues[0]);
+
+        ckfree((char *) fieldValues);
+    }
+
+    /*
+     * Now create a command for the procedure. This will initially be in
+     * the current namespace unless the procedure's name included namespace
+     * qualifiers. To create the new command in the right namespace, we
+     * generate a fully qualified name for it.
+     */
+
+    /*
+     * EMIL this needs to be looked into; can't really do this, must use
+     * the namespace from the code we are compiling, not the current one
+
+    Tcl_DString ds;
+
+    Tcl_DStringInit(&ds);
+    if (nsPtr != iPtr->globalNsPtr) {
+        Tcl_DStringAppend(&ds, nsPtr->fullName, -1);
+        Tcl_DStringAppend(&ds, "::", 2);
+    }
+    Tcl_DStringAppend(&ds, procName, -1);
+
+    Tcl_CreateCommand(interp, Tcl_DStringValue(&ds), InterpProc,
+	    (ClientData) procPtr, ProcDeleteProc);
+    cmd = Tcl_CreateObjCommand(interp, Tcl_DStringValue(&ds),
+	    TclObjInterpProc, (ClientData) procPtr, ProcDeleteProc);
+     */
+
+    /*
+     * Make sure that the temporary name is not already used
+     */
+
+    Tcl_MutexLock(&compilerMutex);
+    do {
+        sprintf(cmdNameBuf, dummyCommandName, dummyCommandCounter);
+        cmd = Tcl_FindCommand(interp, dummyCommandName,
+                (Tcl_Namespace *) NULL, TCL_GLOBAL_ONLY);
+        dummyCommandCounter += 1;
+    } while (cmd != (Tcl_Command) NULL);
+    Tcl_MutexUnlock(&compilerMutex);
+
+    Tcl_CreateCommand(interp, cmdNameBuf, (Tcl_CmdProc*) DummyInterpProc,
+            (ClientData) procPtr, CmpDeleteProc);
+    cmd = Tcl_CreateObjCommand(interp, cmdNameBuf,
+            DummyObjInterpProc, (ClientData) procPtr, CmpDeleteProc);
+    if (cmd == (Tcl_Command) NULL) {
+        result = TCL_ERROR;
+        goto cleanAndReturn;
+    }
+
+    /*
+     * Now initialize the new procedure's cmdPtr field. This will be used
+     * later when the procedure is called to determine what namespace the
+     * procedure will run in. This will be different than the current
+     * namespace if the proc was renamed into a different namespace.
+     */
+
+    procPtr->cmdPtr = (Command *) cmd;
+
+    /*
+     * At this stage, we are ready to compile the procedure body.
+     * Much of this code is derived from TclObjInterpProc.
+     *
+     * We force a recompilation of the body, even if the body is already
+     * of bytecode type. When optimizing, the body is compiled as the
+     * bytecode type would, but with a hook running the optimizer.
+     */
+
+    if (bodyPtr->typePtr) {
+        bodyPtr->typePtr->freeIntRepProc(bodyPtr);
+        bodyPtr->typePtr = (Tcl_ObjType *) NULL;
+    }
+
+    saveProcPtr = iPtr->compiledProcPtr;
+    iPtr->compiledProcPtr = procPtr;
+    if (flags & COMPILER_OPTIMIZE) {
+        result = TclSetByteCodeFromAny(interp, bodyPtr, OptimizeProcBody,
+                (ClientData) NULL);
+    } else {
+        result = cmpByteCodeType->setFromAnyProc(interp, bodyPtr);
+    }
+    iPtr->compiledProcPtr = saveProcPtr;
+
+    if (result != TCL_OK) {
+        if (result == TCL_ERROR) {
+            char buf[100];
+            int numChars;
+            char *ellipsis;
+
+            /*
+             * Prepend the procedure name to the error object
+             */
+
+            sprintf(buf, "compilation of procedure \"%s\" failed: ", fullName);
+            PrependResult(interp, buf);
+
+            numChars = strlen(fullName);
+            ellipsis = "";
+            if (numChars > 50) {
+                numChars = 50;
+                ellipsis = "...";
+            }
+            sprintf(buf, "\n    (compiling body of proc \"%.*s%s\", line %d)",
+                    numChars, fullName, ellipsis, ERRORLINE(interp));
+            Tcl_AddObjErrorInfo(interp, buf, -1);
+	    }
+        goto cleanAndReturn;
+    }
+
+    ctxPtr->numCompiledBodies += 1;
+
+    /*
+     * Now that we have compiled the procedure, create a new TCL object
+     * containing both the bytecodes and the info stored in the Proc struct.
+     * this info is usually generated at run time during the compilation of
+     * the procedure body, but of course this won't be possible in our case
+     * (the body is already compiled). So, we use this strategy:
+     *   1. compile the body, then save the relevant parts of Proc into a
+     *      procbody object. This object replaces the proc body object
+     *      in the object table.
+     *   2. tweak the name of the command to call from "proc" to
+     *      "loader::bcproc". This is our version of "proc" that knows how
+     *      to reconstruct the Proc struct from the TclProProcBody object.
+     *
+     * Note: 8.0.3 interpreters don't define a "procbody" object, so that the
+     * writer/reader code used to create instances of "TclProProcBody". These
+     * objects are the same as "procbody", but provided by the compiler;
+     * because the layout in the .tbc file (and the internal representation)
+     * are the same, we no longer create "TclProProcBody" objects, but rather
+     * "procbody". The tbcload package, on the other hand, still contains
+     * support for "TclProProcBody" so that it can be loaded in a 8.0.3
+     * interpreter.
+     */
+
+    procObjPtr = TclNewProcBodyObj(procPtr);
+    Tcl_IncrRefCount(procObjPtr);
+    compEnvPtr->literalArrayPtr[infoPtr->bodyNewIndex].objPtr = procObjPtr;
+    Tcl_DecrRefCount(bodyPtr);
+
+    cleanAndReturn:
+    if (argArray != NULL) {
+        ckfree((char *) argArray);
+    }
+    if (cmd) {
+        /*
+         * This will delete the Proc struct
+         */
+
+        Tcl_DeleteCommand(interp, cmdNameBuf);
+    } else {
+        TclProcCleanupProc(procPtr);
+    }
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DummyInterpProc --
+ *
+ *  Dummy, used to supply a nonzero value to the dummyCommand object.
+ *
+ * Results:
+ *  Returns TCL_OK.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DummyInterpProc(clientData, interp, argc, argv)
+    ClientData clientData;	/* context, unused */
+    Tcl_Interp *interp;		/* current interpreter, unused */
+    int argc;			/* argument count, unused */
+    char *argv[];		/* arguments, unused */
+{
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DummyObjInterpProc --
+ *
+ *  Dummy, used to supply a nonzero value to the dummyCommand object.
+ *
+ * Results:
+ *  Returns TCL_OK.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DummyObjInterpProc(clientData, interp, objc, objv)
+    ClientData clientData;	/* Record describing procedure to be
+                                 * interpreted. */
+    Tcl_Interp *interp;		/* Interpreter in which procedure was
+                                 * invoked. */
+    int objc;			/* Count of number of arguments to this
+                                 * procedure. */
+    Tcl_Obj *CONST objv[];	/* Argument value objects. */
+{
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CmpDeleteProc --
+ *
+ *  From ProcDeleteProc in tclProc.c; the rest of the header is the one for
+ *  ProcDeleteProc.
+ *
+ *  This procedure is invoked just before a command procedure is
+ *  removed from an interpreter.  Its job is to release all the
+ *  resources allocated to the procedure.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Memory gets freed, unless the procedure is actively being
+ *  executed.  In this case the cleanup is delayed until the
+ *  last call to the current procedure completes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CmpDeleteProc(clientData)
+    ClientData clientData;		/* Procedure to be deleted. */
+{
+    Proc *procPtr = (Proc *) clientData;
+
+    procPtr->refCount--;
+    if (procPtr->refCount <= 0) {
+        TclProcCleanupProc(procPtr);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UnshareProcBodies --
+ *
+ *  If any of the procedure bodies are shared, create duplicate objects so
+ *  that they are no longer shared. The index to the new object is stored in
+ *  the info structs for later use by the compilation procedure.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  May add objects to the object table for the compilation environment.
+ *  Panics on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+UnshareProcBodies(interp, ctxPtr, compEnvPtr)
+    Tcl_Interp *interp;		/* the active interpreter */
+    CompilerContext *ctxPtr;	/* compiler context struct, contains
+                                 * the post-processing info struct */
+    CompileEnv *compEnvPtr;	/* the compilation environment to
+                                 * postprocess */
+{
+    PostProcessInfo *infoPtr = ctxPtr->ppi;
+    ProcBodyInfo **infoArrayPtr;
+    ProcBodyInfo *bodyInfoPtr;
+    int origIndex;
+    Tcl_HashTable *objTablePtr;
+    Tcl_HashEntry *entryPtr;
+    ObjRefInfo *refInfoPtr;
+
+    infoPtr->numUnshares = 0;
+
+    if (infoPtr->numProcs < 1) {
+        return;
+    }
+
+    objTablePtr = &infoPtr->objTable;
+    for (infoArrayPtr=infoPtr->infoArrayPtr ; *infoArrayPtr ; infoArrayPtr++) {
+        bodyInfoPtr = *infoArrayPtr;
+        origIndex = bodyInfoPtr->bodyOrigIndex;
+        if (origIndex != -1) {
+            entryPtr = Tcl_FindHashEntry(objTablePtr, (char *) origIndex);
+            if (!entryPtr) {
+                panic("UnshareProcBodies: no ObjRefInfo entry in objTable!");
+            }
+            refInfoPtr = (ObjRefInfo *) Tcl_GetHashValue(entryPtr);
+
+            if (refInfoPtr->numReferences < 2) {
+                /*
+                 * Not a shared object, but we still need to remove
+		 * the object from the literal hash table so it
+		 * doesn't show up as a local literal without a global.
+                 */
+
+		TclHideLiteral(interp, compEnvPtr, bodyInfoPtr->bodyNewIndex);
+
+                continue;
+            }
+
+            /*
+             * If the only sharing is among procedure bodies, then we can
+             * copy N - 1 objects, and compile one in place.
+             * But if at least one other entity is sharing, then we must
+             * unshare all the procedure bodies.
+             */
+
+            if ((refInfoPtr->numReferences == refInfoPtr->numProcReferences)
+                    && (refInfoPtr->numUnshares < 1)) {
+                /*
+                 * do not copy the first occurrence, just remove it from
+		 * the global and local literal hash tables
+                 */
+
+		TclHideLiteral(interp, compEnvPtr, bodyInfoPtr->bodyNewIndex);
+                refInfoPtr->numUnshares = 1;
+            } else {
+		/* (xxxx) */
+
+                bodyInfoPtr->bodyNewIndex
+                    = UnshareObject(origIndex, compEnvPtr);
+                refInfoPtr->numUnshares += 1;
+                infoPtr->numUnshares += 1;
+                ctxPtr->numUnshares += 1;
+            }
+
+            if (refInfoPtr->numUnshares == 1) {
+                ctxPtr->numUnsharedBodies += 1;
+            }
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UnshareObject --
+ *
+ *  Creates a copy of an object, and adds it to the object table for the
+ *  compilation environment.
+ *
+ * Results:
+ *  Returns the index to the newly created object.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+UnshareObject(origIndex, compEnvPtr)
+    int origIndex;		/* the index in the object array of the
+                                 * object to duplicate */
+    CompileEnv *compEnvPtr;	/* the compilation environment to
+                                 * postprocess */
+{
+    return TclAddLiteralObj(compEnvPtr,
+	    Tcl_DuplicateObj(compEnvPtr->literalArrayPtr[origIndex].objPtr),
+	    NULL);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UpdateByteCodes --
+ *
+ *  If any of the procedure bodies have been compiled, or have been unshared
+ *  (if they are unshared then they also were compiled), we need to modify the
+ *  bytecodes so that the correct object index is pushed on the stack.
+ *  There are two cases where we need to modify the bytecodes:
+ *    1. A procedure body that has been compiled is stored as a TclProBodyType
+ *       Tcl_Obj; this is an object that contains the ByteCode, and also some
+ *       fields from the Proc struct, which need to be loaded at runtime
+ *       (they cannot be regenerated at runtime because the body is already
+ *       compiled, and the compiler does that work at runtime). In this case,
+ *       we need to push the name of the loader package's bcproc command,
+ *       which is a modified version of proc which knows how to handle the
+ *       TclProBodyType object.
+ *    2. If the body has been unshared, we have to make sure the the correct
+ *       index in the object table is used; the original one refers to the
+ *       shared object.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  May modify the bytecodes, possibly reallocating the bytecode array; may
+ *  also modify support data structures in the compilation environment.
+ *  Panics on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+UpdateByteCodes(infoPtr, compEnvPtr)
+    PostProcessInfo *infoPtr;	/* postprocess info, contains the list of
+                                 * calls to "proc" */
+    CompileEnv *compEnvPtr;	/* the compilation environment to
+                                 * postprocess */
+{
+    ProcBodyInfo **infoArrayPtr;
+    ProcBodyInfo *bodyInfoPtr;
+    int newIndex;
+    unsigned char *pc;
+    int procNameObjIndex;
+    int *sites, numSites;
+    Tcl_Obj *objPtr;
+
+    if (infoPtr->numCompiledBodies == 0) {
+        return;
+    }
+
+    /*
+     * Some bodies were compiled: create a new string object containing the
+     * name of the loader package's proc command, add it to the object table,
+     * and use its index as the operand to the first PUSH instruction.
+     */
+
+    objPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(objPtr);
+    Tcl_AppendStringsToObj(objPtr, loaderName, "::", procCommand, NULL);
+    procNameObjIndex = TclAddLiteralObj(compEnvPtr, objPtr, NULL);
+    Tcl_DecrRefCount(objPtr);
+
+#ifdef DEBUG_REWRITE
+    fprintf (stdout,"tbcload::bcproc @ %d\n",procNameObjIndex);fflush(stdout);
+#endif
+    if (procNameObjIndex >= 255) {
+	/*
+	 * This literal index signals that all the primary INST_PUSH
+	 * instructions (for the proc command name) will be rewritten from
+	 * push1 to push4, growing the bytecode (by 3 bytes per compiled
+	 * procedure). This means that any JUMP instructions around procedure
+	 * definitions require updates to their offsets to avoid having them
+	 * jumping into the middle of an instruction. Assuming that there are
+	 * jump instructions.
+	 *
+	 * The easiest way of doing that is to not only record where all jump
+	 * instructions are, but to rewrite them all to jump4. Otherwise we
+	 * would have to do some iterative rewriting where changing the offset
+	 * of a jump makes it larger, forcing more jump instructions to be
+	 * rewritten. It is likely easier to simply convert them all to the
+	 * large form.
+	 *
+	 * First we have to scan the bytecode and check if there are jump
+	 * instructions. If not then there is no need to run the complex jump
+	 * compensation code and the regular rewrite below (at %%%%) is fine.
+	 *
+	 * If jump instructions are present we have to scan a second time,
+	 * recording where all instructions are, and how much they are shifted
+	 * by instruction expansion, applied to _ALL_ jump and push
+	 * instructions. Then we scan a third time and build the expanded
+	 * bytecode, compensating for the shift in all jump instructions. This
+	 * includes updating all the auxiliary structures recording
+	 * instruction offsets and size.
+	 *
+	 * At last the expanded bytecode goes into the regular rewrite at
+	 * (%%%%). There no expansion will happen any longer, as all the
+	 * relevant instructions are already in their push4 forms, and any
+	 * jump offsets are corrected already as well.
+	 */
+
+	int jumps = 0;
+	InstructionDesc *opCodesTablePtr = (InstructionDesc*) TclGetInstructionTable();
+
+	/*
+	 * Scan for jumps.
 	 */
 
-	int jumps = 0;
-	InstructionDesc *opCodesTablePtr = (InstructionDesc*) TclGetInstructionTable();
+	for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
+	    if ((*pc >= INST_JUMP1) && (*pc <= INST_JUMP_FALSE4)) {
+		jumps ++;
+	    }
+	    pc += opCodesTablePtr[*pc].numBytes;
+	}
+
+	if (jumps) {
+	    int codesize = compEnvPtr->codeNext - compEnvPtr->codeStart;
+	    int* delta = (int*) ckalloc ((codesize + 1) * sizeof(int));
+	    int offset = 0;
+
+#ifdef DEBUG_REWRITE
+	    fprintf (stderr,"=== BEFORE START ===\n");
+	    {
+		int i, numExceptRanges = compEnvPtr->exceptArrayNext;
+		ExceptionRange *excPtr = compEnvPtr->exceptArrayPtr;
+		for (i=0 ; i < numExceptRanges ; i++) {
+		    switch (excPtr->type) {
+		    case CATCH_EXCEPTION_RANGE:
+			fprintf (stderr,"EC [%8d] @%4d /%4d : %4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes, excPtr->catchOffset);
+			break;
+		    case LOOP_EXCEPTION_RANGE:
+			fprintf (stderr,"EL [%8d] @%4d /%4d : %4d %4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes, excPtr->breakOffset, excPtr->continueOffset);
+			break;
+		    default:
+			fprintf (stderr,"E? [%8d] @%4d /%4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes);
+		    }
+		    excPtr += 1;
+		}
+	    }
+	    for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
+		FormatInstruction (compEnvPtr, pc);
+		pc += opCodesTablePtr[*pc].numBytes;
+	    }
+	    fprintf (stderr,"=== BEFORE END =====\n");
+	    fflush(stderr);
+#endif
+	    /*
+	     * Compute per-instruction shift offsets under the assumption that
+	     * all jump1 and push1 instructions are expanded. The value of
+	     * 'offset' after this loop is the total amount of expansion
+	     * required. This may be nothing if all instructions are already
+	     * in *4 form. In that case we can skip the expansion-rewrite.
+	     */
+
+	    for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
+		delta [pc - compEnvPtr->codeStart] = offset;
+		switch (*pc) {
+		case INST_JUMP1:
+		case INST_JUMP_TRUE1:
+		case INST_JUMP_FALSE1:
+		case INST_PUSH1:
+		    offset += 3;
+		    break;
+		default:
+		    break;
+		}
+		pc += opCodesTablePtr[*pc].numBytes;
+	    }
+	    delta [codesize] = offset;
+
+	    if (offset) {
+		/*
+		 * We use a helper array for the expanded bytecode to avoid
+		 * lots of shifting. We basically copy instructions from the
+		 * original array over to the expanded one, expanding them as
+		 * we go, and when we are done we expand the compilation
+		 * environment proper and copy things back.
+		 */
+
+		int newcodesize = codesize + offset;
+		unsigned char* newbc = (unsigned char*) ckalloc (newcodesize * sizeof(unsigned char));
+		unsigned char* pcnew = newbc;
+		int isize;
+
+		for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
+		    isize = opCodesTablePtr[*pc].numBytes;
+#ifdef DEBUG_REWRITE
+		    fprintf (stderr,"[%8d] d%4d s%2d %s\n",pc-compEnvPtr->codeStart,delta [(pc - compEnvPtr->codeStart)],isize,opCodesTablePtr[*pc].name);fflush(stderr);
+#endif
+		    switch (*pc) {
+		    case INST_JUMP1:
+		    case INST_JUMP_TRUE1:
+		    case INST_JUMP_FALSE1: {
+			/*
+			 * These instructions expand to *4 form, and may have
+			 * to change their jump offset to compensate for
+			 * differences in shift for this instruction and at
+			 * the jump destination.
+			 */
+
+			int jmpdelta = TclGetInt1AtPtr(pc+1);
+			int jmpshift = delta [(pc - compEnvPtr->codeStart)];
+			int dstshift = delta [(pc - compEnvPtr->codeStart) + jmpdelta];
+
+			if (jmpshift != dstshift) {
+#ifdef DEBUG_REWRITE
+			    fprintf (stderr,"           JUMP1 change %4d (%4d/%4d) by %4d, now %4d\n",jmpdelta,jmpshift,dstshift,dstshift - jmpshift,jmpdelta + (dstshift - jmpshift));fflush(stderr);
+#endif
+			    jmpdelta += (dstshift - jmpshift);
+			}
+
+			 /*
+			  * Instruction change!
+			  * HACK :: Assumes that the *1 and *4 forms
+			  * are paired, with *4 one higher than *1.
+			  * See tclCompile.h
+			  */
+			TclUpdateInstInt4AtPc ((*pc)+1, jmpdelta, pcnew);
+			pcnew += 5;
+
+		    } ; break;
+		    case INST_JUMP4:
+		    case INST_JUMP_TRUE4:
+		    case INST_JUMP_FALSE4: {
+			/*
+			 * While these instructions do not expand we still may
+			 * have to change their jump offset to compensate for
+			 * differences in shift for this instruction and at
+			 * the jump destination. If there is no difference no
+			 * change is needed. Otherwise the jump offset has to
+			 * be modified.
+			 */
+
+			int jmpdelta = TclGetInt4AtPtr(pc+1);
+			int jmpshift = delta [(pc - compEnvPtr->codeStart)];
+			int dstshift = delta [(pc - compEnvPtr->codeStart) + jmpdelta];
+
+			if (jmpshift != dstshift) {
+#ifdef DEBUG_REWRITE
+			    fprintf (stderr,"           JUMP4 change %4d (%4d/%4d) by %4d, now %4d\n",jmpdelta,jmpshift,dstshift,dstshift - jmpshift,jmpdelta + (dstshift - jmpshift));fflush(stderr);
+#endif
+			    jmpdelta += (dstshift - jmpshift);
+
+			    TclUpdateInstInt4AtPc ((*pc), jmpdelta, pcnew);
+			    pcnew += 5;
+
+			} else goto copy;
+		    } ; break;
+		    case INST_PUSH1: {
+			/*
+			 * All push1 instructions expand to push4, as in
+			 * WidenPushInstructions.
+			 */
+
+			int literal = TclGetUInt1AtPtr(pc+1);
+
+			TclUpdateInstInt4AtPc (INST_PUSH4, literal, pcnew);
+			pcnew += 5;
+
+		    } ; break;
+		    default: {
+			copy:
+			/*
+			 * All other instruction are copied as they are
+			 */
+			memcpy (pcnew, pc, isize);
+			pcnew += isize;
+		    } ; break;
+		    }
+		    pc += isize;
+		}
+
+		/*
+		 * At last copy the expanded byte code sequence back into the
+		 * compile environment and fix the auxiliary data structures.
+		 */
+
+		while ((compEnvPtr->codeStart + newcodesize) > compEnvPtr->codeEnd) {
+		    TclExpandCodeArray(compEnvPtr);
+		}
+
+		memcpy (compEnvPtr->codeStart, newbc, newcodesize);
+		compEnvPtr->codeNext = compEnvPtr->codeStart + newcodesize;
+		ckfree ((char*) newbc);
+
+		/*
+		 * Fix the auxiliary data structures containing instruction
+		 * sizes and offsets.
+		 */
+
+		/*
+		 * Fix command location array. We have it easier because we
+		 * know for each place in the old code how much it was shifted
+		 * (-> delta array). A command grows by the expansion between
+		 * its start and its end.
+		 */
+
+		{
+		    int i, end;
+		    CmdLocation *locPtr;
+
+		    for (i=0; i < compEnvPtr->numCommands; i++) {
+			locPtr = &compEnvPtr->cmdMapPtr[i];
+			end = locPtr->codeOffset + locPtr->numCodeBytes;
+
+			locPtr->numCodeBytes += delta [end] - delta [locPtr->codeOffset];
+			locPtr->codeOffset   += delta [locPtr->codeOffset];
+		    }
+		}
+
+		/*
+		 * Fix exception ranges. See also WidenPushInstructions. We have it
+		 * easier because we know for each place in the old code how
+		 * much it was shifted (-> delta array).
+		 */
+
+		{
+		    int i, end, numExceptRanges = compEnvPtr->exceptArrayNext;
+		    ExceptionRange *excPtr = compEnvPtr->exceptArrayPtr;
+
+		    for (i=0 ; i < numExceptRanges ; i++) {
+			end = excPtr->codeOffset + excPtr->numCodeBytes;
+
+			excPtr->numCodeBytes += delta [end] - delta [excPtr->codeOffset];
+			excPtr->codeOffset   += delta [excPtr->codeOffset];
+
+			switch (excPtr->type) {
+			case CATCH_EXCEPTION_RANGE:
+			    excPtr->catchOffset += delta [excPtr->catchOffset];
+			    break;
+			case LOOP_EXCEPTION_RANGE:
+			    excPtr->breakOffset    += delta [excPtr->breakOffset];
+			    if (excPtr->continueOffset != -1) {
+				excPtr->continueOffset += delta [excPtr->continueOffset];
+			    }
+			    break;
+			}
+
+			excPtr += 1;
+		    }
+		}
+
+		/*
+		 * Fix the local infoPtr->infoArrayPtr structures where we
+		 * recorded the locations of the compiled proc commands.
+		 */
+
+		{
+		    for (infoArrayPtr=infoPtr->infoArrayPtr ; *infoArrayPtr ; infoArrayPtr++) {
+			bodyInfoPtr = *infoArrayPtr;
+
+			bodyInfoPtr->procOffset += delta [bodyInfoPtr->procOffset];
+			bodyInfoPtr->bodyOffset += delta [bodyInfoPtr->bodyOffset];
+		    }
+		}
+	    }
+
+	    ckfree ((char*) delta);
+
+#ifdef DEBUG_REWRITE
+	    fprintf (stderr,"=== AFTER_ START ===\n");
+	    {
+		int i, numExceptRanges = compEnvPtr->exceptArrayNext;
+		ExceptionRange *excPtr = compEnvPtr->exceptArrayPtr;
+		for (i=0 ; i < numExceptRanges ; i++) {
+		    switch (excPtr->type) {
+		    case CATCH_EXCEPTION_RANGE:
+			fprintf (stderr,"EC [%8d] @%4d /%4d : %4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes, excPtr->catchOffset);
+			break;
+		    case LOOP_EXCEPTION_RANGE:
+			fprintf (stderr,"EL [%8d] @%4d /%4d : %4d %4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes, excPtr->breakOffset, excPtr->continueOffset);
+			break;
+		    default:
+			fprintf (stderr,"E? [%8d] @%4d /%4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes);
+		    }
+		    excPtr += 1;
+		}
+	    }
+	    for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
+		FormatInstruction (compEnvPtr, pc);
+		pc += opCodesTablePtr[*pc].numBytes;
+	    }
+	    fprintf (stderr,"=== AFTER_ END =====\n");
+	    fflush(stderr);
+#endif
+	}
+    }
+
+    /*
+     * (%%%%)
+     * Collect the push1 instructions whose operand will no longer fit:
+     * the proc command name, for all compiled procedure bodies, and the
+     * body itself, if it was unshared to a large index. All of them are
+     * widened to push4 in a single relocation pass, so that the operands
+     * can then be replaced in place.
+     * If there are jumps, all push1 were already widened above, so the
+     * relocation never has to adjust jump offsets.
+     */
+
+    numSites = 0;
+    sites = NULL;
+    for (infoArrayPtr=infoPtr->infoArrayPtr ; *infoArrayPtr ; infoArrayPtr++) {
+        bodyInfoPtr = *infoArrayPtr;
+        newIndex = bodyInfoPtr->bodyNewIndex;
+        if (newIndex == -1) {
+            continue;
+        }
+
+        if (sites == NULL) {
+            sites = (int *) ckalloc(2 * infoPtr->numProcs * sizeof(int));
+        }
+        pc = compEnvPtr->codeStart + bodyInfoPtr->procOffset;
+        if ((*pc == INST_PUSH1) && (procNameObjIndex >= 255)) {
+            sites[numSites++] = bodyInfoPtr->procOffset;
+        }
+        pc = compEnvPtr->codeStart + bodyInfoPtr->bodyOffset;
+        if ((newIndex != bodyInfoPtr->bodyOrigIndex)
+                && (*pc == INST_PUSH1) && (newIndex >= 255)) {
+            /*
+             * According to (****) the newIndex is the original index,
+             * thus this replacement should not require growth. Ah. But
+             * (xxxx) in UnshareProcBodies allows differently. Therefore,
+             * don't panic! (You have a towel with you, don't you ? ;)
+             */
+
+            sites[numSites++] = bodyInfoPtr->bodyOffset;
+        }
+    }
+
+    if (numSites > 0) {
+        qsort((VOID *) sites, (size_t) numSites, sizeof(int),
+                CompareOffsets);
+        WidenPushInstructions(sites, numSites, infoPtr, compEnvPtr);
+    }
+    if (sites != NULL) {
+        ckfree((char *) sites);
+    }
+
+    /*
+     * Now replace the operands; the offsets in the ProcBodyInfo structs
+     * were corrected by the relocation.
+     */
+
+    for (infoArrayPtr=infoPtr->infoArrayPtr ; *infoArrayPtr ; infoArrayPtr++) {
+        bodyInfoPtr = *infoArrayPtr;
+        newIndex = bodyInfoPtr->bodyNewIndex;
+
+        if (newIndex != -1) {
+            /*
+             * Replace the index for the command name object. This is done for
+             * all compiled procedure bodies
+             */
+
+            pc = compEnvPtr->codeStart + bodyInfoPtr->procOffset;
+            ReplacePushIndex(pc, procNameObjIndex);
+
+            if (newIndex != bodyInfoPtr->bodyOrigIndex) {
+                /*
+                 * replace the index of the body with the unshared index
+                 */
+
+                pc = compEnvPtr->codeStart + bodyInfoPtr->bodyOffset;
+                ReplacePushIndex(pc, newIndex);
+            }
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReplacePushIndex --
+ *
+ *  Replaces the operand to a PUSH operation with the new index value.
+ *  A push1 must have been widened by WidenPushInstructions if the new
+ *  index does not fit in its operand.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Modifies the bytecodes. Panics on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReplacePushIndex(pc, newIndex)
+    unsigned char *pc;		/* address of the PUSH instruction to modify */
+    int newIndex;		/* the new value of the PUSH operand */
+{
+    switch (*pc) {
+        case INST_PUSH1:
+            if (newIndex >= 255) {
+                panic("ReplacePushIndex: push1 operand out of range");
+            }
+            pc += 1;
+            *pc = (unsigned char) newIndex;
+            break;
+
+        case INST_PUSH4:
+            /*
+             * Because a 4 byte PUSH supports a single byte, we don't
+             * bother shrinking the bytecodes, just fit the new
+             * index in. It is unlikely that this will happen anyway, because
+             * we add new objects at the end of the object array anyway.
+             */
+
+            pc += 1;
+            *pc++ = (unsigned char) ((unsigned int) newIndex >> 24);
+            *pc++ = (unsigned char) ((unsigned int) newIndex >> 16);
+            *pc++ = (unsigned char) ((unsigned int) newIndex >>  8);
+            *pc++ = (unsigned char) ((unsigned int) newIndex);
+            break;
+
+        default:
+            panic("ReplacePushIndex: expected a push opcode");
+            break;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WidenPushInstructions --
+ *
+ *  Widens a set of push1 instructions to push4, keeping their operands.
+ *  This replaces shifting the tail of the bytecodes once per instruction:
+ *  the new bytecodes are built in a single sweep, then the command
+ *  locations, exception ranges and the offsets in the ProcBodyInfo
+ *  structs are relocated, each once. The bytecodes must not contain
+ *  jumps, whose offsets are not relocated.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  May grow the bytecode array, and modifies the data structures of the
+ *  compile environment to match the new bytecodes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WidenPushInstructions(sites, numSites, infoPtr, compEnvPtr)
+    int *sites;			/* sorted offsets of the push1 instructions
+                                 * to widen */
+    int numSites;		/* number of entries in sites */
+    PostProcessInfo *infoPtr;	/* postprocess info, holds the ProcBodyInfo
+                                 * structs to relocate */
+    CompileEnv *compEnvPtr;	/* Compilation environment to modify */
+{
+    int codeSize = compEnvPtr->codeNext - compEnvPtr->codeStart;
+    int newCodeSize = codeSize + 3 * numSites;
+    unsigned char *newCode, *toPtr;
+    int i, from, start, end, operand, numExceptRanges;
+    CmdLocation *locPtr;
+    ExceptionRange *excPtr;
+    ProcBodyInfo **infoArrayPtr;
+
+    /*
+     * Build the new bytecodes: copy the runs between the sites, widening
+     * each site on the way.
+     */
+
+    newCode = (unsigned char *) ckalloc((unsigned) newCodeSize);
+    toPtr = newCode;
+    from = 0;
+    for (i=0 ; i < numSites ; i++) {
+        memcpy(toPtr, compEnvPtr->codeStart + from,
+                (size_t) (sites[i] - from));
+        toPtr += sites[i] - from;
+
+        operand = TclGetUInt1AtPtr(compEnvPtr->codeStart + sites[i] + 1);
+        TclUpdateInstInt4AtPc(INST_PUSH4, operand, toPtr);
+        toPtr += 5;
+        from = sites[i] + 2;
+    }
+    memcpy(toPtr, compEnvPtr->codeStart + from, (size_t) (codeSize - from));
+
+    while ((compEnvPtr->codeStart + newCodeSize) > compEnvPtr->codeEnd) {
+        TclExpandCodeArray(compEnvPtr);
+    }
+    memcpy(compEnvPtr->codeStart, newCode, (size_t) newCodeSize);
+    compEnvPtr->codeNext = compEnvPtr->codeStart + newCodeSize;
+    ckfree((char *) newCode);
+
+    /*
+     * Relocate the command locations. A command grows by the sites
+     * it contains, so both ends are relocated.
+     */
+
+    locPtr = compEnvPtr->cmdMapPtr;
+    for (i=0 ; i < compEnvPtr->numCommands ; i++, locPtr++) {
+        start = locPtr->codeOffset;
+        end = start + locPtr->numCodeBytes;
+        locPtr->codeOffset = RelocateOffset(start, sites, numSites);
+        locPtr->numCodeBytes = RelocateOffset(end, sites, numSites)
+                - locPtr->codeOffset;
+    }
+
+    /*
+     * Relocate the exception ranges, so that each covers the same
+     * sequence of bytecodes as before. For catch ranges, we also need to
+     * relocate the catchOffset, for loop ranges the break and continue
+     * offsets.
+     */
+
+    numExceptRanges = compEnvPtr->exceptArrayNext;
+    excPtr = compEnvPtr->exceptArrayPtr;
+    for (i=0 ; i < numExceptRanges ; i++, excPtr++) {
+        start = excPtr->codeOffset;
+        end = start + excPtr->numCodeBytes;
+        excPtr->codeOffset = RelocateOffset(start, sites, numSites);
+        excPtr->numCodeBytes = RelocateOffset(end, sites, numSites)
+                - excPtr->codeOffset;
+
+        switch (excPtr->type) {
+            case CATCH_EXCEPTION_RANGE:
+                excPtr->catchOffset = RelocateOffset(excPtr->catchOffset,
+                        sites, numSites);
+                break;
+
+            case LOOP_EXCEPTION_RANGE:
+                excPtr->breakOffset = RelocateOffset(excPtr->breakOffset,
+                        sites, numSites);
+                excPtr->continueOffset =
+                        RelocateOffset(excPtr->continueOffset, sites,
+                                numSites);
+                break;
+        }
+    }
+
+    /*
+     * Relocate the locations of the compiled proc commands.
+     */
+
+    for (infoArrayPtr=infoPtr->infoArrayPtr ; *infoArrayPtr ;
+            infoArrayPtr++) {
+        (*infoArrayPtr)->procOffset =
+                RelocateOffset((*infoArrayPtr)->procOffset, sites, numSites);
+        (*infoArrayPtr)->bodyOffset =
+                RelocateOffset((*infoArrayPtr)->bodyOffset, sites, numSites);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RelocateOffset --
+ *
+ *  Maps an offset in the bytecodes to its value after the push1
+ *  instructions at the given sites were widened. Each site before the
+ *  offset moves it by 3 bytes; a site at the offset itself does not.
+ *
+ * Results:
+ *  The relocated offset.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+RelocateOffset(offset, sites, numSites)
+    int offset;			/* the offset to relocate */
+    int *sites;			/* sorted offsets of the widened push1
+                                 * instructions */
+    int numSites;		/* number of entries in sites */
+{
+    int low = 0, high = numSites, mid;
+
+    /*
+     * Binary search for the number of sites below offset.
+     */
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (sites[mid] < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return offset + 3 * low;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareOffsets --
+ *
+ *  qsort comparison function for bytecode offsets.
+ *
+ * Results:
+ *  Negative, zero or positive as the first offset is below, equal to or
+ *  above the second.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CompareOffsets(first, second)
+    CONST VOID *first;		/* the first offset */
+    CONST VOID *second;		/* the second offset */
+{
+    return *((int *) first) - *((int *) second);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OptimizeProcBody --
+ *
+ *  The compile hook used for the proc bodies when optimizing: runs the
+ *  peephole optimizer on the compilation environment of the body.
+ *
+ * Results:
+ *  Returns TCL_OK.
+ *
+ * Side effects:
+ *  See OptimizeByteCodes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+OptimizeProcBody(interp, compEnvPtr, clientData)
+    Tcl_Interp *interp;			/* the active interpreter */
+    struct CompileEnv *compEnvPtr;	/* the compilation environment to
+                                         * optimize */
+    ClientData clientData;		/* not used */
+{
+    OptimizeByteCodes(compEnvPtr);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OptimizeByteCodes --
+ *
+ *  Runs a peephole optimizer over the bytecodes of a compilation
+ *  environment. The core compiler leaves nop instructions behind where
+ *  it optimized code away, and emits the long form of jumps it could not
+ *  size in advance; since a compiled script is optimized once and loaded
+ *  many times, this is the place to clean that up. The rewrites are:
+ *   - jumps to unconditional jumps are redirected to the final target,
+ *   - code that control cannot reach is dropped,
+ *   - nop instructions, push/pop pairs and unconditional jumps to the
+ *     next instruction are dropped,
+ *   - jumps use the 1 byte form wherever their offset allows.
+ *  The command locations, the exception ranges, the startCommand
+ *  operands and the offsets held in jump tables and foreach loops are
+ *  relocated to match. Bytecodes containing an instruction whose control
+ *  flow is not known here are left alone.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  May rewrite the bytecodes and the data structures of the compilation
+ *  environment.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+OptimizeByteCodes(compEnvPtr)
+    CompileEnv *compEnvPtr;	/* the compilation environment to
+                                 * optimize */
+{
+    InstructionDesc *opCodesTablePtr =
+            (InstructionDesc *) TclGetInstructionTable();
+    int codeSize = compEnvPtr->codeNext - compEnvPtr->codeStart;
+    int numInsts, numStack, newCodeSize, i, j, k, offset, op, numBytes;
+    int changed, savedPhase;
+    int *instIndex, *stack;
+    unsigned char *pc, *newCode, *toPtr;
+    OptInst *insts;
+    CmdLocation *locPtr;
+    ExceptionRange *excPtr;
+    AuxData *auxDataPtr;
+#ifdef TCL_85_PLUS
+    JumptableInfo *jtPtr;
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+#endif
+#ifdef TCL_862_PLUS
+    ForeachInfo *fePtr;
+#endif
+
+    savedPhase = PhaseEnter(COMPILER_PHASE_OPTIMIZE);
 
-	/*
-	 * Scan for jumps.
-	 */
+    instIndex = (int *) ckalloc((codeSize + 1) * sizeof(int));
+    insts = (OptInst *) ckalloc((codeSize + 1) * sizeof(OptInst));
+    stack = (int *) ckalloc((codeSize + 1) * sizeof(int));
 
-	for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
-	    if ((*pc >= INST_JUMP1) && (*pc <= INST_JUMP_FALSE4)) {
-		jumps ++;
-	    }
-	    pc += opCodesTablePtr[*pc].numBytes;
-	}
+    /*
+     * Split the bytecodes into instructions. instIndex maps the offset of
+     * each instruction to its index in insts, and any other offset to -1.
+     * The entry past the last instruction stands for the end of the code.
+     */
 
-	if (jumps) {
-	    int codesize = compEnvPtr->codeNext - compEnvPtr->codeStart;
-	    int* delta = (int*) ckalloc (codesize * sizeof(int));
-	    int offset = 0;
+    numInsts = 0;
+    for (offset=0 ; offset < codeSize ; offset += numBytes) {
+        pc = compEnvPtr->codeStart + offset;
+        op = *pc;
+        numBytes = (op <= LAST_INST_OPCODE) ? opCodesTablePtr[op].numBytes : 0;
+        if ((numBytes < 1) || (offset + numBytes > codeSize)) {
+            goto done;
+        }
+#ifdef INST_RETURN_CODE_BRANCH
+        if (op == INST_RETURN_CODE_BRANCH) {
+            /*
+             * Branches into the table of jumps which follows it, so these
+             * have to stay where they are.
+             */
 
-#ifdef DEBUG_REWRITE
-	    fprintf (stderr,"=== BEFORE START ===\n");
-	    {
-		int i, numExceptRanges = compEnvPtr->exceptArrayNext;
-		ExceptionRange *excPtr = compEnvPtr->exceptArrayPtr;
-		for (i=0 ; i < numExceptRanges ; i++) {
-		    switch (excPtr->type) {
-		    case CATCH_EXCEPTION_RANGE:
-			fprintf (stderr,"EC [%8d] @%4d /%4d : %4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes, excPtr->catchOffset);
-			break;
-		    case LOOP_EXCEPTION_RANGE:
-			fprintf (stderr,"EL [%8d] @%4d /%4d : %4d %4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes, excPtr->breakOffset, excPtr->continueOffset);
-			break;
-		    default:
-			fprintf (stderr,"E? [%8d] @%4d /%4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes);
-		    }
-		    excPtr += 1;
-		}
-	    }
-	    for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
-		FormatInstruction (compEnvPtr, pc);
-		pc += opCodesTablePtr[*pc].numBytes;
-	    }
-	    fprintf (stderr,"=== BEFORE END =====\n");
-	    fflush(stderr);
+            goto done;
+        }
 #endif
-	    /*
-	     * Compute per-instruction shift offsets under the assumption that
-	     * all jump1 and push1 instructions are expanded. The value of
-	     * 'offset' after this loop is the total amount of expansion
-	     * required. This may be nothing if all instructions are already
-	     * in *4 form. In that case we can skip the expansion-rewrite.
-	     */
 
-	    for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
-		delta [pc - compEnvPtr->codeStart] = offset;
-		switch (*pc) {
-		case INST_JUMP1:
-		case INST_JUMP_TRUE1:
-		case INST_JUMP_FALSE1:
-		case INST_PUSH1:
-		    offset += 3;
-		    break;
-		default:
-		    break;
-		}
-		pc += opCodesTablePtr[*pc].numBytes;
-	    }
+        instIndex[offset] = numInsts;
+        for (j=1 ; j < numBytes ; j++) {
+            instIndex[offset + j] = -1;
+        }
 
-	    if (offset) {
-		/*
-		 * We use a helper array for the expanded bytecode to avoid
-		 * lots of shifting. We basically copy instructions from the
-		 * original array over to the expanded one, expanding them as
-		 * we go, and when we are done we expand the compilation
-		 * environment proper and copy things back.
-		 */
+        insts[numInsts].offset = offset;
+        insts[numInsts].size = numBytes;
+        insts[numInsts].reachable = 0;
+        insts[numInsts].label = 0;
+        switch (op) {
+            case INST_JUMP1:
+            case INST_JUMP_TRUE1:
+            case INST_JUMP_FALSE1:
+                insts[numInsts].target = offset + TclGetInt1AtPtr(pc+1);
+                break;
+
+            case INST_JUMP4:
+            case INST_JUMP_TRUE4:
+            case INST_JUMP_FALSE4:
+                insts[numInsts].target = offset + TclGetInt4AtPtr(pc+1);
+                break;
+
+            default:
+                insts[numInsts].target = -1;
+                break;
+        }
+        numInsts += 1;
+    }
+
+    instIndex[codeSize] = numInsts;
+    insts[numInsts].offset = codeSize;
+    insts[numInsts].target = -1;
+    insts[numInsts].size = 0;
+
+    /*
+     * Every offset we will have to relocate must be the start of an
+     * instruction, or the end of the code for the end of a range.
+     */
+
+    for (i=0 ; i < numInsts ; i++) {
+        pc = compEnvPtr->codeStart + insts[i].offset;
+        if ((insts[i].target != -1)
+                && (OptimizeIndex(instIndex, codeSize - 1,
+                        insts[i].target) < 0)) {
+            goto done;
+        }
+#ifdef TCL_85_PLUS
+        if ((*pc == INST_START_CMD)
+                && (OptimizeIndex(instIndex, codeSize,
+                        insts[i].offset + TclGetInt4AtPtr(pc+1)) < 0)) {
+            goto done;
+        }
+#endif
+    }
+    locPtr = compEnvPtr->cmdMapPtr;
+    for (i=0 ; i < compEnvPtr->numCommands ; i++, locPtr++) {
+        if ((OptimizeIndex(instIndex, codeSize, locPtr->codeOffset) < 0)
+                || (OptimizeIndex(instIndex, codeSize,
+                        locPtr->codeOffset + locPtr->numCodeBytes) < 0)) {
+            goto done;
+        }
+    }
+    excPtr = compEnvPtr->exceptArrayPtr;
+    for (i=0 ; i < compEnvPtr->exceptArrayNext ; i++, excPtr++) {
+        if ((OptimizeIndex(instIndex, codeSize, excPtr->codeOffset) < 0)
+                || (OptimizeIndex(instIndex, codeSize,
+                        excPtr->codeOffset + excPtr->numCodeBytes) < 0)) {
+            goto done;
+        }
+        switch (excPtr->type) {
+            case CATCH_EXCEPTION_RANGE:
+                if (OptimizeIndex(instIndex, codeSize - 1,
+                        excPtr->catchOffset) < 0) {
+                    goto done;
+                }
+                break;
+
+            case LOOP_EXCEPTION_RANGE:
+                if ((OptimizeIndex(instIndex, codeSize - 1,
+                        excPtr->breakOffset) < 0)
+                        || ((excPtr->continueOffset != -1)
+                        && (OptimizeIndex(instIndex, codeSize - 1,
+                                excPtr->continueOffset) < 0))) {
+                    goto done;
+                }
+                break;
+        }
+    }
+
+    /*
+     * Redirect jumps to unconditional jumps, and past nops, to where
+     * control finally goes. The hop count guards against loops made of
+     * jumps only.
+     */
+
+    for (i=0 ; i < numInsts ; i++) {
+        if (insts[i].target == -1) {
+            continue;
+        }
+        for (k=0 ; k < numInsts ; k++) {
+            j = instIndex[insts[i].target];
+            op = compEnvPtr->codeStart[insts[j].offset];
+            if ((j != i) && ((op == INST_JUMP1) || (op == INST_JUMP4))) {
+                insts[i].target = insts[j].target;
+#ifdef INST_NOP
+            } else if ((op == INST_NOP) && (j + 1 < numInsts)) {
+                insts[i].target = insts[j + 1].offset;
+#endif
+            } else {
+                break;
+            }
+        }
+    }
+
+    /*
+     * Find the instructions control can reach: from the start of the
+     * code, and from the exception handlers. The last instruction is
+     * always kept, so that the code still ends in a done instruction.
+     */
+
+    numStack = 0;
+    OptimizeReach(insts, 0, 0, stack, &numStack);
+    OptimizeReach(insts, numInsts - 1, 0, stack, &numStack);
+    excPtr = compEnvPtr->exceptArrayPtr;
+    for (i=0 ; i < compEnvPtr->exceptArrayNext ; i++, excPtr++) {
+        if (excPtr->type == CATCH_EXCEPTION_RANGE) {
+            OptimizeReach(insts, instIndex[excPtr->catchOffset], 1, stack,
+                    &numStack);
+        } else if (excPtr->type == LOOP_EXCEPTION_RANGE) {
+            OptimizeReach(insts, instIndex[excPtr->breakOffset], 1, stack,
+                    &numStack);
+            if (excPtr->continueOffset != -1) {
+                OptimizeReach(insts, instIndex[excPtr->continueOffset], 1,
+                        stack, &numStack);
+            }
+        }
+    }
+
+    while (numStack > 0) {
+        i = stack[--numStack];
+        pc = compEnvPtr->codeStart + insts[i].offset;
+        op = *pc;
+
+        if (insts[i].target != -1) {
+            OptimizeReach(insts, instIndex[insts[i].target], 1, stack,
+                    &numStack);
+        }
+
+#ifdef TCL_85_PLUS
+        if (op == INST_JUMP_TABLE) {
+            auxDataPtr = OptimizeAuxData(compEnvPtr, pc,
+                    cmpJumptableInfoType);
+            if (auxDataPtr == NULL) {
+                goto done;
+            }
+            jtPtr = (JumptableInfo *) auxDataPtr->clientData;
+            for (hPtr=Tcl_FirstHashEntry(&jtPtr->hashTable, &search) ; hPtr ;
+                    hPtr=Tcl_NextHashEntry(&search)) {
+                j = OptimizeIndex(instIndex, codeSize - 1,
+                        insts[i].offset + PTR2INT(Tcl_GetHashValue(hPtr)));
+                if (j < 0) {
+                    goto done;
+                }
+                OptimizeReach(insts, j, 1, stack, &numStack);
+            }
+        }
+#endif
+#ifdef TCL_862_PLUS
+        if (op == INST_FOREACH_START) {
+            /*
+             * foreach_start jumps forward to the foreach_step, which jumps
+             * back to the start of the loop body, right after the
+             * foreach_start. Both use the offset in the ForeachInfo.
+             */
+
+            auxDataPtr = OptimizeAuxData(compEnvPtr, pc,
+                    cmpNewForeachInfoType);
+            if (auxDataPtr == NULL) {
+                goto done;
+            }
+            fePtr = (ForeachInfo *) auxDataPtr->clientData;
+            j = OptimizeIndex(instIndex, codeSize - 1,
+                    insts[i].offset + 5 - fePtr->loopCtTemp);
+            if ((j < 0) || (compEnvPtr->codeStart[insts[j].offset]
+                    != INST_FOREACH_STEP)) {
+                goto done;
+            }
+            OptimizeReach(insts, j, 1, stack, &numStack);
+            OptimizeReach(insts, i + 1, 1, stack, &numStack);
+        }
+#endif
+
+        if ((op != INST_JUMP1) && (op != INST_JUMP4) && (op != INST_DONE)
+                && (i + 1 < numInsts)) {
+            OptimizeReach(insts, i + 1, 0, stack, &numStack);
+        }
+    }
+
+    /*
+     * Drop the unreachable instructions and the nops, then the push/pop
+     * pairs. The pop must not be reachable from anywhere but the push,
+     * not even through dropped instructions.
+     */
+
+    for (i=0 ; i < numInsts ; i++) {
+        op = compEnvPtr->codeStart[insts[i].offset];
+        if (!insts[i].reachable
+#ifdef INST_NOP
+                || (op == INST_NOP)
+#endif
+                ) {
+            insts[i].size = 0;
+        }
+    }
+    for (i=0 ; i < numInsts ; i++) {
+        op = compEnvPtr->codeStart[insts[i].offset];
+        if ((insts[i].size == 0)
+                || ((op != INST_PUSH1) && (op != INST_PUSH4))) {
+            continue;
+        }
+        for (k=i+1 ; (k < numInsts) && (insts[k].size == 0)
+                && !insts[k].label ; k++) {
+            /* empty */
+        }
+        if ((k < numInsts) && !insts[k].label && (insts[k].size > 0)
+                && (compEnvPtr->codeStart[insts[k].offset] == INST_POP)) {
+            insts[i].size = 0;
+            insts[k].size = 0;
+        }
+    }
+
+    /*
+     * Drop the unconditional jumps to the next instruction kept. Dropping
+     * one may make another one jump to the next instruction.
+     */
+
+    do {
+        changed = 0;
+        for (i=0 ; i < numInsts ; i++) {
+            op = compEnvPtr->codeStart[insts[i].offset];
+            if ((insts[i].size == 0)
+                    || ((op != INST_JUMP1) && (op != INST_JUMP4))) {
+                continue;
+            }
+            for (k=i+1 ; (k < numInsts) && (insts[k].size == 0) ; k++) {
+                /* empty */
+            }
+            for (j=instIndex[insts[i].target] ;
+                    (j < numInsts) && (insts[j].size == 0) ; j++) {
+                /* empty */
+            }
+            if (j == k) {
+                insts[i].size = 0;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    /*
+     * Lay out the new bytecodes. All jumps start in their 1 byte form, and
+     * those whose offset does not fit grow to 4 bytes. Growing a jump can
+     * only make other offsets larger, so this settles on the smallest
+     * layout.
+     */
+
+    for (i=0 ; i < numInsts ; i++) {
+        if ((insts[i].target != -1) && (insts[i].size > 0)) {
+            insts[i].size = 2;
+        }
+    }
+    do {
+        newCodeSize = 0;
+        for (i=0 ; i <= numInsts ; i++) {
+            insts[i].newOffset = newCodeSize;
+            newCodeSize += insts[i].size;
+        }
+
+        changed = 0;
+        for (i=0 ; i < numInsts ; i++) {
+            if ((insts[i].target != -1) && (insts[i].size == 2)) {
+                j = OptimizeOffset(insts, instIndex, insts[i].target)
+                        - insts[i].newOffset;
+                if ((j < -128) || (j > 127)) {
+                    insts[i].size = 5;
+                    changed = 1;
+                }
+            }
+        }
+    } while (changed);
+
+    /*
+     * Generate the new bytecodes, and relocate the offsets held in the
+     * instructions and their aux data.
+     */
+
+    newCode = (unsigned char *) ckalloc((unsigned) newCodeSize + 1);
+    for (i=0 ; i < numInsts ; i++) {
+        if (insts[i].size == 0) {
+            continue;
+        }
+
+        pc = compEnvPtr->codeStart + insts[i].offset;
+        toPtr = newCode + insts[i].newOffset;
+        op = *pc;
+
+        if (insts[i].target != -1) {
+            /*
+             * HACK :: Assumes that the *1 and *4 forms of the jumps are
+             * paired, with *4 one higher than *1, as UpdateByteCodes does.
+             */
+
+            j = OptimizeOffset(insts, instIndex, insts[i].target)
+                    - insts[i].newOffset;
+            if ((op == INST_JUMP4) || (op == INST_JUMP_TRUE4)
+                    || (op == INST_JUMP_FALSE4)) {
+                op -= 1;
+            }
+            if (insts[i].size == 2) {
+                TclUpdateInstInt1AtPc(op, j, toPtr);
+            } else {
+                TclUpdateInstInt4AtPc(op + 1, j, toPtr);
+            }
+            continue;
+        }
+
+        memcpy(toPtr, pc, (size_t) insts[i].size);
+
+        switch (op) {
+#ifdef TCL_85_PLUS
+            case INST_START_CMD:
+                /*
+                 * The first operand is the length of the code of the
+                 * command, up to the next command.
+                 */
+
+                j = OptimizeOffset(insts, instIndex,
+                        insts[i].offset + TclGetInt4AtPtr(pc+1))
+                        - insts[i].newOffset;
+                TclStoreInt4AtPtr(j, toPtr+1);
+                break;
+
+            case INST_JUMP_TABLE:
+                jtPtr = (JumptableInfo *) compEnvPtr->auxDataArrayPtr[
+                        TclGetUInt4AtPtr(pc+1)].clientData;
+                for (hPtr=Tcl_FirstHashEntry(&jtPtr->hashTable, &search) ;
+                        hPtr ; hPtr=Tcl_NextHashEntry(&search)) {
+                    j = OptimizeOffset(insts, instIndex, insts[i].offset
+                            + PTR2INT(Tcl_GetHashValue(hPtr)))
+                            - insts[i].newOffset;
+                    Tcl_SetHashValue(hPtr, INT2PTR(j));
+                }
+                break;
+#endif
+
+#ifdef TCL_862_PLUS
+            case INST_FOREACH_START:
+                fePtr = (ForeachInfo *) compEnvPtr->auxDataArrayPtr[
+                        TclGetUInt4AtPtr(pc+1)].clientData;
+                fePtr->loopCtTemp = insts[i].newOffset + 5
+                        - OptimizeOffset(insts, instIndex,
+                                insts[i].offset + 5 - fePtr->loopCtTemp);
+                break;
+#endif
+        }
+    }
+
+    /*
+     * Relocate the command locations and the exception ranges, so that
+     * each covers what remains of its code.
+     */
+
+    locPtr = compEnvPtr->cmdMapPtr;
+    for (i=0 ; i < compEnvPtr->numCommands ; i++, locPtr++) {
+        offset = locPtr->codeOffset;
+        locPtr->codeOffset = OptimizeOffset(insts, instIndex, offset);
+        locPtr->numCodeBytes = OptimizeOffset(insts, instIndex,
+                offset + locPtr->numCodeBytes) - locPtr->codeOffset;
+    }
+
+    excPtr = compEnvPtr->exceptArrayPtr;
+    for (i=0 ; i < compEnvPtr->exceptArrayNext ; i++, excPtr++) {
+        offset = excPtr->codeOffset;
+        excPtr->codeOffset = OptimizeOffset(insts, instIndex, offset);
+        excPtr->numCodeBytes = OptimizeOffset(insts, instIndex,
+                offset + excPtr->numCodeBytes) - excPtr->codeOffset;
+
+        switch (excPtr->type) {
+            case CATCH_EXCEPTION_RANGE:
+                excPtr->catchOffset = OptimizeOffset(insts, instIndex,
+                        excPtr->catchOffset);
+                break;
+
+            case LOOP_EXCEPTION_RANGE:
+                excPtr->breakOffset = OptimizeOffset(insts, instIndex,
+                        excPtr->breakOffset);
+                if (excPtr->continueOffset != -1) {
+                    excPtr->continueOffset = OptimizeOffset(insts,
+                            instIndex, excPtr->continueOffset);
+                }
+                break;
+        }
+    }
+
+    /*
+     * At last copy the new bytecodes back into the compilation
+     * environment. Jumps redirected further away may have grown, so the
+     * code array may have to grow as well.
+     */
+
+    while ((compEnvPtr->codeStart + newCodeSize) > compEnvPtr->codeEnd) {
+        TclExpandCodeArray(compEnvPtr);
+    }
+    memcpy(compEnvPtr->codeStart, newCode, (size_t) newCodeSize);
+    compEnvPtr->codeNext = compEnvPtr->codeStart + newCodeSize;
+    ckfree((char *) newCode);
+
+    done:
+    ckfree((char *) stack);
+    ckfree((char *) insts);
+    ckfree((char *) instIndex);
+    PhaseLeave(savedPhase);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OptimizeAuxData --
+ *
+ *  Finds the aux data of an instruction for OptimizeByteCodes; the
+ *  operand of the instruction is the index of the aux data.
+ *
+ * Results:
+ *  The aux data, or NULL if the index is out of range or the aux data
+ *  is not of the expected type.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-		int newcodesize = codesize + offset;
-		unsigned char* newbc = (unsigned char*) ckalloc (newcodesize * sizeof(unsigned char));
-		unsigned char* pcnew = newbc;
-		int isize;
+static AuxData *
+OptimizeAuxData(compEnvPtr, pc, typePtr)
+    CompileEnv *compEnvPtr;	/* the compilation environment */
+    unsigned char *pc;		/* the instruction */
+    CONST AuxDataType *typePtr;	/* the expected type of the aux data */
+{
+    unsigned int index = TclGetUInt4AtPtr(pc+1);
 
-		for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
-		    isize = opCodesTablePtr[*pc].numBytes;
-#ifdef DEBUG_REWRITE
-		    fprintf (stderr,"[%8d] d%4d s%2d %s\n",pc-compEnvPtr->codeStart,delta [(pc - compEnvPtr->codeStart)],isize,opCodesTablePtr[*pc].name);fflush(stderr);
-#endif
-		    switch (*pc) {
-		    case INST_JUMP1:
-		    case INST_JUMP_TRUE1:
-		    case INST_JUMP_FALSE1: {
-			/*
-			 * These instructions expand to *4 form, and may have
-			 * to change their jump offset to compensate for
-			 * differences in shift for this instruction and at
-			 * the jump destination.
-			 */
+    if ((index >= (unsigned int) compEnvPtr->auxDataArrayNext)
+            || (compEnvPtr->auxDataArrayPtr[index].type != typePtr)) {
+        return NULL;
+    }
+    return &compEnvPtr->auxDataArrayPtr[index];
+}
 
-			int jmpdelta = TclGetInt1AtPtr(pc+1);
-			int jmpshift = delta [(pc - compEnvPtr->codeStart)];
-			int dstshift = delta [(pc - compEnvPtr->codeStart) + jmpdelta];
+/*
+ *----------------------------------------------------------------------
+ *
+ * OptimizeIndex --
+ *
+ *  Maps an offset in the bytecodes to the index of the instruction
+ *  starting there, for OptimizeByteCodes.
+ *
+ * Results:
+ *  The index of the instruction, or -1 if the offset is beyond 'limit'
+ *  or not at an instruction boundary. The end of the code maps to the
+ *  number of instructions.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-			if (jmpshift != dstshift) {
-#ifdef DEBUG_REWRITE
-			    fprintf (stderr,"           JUMP1 change %4d (%4d/%4d) by %4d, now %4d\n",jmpdelta,jmpshift,dstshift,dstshift - jmpshift,jmpdelta + (dstshift - jmpshift));fflush(stderr);
-#endif
-			    jmpdelta += (dstshift - jmpshift);
-			}
+static int
+OptimizeIndex(instIndex, limit, offset)
+    int *instIndex;		/* instruction index of each offset */
+    int limit;			/* the largest offset allowed */
+    int offset;			/* the offset to map */
+{
+    if ((offset < 0) || (offset > limit)) {
+        return -1;
+    }
+    return instIndex[offset];
+}
 
-			 /*
-			  * Instruction change!
-			  * HACK :: Assumes that the *1 and *4 forms
-			  * are paired, with *4 one higher than *1.
-			  * See tclCompile.h
-			  */
-			TclUpdateInstInt4AtPc ((*pc)+1, jmpdelta, pcnew);
-			pcnew += 5;
+/*
+ *----------------------------------------------------------------------
+ *
+ * OptimizeOffset --
+ *
+ *  Maps an offset in the original bytecodes to the matching offset in
+ *  the bytecodes laid out by OptimizeByteCodes. The offset of a dropped
+ *  instruction maps to the next instruction kept.
+ *
+ * Results:
+ *  The new offset.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-		    } ; break;
-		    case INST_JUMP4:
-		    case INST_JUMP_TRUE4:
-		    case INST_JUMP_FALSE4: {
-			/*
-			 * While these instructions do not expand we still may
-			 * have to change their jump offset to compensate for
-			 * differences in shift for this instruction and at
-			 * the jump destination. If there is no difference no
-			 * change is needed. Otherwise the jump offset has to
-			 * be modified.
-			 */
+static int
+OptimizeOffset(insts, instIndex, offset)
+    OptInst *insts;		/* the instructions, laid out */
+    int *instIndex;		/* instruction index of each offset */
+    int offset;			/* the offset to map */
+{
+    return insts[instIndex[offset]].newOffset;
+}
 
-			int jmpdelta = TclGetInt4AtPtr(pc+1);
-			int jmpshift = delta [(pc - compEnvPtr->codeStart)];
-			int dstshift = delta [(pc - compEnvPtr->codeStart) + jmpdelta];
+/*
+ *----------------------------------------------------------------------
+ *
+ * OptimizeReach --
+ *
+ *  Marks an instruction as reachable for OptimizeByteCodes, and queues
+ *  it if this is news, so that its successors are marked in turn.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Updates the instruction and the stack of instructions to visit.
+ *
+ *----------------------------------------------------------------------
+ */
 
-			if (jmpshift != dstshift) {
-#ifdef DEBUG_REWRITE
-			    fprintf (stderr,"           JUMP4 change %4d (%4d/%4d) by %4d, now %4d\n",jmpdelta,jmpshift,dstshift,dstshift - jmpshift,jmpdelta + (dstshift - jmpshift));fflush(stderr);
-#endif
-			    jmpdelta += (dstshift - jmpshift);
+static void
+OptimizeReach(insts, index, isLabel, stack, numStackPtr)
+    OptInst *insts;		/* the instructions */
+    int index;			/* index of the instruction reached */
+    int isLabel;		/* non-zero if reached by a jump, rather
+                                 * than from the previous instruction */
+    int *stack;			/* instructions still to visit */
+    int *numStackPtr;		/* number of entries in stack */
+{
+    if (isLabel) {
+        insts[index].label = 1;
+    }
+    if (!insts[index].reachable) {
+        insts[index].reachable = 1;
+        stack[(*numStackPtr)++] = index;
+    }
+}
 
-			    TclUpdateInstInt4AtPc ((*pc), jmpdelta, pcnew);
-			    pcnew += 5;
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetSharedIndex --
+ *
+ *  Looks at the bytecode instruction at *pc, if the instruction is one
+ *  that makes a reference to an object in the object table extract the
+ *  index operand and return it.
+ *
+ * Results:
+ *  Returns an index into the object table, or -1 if this instruction is
+ *  not on the list of instructions that make index references.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-			} else goto copy;
-		    } ; break;
-		    case INST_PUSH1: {
-			/*
-			 * All push1 instructions expand to push4. This code
-			 * copied from ReplacePushIndex, except that growing
-			 * is not necessary at this point.
-			 */
+static int
+GetSharedIndex(pc)
+    unsigned char *pc;		/* address of the bytecode instruction to
+                                 * examine */
+{
+    unsigned int objIndex;
 
-			int literal = TclGetUInt1AtPtr(pc+1);
+    switch (*pc) {
+        case INST_PUSH1:
+            objIndex = TclGetUInt1AtPtr(pc+1);
+            break;
 
-			TclUpdateInstInt4AtPc (INST_PUSH4, literal, pcnew);
-			pcnew += 5;
+        case INST_PUSH4:
+            objIndex = TclGetUInt4AtPtr(pc+1);
+            break;
 
-		    } ; break;
-		    default: {
-			copy:
-			/*
-			 * All other instruction are copied as they are
-			 */
-			memcpy (pcnew, pc, isize);
-			pcnew += isize;
-		    } ; break;
-		    }
-		    pc += isize;
-		}
+        default:
+            return -1;
+    }
 
-		/*
-		 * At last copy the expanded byte code sequence back into the
-		 * compile environment and fix the auxiliary data structures.
-		 */
+    return objIndex;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitForeachInfo --
+ *
+ *  Emits a ForeachInfo struct to an EmitContext.
+ *
+ * Results:
+ *  Returns a TCL error code.
+ *
+ * Side effects:
+ *  Sets the TCL result on error.
+ *
+ *----------------------------------------------------------------------
+ */
 
-		while ((compEnvPtr->codeStart + newcodesize) > compEnvPtr->codeEnd) {
-		    TclExpandCodeArray(compEnvPtr);
-		}
+static int
+EmitForeachInfo(interp, infoPtr, emitPtr)
+    Tcl_Interp *interp;		/* the current interpreter */
+    ForeachInfo *infoPtr;	/* pointer to the ForeachInfo struct to emit */
+    EmitContext *emitPtr;	/* The context to which the info is emitted */
+{
+    int i, j, lastEntry, result;
+    int *varIndexesPtr;
+    char separator;
+    ForeachVarList *varListPtr;
 
-		memcpy (compEnvPtr->codeStart, newbc, newcodesize);
-		compEnvPtr->codeNext = compEnvPtr->codeStart + newcodesize;
-		ckfree ((char*) newbc);
+    result = EmitInteger(interp, infoPtr->numLists, ' ', emitPtr);
+    if (result != TCL_OK) {
+        return result;
+    }
+    result = EmitInteger(interp, infoPtr->firstValueTemp, ' ', emitPtr);
+    if (result != TCL_OK) {
+        return result;
+    }
+    result = EmitInteger(interp, infoPtr->loopCtTemp, '\n', emitPtr);
+    if (result != TCL_OK) {
+        return result;
+    }
 
-		/*
-		 * Fix the auxiliary data structures containing instruction
-		 * sizes and offsets.
-		 */
+    for (i=0 ; i < infoPtr->numLists ; i++) {
+        varListPtr = infoPtr->varLists[i];
 
-		/*
-		 * Fix command location array. We have it easier because we
-		 * know for each place in the old code how much it was shifted
-		 * (-> delta array).
-		 */
+        result = EmitInteger(interp, varListPtr->numVars, '\n', emitPtr);
+        if (result != TCL_OK) {
+            return result;
+        }
 
-		{
-		    int i;
-		    CmdLocation *locPtr;
+        varIndexesPtr = &varListPtr->varIndexes[0];
+        separator = ' ';
+        lastEntry = varListPtr->numVars - 1;
+        for (j=0 ; j <= lastEntry ; j++) {
+            if (j == lastEntry) {
+                separator = '\n';
+            }
 
-		    for (i=0; i < compEnvPtr->numCommands; i++) {
-			locPtr = &compEnvPtr->cmdMapPtr[i];
+            result = EmitInteger(interp, *varIndexesPtr, separator, emitPtr);
+            if (result != TCL_OK) {
+                return result;
+            }
+
+            varIndexesPtr += 1;
+        }
+    }
+
+    return TCL_OK;
+}
+
+#ifdef TCL_862_PLUS
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitNewForeachInfo --
+ *
+ *  Emits a ForeachInfo struct as used by the 8.6.2 bytecode to an EmitContext.
+ *
+ * Results:
+ *  Returns a TCL error code.
+ *
+ * Side effects:
+ *  Sets the TCL result on error.
+ *
+ *----------------------------------------------------------------------
+ */
 
-			locPtr->codeOffset  += delta [locPtr->codeOffset];
-			locPtr->numCodeBytes = opCodesTablePtr[*(compEnvPtr->codeStart + locPtr->codeOffset)].numBytes;
-		    }
-		}
+static int
+EmitNewForeachInfo(interp, infoPtr, emitPtr)
+    Tcl_Interp *interp;		/* the current interpreter */
+    ForeachInfo *infoPtr;	/* pointer to the ForeachInfo struct to emit */
+    EmitContext *emitPtr;	/* The context to which the info is emitted */
+{
+    int i, j, lastEntry, result;
+    int *varIndexesPtr;
+    char separator;
+    ForeachVarList *varListPtr;
 
-		/*
-		 * Fix exception ranges. See also ShiftByteCodes. We have it
-		 * easier because we know for each place in the old code how
-		 * much it was shifted (-> delta array).
-		 */
+    result = EmitInteger(interp, infoPtr->numLists, ' ', emitPtr);
+    if (result != TCL_OK) {
+        return result;
+    }
+    /*
+     * The new bytecodes handling foreach do not use firstValueTemp.
+     * Dropped from saved bytecode.
+     */
+    result = EmitInteger(interp, infoPtr->loopCtTemp, '\n', emitPtr);
+    if (result != TCL_OK) {
+        return result;
+    }
 
-		{
-		    int i, numExceptRanges = compEnvPtr->exceptArrayNext;
-		    ExceptionRange *excPtr = compEnvPtr->exceptArrayPtr;
+    for (i=0 ; i < infoPtr->numLists ; i++) {
+        varListPtr = infoPtr->varLists[i];
 
-		    for (i=0 ; i < numExceptRanges ; i++) {
-			excPtr->numCodeBytes += delta [excPtr->codeOffset + excPtr->numCodeBytes];
-			excPtr->codeOffset   += delta [excPtr->codeOffset];
+        result = EmitInteger(interp, varListPtr->numVars, '\n', emitPtr);
+        if (result != TCL_OK) {
+            return result;
+        }
 
-			switch (excPtr->type) {
-			case CATCH_EXCEPTION_RANGE:
-			    excPtr->catchOffset += delta [excPtr->catchOffset];
-			    break;
-			case LOOP_EXCEPTION_RANGE:
-			    excPtr->breakOffset    += delta [excPtr->breakOffset];
-			    excPtr->continueOffset += delta [excPtr->continueOffset];
-			    break;
-			}
+        varIndexesPtr = &varListPtr->varIndexes[0];
+        separator = ' ';
+        lastEntry = varListPtr->numVars - 1;
+        for (j=0 ; j <= lastEntry ; j++) {
+            if (j == lastEntry) {
+                separator = '\n';
+            }
 
-			excPtr += 1;
-		    }
-		}
+            result = EmitInteger(interp, *varIndexesPtr, separator, emitPtr);
+            if (result != TCL_OK) {
+                return result;
+            }
 
-		/*
-		 * Fix the local infoPtr->infoArrayPtr structures where we
-		 * recorded the locations of the compiled proc commands.
-		 */
+            varIndexesPtr += 1;
+        }
+    }
 
-		{
-		    for (infoArrayPtr=infoPtr->infoArrayPtr ; *infoArrayPtr ; infoArrayPtr++) {
-			bodyInfoPtr = *infoArrayPtr;
+    return TCL_OK;
+}
+#endif
+
+#ifdef TCL_85_PLUS
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitJumptableInfo --
+ *
+ *  Emits a JumptableInfo struct to an EmitContext.
+ *
+ * Results:
+ *  Returns a TCL error code.
+ *
+ * Side effects:
+ *  Sets the TCL result on error.
+ *
+ *----------------------------------------------------------------------
+ */
 
-			bodyInfoPtr->procOffset += delta [bodyInfoPtr->procOffset];
-			bodyInfoPtr->bodyOffset += delta [bodyInfoPtr->bodyOffset];
-		    }
-		}
-	    }
+static int
+EmitJumptableInfo(interp, infoPtr, emitPtr)
+    Tcl_Interp *interp;		/* the current interpreter */
+    JumptableInfo *infoPtr;	/* pointer to the JumptableInfo struct to emit */
+    EmitContext *emitPtr;	/* The context to which the info is emitted */
+{
+    JumpEntry *entries;
+    int i, numJmp;
+    int result;
 
-	    ckfree ((char*) delta);
+    entries = JumptableEntries(infoPtr, emitPtr->flags, &numJmp);
 
-#ifdef DEBUG_REWRITE
-	    fprintf (stderr,"=== AFTER_ START ===\n");
-	    {
-		int i, numExceptRanges = compEnvPtr->exceptArrayNext;
-		ExceptionRange *excPtr = compEnvPtr->exceptArrayPtr;
-		for (i=0 ; i < numExceptRanges ; i++) {
-		    switch (excPtr->type) {
-		    case CATCH_EXCEPTION_RANGE:
-			fprintf (stderr,"EC [%8d] @%4d /%4d : %4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes, excPtr->catchOffset);
-			break;
-		    case LOOP_EXCEPTION_RANGE:
-			fprintf (stderr,"EL [%8d] @%4d /%4d : %4d %4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes, excPtr->breakOffset, excPtr->continueOffset);
-			break;
-		    default:
-			fprintf (stderr,"E? [%8d] @%4d /%4d\n", i, excPtr->codeOffset, excPtr->numCodeBytes);
-		    }
-		    excPtr += 1;
-		}
-	    }
-	    for (pc=compEnvPtr->codeStart ; pc < compEnvPtr->codeNext ; ) {
-		FormatInstruction (compEnvPtr, pc);
-		pc += opCodesTablePtr[*pc].numBytes;
-	    }
-	    fprintf (stderr,"=== AFTER_ END =====\n");
-	    fflush(stderr);
-#endif
-	}
+    result = EmitInteger(interp, numJmp, '\n', emitPtr);
+    for (i=0 ; (result == TCL_OK) && (i < numJmp) ; i++) {
+        result = EmitInteger(interp, entries[i].offset, '\n', emitPtr);
+        if (result == TCL_OK) {
+            result = EmitByteSequence(interp,
+                    (unsigned char *) entries[i].key,
+                    (int) strlen(entries[i].key), emitPtr);
+        }
     }
 
-    /*
-     * (%%%%)
-     * offset is the sum of all shifts we have done; it is used to correct
-     * the original offsets as saved in the ProcBodyInfo structs so that
-     * they correspond to the new bytecodes.
-     * Note that this assumes that the ProcBodyInfo structs are ordered,
-     * which they are because they are built in the compile proc.
-     */
+    ckfree((char *) entries);
+    return result;
+}
 
-    offset = 0;
+/*
+ *----------------------------------------------------------------------
+ *
+ * JumptableEntries --
+ *
+ *  Collects the entries of a jump table, in hash table order, or sorted
+ *  by key with COMPILER_DETERMINISTIC: the hash table order depends on
+ *  the hash function and on the order in which the keys were added.
+ *
+ * Results:
+ *  A new array, to be freed with ckfree. Stores the number of entries
+ *  in *numEntriesPtr.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    for (infoArrayPtr=infoPtr->infoArrayPtr ; *infoArrayPtr ; infoArrayPtr++) {
-        bodyInfoPtr = *infoArrayPtr;
-        newIndex = bodyInfoPtr->bodyNewIndex;
+static JumpEntry *
+JumptableEntries(infoPtr, flags, numEntriesPtr)
+    JumptableInfo *infoPtr;	/* the jump table */
+    int flags;			/* OR-ed combination of COMPILER_* flags */
+    int *numEntriesPtr;		/* Receives the number of entries */
+{
+    Tcl_HashSearch jmpHashSearch;
+    Tcl_HashEntry *jmpHashEntry;
+    JumpEntry *entries;
+    int numEntries = 0;
 
-        /*
-         * correct the offsets to the new bytecodes
-         */
+    entries = (JumpEntry *) ckalloc((infoPtr->hashTable.numEntries + 1)
+            * sizeof(JumpEntry));
+    jmpHashEntry = Tcl_FirstHashEntry(&infoPtr->hashTable, &jmpHashSearch);
+    while (jmpHashEntry) {
+        entries[numEntries].key =
+                Tcl_GetHashKey(&infoPtr->hashTable, jmpHashEntry);
+        entries[numEntries].offset = PTR2INT(Tcl_GetHashValue(jmpHashEntry));
+        numEntries++;
+        jmpHashEntry = Tcl_NextHashEntry(&jmpHashSearch);
+    }
 
-        bodyInfoPtr->procOffset += offset;
-        bodyInfoPtr->bodyOffset += offset;
+    if (flags & COMPILER_DETERMINISTIC) {
+        qsort((VOID *) entries, (size_t) numEntries, sizeof(JumpEntry),
+                CompareJumpEntries);
+    }
 
-        if (newIndex != -1) {
-            /*
-             * Replace the index for the command name object. This is done for
-             * all compiled procedure bodies
-             */
+    *numEntriesPtr = numEntries;
+    return entries;
+}
 
-            pc = compEnvPtr->codeStart + bodyInfoPtr->procOffset;
-            delta = ReplacePushIndex(bodyInfoPtr->commandIndex, pc,
-                    procNameObjIndex, compEnvPtr);
-            offset += delta;
-            bodyInfoPtr->bodyOffset += delta;
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareJumpEntries --
+ *
+ *  qsort comparison function for jump table entries, by key.
+ *
+ * Results:
+ *  Negative, zero or positive as the first key sorts before, equal to or
+ *  after the second.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-            if (newIndex != bodyInfoPtr->bodyOrigIndex) {
-                /*
-                 * replace the index of the body with the unshared index
-                 */
+static int
+CompareJumpEntries(first, second)
+    CONST VOID *first;		/* the first entry */
+    CONST VOID *second;		/* the second entry */
+{
+    return strcmp(((JumpEntry *) first)->key, ((JumpEntry *) second)->key);
+}
+#endif
+
+#ifdef TCL_86_PLUS
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmitDictUpdateInfo --
+ *
+ *  Emits a DictUpdateInfo struct to an EmitContext.
+ *
+ * Results:
+ *  Returns a TCL error code.
+ *
+ * Side effects:
+ *  Sets the TCL result on error.
+ *
+ *----------------------------------------------------------------------
+ */
 
-                pc = compEnvPtr->codeStart + bodyInfoPtr->bodyOffset;
-                delta = ReplacePushIndex(bodyInfoPtr->commandIndex, pc,
-                        newIndex, compEnvPtr);
+static int
+EmitDictUpdateInfo(interp, infoPtr, emitPtr)
+    Tcl_Interp *interp;		/* the current interpreter */
+    DictUpdateInfo *infoPtr;	/* pointer to the DictUpdateInfo struct to emit */
+    EmitContext *emitPtr;	/* The context to which the info is emitted */
+{
+    int result, i;
 
-		/*
-		 * According to (****) the newIndex is the original index,
-		 * thus this replacement should not require growth. Ah. But
-		 * (xxxx) in UnshareProcBodies allows differently. Therefore,
-		 * don't panic! (You have a towel with you, don't you ? ;)
-		 */
+    result = EmitInteger(interp, infoPtr->length, '\n', emitPtr);
+    if (result != TCL_OK) {
+	return result;
+    }
 
-                offset += delta;
-            }
-        }
+    for (i = 0; i < infoPtr->length; i++) {
+	result = EmitInteger(interp, infoPtr->varIndices [i], '\n', emitPtr);
+	if (result != TCL_OK) {
+	    return result;
+	}
     }
+
+    return TCL_OK;
 }
+#endif
 
 /*
  *----------------------------------------------------------------------
  *
- * ReplacePushIndex --
+ * EmitProcBody --
  *
- *  Replaces the operand to a PUSH operation with the new index value.
+ *  Emits the contents of a Proc structure to an EmitContext.
+ *  There are two parts to the dumped information:
+ *   - the dump of the ByteCode structure.
+ *   - the dump of the additional Proc struct values.
  *
  * Results:
- *  Returns the number of bytes by which the bytecodes were shifted in
- *  order to make room for the new operand.
+ *  Returns TCL_OK on success, TCL_ERROR on failure.
  *
  * Side effects:
- *  May modify the bytecodes, possibly reallocating the bytecode array; may
- *  also modify support data structures in the compilation environment.
- *  Panics on error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-ReplacePushIndex(commandIndex, pc, newIndex, compEnvPtr)
-    int commandIndex;		/* the index of the command that contains the
-                                 * PUSH instruction for which we modify the
-                                 * index. */
-    unsigned char *pc;		/* address of the PUSH instruction to modify */
-    int newIndex;		/* the new value of the PUSH operand */
-    CompileEnv *compEnvPtr;	/* the compilation environment to
-                                 * postprocess */
+EmitProcBody(interp, procPtr, emitPtr)
+    Tcl_Interp *interp;		/* the current interpreter */
+    Proc *procPtr;		/* Pointer to the BodyInfoObj structure to be
+                                 * emitted */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
 {
-    int offset = 0;
-
-    switch (*pc) {
-        case INST_PUSH1:
-            if (newIndex < 255) {
-                pc += 1;
-                *pc = (unsigned char) newIndex;
-            } else {
-                int savedOffset = pc - compEnvPtr->codeStart;
-                ShiftByteCodes(commandIndex, savedOffset, 3, compEnvPtr);
-                pc = compEnvPtr->codeStart + savedOffset;
-                *pc++ = INST_PUSH4;
-                *pc++ = (unsigned char) ((unsigned int) newIndex >> 24);
-                *pc++ = (unsigned char) ((unsigned int) newIndex >> 16);
-                *pc++ = (unsigned char) ((unsigned int) newIndex >>  8);
-                *pc++ = (unsigned char) ((unsigned int) newIndex);
+    int result;
+    Tcl_Obj *bodyPtr = procPtr->bodyPtr;
+    CompiledLocal *localPtr;
 
-                /*
-                 * we shifted everything right by 3 bytes
-                 */
+    if (bodyPtr->typePtr != cmpByteCodeType) {
+        panic("EmitProcBody: body is not compiled");
+    }
+    StatsAddProcBody();
 
-                offset += 3;
-            }
-            break;
+    /*
+     * Emit the ByteCode associated with this proc body
+     */
 
-        case INST_PUSH4:
-            /*
-             * Because a 4 byte PUSH supports a single byte, we don't
-             * bother shrinking the bytecodes, just fit the new
-             * index in. It is unlikely that this will happen anyway, because
-             * we add new objects at the end of the object array anyway.
-             */
+    result = EmitByteCode(interp,
+            (ByteCode *) bodyPtr->internalRep.otherValuePtr, emitPtr);
+    if (result != TCL_OK) {
+        return result;
+    }
 
-            pc += 1;
-            *pc++ = (unsigned char) ((unsigned int) newIndex >> 24);
-            *pc++ = (unsigned char) ((unsigned int) newIndex >> 16);
-            *pc++ = (unsigned char) ((unsigned int) newIndex >>  8);
-            *pc++ = (unsigned char) ((unsigned int) newIndex);
-            break;
+    /*
+     * Now the additional Proc fields
+     */
 
-        default:
-            panic("ReplacePushIndex: expected a push opcode");
-            break;
+    if ((EmitInteger(interp, procPtr->numArgs, ' ', emitPtr) != TCL_OK)
+            || (EmitInteger(interp, procPtr->numCompiledLocals, '\n',
+                    emitPtr) != TCL_OK)) {
+        return TCL_ERROR;
+    }
+
+    for (localPtr=procPtr->firstLocalPtr ; localPtr ;
+         localPtr=localPtr->nextPtr) {
+        result = EmitCompiledLocal(interp, localPtr, emitPtr);
+        if (result != TCL_OK) {
+            return result;
+        }
     }
 
-    return offset;
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * ShiftByteCodes --
+ * EmitCompiledLocal --
  *
- *  Moves all bytecodes past a given offset to the right by 'shiftCount'
- *  bytes. This opens up 'shiftCount' bytes in the bytecodes at startOffset.
+ *  Emits a CompiledLocal struct to an EmitContext.
  *
  * Results:
- *  None.
+ *  Returns a TCL result code.
  *
  * Side effects:
- *  May grow the bytecode array. After the shift, it also modifies the
- *  various data structures in the compile environment so that they are
- *  corrected for the shift amount.
+ *  May set the TCL result on error.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-ShiftByteCodes(commandIndex, startOffset, shiftCount, compEnvPtr)
-    int commandIndex;		/* the index of the command that contains the
-                                 * PUSH instruction for which we modify the
-                                 * index. */
-    int startOffset;		/* offset to the first byte to shift, 0 is
-                                 * the first byte in the bytecodes array */
-    int shiftCount;		/* count of bytes by which we shift up */
-    CompileEnv *compEnvPtr;	/* Compilation environment to modify */
+static int
+EmitCompiledLocal(interp, localPtr, emitPtr)
+    Tcl_Interp *interp;		/* the current interpreter */
+    CompiledLocal* localPtr;	/* the struct to emit */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
 {
-    unsigned char *fromPtr, *toPtr;
-    int currBytes, numCmds, i;
-    CmdLocation *locPtr;
-    int numExceptRanges, start, end;
-    ExceptionRange *excPtr;
+    int hasDef = (localPtr->defValuePtr) ? 1 : 0;
+    int i, flags;
+    unsigned int bit, mask;
 
     /*
-     * Grow the array if necessary
+     * First the name.
      */
 
-    if ((compEnvPtr->codeNext + shiftCount) > compEnvPtr->codeEnd) {
-        TclExpandCodeArray(compEnvPtr);
+    if (EmitByteSequence(interp, localPtr->name, localPtr->nameLength,
+            emitPtr) != TCL_OK) {
+        return TCL_ERROR;
     }
 
     /*
-     * the bytes from 0 to (startOffset-1) are fine where they are.
-     * The others need to be moved up by shiftCount bytes.
-     * Use memmove, which guarantees that the copy is correct even with
-     * overlapping source and destination.
+     * The flags are mapped to a bit sequence and written as an int.
+     * This step lets us filter out some flags.
      */
 
-    fromPtr = compEnvPtr->codeStart + startOffset;
-    toPtr = fromPtr + shiftCount;
-    currBytes = compEnvPtr->codeNext - compEnvPtr->codeStart;
-    memmove(toPtr, fromPtr, currBytes - startOffset);
+    bit = 1;
+    mask = 0;
+    flags = localPtr->flags;
+    for (i=0 ; i < varFlagsListSize ; i++) {
+        if (flags & varFlagsList[i]) {
+            mask |= bit;
+        }
+        bit <<= 1;
+    }
 
     /*
-     * Now we need to fix up the data structures.
-     *
-     * First the command location arrays.
-     * We only need to modify entries past the commandIndex.
-     * The entry at commandIndex needs to have its size bumped.
+     * emit the control fields in a single line, except for nameLength
+     * which was emitted with the name.
      */
 
-    compEnvPtr->codeNext += shiftCount;
-
-    locPtr = &compEnvPtr->cmdMapPtr[commandIndex];
-    locPtr->numCodeBytes += shiftCount;
-    locPtr += 1;
-
-    numCmds = compEnvPtr->numCommands;
-    for (i=commandIndex+1 ; i < numCmds ; i++) {
-        locPtr->codeOffset += shiftCount;
-        locPtr += 1;
+    if ((EmitInteger(interp, localPtr->frameIndex, ' ', emitPtr) != TCL_OK)
+            || (EmitInteger(interp, hasDef, ' ', emitPtr) != TCL_OK)
+            || (EmitInteger(interp, mask, '\n', emitPtr) != TCL_OK)) {
+        return TCL_ERROR;
     }
 
     /*
-     * Now the exception ranges.
-     * We need to slide their offsets, so that the range covers the same
-     * sequence of bytecodes as before the shift.
-     *
-     * For catch ranges, we also need to slide the catchOffset
-     * For loop ranges, we need to slide the break and continue Offsets
+     * the default value if any
      */
 
-    numExceptRanges = compEnvPtr->exceptArrayNext;
-    excPtr = compEnvPtr->exceptArrayPtr;
-    for (i=0 ; i < numExceptRanges ; i++) {
-        start = excPtr->codeOffset;
-        if (start > startOffset) {
-            excPtr->codeOffset += shiftCount;
-        } else {
-            end = start + excPtr->numCodeBytes;
-            if (end > startOffset) {
-                /*
-                 * the starting offset for the bytecodes shift was inside the
-                 * range, so in this case we don't bump the code offset,
-                 * but we do bump the number of bytes in the range
-                 */
-
-                excPtr->numCodeBytes += shiftCount;
-            }
-        }
-
-        switch (excPtr->type) {
-            case CATCH_EXCEPTION_RANGE:
-                if (excPtr->catchOffset > startOffset) {
-                    excPtr->catchOffset += shiftCount;
-                }
-                break;
-
-            case LOOP_EXCEPTION_RANGE:
-                if (excPtr->breakOffset > startOffset) {
-                    excPtr->breakOffset += shiftCount;
-                }
-                if (excPtr->continueOffset > startOffset) {
-                    excPtr->continueOffset += shiftCount;
-                }
-                break;
-        }
-
-        excPtr += 1;
+    if (hasDef
+            && (EmitObject(interp, localPtr->defValuePtr, emitPtr)
+                    != TCL_OK)) {
+        return TCL_ERROR;
     }
+
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * GetSharedIndex --
+ * BinEmitCompiledObject --
  *
- *  Looks at the bytecode instruction at *pc, if the instruction is one
- *  that makes a reference to an object in the object table extract the
- *  index operand and return it.
+ *  Emits the contents of a ByteCode structure to an EmitContext as a
+ *  binary container. The loader script is written as text and terminated
+ *  by a ^Z, the binary image follows it. The image is a header (magic,
+ *  container and format versions, flags, compiler and Tcl versions)
+ *  followed by the ByteCode record, see BinEmitByteCode.
  *
  * Results:
- *  Returns an index into the object table, or -1 if this instruction is
- *  not on the list of instructions that make index references.
+ *  Returns a TCL result code.
  *
  * Side effects:
- *  None.
+ *  Switches the channel to binary translation. Appends an error message
+ *  to the TCL error.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-GetSharedIndex(pc)
-    unsigned char *pc;		/* address of the bytecode instruction to
-                                 * examine */
+BinEmitCompiledObject(interp, objPtr, emitPtr)
+    Tcl_Interp *interp;		/* Token for command interpreter
+                                 * (returned by a previous call to
+                                 * Tcl_CreateInterp). */
+    Tcl_Obj *objPtr;		/* Pointer to the object whose bytecode
+                                 * structure is to be written to file */
+    EmitContext *emitPtr;	/* the context to which we want to emit */
 {
-    unsigned int objIndex;
+    Tcl_DString image;
+    BinContext bin;
+    unsigned char header[4];
 
-    switch (*pc) {
-        case INST_PUSH1:
-            objIndex = TclGetUInt1AtPtr(pc+1);
-            break;
+    if (EmitScriptPreamble(interp, PREAMBLE_BINARY, emitPtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
 
-        case INST_PUSH4:
-            objIndex = TclGetUInt4AtPtr(pc+1);
-            break;
+    /*
+     * The preamble is written with the current translation; the image must
+     * be written untranslated. An in-memory context is not translated.
+     */
 
-        default:
-            return -1;
+    if (EmitFlushContext(interp, emitPtr) != TCL_OK) {
+        PrependResult(interp, "error writing bytecode stream: ");
+        return TCL_ERROR;
+    }
+    if ((emitPtr->target != NULL)
+            && (Tcl_SetChannelOption(interp, emitPtr->target, "-translation",
+                    "binary") != TCL_OK)) {
+        PrependResult(interp, "error writing bytecode stream: ");
+        return TCL_ERROR;
     }
 
-    return objIndex;
+    Tcl_DStringInit(&image);
+    bin.flags = emitPtr->flags;
+    bin.numProcs = 0;
+    bin.procCounted = 0;
+    Tcl_DStringInit(&bin.procTable);
+    Tcl_DStringInit(&bin.procBodies);
+
+    header[0] = BINARY_CONTAINER_VERSION;
+    header[1] = (unsigned char) formatVersion;
+    header[2] = BIN_FLAG_VARINT_LOCMAP | BIN_FLAG_COMPACT_AUX; /* features */
+    if (bin.flags & COMPILER_LAZY_PROCS) {
+        header[2] |= BIN_FLAG_LAZY_PROCS;
+    }
+    header[3] = 0;
+    Tcl_DStringAppend(&image, binaryMagic, 4);
+    Tcl_DStringAppend(&image, (char *) header, 4);
+    BinAppendString(&image, CMP_VERSION, -1);
+    BinAppendString(&image, TCL_VERSION, -1);
+
+    BinEmitByteCode((ByteCode *) objPtr->internalRep.otherValuePtr,
+            &bin, &image);
+    if (bin.flags & COMPILER_LAZY_PROCS) {
+        BinEmitProcTable(&bin, &image);
+    }
+    Tcl_DStringFree(&bin.procTable);
+    Tcl_DStringFree(&bin.procBodies);
+
+    if (EmitBytes(interp, Tcl_DStringValue(&image),
+            Tcl_DStringLength(&image), emitPtr) != TCL_OK) {
+        PrependResult(interp, "error writing bytecode stream: ");
+        Tcl_DStringFree(&image);
+        return TCL_ERROR;
+    }
+    Tcl_DStringFree(&image);
+
+    if (EmitFlushContext(interp, emitPtr) != TCL_OK) {
+        PrependResult(interp, "error writing bytecode stream: ");
+        return TCL_ERROR;
+    }
+
+    if ((emitPtr->target != NULL) && (Tcl_Flush(emitPtr->target) != TCL_OK)) {
+        Tcl_AppendResult(interp,
+                "error flushing bytecode stream: Tcl_Flush: ",
+                Tcl_PosixError(interp),
+                (char *) NULL);
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitForeachInfo --
+ * BinEmitByteCode --
  *
- *  Emits a ForeachInfo struct to a Tcl_Channel.
+ *  Appends the binary record of a ByteCode structure to a DString.
+ *  The record starts with the same 13 header fields as the text format,
+ *  followed by the code, location map, literal, exception range and
+ *  AuxData sections.
  *
  * Results:
- *  Returns a TCL error code.
+ *  None.
  *
  * Side effects:
- *  Sets the TCL result on error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-EmitForeachInfo(interp, infoPtr, chan)
-    Tcl_Interp *interp;		/* the current interpreter */
-    ForeachInfo *infoPtr;	/* pointer to the ForeachInfo struct to emit */
-    Tcl_Channel chan;		/* The Tcl_channel to which the info is emitted */
+static void
+BinEmitByteCode(codePtr, binPtr, dsPtr)
+    ByteCode *codePtr;		/* Pointer to the ByteCode structure to be
+                                 * emitted */
+    BinContext *binPtr;		/* the binary emit state */
+    Tcl_DString *dsPtr;		/* the DString to which we want to emit */
 {
-    int i, j, lastEntry, result;
-    int *varIndexesPtr;
-    char separator;
-    ForeachVarList *varListPtr;
-
-    result = EmitInteger(interp, infoPtr->numLists, ' ', chan);
-    if (result != TCL_OK) {
-        return result;
-    }
-    result = EmitInteger(interp, infoPtr->firstValueTemp, ' ', chan);
-    if (result != TCL_OK) {
-        return result;
-    }
-    result = EmitInteger(interp, infoPtr->loopCtTemp, '\n', chan);
-    if (result != TCL_OK) {
-        return result;
-    }
-
-    for (i=0 ; i < infoPtr->numLists ; i++) {
-        varListPtr = infoPtr->varLists[i];
-
-        result = EmitInteger(interp, varListPtr->numVars, '\n', chan);
-        if (result != TCL_OK) {
-            return result;
-        }
-
-        varIndexesPtr = &varListPtr->varIndexes[0];
-        separator = ' ';
-        lastEntry = varListPtr->numVars - 1;
-        for (j=0 ; j <= lastEntry ; j++) {
-            if (j == lastEntry) {
-                separator = '\n';
-            }
+    LocMapSizes locMapSizes;
+    LiteralMap litMap;
+    Tcl_DString section;
+    Tcl_WideInt counted;
+    int i, emitSrcMap, savedPhase;
 
-            result = EmitInteger(interp, *varIndexesPtr, separator, chan);
-            if (result != TCL_OK) {
-                return result;
-            }
+#if EMIT_SRCMAP
+    emitSrcMap = !(binPtr->flags & COMPILER_NO_SRCMAP);
+#else
+    emitSrcMap = 0;
+#endif
 
-            varIndexesPtr += 1;
-        }
+    savedPhase = PhaseEnter(COMPILER_PHASE_EMIT_LITERALS);
+    CompactLiterals(codePtr, binPtr->flags, &litMap);
+    PhaseEnter(COMPILER_PHASE_EMIT);
+    CalculateLocMapSizes(codePtr, &locMapSizes);
+    StatsAddByteCode(codePtr, &litMap);
+
+    BinAppendInt(dsPtr, codePtr->numCommands);
+    BinAppendInt(dsPtr, 0);			/* numSrcChars */
+    BinAppendInt(dsPtr, codePtr->numCodeBytes);
+    BinAppendInt(dsPtr, litMap.numLitObjects);
+    BinAppendInt(dsPtr, codePtr->numExceptRanges);
+    BinAppendInt(dsPtr, codePtr->numAuxDataItems);
+    BinAppendInt(dsPtr, codePtr->numCmdLocBytes);
+    BinAppendInt(dsPtr, codePtr->maxExceptDepth);
+    BinAppendInt(dsPtr, codePtr->maxStackDepth);
+    BinAppendInt(dsPtr, locMapSizes.codeDeltaSize);
+    BinAppendInt(dsPtr, locMapSizes.codeLengthSize);
+    if (emitSrcMap) {
+        BinAppendInt(dsPtr, locMapSizes.srcDeltaSize);
+        BinAppendInt(dsPtr, locMapSizes.srcLengthSize);
+    } else {
+        BinAppendInt(dsPtr, -1);
+        BinAppendInt(dsPtr, -1);
     }
 
-    return TCL_OK;
+    /*
+     * The size accounted for each section includes its tag and length.
+     */
+
+    Tcl_DStringInit(&section);
+
+    PhaseEnter(COMPILER_PHASE_EMIT_CODE);
+    Tcl_DStringAppend(&section, (char *) litMap.codeStart,
+            codePtr->numCodeBytes);
+    PhaseAddBytes(COMPILER_PHASE_EMIT_CODE, Tcl_DStringLength(&section) + 5);
+    BinAppendSection(dsPtr, BIN_CODE_SECTION, &section);
+
+    PhaseEnter(COMPILER_PHASE_EMIT_LOCMAP);
+    BinAppendLocArray(&section, codePtr->codeDeltaStart,
+            codePtr->numCommands, 0);
+    BinAppendLocArray(&section, codePtr->codeLengthStart,
+            codePtr->numCommands, 0);
+    if (emitSrcMap) {
+        BinAppendLocArray(&section, codePtr->srcDeltaStart,
+                codePtr->numCommands, 1);
+        BinAppendLocArray(&section, codePtr->srcLengthStart,
+                codePtr->numCommands, 0);
+    }
+    PhaseAddBytes(COMPILER_PHASE_EMIT_LOCMAP, Tcl_DStringLength(&section) + 5);
+    BinAppendSection(dsPtr, BIN_LOCMAP_SECTION, &section);
+
+    PhaseEnter(COMPILER_PHASE_EMIT_LITERALS);
+    counted = PhaseCountedBytes();
+    for (i=0 ; i < litMap.numLitObjects ; i++) {
+        BinEmitObject(litMap.objArrayPtr[i], binPtr, &section);
+    }
+    PhaseAddBytes(COMPILER_PHASE_EMIT_LITERALS, Tcl_DStringLength(&section)
+            + 5 - (PhaseCountedBytes() - counted));
+    BinAppendSection(dsPtr, BIN_LITERAL_SECTION, &section);
+    FreeLiteralMap(codePtr, &litMap);
+
+    PhaseEnter(COMPILER_PHASE_EMIT_EXCRANGES);
+    BinEmitExcRangeArray(codePtr, &section);
+    PhaseAddBytes(COMPILER_PHASE_EMIT_EXCRANGES,
+            Tcl_DStringLength(&section) + 5);
+    BinAppendSection(dsPtr, BIN_EXCRANGE_SECTION, &section);
+
+    PhaseEnter(COMPILER_PHASE_EMIT_AUXDATA);
+    BinEmitAuxDataArray(codePtr, binPtr, &section);
+    PhaseAddBytes(COMPILER_PHASE_EMIT_AUXDATA,
+            Tcl_DStringLength(&section) + 5);
+    BinAppendSection(dsPtr, BIN_AUXDATA_SECTION, &section);
+
+    Tcl_DStringFree(&section);
+    PhaseLeave(savedPhase);
 }
-
-#ifdef TCL_862_PLUS
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitNewForeachInfo --
+ * BinEmitObject --
  *
- *  Emits a ForeachInfo struct as used by the 8.6.2 bytecode to a Tcl_Channel.
+ *  Appends the binary record of a literal Tcl_Obj to a DString. The
+ *  record is the type code used by the text format, followed by the
+ *  length-prefixed string rep, or by the nested ByteCode or Proc record.
  *
  * Results:
- *  Returns a TCL error code.
+ *  None.
  *
  * Side effects:
- *  Sets the TCL result on error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-EmitNewForeachInfo(interp, infoPtr, chan)
-    Tcl_Interp *interp;		/* the current interpreter */
-    ForeachInfo *infoPtr;	/* pointer to the ForeachInfo struct to emit */
-    Tcl_Channel chan;		/* The Tcl_channel to which the info is emitted */
+static void
+BinEmitObject(objPtr, binPtr, dsPtr)
+    Tcl_Obj* objPtr;	/* the object to emit */
+    BinContext *binPtr;	/* the binary emit state */
+    Tcl_DString *dsPtr;	/* the DString to which we want to emit */
 {
-    int i, j, lastEntry, result;
-    int *varIndexesPtr;
-    char separator;
-    ForeachVarList *varListPtr;
+    const Tcl_ObjType *objTypePtr = objPtr->typePtr;
+    char *objBytes;
+    int objLength;
+    char typeCode;
 
-    result = EmitInteger(interp, infoPtr->numLists, ' ', chan);
-    if (result != TCL_OK) {
-        return result;
-    }
-    /*
-     * The new bytecodes handling foreach do not use firstValueTemp.
-     * Dropped from saved bytecode.
-     */
-    result = EmitInteger(interp, infoPtr->loopCtTemp, '\n', chan);
-    if (result != TCL_OK) {
-        return result;
+    if (objTypePtr == cmpByteCodeType) {
+        typeCode = CMP_BYTECODE_CODE;
+        Tcl_DStringAppend(dsPtr, &typeCode, 1);
+        BinEmitByteCode((ByteCode *) objPtr->internalRep.otherValuePtr,
+                binPtr, dsPtr);
+        return;
+    } else if (objTypePtr == cmpProcBodyType) {
+        typeCode = CMP_PROCBODY_CODE;
+        Tcl_DStringAppend(dsPtr, &typeCode, 1);
+        BinEmitProcBody((Proc *) objPtr->internalRep.otherValuePtr, binPtr,
+                dsPtr);
+        return;
     }
 
-    for (i=0 ; i < infoPtr->numLists ; i++) {
-        varListPtr = infoPtr->varLists[i];
-
-        result = EmitInteger(interp, varListPtr->numVars, '\n', chan);
-        if (result != TCL_OK) {
-            return result;
-        }
-
-        varIndexesPtr = &varListPtr->varIndexes[0];
-        separator = ' ';
-        lastEntry = varListPtr->numVars - 1;
-        for (j=0 ; j <= lastEntry ; j++) {
-            if (j == lastEntry) {
-                separator = '\n';
-            }
-
-            result = EmitInteger(interp, *varIndexesPtr, separator, chan);
-            if (result != TCL_OK) {
-                return result;
-            }
-
-            varIndexesPtr += 1;
-        }
+    typeCode = LiteralTypeCode(objPtr, binPtr->flags);
+
+    objBytes = Tcl_GetStringFromObj(objPtr, &objLength);
+    if (!objBytes) {
+        objBytes = "";
+        objLength = 0;
     }
 
-    return TCL_OK;
+    Tcl_DStringAppend(dsPtr, &typeCode, 1);
+    BinAppendString(dsPtr, objBytes, objLength);
 }
-#endif
-
-#ifdef TCL_85_PLUS
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitJumptableInfo --
+ * BinEmitExcRangeArray --
  *
- *  Emits a JumptableInfo struct to a Tcl_Channel.
+ *  Appends the exception range array for a ByteCode struct to a DString.
  *
  * Results:
- *  Returns a TCL error code.
+ *  None.
  *
  * Side effects:
- *  Sets the TCL result on error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-EmitJumptableInfo(interp, infoPtr, chan)
-    Tcl_Interp *interp;		/* the current interpreter */
-    JumptableInfo *infoPtr;	/* pointer to the JumptableInfo struct to emit */
-    Tcl_Channel chan;		/* The Tcl_channel to which the info is emitted */
+static void
+BinEmitExcRangeArray(codePtr, dsPtr)
+    ByteCode *codePtr;	/* The ByteCode containing the range array */
+    Tcl_DString *dsPtr;	/* the DString to which we want to emit */
 {
-    int result,numJmp;
-    Tcl_HashSearch jmpHashSearch;
-    Tcl_HashEntry *jmpHashEntry;
-    char *key;
-
-    numJmp = 0;
-
-    /* get number of entries */
-    jmpHashEntry = Tcl_FirstHashEntry(&infoPtr->hashTable,&jmpHashSearch);
-    while(jmpHashEntry) {
-      numJmp++;
-      jmpHashEntry = Tcl_NextHashEntry(&jmpHashSearch);
-    }
-
-    result = EmitInteger(interp,  numJmp, '\n', chan);
-    if (result != TCL_OK) {
-      return result;
-    }
-
-    jmpHashEntry = Tcl_FirstHashEntry(&infoPtr->hashTable,&jmpHashSearch);
-    while(jmpHashEntry) {
-      result = EmitInteger(interp,  (int)Tcl_GetHashValue(jmpHashEntry),
-			   '\n', chan);
-      if (result != TCL_OK) {
-        return result;
-      }
+    int i;
+    ExceptionRange *excArrayPtr = codePtr->exceptArrayPtr;
+    char excName;
 
-      key = Tcl_GetHashKey(&infoPtr->hashTable, jmpHashEntry);
+    for (i=0 ; i < codePtr->numExceptRanges ; i++) {
+        excName = NameFromExcRange(excArrayPtr->type);
+        Tcl_DStringAppend(dsPtr, &excName, 1);
+        BinAppendInt(dsPtr, excArrayPtr->nestingLevel);
+        BinAppendInt(dsPtr, excArrayPtr->codeOffset);
+        BinAppendInt(dsPtr, excArrayPtr->numCodeBytes);
+        BinAppendInt(dsPtr, excArrayPtr->breakOffset);
+        BinAppendInt(dsPtr, excArrayPtr->continueOffset);
+        BinAppendInt(dsPtr, excArrayPtr->catchOffset);
 
-      result = EmitByteSequence(interp, key, strlen(key), chan);
-      if (result != TCL_OK) {
-        return result;
-      }
-      jmpHashEntry = Tcl_NextHashEntry(&jmpHashSearch);
+        excArrayPtr += 1;
     }
-    return TCL_OK;
 }
-#endif
-
-#ifdef TCL_86_PLUS
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitDictUpdateInfo --
+ * BinEmitAuxDataArray --
+ *
+ *  Appends the AuxData array for a ByteCode struct to a DString. Each
+ *  item is the type code used by the text format followed by its fields,
+ *  in the BIN_FLAG_COMPACT_AUX layout:
  *
- *  Emits a DictUpdateInfo struct to a Tcl_Channel.
+ *  foreach	numLists [firstValueTemp] loopCtTemp, the numVars of each
+ *		list, then the variable indices of all lists in order.
+ *  jump table	numEntries, the size of the key block, the arm offsets,
+ *		then the key block: the NUL terminated keys, concatenated.
+ *		Offsets and keys are sorted by key, so that the output does
+ *		not depend on the hash table order, and the loader can look
+ *		keys up by binary search or build its hash table sized up
+ *		front.
+ *  dict update	length, then the variable indices.
+ *
+ *  All integers are 4 bytes wide, so that each array can be converted
+ *  as a whole.
  *
  * Results:
- *  Returns a TCL error code.
+ *  None.
  *
  * Side effects:
- *  Sets the TCL result on error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-EmitDictUpdateInfo(interp, infoPtr, chan)
-    Tcl_Interp *interp;		/* the current interpreter */
-    DictUpdateInfo *infoPtr;	/* pointer to the DictUpdateInfo struct to emit */
-    Tcl_Channel chan;		/* The Tcl_channel to which the info is emitted */
+static void
+BinEmitAuxDataArray(codePtr, binPtr, dsPtr)
+    ByteCode *codePtr;	/* The ByteCode containing the AuxData array */
+    BinContext *binPtr;	/* the binary emit state */
+    Tcl_DString *dsPtr;	/* the DString to which we want to emit */
 {
-    int result, i;
+    int i, j, k;
+    AuxData *auxDataPtr = codePtr->auxDataArrayPtr;
+    const AuxDataType *typePtr;
+    char typeCode;
 
-    result = EmitInteger(interp, infoPtr->length, '\n', chan);
-    if (result != TCL_OK) {
-	return result;
-    }
+    for (i=0 ; i < codePtr->numAuxDataItems ; i++) {
+        typePtr = auxDataPtr->type;
+        if ((typePtr == cmpForeachInfoType)
+#ifdef TCL_862_PLUS
+                || (typePtr == cmpNewForeachInfoType)
+#endif
+                ) {
+            ForeachInfo *infoPtr = (ForeachInfo *) auxDataPtr->clientData;
+            ForeachVarList *varListPtr;
 
-    for (i = 0; i < infoPtr->length; i++) {
-	result = EmitInteger(interp, infoPtr->varIndices [i], '\n', chan);
-	if (result != TCL_OK) {
-	    return result;
-	}
-    }
+            typeCode = CMP_FOREACH_INFO;
+#ifdef TCL_862_PLUS
+            if (typePtr == cmpNewForeachInfoType) {
+                typeCode = CMP_FOREACH_INFO_2;
+            }
+#endif
+            Tcl_DStringAppend(dsPtr, &typeCode, 1);
+            BinAppendInt(dsPtr, infoPtr->numLists);
+            if (typeCode == CMP_FOREACH_INFO) {
+                BinAppendInt(dsPtr, infoPtr->firstValueTemp);
+            }
+            BinAppendInt(dsPtr, infoPtr->loopCtTemp);
+            for (j=0 ; j < infoPtr->numLists ; j++) {
+                BinAppendInt(dsPtr, infoPtr->varLists[j]->numVars);
+            }
+            for (j=0 ; j < infoPtr->numLists ; j++) {
+                varListPtr = infoPtr->varLists[j];
+                for (k=0 ; k < varListPtr->numVars ; k++) {
+                    BinAppendInt(dsPtr, varListPtr->varIndexes[k]);
+                }
+            }
+#ifdef TCL_85_PLUS
+        } else if (typePtr == cmpJumptableInfoType) {
+            JumpEntry *entries;
+            int numEntries, keyBytes;
 
-    return TCL_OK;
-}
+            /*
+             * The compact layout is always sorted by key.
+             */
+
+            entries = JumptableEntries(
+                    (JumptableInfo *) auxDataPtr->clientData,
+                    binPtr->flags | COMPILER_DETERMINISTIC, &numEntries);
+            keyBytes = 0;
+            for (j=0 ; j < numEntries ; j++) {
+                keyBytes += strlen(entries[j].key) + 1;
+            }
+            typeCode = CMP_JUMPTABLE_INFO;
+            Tcl_DStringAppend(dsPtr, &typeCode, 1);
+            BinAppendInt(dsPtr, numEntries);
+            BinAppendInt(dsPtr, keyBytes);
+            for (j=0 ; j < numEntries ; j++) {
+                BinAppendInt(dsPtr, entries[j].offset);
+            }
+            for (j=0 ; j < numEntries ; j++) {
+                Tcl_DStringAppend(dsPtr, entries[j].key,
+                        (int) strlen(entries[j].key) + 1);
+            }
+            ckfree((char *) entries);
 #endif
-
+#ifdef TCL_86_PLUS
+        } else if (typePtr == cmpDictUpdateInfoType) {
+            DictUpdateInfo *infoPtr =
+                    (DictUpdateInfo *) auxDataPtr->clientData;
+
+            typeCode = CMP_DICTUPDATE_INFO;
+            Tcl_DStringAppend(dsPtr, &typeCode, 1);
+            BinAppendInt(dsPtr, infoPtr->length);
+            for (j=0 ; j < infoPtr->length ; j++) {
+                BinAppendInt(dsPtr, infoPtr->varIndices[j]);
+            }
+#endif
+        } else {
+            panic("BinEmitAuxDataArray: unknown AuxType \"%s\"",
+                    typePtr->name);
+        }
+
+        auxDataPtr += 1;
+    }
+}
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitProcBody --
+ * BinEmitProcBody --
  *
- *  Emits the contents of a Proc structure to a Tcl_Channel.
- *  There are two parts to the dumped information:
- *   - the dump of the ByteCode structure.
- *   - the dump of the additional Proc struct values.
+ *  Appends the binary record of a Proc structure to a DString: the
+ *  ByteCode record of the body, then numArgs, numCompiledLocals and the
+ *  compiled locals. With COMPILER_LAZY_PROCS only the index of the
+ *  record in the proc table is appended, and the record goes to the
+ *  table.
  *
  * Results:
- *  Returns TCL_OK on success, TCL_ERROR on failure.
+ *  None.
  *
  * Side effects:
  *  None.
@@ -4352,312 +10473,305 @@ EmitDictUpdateInfo(interp, infoPtr, chan)
  *----------------------------------------------------------------------
  */
 
-static int
-EmitProcBody(interp, procPtr, chan)
-    Tcl_Interp *interp;		/* the current interpreter */
-    Proc *procPtr;		/* Pointer to the BodyInfoObj structure to be
+static void
+BinEmitProcBody(procPtr, binPtr, dsPtr)
+    Proc *procPtr;		/* Pointer to the Proc structure to be
                                  * emitted */
-    Tcl_Channel chan;		/* the Tcl_Channel to which we want to emit */
+    BinContext *binPtr;		/* the binary emit state */
+    Tcl_DString *dsPtr;		/* the DString to which we want to emit */
 {
-    int result;
     Tcl_Obj *bodyPtr = procPtr->bodyPtr;
     CompiledLocal *localPtr;
+    Tcl_DString body;
+    Tcl_WideInt counted = 0;
+    unsigned char *entryPtr;
+    int index = 0, offset, length;
 
     if (bodyPtr->typePtr != cmpByteCodeType) {
-        panic("EmitProcBody: body is not compiled");
+        panic("BinEmitProcBody: body is not compiled");
     }
+    StatsAddProcBody();
 
     /*
-     * Emit the ByteCode associated with this proc body
+     * A lazy body is replaced by its index in the proc table. The index is
+     * taken before the body is written, as the body may define procs of
+     * its own.
      */
 
-    result = EmitByteCode(interp,
-            (ByteCode *) bodyPtr->internalRep.otherValuePtr, chan);
-    if (result != TCL_OK) {
-        return result;
+    if (binPtr->flags & COMPILER_LAZY_PROCS) {
+        index = binPtr->numProcs++;
+        BinAppendInt(dsPtr, index);
+        Tcl_DStringSetLength(&binPtr->procTable, 8 * binPtr->numProcs);
+        Tcl_DStringInit(&body);
+        dsPtr = &body;
+        counted = PhaseCountedBytes();
     }
 
-    /*
-     * Now the additional Proc fields
-     */
+    BinEmitByteCode((ByteCode *) bodyPtr->internalRep.otherValuePtr, binPtr,
+            dsPtr);
 
-    if ((EmitInteger(interp, procPtr->numArgs, ' ', chan) != TCL_OK)
-            || (EmitInteger(interp, procPtr->numCompiledLocals, '\n',
-                    chan) != TCL_OK)) {
-        return TCL_ERROR;
-    }
+    BinAppendInt(dsPtr, procPtr->numArgs);
+    BinAppendInt(dsPtr, procPtr->numCompiledLocals);
 
     for (localPtr=procPtr->firstLocalPtr ; localPtr ;
          localPtr=localPtr->nextPtr) {
-        result = EmitCompiledLocal(interp, localPtr, chan);
-        if (result != TCL_OK) {
-            return result;
-        }
+        BinEmitCompiledLocal(localPtr, binPtr, dsPtr);
     }
 
-    return TCL_OK;
+    if (binPtr->flags & COMPILER_LAZY_PROCS) {
+        entryPtr = (unsigned char *) Tcl_DStringValue(&binPtr->procTable)
+                + 8 * index;
+        offset = Tcl_DStringLength(&binPtr->procBodies);
+        length = Tcl_DStringLength(&body);
+        TclStoreInt4AtPtr(offset, entryPtr);
+        TclStoreInt4AtPtr(length, entryPtr + 4);
+        Tcl_DStringAppend(&binPtr->procBodies, Tcl_DStringValue(&body),
+                length);
+        Tcl_DStringFree(&body);
+
+        /*
+         * The body is not part of the enclosing literal section, but of
+         * the proc table, which must not count its sections again.
+         */
+
+        binPtr->procCounted += PhaseCountedBytes() - counted;
+        PhaseResetCountedBytes(counted);
+    }
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EmitCompiledLocal --
+ * BinEmitProcTable --
  *
- *  Emits a CompiledLocal struct to the TclChannel chan.
+ *  Appends the proc table collected with COMPILER_LAZY_PROCS to a
+ *  DString, as a section holding the number of bodies, the offset and
+ *  length of each body, and the body records. Offsets are relative to
+ *  the first body record, so that a loader can keep the section around
+ *  and decode each body on the first call of its proc.
  *
  * Results:
- *  Returns a TCL result code.
+ *  None.
  *
  * Side effects:
- *  May set the TCL result on error.
+ *  Accounts the bytes of the section, less those of the sections of the
+ *  proc bodies, to COMPILER_PHASE_EMIT_PROCTABLE.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-EmitCompiledLocal(interp, localPtr, chan)
-    Tcl_Interp *interp;		/* the current interpreter */
-    CompiledLocal* localPtr;	/* the struct to emit */
-    Tcl_Channel chan;		/* the Tcl_Channel to which we want to emit */
+static void
+BinEmitProcTable(binPtr, dsPtr)
+    BinContext *binPtr;		/* the binary emit state */
+    Tcl_DString *dsPtr;		/* the DString to which we want to emit */
 {
-    int hasDef = (localPtr->defValuePtr) ? 1 : 0;
-    int i, flags;
-    unsigned int bit, mask;
-
-    /*
-     * First the name.
-     */
+    Tcl_DString section;
+    int savedPhase;
+
+    savedPhase = PhaseEnter(COMPILER_PHASE_EMIT_PROCTABLE);
+    Tcl_DStringInit(&section);
+    BinAppendInt(&section, binPtr->numProcs);
+    Tcl_DStringAppend(&section, Tcl_DStringValue(&binPtr->procTable),
+            Tcl_DStringLength(&binPtr->procTable));
+    Tcl_DStringAppend(&section, Tcl_DStringValue(&binPtr->procBodies),
+            Tcl_DStringLength(&binPtr->procBodies));
+    PhaseAddBytes(COMPILER_PHASE_EMIT_PROCTABLE,
+            Tcl_DStringLength(&section) + 5 - binPtr->procCounted);
+    BinAppendSection(dsPtr, BIN_PROCTABLE_SECTION, &section);
+    Tcl_DStringFree(&section);
+    PhaseLeave(savedPhase);
+}
 
-    if (EmitByteSequence(interp, localPtr->name, localPtr->nameLength,
-            chan) != TCL_OK) {
-        return TCL_ERROR;
-    }
+/*
+ *----------------------------------------------------------------------
+ *
+ * BinEmitCompiledLocal --
+ *
+ *  Appends the binary record of a CompiledLocal struct to a DString.
+ *  The flags are mapped through varFlagsList, as in EmitCompiledLocal.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    /*
-     * The flags are mapped to a bit sequence and written as an int.
-     * This step lets us filter out some flags.
-     */
+static void
+BinEmitCompiledLocal(localPtr, binPtr, dsPtr)
+    CompiledLocal* localPtr;	/* the struct to emit */
+    BinContext *binPtr;		/* the binary emit state */
+    Tcl_DString *dsPtr;		/* the DString to which we want to emit */
+{
+    char hasDef = (localPtr->defValuePtr) ? 1 : 0;
+    int i;
+    unsigned int bit, mask;
 
     bit = 1;
     mask = 0;
-    flags = localPtr->flags;
     for (i=0 ; i < varFlagsListSize ; i++) {
-        if (flags & varFlagsList[i]) {
+        if (localPtr->flags & varFlagsList[i]) {
             mask |= bit;
         }
         bit <<= 1;
     }
 
-    /*
-     * emit the control fields in a single line, except for nameLength
-     * which was emitted with the name.
-     */
-
-    if ((EmitInteger(interp, localPtr->frameIndex, ' ', chan) != TCL_OK)
-            || (EmitInteger(interp, hasDef, ' ', chan) != TCL_OK)
-            || (EmitInteger(interp, mask, '\n', chan) != TCL_OK)) {
-        return TCL_ERROR;
-    }
-
-    /*
-     * the default value if any
-     */
+    BinAppendString(dsPtr, localPtr->name, localPtr->nameLength);
+    BinAppendInt(dsPtr, localPtr->frameIndex);
+    Tcl_DStringAppend(dsPtr, &hasDef, 1);
+    BinAppendInt(dsPtr, (int) mask);
 
-    if (hasDef
-            && (EmitObject(interp, localPtr->defValuePtr, chan) != TCL_OK)) {
-        return TCL_ERROR;
+    if (hasDef) {
+        BinEmitObject(localPtr->defValuePtr, binPtr, dsPtr);
     }
-
-    return TCL_OK;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * A85InitEncodeContext --
+ * BinAppendInt --
  *
- *  Initialize an A85EncodeContext struct.
+ *  Appends an integer to a DString, as 4 bytes in big-endian order.
  *
  * Results:
  *  None.
  *
  * Side effects:
- *  initializes the fields of the A85ContextStruct with appropriate values.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-A85InitEncodeContext(target, separator, ctxPtr)
-    Tcl_Channel target;		/* the target channel */
-    char separator;		/* the separator */
-    A85EncodeContext *ctxPtr;	/* pointer to the context to initialize */
+BinAppendInt(dsPtr, value)
+    Tcl_DString *dsPtr;		/* the DString to which we want to emit */
+    int value;			/* the value to emit */
 {
-    ctxPtr->target = target;
-    ctxPtr->basePtr = &ctxPtr->encBuffer[0];
-    ctxPtr->curPtr = ctxPtr->basePtr;
-    ctxPtr->endPtr = ctxPtr->curPtr + ENCODED_BUFFER_SIZE;
-    ctxPtr->separator = separator;
+    unsigned char buf[4];
+
+    TclStoreInt4AtPtr(value, buf);
+    Tcl_DStringAppend(dsPtr, (char *) buf, 4);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * A85EncodeBytes --
+ * BinAppendString --
  *
- *  Encodes a N byte sequence using our modified ASCII85 filter. Typically
- *  N is 4, except that the final tuple may specify that fewer than 4 bytes
- *  are to be encoded. If 'numBytes' < 4, the 'bytesPtr' array is zero padded
- *  to 4.
+ *  Appends a length-prefixed string to a DString.
+ *  If the length is passed as -1, it is calculated with strlen.
  *
  * Results:
- *  Returns a Tcl standard result code.
+ *  None.
  *
  * Side effects:
- *  Modifies the eror result in the interpreter in case of error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-A85EncodeBytes(interp, bytesPtr, numBytes, ctxPtr)
-    Tcl_Interp *interp;		/* the current interpreter */
-    unsigned char *bytesPtr;	/* the 4-byte sequence to encode */
-    int numBytes;		/* how many bytes to encode. If < 4, this
-                                 * is the last set in the run. */
-    A85EncodeContext *ctxPtr;	/* the encoding context */
+static void
+BinAppendString(dsPtr, src, length)
+    Tcl_DString *dsPtr;		/* the DString to which we want to emit */
+    CONST char *src;		/* the string to emit */
+    int length;			/* the length of the string to emit */
 {
-    long int word = 0;
-    int i;
-    char toEmit[5];
-
-    for (i=numBytes ; i < 4 ; i++) {
-        bytesPtr[i] = 0;
-    }
-
-    for (i=3 ; i >= 0 ; i--) {
-        word <<= 8;
-        word |= bytesPtr[i];
-    }
-
-    if (word == 0) {
-        A85EmitChar(interp, 'z', ctxPtr);
-    }  else {
-        int tmp = 0;
-
-        if (word < 0) {
-            /* Because some don't support unsigned long */
-            tmp = 32;
-            word = word - (long)(85L * 85 * 85 * 85 * 32);
-        }
-        if (word < 0) {
-            tmp = 64;
-            word = word - (long)(85L * 85 * 85 * 85 * 32);
-        }
-
-        /*
-         * we emit from least significant to most significant char, so that
-         * the 0 chars from an incomplete 4-tuple are the last ones in the
-         * sequence and can be omitted (for the last 4-tuple in the array)
-         */
-
-        toEmit[4] = EN((word / (long)(85L * 85 * 85 * 85)) + tmp);
-        word %= (long)(85L * 85 * 85 * 85);
-        toEmit[3] = EN(word / (85L * 85 * 85));
-        word %= (85L * 85 * 85);
-        toEmit[2] = EN(word / (85L * 85));
-        word %= (85L * 85);
-        toEmit[1] = EN(word / 85);
-        word %= 85;
-        toEmit[0] = EN(word);
-
-        /*
-         * Emit only 'numBytes+1' chars, since the extra ones are all '!'
-         * and can therefore be reconstructed by the decoder (if we know the
-         * number of bytes that were encoded).
-         */
-
-        for (i=0 ; i <= numBytes ; i++) {
-            A85EmitChar(interp, toEmit[i], ctxPtr);
-        }
+    if (length < 0) {
+        length = strlen(src);
     }
-
-    return TCL_OK;
+    BinAppendInt(dsPtr, length);
+    Tcl_DStringAppend(dsPtr, src, length);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * A85EmitChar --
+ * BinAppendSection --
  *
- *  Emits a character.
+ *  Appends a section (tag, length, payload) to a DString. The section
+ *  buffer is reset, so that it can be reused for the next section.
  *
  * Results:
- *  Returns a Tcl standard result code.
+ *  None.
  *
  * Side effects:
- *  Modifies the error result in the interpreter in case of error.
+ *  Empties the section DString.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-A85EmitChar(interp, toEmit, ctxPtr)
-    Tcl_Interp *interp;		/* the current interpreter */
-    char toEmit;		/* the character to emit */
-    A85EncodeContext *ctxPtr;	/* the encoding context */
+static void
+BinAppendSection(dsPtr, tag, sectionPtr)
+    Tcl_DString *dsPtr;		/* the DString to which we want to emit */
+    char tag;			/* the section tag */
+    Tcl_DString *sectionPtr;	/* the section payload */
 {
-    *(ctxPtr->curPtr) = toEmit;
-    ctxPtr->curPtr += 1;
-
-    if (ctxPtr->curPtr >= ctxPtr->endPtr) {
-        return A85Flush(interp, ctxPtr);
-    }
-
-    return TCL_OK;
+    Tcl_DStringAppend(dsPtr, &tag, 1);
+    BinAppendInt(dsPtr, Tcl_DStringLength(sectionPtr));
+    Tcl_DStringAppend(dsPtr, Tcl_DStringValue(sectionPtr),
+            Tcl_DStringLength(sectionPtr));
+    Tcl_DStringSetLength(sectionPtr, 0);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * A85Flush --
+ * BinAppendLocArray --
  *
- *  Flush the encoded buffer.
+ *  Appends a command location array to a DString, recoding each entry
+ *  from Tcl's encoding (one byte, or 0xFF followed by four bytes) to a
+ *  LEB128 varint. Entries below 128, the common case, still take one
+ *  byte, but the larger ones mostly take two or three bytes instead of
+ *  five. Signed arrays are zigzag encoded first.
  *
  * Results:
- *  Returns a Tcl standard result code.
+ *  None.
  *
  * Side effects:
- *  Modifies the error result in the interpreter in case of error.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-A85Flush(interp, ctxPtr)
-    Tcl_Interp *interp;		/* the current interpreter */
-    A85EncodeContext *ctxPtr;	/* the encoding context */
+static void
+BinAppendLocArray(dsPtr, bytes, numCommands, isSigned)
+    Tcl_DString *dsPtr;		/* the DString to which we want to emit */
+    unsigned char *bytes;	/* the location array */
+    int numCommands;		/* count of commands in the bytecode */
+    int isSigned;		/* non-zero if the entries may be negative */
 {
-    int toWrite = ctxPtr->curPtr - ctxPtr->basePtr;
+    unsigned char buf[5];
+    unsigned int value;
+    int i, entry, length;
 
-    if (Tcl_Write(ctxPtr->target, ctxPtr->basePtr, toWrite) < 0) {
-        Tcl_AppendResult(interp, "Tcl_Write: ", Tcl_PosixError(interp),
-                (char *) NULL);
-        return TCL_ERROR;
-    }
+    for (i=0 ; i < numCommands ; i++) {
+        if (*bytes == 0xff) {
+            entry = TclGetInt4AtPtr(bytes+1);
+            bytes += 5;
+        } else {
+            entry = TclGetInt1AtPtr(bytes);
+            bytes += 1;
+        }
 
-    ctxPtr->curPtr = ctxPtr->basePtr;
+        if (isSigned) {
+            value = (entry < 0) ? ((((unsigned int) ~entry) << 1) | 1)
+                    : (((unsigned int) entry) << 1);
+        } else {
+            value = (unsigned int) entry;
+        }
 
-    if (ctxPtr->separator != '\0') {
-        if (Tcl_Write(ctxPtr->target, &ctxPtr->separator, 1) < 0) {
-            Tcl_AppendResult(interp, "Tcl_Write: ", Tcl_PosixError(interp),
-                    (char *) NULL);
-            return TCL_ERROR;
+        length = 0;
+        while (value >= 0x80) {
+            buf[length++] = (unsigned char) ((value & 0x7f) | 0x80);
+            value >>= 7;
         }
+        buf[length++] = (unsigned char) value;
+        Tcl_DStringAppend(dsPtr, (char *) buf, length);
     }
-
-    return TCL_OK;
 }
+
 
 #ifdef DEBUG_REWRITE
 /*
@@ -24,6 +24,75 @@
 #define LOADER_ERROR_VARIABLE "LoaderError"
 #define LOADER_ERROR_MESSAGE "The TclPro ByteCode Loader is not available or does not support the correct version"
 
+/*
+ * Flags accepted by Compiler_CompileFileEx, selecting the layout of the
+ * generated compiled script.
+ *
+ * COMPILER_BINARY	Emit the ByteCode as a binary container appended to
+ *			the loader preamble, instead of the ASCII85 text
+ *			stream. Experimental: requires tbcload 2.0, the first
+ *			loader supporting "bceval -binary".
+ * COMPILER_NO_SRCMAP	Do not emit the source offset maps of the commands.
+ *			They are of no use to the loader when the script
+ *			source is not shipped with the compiled script.
+ * COMPILER_LAZY_PROCS	Move the precompiled proc bodies of a binary
+ *			container to a proc table with an offset per body,
+ *			so that the loader can decode them on first call.
+ * COMPILER_OPTIMIZE	Run the peephole optimizer over the bytecodes of the
+ *			script and of the precompiled proc bodies.
+ * COMPILER_STREAM	Read the script incrementally, and compile and emit
+ *			its top-level commands in units of bounded size, each
+ *			evaluated by its own loader call. Only for the ASCII85
+ *			text stream.
+ * COMPILER_DETERMINISTIC
+ *			Make the output depend on the script only: write jump
+ *			tables sorted by key, and literals without the type
+ *			hints taken from the internal rep they happened to get
+ *			in the literal table shared with earlier compiles.
+ * COMPILER_COMPACT_LITERALS
+ *			Drop the literals no push instruction references, and
+ *			merge the literals written out identically, see
+ *			CompactLiterals. Not yet checked against tbcload 1.6.
+ */
+
+#define COMPILER_BINARY		(1<<0)
+#define COMPILER_NO_SRCMAP	(1<<1)
+#define COMPILER_LAZY_PROCS	(1<<2)
+#define COMPILER_OPTIMIZE	(1<<3)
+#define COMPILER_STREAM		(1<<4)
+#define COMPILER_DETERMINISTIC	(1<<5)
+#define COMPILER_COMPACT_LITERALS (1<<6)
+
+/*
+ * The phases of a compilation, as reported by Compiler_GetPhaseStats.
+ * Time is accounted exclusively: the time spent compiling proc bodies is
+ * not part of COMPILER_PHASE_COMPILE, and so on. The EMIT_* phases also
+ * account the bytes written for the matching section of each ByteCode;
+ * COMPILER_PHASE_EMIT_PROCTABLE the proc table of COMPILER_LAZY_PROCS,
+ * less the sections of the proc bodies in it; COMPILER_PHASE_EMIT covers
+ * the rest of the output (preamble, headers).
+ */
+
+#define COMPILER_PHASE_COMPILE		0
+#define COMPILER_PHASE_PROCBODIES	1
+#define COMPILER_PHASE_UPDATE		2
+#define COMPILER_PHASE_OPTIMIZE		3
+#define COMPILER_PHASE_EMIT		4
+#define COMPILER_PHASE_EMIT_CODE	5
+#define COMPILER_PHASE_EMIT_LOCMAP	6
+#define COMPILER_PHASE_EMIT_LITERALS	7
+#define COMPILER_PHASE_EMIT_EXCRANGES	8
+#define COMPILER_PHASE_EMIT_AUXDATA	9
+#define COMPILER_PHASE_EMIT_PROCTABLE	10
+#define COMPILER_NUM_PHASES		11
+
+typedef struct Compiler_PhaseStats {
+    Tcl_WideInt usec[COMPILER_NUM_PHASES];	/* time in each phase, in
+						 * microseconds */
+    Tcl_WideInt bytes[COMPILER_NUM_PHASES];	/* bytes written in each
+						 * EMIT_* phase */
+} Compiler_PhaseStats;
+
 /*
  *----------------------------------------------------------------
  * Procedures exported by cmpWrite.c and cmpWPkg.c
@@ -37,15 +106,38 @@
 #   define TCL_STORAGE_CLASS DLLIMPORT
 #endif
 
+EXTERN int	Compiler_BundleObjCmd _ANSI_ARGS_((ClientData dummy,
+			Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
+EXTERN int	Compiler_CacheObjCmd _ANSI_ARGS_((ClientData dummy,
+			Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
 EXTERN int	Compiler_CompileObjCmd _ANSI_ARGS_((ClientData dummy,
 			Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
 EXTERN int	Compiler_CompileFile _ANSI_ARGS_((Tcl_Interp *interp,
 			char *inFilePtr, char *outFilePtr, char *preamblePtr));
+EXTERN int	Compiler_CompileFileEx _ANSI_ARGS_((Tcl_Interp *interp,
+			char *inFilePtr, char *outFilePtr, char *preamblePtr,
+			int flags));
+EXTERN int	Compiler_CompileFilesObjCmd _ANSI_ARGS_((ClientData dummy,
+			Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
 EXTERN int	Compiler_CompileObj _ANSI_ARGS_((Tcl_Interp *interp,
 			Tcl_Obj *objPtr));
+EXTERN int	Compiler_CompileObjEx _ANSI_ARGS_((Tcl_Interp *interp,
+			Tcl_Obj *objPtr, int flags));
+EXTERN int	Compiler_CompileParallelObjCmd _ANSI_ARGS_((ClientData dummy,
+			Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
+EXTERN int	Compiler_CompileStringObjCmd _ANSI_ARGS_((ClientData dummy,
+			Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
+EXTERN Tcl_Obj *
+		Compiler_CompileToObj _ANSI_ARGS_((Tcl_Interp *interp,
+			Tcl_Obj *scriptObjPtr, char *preamblePtr, int flags));
+EXTERN void	Compiler_EnablePhaseStats _ANSI_ARGS_((int enable));
 EXTERN int	Compiler_GetBytecodeExtensionObjCmd
 			_ANSI_ARGS_((ClientData dummy,
 			Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
+EXTERN void	Compiler_GetPhaseStats _ANSI_ARGS_((
+			Compiler_PhaseStats *statsPtr));
+EXTERN int	Compiler_MemoryObjCmd _ANSI_ARGS_((ClientData dummy,
+			Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
 
 EXTERN CONST char *
 		CompilerGetPackageName _ANSI_ARGS_((void));
@@ -0,0 +1,378 @@
+/*
+ * cmpbench.c --
+ *
+ *  The compiler benchmark. Compiles a corpus of Tcl scripts in memory and
+ *  reports the time spent in each phase of the compiler, the size of
+ *  each section of the output, and the overall throughput.
+ *
+ *  Usage:
+ *    cmpbench ?-binary? ?-iterations count? ?-optimize? ?-srcdir dir?
+ *		?path ...?
+ *  Each path is a script, or a directory whose *.tcl files are compiled.
+ *  The default corpus is the checker, debugger and wrapengine sources,
+ *  looked up in the directory given by -srcdir (by default "..", the lib
+ *  directory of the source tree when run from this directory).
+ *
+ *  Copyright (c) 2018 ActiveState Software Inc.
+ *  Released under the BSD-3 license. See LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tcl.h"
+#include "cmpWrite.h"
+
+/*
+ * The subdirectories of -srcdir making up the default corpus.
+ */
+
+static char *defaultCorpus[] = {
+    "checker", "debugger", "wrapengine", NULL
+};
+
+/*
+ * The names of the COMPILER_PHASE_* phases, in order.
+ */
+
+static char *phaseNames[COMPILER_NUM_PHASES] = {
+    "compile", "proc bodies", "update bytecodes", "optimize", "emit (other)",
+    "emit code", "emit locmap", "emit literals", "emit excranges",
+    "emit auxdata", "emit proctable"
+};
+
+static char usage[] =
+    "usage: cmpbench ?-binary? ?-iterations count? ?-optimize? ?-srcdir dir? "
+    "?path ...?";
+
+/*
+ * Declarations for functions defined in this file.
+ */
+
+static int	AddPath _ANSI_ARGS_((Tcl_Interp *interp, char *path,
+			Tcl_Obj *filesObjPtr));
+static double	Elapsed _ANSI_ARGS_((Tcl_Time *startPtr, Tcl_Time *stopPtr));
+static Tcl_Obj *
+		ReadScript _ANSI_ARGS_((Tcl_Interp *interp, Tcl_Obj *pathPtr));
+static void	Report _ANSI_ARGS_((int numFiles, int iterations,
+			Tcl_WideInt inputBytes, Tcl_WideInt outputBytes,
+			double readTime, double compileTime,
+			Compiler_PhaseStats *statsPtr));
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * main --
+ *
+ *  Parses the command line, compiles the corpus the requested number of
+ *  times, and prints the report.
+ *
+ * Results:
+ *  0 on success, 1 on a usage error, 2 if some file could not be read
+ *  or compiled.
+ *
+ * Side effects:
+ *  Writes the report to stdout, errors to stderr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+main(argc, argv)
+    int argc;			/* Number of command-line arguments. */
+    char **argv;		/* Values of command-line arguments. */
+{
+    Tcl_Interp *interp;
+    Tcl_Obj *filesObjPtr, **fileObjv, *scriptObjPtr, *outObjPtr;
+    Tcl_Time start, stop;
+    Tcl_WideInt inputBytes, outputBytes;
+    Compiler_PhaseStats stats;
+    Tcl_DString path;
+    char *srcDir = "..";
+    double readTime, compileTime;
+    int flags = 0, iterations = 1, numFiles, length, status = 0;
+    int i, n;
+
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    if ((Tcl_Init(interp) != TCL_OK) || (Tclcompiler_Init(interp) != TCL_OK)) {
+        fprintf(stderr, "cmpbench: %s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+
+    for (i=1 ; (i < argc) && (argv[i][0] == '-') ; i++) {
+        if (!strcmp(argv[i], "-binary")) {
+            flags |= COMPILER_BINARY;
+        } else if (!strcmp(argv[i], "-iterations") && (i + 1 < argc)) {
+            iterations = atoi(argv[++i]);
+            if (iterations < 1) {
+                fprintf(stderr, "%s\n", usage);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-optimize")) {
+            flags |= COMPILER_OPTIMIZE;
+        } else if (!strcmp(argv[i], "-srcdir") && (i + 1 < argc)) {
+            srcDir = argv[++i];
+        } else {
+            fprintf(stderr, "%s\n", usage);
+            return 1;
+        }
+    }
+
+    filesObjPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(filesObjPtr);
+
+    if (i < argc) {
+        for ( ; i < argc ; i++) {
+            if (AddPath(interp, argv[i], filesObjPtr) != TCL_OK) {
+                fprintf(stderr, "cmpbench: %s\n", Tcl_GetStringResult(interp));
+                return 1;
+            }
+        }
+    } else {
+        for (n=0 ; defaultCorpus[n] ; n++) {
+            Tcl_DStringInit(&path);
+            Tcl_DStringAppend(&path, srcDir, -1);
+            Tcl_DStringAppend(&path, "/", 1);
+            Tcl_DStringAppend(&path, defaultCorpus[n], -1);
+            if (AddPath(interp, Tcl_DStringValue(&path), filesObjPtr)
+                    != TCL_OK) {
+                fprintf(stderr, "cmpbench: %s\n", Tcl_GetStringResult(interp));
+                return 1;
+            }
+            Tcl_DStringFree(&path);
+        }
+    }
+
+    Tcl_ListObjGetElements(NULL, filesObjPtr, &numFiles, &fileObjv);
+    if (numFiles == 0) {
+        fprintf(stderr, "cmpbench: no scripts to compile\n");
+        return 1;
+    }
+
+    inputBytes = outputBytes = 0;
+    readTime = compileTime = 0.0;
+    Compiler_EnablePhaseStats(1);
+
+    for (n=0 ; n < iterations ; n++) {
+        for (i=0 ; i < numFiles ; i++) {
+            Tcl_GetTime(&start);
+            scriptObjPtr = ReadScript(interp, fileObjv[i]);
+            Tcl_GetTime(&stop);
+            readTime += Elapsed(&start, &stop);
+            if (scriptObjPtr == NULL) {
+                fprintf(stderr, "cmpbench: %s\n", Tcl_GetStringResult(interp));
+                status = 2;
+                continue;
+            }
+
+            Tcl_GetTime(&start);
+            outObjPtr = Compiler_CompileToObj(interp, scriptObjPtr, NULL,
+                    flags);
+            Tcl_GetTime(&stop);
+            compileTime += Elapsed(&start, &stop);
+
+            if (outObjPtr == NULL) {
+                fprintf(stderr, "cmpbench: %s: %s\n",
+                        Tcl_GetString(fileObjv[i]),
+                        Tcl_GetStringResult(interp));
+                status = 2;
+            } else {
+                Tcl_GetStringFromObj(scriptObjPtr, &length);
+                inputBytes += length;
+                Tcl_GetByteArrayFromObj(outObjPtr, &length);
+                outputBytes += length;
+                Tcl_DecrRefCount(outObjPtr);
+            }
+            Tcl_DecrRefCount(scriptObjPtr);
+        }
+    }
+
+    Compiler_GetPhaseStats(&stats);
+    Compiler_EnablePhaseStats(0);
+
+    Report(numFiles, iterations, inputBytes, outputBytes, readTime,
+            compileTime, &stats);
+
+    Tcl_DecrRefCount(filesObjPtr);
+    Tcl_DeleteInterp(interp);
+    return status;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AddPath --
+ *
+ *  Appends a script to the list of files, or the *.tcl files of a
+ *  directory in sorted order.
+ *
+ * Results:
+ *  A standard Tcl result.
+ *
+ * Side effects:
+ *  Modifies the list of files.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AddPath(interp, path, filesObjPtr)
+    Tcl_Interp *interp;		/* the interpreter */
+    char *path;			/* the script or directory */
+    Tcl_Obj *filesObjPtr;	/* the list of files to add to */
+{
+    static char script[] = "\
+if {[file isdirectory $path]} {\n\
+    lsort [glob -nocomplain -types f -directory $path *.tcl]\n\
+} elseif {[file isfile $path]} {\n\
+    list $path\n\
+} else {\n\
+    error \"no such file or directory \\\"$path\\\"\"\n\
+}";
+
+    if ((Tcl_SetVar(interp, "path", path, TCL_LEAVE_ERR_MSG) == NULL)
+            || (Tcl_Eval(interp, script) != TCL_OK)) {
+        return TCL_ERROR;
+    }
+    return Tcl_ListObjAppendList(interp, filesObjPtr,
+            Tcl_GetObjResult(interp));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReadScript --
+ *
+ *  Reads a script the way Compiler_CompileFile does.
+ *
+ * Results:
+ *  A new object with a reference count of 1 holding the script, or NULL
+ *  on error, with a message in the interpreter result.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ReadScript(interp, pathPtr)
+    Tcl_Interp *interp;		/* the interpreter */
+    Tcl_Obj *pathPtr;		/* the script to read */
+{
+    Tcl_Channel chan;
+    Tcl_Obj *scriptObjPtr;
+
+    chan = Tcl_FSOpenFileChannel(interp, pathPtr, "r", 0644);
+    if (chan == (Tcl_Channel) NULL) {
+        return NULL;
+    }
+
+    scriptObjPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(scriptObjPtr);
+    if (Tcl_ReadChars(chan, scriptObjPtr, -1, 0) < 0) {
+        Tcl_AppendResult(interp, "cannot read \"", Tcl_GetString(pathPtr),
+                "\": ", Tcl_PosixError(interp), NULL);
+        Tcl_Close(interp, chan);
+        Tcl_DecrRefCount(scriptObjPtr);
+        return NULL;
+    }
+    Tcl_Close(interp, chan);
+
+    return scriptObjPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Elapsed --
+ *
+ *  Returns the time between two clock readings.
+ *
+ * Results:
+ *  The elapsed time in seconds.
+ *
+ * Side effects:
+ *  None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static double
+Elapsed(startPtr, stopPtr)
+    Tcl_Time *startPtr;		/* the earlier reading */
+    Tcl_Time *stopPtr;		/* the later reading */
+{
+    return (stopPtr->sec - startPtr->sec)
+            + (stopPtr->usec - startPtr->usec) / 1000000.0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Report --
+ *
+ *  Prints the benchmark report: the totals, then the time of each phase
+ *  and the bytes of each output section. Sizes are per iteration. The
+ *  bytes not accounted to a section (preamble, headers) are shown for
+ *  the "emit (other)" phase, and the compile time not accounted to any
+ *  phase (setup, literal table handling) as "unaccounted".
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Writes to stdout.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Report(numFiles, iterations, inputBytes, outputBytes, readTime,
+        compileTime, statsPtr)
+    int numFiles;		/* number of files in the corpus */
+    int iterations;		/* number of times the corpus was compiled */
+    Tcl_WideInt inputBytes;	/* total bytes compiled */
+    Tcl_WideInt outputBytes;	/* total bytes produced */
+    double readTime;		/* total time spent reading, in seconds */
+    double compileTime;		/* total time spent compiling, in seconds */
+    Compiler_PhaseStats *statsPtr;	/* the phase statistics */
+{
+    Tcl_WideInt sectionBytes = 0, phaseUsec = 0, bytes;
+    double mb = 1024.0 * 1024.0;
+    int i;
+
+    for (i=0 ; i < COMPILER_NUM_PHASES ; i++) {
+        sectionBytes += statsPtr->bytes[i];
+        phaseUsec += statsPtr->usec[i];
+    }
+
+    printf("files            %d x %d iterations\n", numFiles, iterations);
+    printf("input            %.0f bytes\n", (double) inputBytes / iterations);
+    printf("output           %.0f bytes (%.2f x input)\n",
+            (double) outputBytes / iterations,
+            inputBytes ? (double) outputBytes / inputBytes : 0.0);
+    printf("read             %.3f s\n", readTime);
+    printf("compile          %.3f s, %.2f MB/s\n", compileTime,
+            (compileTime > 0.0) ? inputBytes / mb / compileTime : 0.0);
+    printf("\n%-18s %12s %7s %12s %7s\n", "phase", "usec", "%", "bytes",
+            "%");
+
+    for (i=0 ; i < COMPILER_NUM_PHASES ; i++) {
+        bytes = statsPtr->bytes[i];
+        if (i == COMPILER_PHASE_EMIT) {
+            bytes = outputBytes - sectionBytes;
+        }
+        printf("%-18s %12.0f %6.1f%% %12.0f %6.1f%%\n", phaseNames[i],
+                (double) statsPtr->usec[i],
+                compileTime > 0.0
+                        ? statsPtr->usec[i] / (compileTime * 10000.0) : 0.0,
+                (double) bytes / iterations,
+                outputBytes ? 100.0 * bytes / outputBytes : 0.0);
+    }
+    printf("%-18s %12.0f %6.1f%%\n", "unaccounted",
+            compileTime * 1000000.0 - phaseUsec,
+            compileTime > 0.0
+                    ? 100.0 - phaseUsec / (compileTime * 10000.0) : 0.0);
+}
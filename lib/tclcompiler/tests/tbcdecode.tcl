@@ -0,0 +1,833 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# tbcdecode.tcl --
+#
+#  Reference decoder for the compiled scripts written by the compiler
+#  package, used by the tests to show that what the compiler writes can be
+#  read back. It reads both the ASCII85 text stream and the binary
+#  container (-binary, -lazyprocs), and returns the same description of
+#  the ByteCode for both:
+#
+#	numCommands numSrcChars numCodeBytes numLitObjects numExceptRanges
+#	numAuxDataItems numCmdLocBytes maxExceptDepth maxStackDepth
+#	codeDeltaSize codeLengthSize srcDeltaSize srcLengthSize
+#		the header fields, as written.
+#	code	the bytecodes, a byte array.
+#	codeDelta codeLength srcDelta srcLength
+#		the command location arrays, as lists of integers. The source
+#		arrays are empty if the maps were dropped (-nosrcmap).
+#	literals
+#		a list of {type value}: s (string), i, d with the string rep
+#		as value, b with a ByteCode description, p with a proc
+#		description {bytecode numArgs numCompiledLocals locals}.
+#		The locals are lists {name frameIndex hasDef flags ?default?}.
+#	exceptRanges
+#		a list of {type nestingLevel codeOffset numCodeBytes
+#		breakOffset continueOffset catchOffset}.
+#	auxData	a list of {type fields}, see TextAux and BinAux.
+#
+#  String values are byte arrays of the UTF-8 rep. Jump tables are sorted
+#  by key, as the text stream has them in hash table order. Lazy proc
+#  bodies are resolved through the proc table. Inconsistencies, such as a
+#  section or size that does not match its contents, raise an error.
+
+namespace eval tbcdecode {
+    # The ASCII85 digits of the text stream, in order; see encodeMap in
+    # cmpWrite.c.
+
+    variable digits "!v#w%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZxy|^_`abcdefghijklmnopqrstu"
+    variable digitValue
+    for {set i 0} {$i < 85} {incr i} {
+	set digitValue([string index $digits $i]) $i
+    }
+    unset i
+
+    # The names of the header fields of a ByteCode, in order.
+
+    variable fields {
+	numCommands numSrcChars numCodeBytes numLitObjects numExceptRanges
+	numAuxDataItems numCmdLocBytes maxExceptDepth maxStackDepth
+	codeDeltaSize codeLengthSize srcDeltaSize srcLengthSize
+    }
+
+    # The data being decoded and the current position in it, and the state
+    # of a binary container: its feature flags and its proc table.
+
+    variable data {}
+    variable pos 0
+    variable features 0
+    variable procTable {}
+    variable procBodies {}
+    variable procUsed
+}
+
+# tbcdecode::file --
+#
+#  Decodes a compiled script file.
+#
+# Arguments:
+#  path		the file.
+#
+# Results:
+#  Returns a dictionary with the keys format (text or binary), header
+#  (the signature or container header fields) and bytecode.
+
+proc tbcdecode::file {path} {
+    set chan [open $path r]
+    fconfigure $chan -translation binary
+    set image [read $chan]
+    close $chan
+    return [decode $image]
+}
+
+# tbcdecode::decode --
+#
+#  Decodes a compiled script, as written to a file or returned by
+#  compiler::compileString.
+#
+# Arguments:
+#  image	the compiled script, a byte array.
+#
+# Results:
+#  See tbcdecode::file.
+
+proc tbcdecode::decode {image} {
+    variable data
+    variable pos
+
+    set start [string first \x1a $image]
+    if {$start >= 0} {
+	set data $image
+	set pos [expr {$start + 1}]
+	return [Binary]
+    }
+
+    # The signature starts a line; the preamble may name the loader too.
+
+    if {![regexp -indices "(?:^|\n)TclPro ByteCode " $image match]} {
+	error "no compiled script found"
+    }
+    set data $image
+    set pos [expr {[lindex $match 1] + 1}]
+    set header {}
+    foreach key {formatVersion buildNumber compilerVersion tclVersion} {
+	lappend header $key [Token]
+    }
+    return [list format text header $header bytecode [TextByteCode]]
+}
+
+# tbcdecode::Fail --
+#
+#  Raises a decoding error, with the position.
+
+proc tbcdecode::Fail {message} {
+    variable pos
+    error "$message at byte $pos"
+}
+
+# tbcdecode::Token --
+#
+#  Reads a whitespace delimited token of the text stream.
+
+proc tbcdecode::Token {} {
+    variable data
+    variable pos
+
+    set length [string length $data]
+    while {($pos < $length) && [string is space [string index $data $pos]]} {
+	incr pos
+    }
+    set start $pos
+    while {($pos < $length) && ![string is space [string index $data $pos]]} {
+	incr pos
+    }
+    if {$start == $pos} {
+	Fail "unexpected end of data"
+    }
+    return [string range $data $start [expr {$pos - 1}]]
+}
+
+# tbcdecode::Int --
+#
+#  Reads an integer of the text stream.
+
+proc tbcdecode::Int {} {
+    set token [Token]
+    if {![string is integer -strict $token]} {
+	Fail "expected an integer, got \"$token\""
+    }
+    return $token
+}
+
+# tbcdecode::Line --
+#
+#  Reads the line following the current one, for the string rep of an
+#  integer or double literal.
+
+proc tbcdecode::Line {} {
+    variable data
+    variable pos
+
+    if {[string index $data $pos] ne "\n"} {
+	Fail "expected a newline"
+    }
+    incr pos
+    set end [string first \n $data $pos]
+    if {$end < 0} {
+	Fail "unterminated line"
+    }
+    set line [string range $data $pos [expr {$end - 1}]]
+    set pos [expr {$end + 1}]
+    return $line
+}
+
+# tbcdecode::Bytes --
+#
+#  Reads a byte sequence of the text stream: the count, then the ASCII85
+#  digits, 'z' standing for four zero bytes, and a partial last tuple
+#  having one digit more than its bytes.
+
+proc tbcdecode::Bytes {} {
+    variable data
+    variable pos
+    variable digitValue
+
+    set count [Int]
+    set bytes {}
+    while {$count > 0} {
+	set num [expr {($count < 4) ? $count : 4}]
+	set c [NextDigit]
+	if {$c eq "z"} {
+	    set word 0
+	} else {
+	    set word 0
+	    set scale 1
+	    for {set i 0} {$i <= $num} {incr i} {
+		if {$i > 0} {
+		    set c [NextDigit]
+		}
+		if {![info exists digitValue($c)]} {
+		    Fail "bad ASCII85 digit \"$c\""
+		}
+		incr word [expr {$digitValue($c) * $scale}]
+		set scale [expr {$scale * 85}]
+	    }
+	    if {$word > 0xffffffff} {
+		Fail "ASCII85 tuple out of range"
+	    }
+	}
+	append bytes [string range [binary format i $word] 0 [expr {$num - 1}]]
+	incr count -$num
+    }
+    return $bytes
+}
+
+proc tbcdecode::NextDigit {} {
+    variable data
+    variable pos
+
+    while {[string index $data $pos] eq "\n"} {
+	incr pos
+    }
+    if {$pos >= [string length $data]} {
+	Fail "unexpected end of data"
+    }
+    set c [string index $data $pos]
+    incr pos
+    return $c
+}
+
+# tbcdecode::TclLocArray --
+#
+#  Decodes a command location array in Tcl's encoding: a signed byte, or
+#  0xFF followed by a 4 byte big-endian integer.
+
+proc tbcdecode::TclLocArray {bytes count} {
+    set values {}
+    set i 0
+    for {set n 0} {$n < $count} {incr n} {
+	if {$i >= [string length $bytes]} {
+	    Fail "location array too short"
+	}
+	binary scan $bytes @${i}c value
+	if {($value & 0xff) == 0xff} {
+	    binary scan $bytes @[expr {$i + 1}]I value
+	    incr i 5
+	} else {
+	    incr i
+	}
+	lappend values $value
+    }
+    if {$i != [string length $bytes]} {
+	Fail "location array too long"
+    }
+    return $values
+}
+
+# tbcdecode::TclLocSize --
+#
+#  Computes the size of a location array in Tcl's encoding.
+
+proc tbcdecode::TclLocSize {values} {
+    set size 0
+    foreach value $values {
+	incr size [expr {(($value >= -127) && ($value <= 127)) ? 1 : 5}]
+    }
+    return $size
+}
+
+# tbcdecode::CheckLocations --
+#
+#  Checks the location arrays of a ByteCode against its header.
+
+proc tbcdecode::CheckLocations {bcVar} {
+    upvar 1 $bcVar bc
+
+    set map {codeDelta codeDeltaSize codeLength codeLengthSize}
+    if {[dict get $bc srcDeltaSize] >= 0} {
+	lappend map srcDelta srcDeltaSize srcLength srcLengthSize
+    } elseif {[dict get $bc srcLengthSize] >= 0} {
+	Fail "source delta map dropped without the source length map"
+    }
+    foreach {array size} $map {
+	if {[TclLocSize [dict get $bc $array]] != [dict get $bc $size]} {
+	    Fail "$array does not match $size [dict get $bc $size]"
+	}
+    }
+}
+
+# tbcdecode::TextByteCode --
+#
+#  Reads a ByteCode of the text stream, see EmitByteCode.
+
+proc tbcdecode::TextByteCode {} {
+    variable fields
+
+    set bc {}
+    foreach key $fields {
+	dict set bc $key [Int]
+    }
+    set numCommands [dict get $bc numCommands]
+
+    set code [Bytes]
+    if {[string length $code] != [dict get $bc numCodeBytes]} {
+	Fail "code is not numCodeBytes long"
+    }
+    dict set bc code $code
+    dict set bc codeDelta [TclLocArray [Bytes] $numCommands]
+    dict set bc codeLength [TclLocArray [Bytes] $numCommands]
+    if {[dict get $bc srcDeltaSize] >= 0} {
+	dict set bc srcDelta [TclLocArray [Bytes] $numCommands]
+	dict set bc srcLength [TclLocArray [Bytes] $numCommands]
+    } else {
+	dict set bc srcDelta {}
+	dict set bc srcLength {}
+    }
+    CheckLocations bc
+
+    set literals {}
+    set count [Int]
+    if {$count != [dict get $bc numLitObjects]} {
+	Fail "literal count does not match numLitObjects"
+    }
+    for {set i 0} {$i < $count} {incr i} {
+	lappend literals [TextObject]
+    }
+    dict set bc literals $literals
+
+    set ranges {}
+    set count [Int]
+    if {$count != [dict get $bc numExceptRanges]} {
+	Fail "range count does not match numExceptRanges"
+    }
+    for {set i 0} {$i < $count} {incr i} {
+	set range [list [Token]]
+	for {set j 0} {$j < 6} {incr j} {
+	    lappend range [Int]
+	}
+	lappend ranges $range
+    }
+    dict set bc exceptRanges $ranges
+
+    set items {}
+    set count [Int]
+    if {$count != [dict get $bc numAuxDataItems]} {
+	Fail "AuxData count does not match numAuxDataItems"
+    }
+    for {set i 0} {$i < $count} {incr i} {
+	lappend items [TextAux]
+    }
+    dict set bc auxData $items
+    return $bc
+}
+
+# tbcdecode::TextObject --
+#
+#  Reads a literal of the text stream, see EmitObject.
+
+proc tbcdecode::TextObject {} {
+    set type [Token]
+    switch -exact -- $type {
+	b {
+	    return [list b [TextByteCode]]
+	}
+	p {
+	    set bc [TextByteCode]
+	    set numArgs [Int]
+	    set numLocals [Int]
+	    set locals {}
+	    for {set i 0} {$i < $numLocals} {incr i} {
+		set local [list [Bytes] [Int] [set hasDef [Int]] [Int]]
+		if {$hasDef} {
+		    lappend local [TextObject]
+		}
+		lappend locals $local
+	    }
+	    return [list p [list $bc $numArgs $numLocals $locals]]
+	}
+	x {
+	    return [list s [Bytes]]
+	}
+	i - d {
+	    return [list $type [Line]]
+	}
+	default {
+	    Fail "unknown literal type \"$type\""
+	}
+    }
+}
+
+# tbcdecode::TextAux --
+#
+#  Reads an AuxData item of the text stream, see EmitAuxDataArray. The
+#  fields are
+#	F, f	numLists ?firstValueTemp? loopCtTemp {indices of each list}
+#	J	{key offset ...}, sorted by key
+#	D	{indices}
+
+proc tbcdecode::TextAux {} {
+    set type [Token]
+    switch -exact -- $type {
+	F - f {
+	    set numLists [Int]
+	    set info [list $numLists]
+	    if {$type eq "F"} {
+		lappend info [Int]
+	    }
+	    lappend info [Int]
+	    set lists {}
+	    for {set i 0} {$i < $numLists} {incr i} {
+		set numVars [Int]
+		set vars {}
+		for {set j 0} {$j < $numVars} {incr j} {
+		    lappend vars [Int]
+		}
+		lappend lists $vars
+	    }
+	    lappend info $lists
+	    return [list $type $info]
+	}
+	J {
+	    set count [Int]
+	    set entries {}
+	    for {set i 0} {$i < $count} {incr i} {
+		set offset [Int]
+		lappend entries [list [Bytes] $offset]
+	    }
+	    return [list J [join [lsort -index 0 $entries]]]
+	}
+	D {
+	    set count [Int]
+	    set vars {}
+	    for {set i 0} {$i < $count} {incr i} {
+		lappend vars [Int]
+	    }
+	    return [list D [list $vars]]
+	}
+	default {
+	    Fail "unknown AuxData type \"$type\""
+	}
+    }
+}
+
+# tbcdecode::Binary --
+#
+#  Reads a binary container, see BinEmitCompiledObject.
+
+proc tbcdecode::Binary {} {
+    variable data
+    variable pos
+    variable features
+    variable procTable
+    variable procBodies
+    variable procUsed
+
+    if {[Raw 4] ne "TBCB"} {
+	Fail "bad container magic"
+    }
+    binary scan [Raw 4] cucucucu version formatVersion features flags2
+    set header [list containerVersion $version formatVersion $formatVersion \
+	    features $features compilerVersion [BinString] \
+	    tclVersion [BinString]]
+    if {$version != 1} {
+	Fail "unknown container version $version"
+    }
+    if {$features & ~7} {
+	Fail "unknown feature flags $features"
+    }
+    if {!($features & 1) || !($features & 4)} {
+	Fail "container without varint location maps or compact AuxData"
+    }
+
+    # Lazy proc bodies refer to the proc table, which follows the top-level
+    # record: decode the record, then resolve the bodies.
+
+    set procTable {}
+    set procBodies {}
+    array unset procUsed
+    set bc [BinByteCode]
+    if {$features & 2} {
+	set end [Section P]
+	set count [BinInt]
+	for {set i 0} {$i < $count} {incr i} {
+	    lappend procTable [list [BinInt] [BinInt]]
+	}
+	set procBodies [Raw [expr {$end - $pos}]]
+	set bc [Resolve $bc]
+	for {set i 0} {$i < $count} {incr i} {
+	    if {![info exists procUsed($i)]} {
+		Fail "proc table entry $i is not referenced"
+	    }
+	}
+    }
+    if {$pos != [string length $data]} {
+	Fail "extra data after the container"
+    }
+    return [list format binary header $header bytecode $bc]
+}
+
+proc tbcdecode::Raw {count} {
+    variable data
+    variable pos
+
+    if {$pos + $count > [string length $data]} {
+	Fail "unexpected end of data"
+    }
+    set bytes [string range $data $pos [expr {$pos + $count - 1}]]
+    incr pos $count
+    return $bytes
+}
+
+proc tbcdecode::BinInt {} {
+    binary scan [Raw 4] I value
+    return $value
+}
+
+proc tbcdecode::BinString {} {
+    set length [BinInt]
+    if {$length < 0} {
+	Fail "negative string length"
+    }
+    return [Raw $length]
+}
+
+# tbcdecode::Section --
+#
+#  Reads the tag and length of a section.
+#
+# Results:
+#  Returns the position of the end of the section.
+
+proc tbcdecode::Section {tag} {
+    variable data
+    variable pos
+
+    set found [Raw 1]
+    if {$found ne $tag} {
+	Fail "expected section $tag, got \"$found\""
+    }
+    set length [BinInt]
+    if {($length < 0) || ($pos + $length > [string length $data])} {
+	Fail "bad length of section $tag"
+    }
+    return [expr {$pos + $length}]
+}
+
+proc tbcdecode::EndSection {tag end} {
+    variable pos
+
+    if {$pos != $end} {
+	Fail "section $tag has [expr {$end - $pos}] bytes left over"
+    }
+}
+
+# tbcdecode::VarintArray --
+#
+#  Decodes a location array of the varint map: LEB128 values, zigzag
+#  encoded if signed, as 32 bit integers.
+
+proc tbcdecode::VarintArray {count signed} {
+    set values {}
+    for {set n 0} {$n < $count} {incr n} {
+	set value 0
+	set shift 0
+	while 1 {
+	    binary scan [Raw 1] cu byte
+	    set value [expr {$value | (($byte & 0x7f) << $shift)}]
+	    incr shift 7
+	    if {!($byte & 0x80)} {
+		break
+	    }
+	    if {$shift > 28} {
+		Fail "varint too long"
+	    }
+	}
+	if {$value > 0xffffffff} {
+	    Fail "varint out of range"
+	}
+	if {$signed} {
+	    set value [expr {($value & 1) ? -(($value >> 1) + 1) : ($value >> 1)}]
+	} elseif {$value > 0x7fffffff} {
+	    set value [expr {$value - 0x100000000}]
+	}
+	lappend values $value
+    }
+    return $values
+}
+
+# tbcdecode::BinByteCode --
+#
+#  Reads a binary ByteCode record, see BinEmitByteCode.
+
+proc tbcdecode::BinByteCode {} {
+    variable fields
+
+    set bc {}
+    foreach key $fields {
+	dict set bc $key [BinInt]
+    }
+    set numCommands [dict get $bc numCommands]
+
+    set end [Section C]
+    dict set bc code [Raw [dict get $bc numCodeBytes]]
+    EndSection C $end
+
+    set end [Section M]
+    dict set bc codeDelta [VarintArray $numCommands 0]
+    dict set bc codeLength [VarintArray $numCommands 0]
+    if {[dict get $bc srcDeltaSize] >= 0} {
+	dict set bc srcDelta [VarintArray $numCommands 1]
+	dict set bc srcLength [VarintArray $numCommands 0]
+    } else {
+	dict set bc srcDelta {}
+	dict set bc srcLength {}
+    }
+    EndSection M $end
+    CheckLocations bc
+
+    set end [Section L]
+    set literals {}
+    for {set i 0} {$i < [dict get $bc numLitObjects]} {incr i} {
+	lappend literals [BinObject]
+    }
+    EndSection L $end
+    dict set bc literals $literals
+
+    set end [Section E]
+    set ranges {}
+    for {set i 0} {$i < [dict get $bc numExceptRanges]} {incr i} {
+	set range [list [Raw 1]]
+	for {set j 0} {$j < 6} {incr j} {
+	    lappend range [BinInt]
+	}
+	lappend ranges $range
+    }
+    EndSection E $end
+    dict set bc exceptRanges $ranges
+
+    set end [Section A]
+    set items {}
+    for {set i 0} {$i < [dict get $bc numAuxDataItems]} {incr i} {
+	lappend items [BinAux]
+    }
+    EndSection A $end
+    dict set bc auxData $items
+    return $bc
+}
+
+# tbcdecode::BinObject --
+#
+#  Reads a binary literal record, see BinEmitObject. A lazy proc body is
+#  returned as {lazy index}, for Resolve.
+
+proc tbcdecode::BinObject {} {
+    variable features
+
+    set type [Raw 1]
+    switch -exact -- $type {
+	b {
+	    return [list b [BinByteCode]]
+	}
+	p {
+	    if {$features & 2} {
+		return [list lazy [BinInt]]
+	    }
+	    return [list p [BinProc]]
+	}
+	s - i - d {
+	    return [list $type [BinString]]
+	}
+	default {
+	    Fail "unknown literal type \"$type\""
+	}
+    }
+}
+
+proc tbcdecode::BinProc {} {
+    set bc [BinByteCode]
+    set numArgs [BinInt]
+    set numLocals [BinInt]
+    set locals {}
+    for {set i 0} {$i < $numLocals} {incr i} {
+	set name [BinString]
+	set frameIndex [BinInt]
+	binary scan [Raw 1] cu hasDef
+	set local [list $name $frameIndex $hasDef [BinInt]]
+	if {$hasDef} {
+	    lappend local [BinObject]
+	}
+	lappend locals $local
+    }
+    return [list $bc $numArgs $numLocals $locals]
+}
+
+# tbcdecode::BinAux --
+#
+#  Reads a binary AuxData item in the compact layout, see
+#  BinEmitAuxDataArray, into the fields of TextAux.
+
+proc tbcdecode::BinAux {} {
+    set type [Raw 1]
+    switch -exact -- $type {
+	F - f {
+	    set numLists [BinInt]
+	    set info [list $numLists]
+	    if {$type eq "F"} {
+		lappend info [BinInt]
+	    }
+	    lappend info [BinInt]
+	    set counts {}
+	    for {set i 0} {$i < $numLists} {incr i} {
+		lappend counts [BinInt]
+	    }
+	    set lists {}
+	    foreach numVars $counts {
+		set vars {}
+		for {set j 0} {$j < $numVars} {incr j} {
+		    lappend vars [BinInt]
+		}
+		lappend lists $vars
+	    }
+	    lappend info $lists
+	    return [list $type $info]
+	}
+	J {
+	    set count [BinInt]
+	    set keyBytes [BinInt]
+	    set offsets {}
+	    for {set i 0} {$i < $count} {incr i} {
+		lappend offsets [BinInt]
+	    }
+	    set block [Raw $keyBytes]
+	    set keys [lrange [split $block \0] 0 end-1]
+	    if {([llength $keys] != $count)
+		    || (($count > 0) && ([string index $block end] ne "\0"))} {
+		Fail "jump table key block does not hold $count keys"
+	    }
+	    set entries {}
+	    foreach key $keys offset $offsets {
+		lappend entries [list $key $offset]
+	    }
+	    if {[lsort -index 0 $entries] ne $entries} {
+		Fail "jump table keys are not sorted"
+	    }
+	    return [list J [join $entries]]
+	}
+	D {
+	    set count [BinInt]
+	    set vars {}
+	    for {set i 0} {$i < $count} {incr i} {
+		lappend vars [BinInt]
+	    }
+	    return [list D [list $vars]]
+	}
+	default {
+	    Fail "unknown AuxData type \"$type\""
+	}
+    }
+}
+
+# tbcdecode::Resolve --
+#
+#  Replaces the lazy proc bodies of a decoded ByteCode by the bodies they
+#  refer to in the proc table. Each body record must fill its table entry
+#  exactly.
+
+proc tbcdecode::Resolve {bc} {
+    variable data
+    variable pos
+    variable procTable
+    variable procBodies
+    variable procUsed
+
+    set literals {}
+    foreach literal [dict get $bc literals] {
+	lassign $literal type value
+	switch -exact -- $type {
+	    lazy {
+		if {($value < 0) || ($value >= [llength $procTable])} {
+		    Fail "proc table index $value out of range"
+		}
+		if {[info exists procUsed($value)]} {
+		    Fail "proc table entry $value referenced twice"
+		}
+		set procUsed($value) 1
+		lassign [lindex $procTable $value] offset length
+		if {($offset < 0) || ($length < 0)
+			|| ($offset + $length > [string length $procBodies])} {
+		    Fail "proc table entry $value out of range"
+		}
+
+		set savedData $data
+		set savedPos $pos
+		set data [string range $procBodies $offset \
+			[expr {$offset + $length - 1}]]
+		set pos 0
+		set proc [BinProc]
+		if {$pos != $length} {
+		    Fail "proc table entry $value has\
+			    [expr {$length - $pos}] bytes left over"
+		}
+		set data $savedData
+		set pos $savedPos
+
+		lset proc 0 [Resolve [lindex $proc 0]]
+		lappend literals [list p $proc]
+	    }
+	    b {
+		lappend literals [list b [Resolve $value]]
+	    }
+	    p {
+		lset value 0 [Resolve [lindex $value 0]]
+		lappend literals [list p $value]
+	    }
+	    default {
+		lappend literals $literal
+	    }
+	}
+    }
+    dict set bc literals $literals
+    return $bc
+}
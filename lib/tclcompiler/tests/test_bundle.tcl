@@ -0,0 +1,74 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests package bundles (compiler::bundle). The package has a
+# file in a subdirectory, which looks at "info script", and a file ending
+# with a "return", which must not stop the files after it.
+
+package require compiler
+
+file delete -force bundle
+file mkdir bundle/src/sub bundle/lib
+
+set chan [open bundle/src/first.tcl w]
+puts $chan {
+    namespace eval bundled {}
+    proc bundled::first {} { return first }
+    lappend ::result [file tail [info script]]
+    return
+    lappend ::result notreached
+}
+close $chan
+
+set chan [open bundle/src/sub/second.tcl w]
+puts $chan {
+    proc bundled::second {} { return [bundled::first]-second }
+    lappend ::result [file tail [file dirname [info script]]]
+    package provide bundled 1.0
+}
+close $chan
+
+# An index already in the directory keeps its other packages, and loses
+# the stale line of the bundled package.
+set chan [open bundle/lib/pkgIndex.tcl w]
+puts $chan {package ifneeded other 2.0 [list source [file join $dir other.tcl]]}
+puts -nonewline $chan {package ifneeded bundled 1.0 [list source stale.tcl]}
+close $chan
+
+# Generate the bundle and its index.
+compiler::bundle bundled 1.0 \
+	{bundle/src/first.tcl bundle/src/sub/second.tcl} \
+	bundle/lib/bundled.tbc
+if {![file exists bundle/lib/pkgIndex.tcl]} {
+    error "no pkgIndex.tcl next to the bundle"
+}
+set chan [open bundle/lib/pkgIndex.tcl]
+set index [split [string trim [read $chan]] \n]
+close $chan
+if {([llength $index] != 2) || ![string match "*other 2.0*" [lindex $index 0]]
+	|| ![string match "*bundled.tbc*" [lindex $index 1]]} {
+    error "bundle index is \"[join $index \n]\""
+}
+
+# Load it, must give the same result as the files.
+set result {}
+lappend auto_path [file join [pwd] bundle/lib]
+package require bundled 1.0
+lappend result [bundled::second]
+set expected {first.tcl sub first-second}
+if {$result ne $expected} {
+    error "bundle returned \"$result\", expected \"$expected\""
+}
+
+# A file that cannot be read leaves no bundle behind.
+if {![catch {
+    compiler::bundle broken 1.0 {bundle/src/first.tcl bundle/src/missing.tcl} \
+	    bundle/lib/broken.tbc
+}]} {
+    error "bundling a missing file did not fail"
+}
+if {[file exists bundle/lib/broken.tbc]} {
+    error "a failed bundle was left behind"
+}
+file delete -force bundle
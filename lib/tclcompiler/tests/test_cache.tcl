@@ -0,0 +1,100 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests the compile cache (compiler::cache). A second compile
+# of the same script with the same options must be a hit, and give the
+# same output; a changed script or other options must miss. The cache
+# directory also holds files of the user, a compiled script among them,
+# which "cache clear" must leave alone.
+
+package require compiler
+
+set dir  cachedir
+set in   cache.tcl
+file delete -force $dir
+
+# Writes the script to compile.
+proc script {body} {
+    global in
+    set chan [open $in w]
+    puts $chan $body
+    close $chan
+}
+
+# Reads a file as bytes.
+proc contents {path} {
+    set chan [open $path rb]
+    set data [read $chan]
+    close $chan
+    return $data
+}
+
+# Checks the cache counters.
+proc expect {what args} {
+    set stats [compiler::cache stats]
+    foreach {key value} $args {
+	if {[dict get $stats $key] != $value} {
+	    error "$what: expected $key $value, got [dict get $stats $key]"
+	}
+    }
+}
+
+compiler::cache configure -directory $dir
+file mkdir [file join $dir sub]
+foreach name {user.tbc notes.txt sub/other.tbc} {
+    set chan [open [file join $dir $name] w]
+    puts $chan "not a cache entry"
+    close $chan
+}
+
+script {proc hello {} { return hello }}
+compiler::compile $in first.tbc
+expect "first compile" hits 0 misses 1 stores 1 entries 1
+
+compiler::compile $in second.tbc
+expect "second compile" hits 1 misses 1 stores 1 entries 1
+if {[contents first.tbc] ne [contents second.tbc]} {
+    error "the cached output differs"
+}
+
+# The entry is named after the digest, and the user's files are not
+# taken for entries.
+set entries [glob -directory $dir -tails *.tbc]
+if {[llength $entries] != 2} {
+    error "expected one entry next to user.tbc, got $entries"
+}
+foreach entry $entries {
+    if {($entry ne "user.tbc") && ![regexp {^[0-9a-f]{32}\.tbc$} $entry]} {
+	error "bad entry name \"$entry\""
+    }
+}
+
+# Other options or another script miss.
+compiler::compile -nosrcmap $in third.tbc
+expect "other options" hits 1 misses 2 stores 2 entries 2
+script {proc hello {} { return goodbye }}
+compiler::compile $in fourth.tbc
+expect "changed script" hits 1 misses 3 stores 3 entries 3
+if {[contents first.tbc] eq [contents fourth.tbc]} {
+    error "the changed script got the old output"
+}
+
+# Clearing drops the entries only.
+compiler::cache clear
+expect "clear" entries 0 size 0
+foreach name {user.tbc notes.txt sub/other.tbc} {
+    if {![file exists [file join $dir $name]]} {
+	error "cache clear deleted $name"
+    }
+}
+if {[llength [glob -nocomplain -directory $dir *.tbc]] != 1} {
+    error "cache clear left entries behind"
+}
+
+compiler::compile $in fifth.tbc
+expect "after clear" misses 4 stores 4 entries 1
+
+compiler::cache configure -directory {}
+file delete -force $dir $in first.tbc second.tbc third.tbc fourth.tbc \
+	fifth.tbc
@@ -0,0 +1,182 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests the literal compaction of compiler::compile
+# -compactliterals. Precompiling a proc redirects the push of the "proc"
+# command name to the loader's command, leaving the name literal
+# unreferenced, and gives procs sharing a body literal a new literal each.
+# The script is compiled with and without the flag, both outputs read back
+# with the reference decoder in tbcdecode.tcl, and compared: the compacted
+# ByteCodes must have fewer literals, all of them referenced, the same
+# code except for the push operands, and each push must refer to a
+# literal written identically to the one it referred to before.
+#
+# The instruction boundaries come from tcl::unsupported::getbytecode, on
+# the same script and proc bodies. The script has fewer than 256 literals,
+# so that the compiler keeps the instructions Tcl compiled.
+
+package require compiler
+source [file join [file dirname [info script]] tbcdecode.tcl]
+
+set script {
+    proc first {a {b 2}} {
+	set r [list $a $b first]
+	foreach x {one two three} {
+	    lappend r $x
+	}
+	return $r
+    }
+    proc second {args} {
+	return [string toupper [join $args -]]
+    }
+    set value [first 1]
+    proc third {} {
+	return [list first second third]
+    }
+    set value [second $value done]
+    proc twin {a {b 2}} {
+	set r [list $a $b first]
+	foreach x {one two three} {
+	    lappend r $x
+	}
+	return $r
+    }
+}
+
+set in  compact.tcl
+set out compact.tbc
+set chan [open $in w]
+puts -nonewline $chan $script
+close $chan
+
+# Compiles the script with the given options and decodes the output.
+proc decodeWith {args} {
+    global in out
+    eval [list compiler::compile -deterministic] $args [list $in $out]
+    set result [dict get [tbcdecode::file $out] bytecode]
+    file delete $out
+    return $result
+}
+
+set plain   [decodeWith]
+set compact [decodeWith -compactliterals]
+
+# The instruction offsets of the script and of the proc bodies, as
+# compiled by Tcl in this interpreter, as the compiler does.
+set info [tcl::unsupported::getbytecode script $script]
+set offsets(script) [dict keys [dict get $info instructions]]
+set names(script) [dict values [dict get $info instructions]]
+eval $script
+foreach name {first second third twin} {
+    set info [tcl::unsupported::getbytecode proc $name]
+    set offsets($name) [dict keys [dict get $info instructions]]
+    set names($name) [dict values [dict get $info instructions]]
+}
+
+# Checks a ByteCode compiled without and with compaction. The opcode of
+# each instruction name is recorded, to catch offsets that do not match
+# the bytecodes.
+proc check {where plain compact key} {
+    global offsets names opcodes
+
+    set code [dict get $plain code]
+    set newCode [dict get $compact code]
+    if {[string length $code] != [string length $newCode]} {
+	error "$where: compaction changed the code length"
+    }
+    set literals [dict get $plain literals]
+    set newLiterals [dict get $compact literals]
+    if {[llength $newLiterals] > [llength $literals]} {
+	error "$where: compaction added literals"
+    }
+
+    set operands {}
+    set pushed {}
+    set used {}
+    foreach pc $offsets($key) instruction $names($key) {
+	set name [lindex $instruction 0]
+	binary scan $code @${pc}cu opcode
+	if {[info exists opcodes($name)] && ($opcodes($name) != $opcode)} {
+	    error "$where: opcode of $name at $pc is $opcode,\
+		    not $opcodes($name)"
+	}
+	set opcodes($name) $opcode
+
+	switch -exact -- $name {
+	    push1 {
+		binary scan $code @[expr {$pc + 1}]cu index
+		binary scan $newCode @[expr {$pc + 1}]cu newIndex
+		lappend operands [expr {$pc + 1}] 1
+	    }
+	    push4 {
+		binary scan $code @[expr {$pc + 1}]Iu index
+		binary scan $newCode @[expr {$pc + 1}]Iu newIndex
+		lappend operands [expr {$pc + 1}] 4
+	    }
+	    default {
+		continue
+	    }
+	}
+	if {$newIndex >= [llength $newLiterals]} {
+	    error "$where: push at $pc out of range"
+	}
+	dict set used $newIndex 1
+	set old [lindex $literals $index]
+	set new [lindex $newLiterals $newIndex]
+	if {[lindex $old 0] ne [lindex $new 0]} {
+	    error "$where: push at $pc changed the literal type"
+	}
+	if {[lindex $old 0] eq "p"} {
+	    # The name and arguments of the proc were pushed before.
+	    set name [lindex $pushed end-1 1]
+	    check "$where proc $name" [lindex $old 1 0] [lindex $new 1 0] \
+		    $name
+	} elseif {$old ne $new} {
+	    error "$where: push at $pc changed the literal:\
+		    \"$old\" != \"$new\""
+	}
+	lappend pushed $old
+    }
+
+    if {[dict size $used] != [llength $newLiterals]} {
+	error "$where: [expr {[llength $newLiterals] - [dict size $used]}]\
+		literals written but not referenced"
+    }
+
+    # Apart from the push operands, the code is unchanged.
+    set last 0
+    foreach {offset length} $operands {
+	if {[string range $code $last [expr {$offset - 1}]]
+		ne [string range $newCode $last [expr {$offset - 1}]]} {
+	    error "$where: compaction changed code before $offset"
+	}
+	set last [expr {$offset + $length}]
+    }
+    if {[string range $code $last end] ne [string range $newCode $last end]} {
+	error "$where: compaction changed code after $last"
+    }
+}
+
+check script $plain $compact script
+
+# The "proc" command name is gone, the proc bodies are all still there.
+if {[llength [dict get $compact literals]]
+	>= [llength [dict get $plain literals]]} {
+    error "compaction dropped no literal"
+}
+if {[dict get $compact numLitObjects]
+	!= [llength [dict get $compact literals]]} {
+    error "numLitObjects does not match the literals written"
+}
+if {[lsearch -exact [dict get $compact literals] {s proc}] >= 0} {
+    error "the proc command name is still written"
+}
+foreach result [list $plain $compact] {
+    if {[llength [lsearch -all -index 0 [dict get $result literals] p]]
+	    != 4} {
+	error "expected 4 proc bodies"
+    }
+}
+
+file delete $in
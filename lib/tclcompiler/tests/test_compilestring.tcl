@@ -0,0 +1,67 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests compiler::compileString, which compiles a script in
+# memory. Its result must be the same, byte for byte, as the file written
+# by compiler::compile for the same script, in each layout. A script
+# starting with a "-" must be taken as the script after "--".
+
+package require compiler
+
+set script {
+    proc greet {who {how hello}} {
+	switch -exact -- $how {
+	    hello { return "hello, $who" }
+	    bye   { return "goodbye, $who" }
+	    default { return "$how, $who" }
+	}
+    }
+    set result {}
+    foreach who {alpha beta} how {hello bye} {
+	lappend result [greet $who $how]
+    }
+}
+
+set in  compilestring.tcl
+set out compilestring.tbc
+set chan [open $in w]
+puts -nonewline $chan $script
+close $chan
+
+foreach options {
+    {} -nosrcmap -optimize -compactliterals -binary {-binary -nosrcmap}
+    -lazyprocs {-preamble {# preamble}}
+} {
+    set options [linsert $options 0 -deterministic]
+    eval [list compiler::compile] $options [list $in $out]
+    set chan [open $out rb]
+    set expected [read $chan]
+    close $chan
+    file delete $out
+
+    set image [eval [list compiler::compileString] $options [list -- $script]]
+    if {$image ne $expected} {
+	error "compileString $options differs from compile"
+    }
+}
+
+# The image can be evaluated, as the file would be sourced, where the
+# loader is available.
+if {![catch {package require tbcload}]} {
+    set result {}
+    eval [compiler::compileString $script]
+    if {$result ne {{hello, alpha} {goodbye, beta}}} {
+	error "compiled script returned \"$result\""
+    }
+}
+
+# A script starting with a "-" is not an option after "--".
+if {[catch {compiler::compileString -- {-dash}} image]} {
+    error "compileString -- -dash failed: $image"
+}
+if {![catch {compiler::compileString {-dash}}]} {
+    error "compileString took -dash as a script without --"
+}
+
+file delete $in
@@ -0,0 +1,66 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests reproducible output (compiler::compile -deterministic).
+# The script is compiled alone, and again after another script sharing its
+# literals as numbers, and the two outputs compared byte for byte. A large
+# jump table checks that the sorted entries still dispatch correctly.
+
+package require compiler
+
+set in    deterministic.tcl
+set other other.tcl
+set out1  deterministic1.tbc
+set out2  deterministic2.tbc
+set chan  [open $in w]
+
+puts $chan {
+    set result {}
+    foreach x {12 1.5 k7 k3 nope} {
+	switch -- $x {
+	    k0 - k1 - k2 { lappend result low }
+	    k3 { lappend result three }
+	    k4 - k5 - k6 { lappend result mid }
+	    k7 { lappend result seven }
+	    k8 - k9 { lappend result high }
+	    12 { lappend result twelve }
+	    1.5 { lappend result half }
+	    default { lappend result other }
+	}
+    }
+}
+close $chan
+
+set chan [open $other w]
+puts $chan {
+    set y [expr {12 + 1.5}]
+}
+close $chan
+
+# Reference result, from source.
+source $in
+set expected $result
+unset result
+
+# Generate the bytecode, alone and after the other script.
+compiler::compileFiles -deterministic [list [list $in $out1]]
+compiler::compileFiles -deterministic [list \
+	[list $other other.tbc] [list $in $out2]]
+
+set chan [open $out1 rb]
+set data1 [read $chan]
+close $chan
+set chan [open $out2 rb]
+set data2 [read $chan]
+close $chan
+if {$data1 ne $data2} {
+    error "compiling after another script changed the output"
+}
+
+# Run it, must give the same result.
+source $out1
+if {$result ne $expected} {
+    error "deterministic code returned \"$result\", expected \"$expected\""
+}
+file delete $in $other $out1 $out2 other.tbc
@@ -0,0 +1,38 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests the compile arena statistics (compiler::memory). A
+# script with many procs must need more memory than one with a few.
+
+package require compiler
+
+proc script {numProcs} {
+    set script {}
+    for {set i 0} {$i < $numProcs} {incr i} {
+	append script "proc p$i {x} { return \[expr {\$x + $i}\] }\n"
+    }
+    return $script
+}
+
+set before [compiler::memory]
+foreach key {compiles lastPeakBytes maxPeakBytes reservedBytes} {
+    if {![dict exists $before $key]} {
+	error "compiler::memory has no key \"$key\""
+    }
+}
+
+compiler::compileString [script 500]
+set large [compiler::memory]
+compiler::compileString [script 5]
+set small [compiler::memory]
+
+if {[dict get $small compiles] != [dict get $before compiles] + 2} {
+    error "expected two more compiles, got \"$small\" after \"$before\""
+}
+if {[dict get $small lastPeakBytes] >= [dict get $large lastPeakBytes]} {
+    error "5 procs used as much memory as 500: \"$small\", \"$large\""
+}
+if {[dict get $small maxPeakBytes] < [dict get $large lastPeakBytes]} {
+    error "the peak of the large compile was lost: \"$small\""
+}
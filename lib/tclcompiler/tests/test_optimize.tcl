@@ -0,0 +1,57 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests the peephole optimizer (compiler::compile -optimize).
+# The optimizer drops and shortens instructions, so every construct whose
+# code holds offsets (jumps, loops, jump tables, catch ranges, foreach aux
+# data) is exercised, and the results compared to those of the script
+# run from source.
+
+package require compiler
+
+set in   optimize.tcl
+set out  optimize.tbc
+set chan [open $in w]
+
+puts $chan {
+    proc optimized {x} {
+	set r {}
+	if {$x} { lappend r yes } else { lappend r no }
+	foreach a {1 0 1 1} {
+	    lappend r $a
+	    if {!$a} continue
+	    if {[llength $r] > 4} break
+	}
+	while {1} { incr x ; if {$x > 10} break }
+	switch -- $x { 11 { lappend r eleven } default { lappend r other } }
+	catch { error foo } msg
+	lappend r $msg
+	for {set i 0} {$i < 3} {incr i} {
+	    if {$i == 1} continue
+	    lappend r i$i
+	}
+	try { lappend r t } on error {} { lappend r e } finally { lappend r f }
+	dict for {k v} {x 1 y 2} { lappend r $k$v }
+	lappend r [lmap y {1 2 3 4} { if {$y % 2} continue ; set y }]
+	return $r
+    }
+    set result [list [optimized 0] [optimized 1]]
+}
+close $chan
+
+# Reference result, from source.
+source $in
+set expected $result
+unset result
+rename optimized {}
+
+# Generate the bytecode
+compiler::compile -optimize $in $out
+
+# Run it, must give the same result.
+source $out
+if {$result ne $expected} {
+    error "optimized code returned \"$result\", expected \"$expected\""
+}
+file delete $in $out
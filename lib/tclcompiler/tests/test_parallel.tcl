@@ -0,0 +1,78 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests compiler::compileParallel against compiler::compileFiles.
+# A batch of files of very different sizes, so that the workers finish them
+# out of order, with a missing file and a file listed twice, is compiled
+# serially and in parallel. The results must be the same, position by
+# position, and the outputs identical byte for byte.
+
+package require compiler
+
+if {![llength [info commands compiler::compileParallel]]} {
+    puts "compiler::compileParallel not available, skipped"
+    return
+}
+
+set files {}
+for {set i 0} {$i < 12} {incr i} {
+    set name parallel$i.tcl
+    set chan [open $name w]
+    # Every third file is large, the others small.
+    set count [expr {($i % 3) ? 5 : 2000}]
+    for {set j 0} {$j < $count} {incr j} {
+	puts $chan [list proc p${i}_$j {a} "return \[list \$a $i $j\]"]
+    }
+    close $chan
+    lappend files $name
+}
+lset files 7 missing.tcl
+lappend files parallel3.tcl
+
+# Builds the file list of a run, with its own output names.
+proc jobs {run} {
+    global files
+    set jobs {}
+    set i 0
+    foreach name $files {
+	lappend jobs [list $name $run$i.tbc]
+	incr i
+    }
+    return $jobs
+}
+
+set serial   [compiler::compileFiles -deterministic [jobs serial]]
+set parallel [compiler::compileParallel -deterministic -threads 4 \
+	[jobs parallel]]
+
+if {[llength $serial] != [llength $files]
+	|| [llength $parallel] != [llength $files]} {
+    error "expected one result per file"
+}
+set i 0
+foreach s $serial p $parallel {
+    if {[dict get $s status] ne [dict get $p status]} {
+	error "file $i: status [dict get $s status] != [dict get $p status]"
+    }
+    if {[dict get $s status] eq "ok"} {
+	set chan [open serial$i.tbc rb]
+	set expected [read $chan]
+	close $chan
+	set chan [open parallel$i.tbc rb]
+	set actual [read $chan]
+	close $chan
+	if {$expected ne $actual} {
+	    error "file $i: parallel output differs"
+	}
+    } elseif {[dict get $s error] ne [dict get $p error]} {
+	error "file $i: error \"[dict get $s error]\" !=\
+		\"[dict get $p error]\""
+    }
+    incr i
+}
+if {[dict get [lindex $parallel 7] status] ne "error"} {
+    error "the missing file compiled"
+}
+
+file delete {*}[glob parallel*.tcl] {*}[glob -nocomplain serial*.tbc parallel*.tbc]
@@ -0,0 +1,219 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests that the binary container (compiler::compile -binary)
+# holds the same bytecode as the text format. No loader reads the binary
+# container yet, so both outputs are read back with the reference decoder
+# in tbcdecode.tcl, and the decoded ByteCodes compared: header fields,
+# code, location arrays, literals, exception ranges and AuxData. This
+# covers the varint location maps, the compact AuxData layout and, with
+# -lazyprocs, the proc table.
+
+package require compiler
+source [file join [file dirname [info script]] tbcdecode.tcl]
+
+set in   roundtrip.tcl
+set chan [open $in w]
+
+# Procs with defaults, a proc defined by a proc, a jump table, foreach with several
+# lists, dict update and exception ranges.
+puts $chan {
+    proc outer {a {b 2} {c {x y}} args} {
+	proc inner {n} {
+	    set r 0
+	    while {$n > 0} {
+		if {[catch {incr r $n} msg]} { return -code error $msg }
+		incr n -1
+	    }
+	    return $r
+	}
+	set out {}
+	foreach {x y} $c z {1 2 3} {
+	    switch -exact -- $x {
+		x { lappend out ex }
+		y { lappend out why }
+		zzz - www { lappend out many }
+		default { lappend out $x$y$z }
+	    }
+	}
+	set d [dict create k1 1 k2 2]
+	dict update d k1 v1 k2 v2 {
+	    incr v1 $a
+	    set v2 $b
+	}
+	return [list $out $d [inner 3]]
+    }
+    outer 1
+    set pi 3.25
+    set big 123456789
+    set neg -17
+}
+
+# Non-ASCII literals, written as escapes so that the file does not depend
+# on the system encoding.
+set greeting "gr\u00fc\u00df dich \u20ac \u4e2d\u6587"
+puts $chan {set greeting "gr\u00fc\u00df dich \u20ac \u4e2d\u6587"}
+
+# More than 256 literals, for push4.
+for {set i 0} {$i < 300} {incr i} {
+    puts $chan [list set v$i literal$i]
+}
+
+# A command longer than 127 bytes of code and of source, and enough
+# source before the last commands, for 5 byte location entries.
+set words {}
+for {set i 0} {$i < 120} {incr i} {
+    lappend words w$i
+}
+puts $chan "proc long {} { return \[list $words\] }"
+puts $chan "set last \[list $words\]"
+close $chan
+
+# Compiles the script with the given options and decodes the output.
+proc decodeWith {args} {
+    global in
+    set out roundtrip.tbc
+    eval [list compiler::compile -deterministic] $args [list $in $out]
+    set result [tbcdecode::file $out]
+    file delete $out
+    return $result
+}
+
+# Compares two decoded ByteCodes, field by field, recursing into the
+# ByteCode and proc literals so that a mismatch names its place.
+proc compare {where expected actual} {
+    foreach key [dict keys $expected] {
+	if {$key eq "literals"} continue
+	if {[dict get $expected $key] ne [dict get $actual $key]} {
+	    error "$where: $key differs:\
+		    [dict get $expected $key] != [dict get $actual $key]"
+	}
+    }
+    set expLits [dict get $expected literals]
+    set actLits [dict get $actual literals]
+    if {[llength $expLits] != [llength $actLits]} {
+	error "$where: literal count differs"
+    }
+    set i 0
+    foreach e $expLits a $actLits {
+	lassign $e eType eValue
+	lassign $a aType aValue
+	if {$eType ne $aType} {
+	    error "$where: literal $i type $eType != $aType"
+	}
+	switch -exact -- $eType {
+	    b {
+		compare "$where literal $i" $eValue $aValue
+	    }
+	    p {
+		compare "$where proc $i" [lindex $eValue 0] [lindex $aValue 0]
+		if {[lrange $eValue 1 end] ne [lrange $aValue 1 end]} {
+		    error "$where: proc $i arguments or locals differ"
+		}
+	    }
+	    default {
+		if {$eValue ne $aValue} {
+		    error "$where: literal $i differs: $eValue != $aValue"
+		}
+	    }
+	}
+	incr i
+    }
+}
+
+# Walks the ByteCodes of a decoded script, calling a script with each.
+proc walk {bc cmd} {
+    uplevel 1 $cmd [list $bc]
+    foreach literal [dict get $bc literals] {
+	lassign $literal type value
+	switch -exact -- $type {
+	    b { uplevel 1 [list walk $value $cmd] }
+	    p { uplevel 1 [list walk [lindex $value 0] $cmd] }
+	}
+    }
+}
+
+set text       [decodeWith]
+set binary     [decodeWith -binary]
+set textNoSrc  [decodeWith -nosrcmap]
+set binNoSrc   [decodeWith -binary -nosrcmap]
+set lazy       [decodeWith -lazyprocs]
+
+foreach {name result format features} {
+    text text text {} binary binary binary 5 textNoSrc textNoSrc text {}
+    binNoSrc binNoSrc binary 5 lazy lazy binary 7
+} {
+    set result [set $result]
+    if {[dict get $result format] ne $format} {
+	error "$name: expected the $format format"
+    }
+    if {($features ne "")
+	    && ([dict get $result header features] != $features)} {
+	error "$name: expected features $features"
+    }
+}
+
+compare binary           [dict get $text bytecode] [dict get $binary bytecode]
+compare "binary nosrcmap" [dict get $textNoSrc bytecode] \
+	[dict get $binNoSrc bytecode]
+compare lazyprocs        [dict get $text bytecode] [dict get $lazy bytecode]
+
+# Check that the script exercised what it should: large location entries,
+# push4, the AuxData types and proc bodies.
+set stats [dict create procs 0 wide 0 aux {}]
+walk [dict get $text bytecode] {apply {{bc} {
+    upvar 1 stats stats
+    foreach literal [dict get $bc literals] {
+	if {[lindex $literal 0] eq "p"} {
+	    dict incr stats procs
+	}
+    }
+    foreach key {codeLength srcDelta srcLength} {
+	foreach value [dict get $bc $key] {
+	    if {$value > 127} {
+		dict incr stats wide
+	    }
+	}
+    }
+    foreach item [dict get $bc auxData] {
+	dict lappend stats aux [lindex $item 0]
+    }
+}}}
+if {[dict get $stats procs] < 2} {
+    error "expected at least 2 procs, got [dict get $stats procs]"
+}
+if {![dict get $stats wide]} {
+    error "no location entry needs 5 bytes"
+}
+foreach type {J D} {
+    if {$type ni [dict get $stats aux]} {
+	error "no AuxData item of type $type"
+    }
+}
+if {([lsearch -regexp [dict get $stats aux] {^[Ff]$}] < 0)} {
+    error "no foreach AuxData item"
+}
+if {[llength [dict get $text bytecode literals]] <= 256} {
+    error "expected more than 256 literals"
+}
+
+# The source maps are dropped with -nosrcmap only.
+if {([dict get $textNoSrc bytecode srcDeltaSize] != -1)
+	|| ([dict get $text bytecode srcDeltaSize] == -1)} {
+    error "-nosrcmap did not drop the source maps"
+}
+
+# The non-ASCII literal survives as UTF-8.
+set found 0
+foreach literal [dict get $binary bytecode literals] {
+    if {[encoding convertfrom utf-8 [lindex $literal 1]]
+	    eq $greeting} {
+	set found 1
+    }
+}
+if {!$found} {
+    error "non-ASCII literal not found"
+}
+
+file delete $in
@@ -0,0 +1,60 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests the statistics returned by compiler::compile -stats.
+
+package require compiler
+
+set in   stats.tcl
+set out  stats.tbc
+set chan [open $in w]
+
+puts $chan {
+    proc counted {x} {
+	foreach a {1 2 3} { lappend x $a }
+	catch { error foo }
+	return $x
+    }
+    counted 0
+}
+close $chan
+
+# Without -stats, the result is empty.
+if {[compiler::compile $in $out] ne ""} {
+    error "compiler::compile returned a result without -stats"
+}
+
+set stats [compiler::compile -stats $in $out]
+foreach key {
+    instructions byteCodes procBodies literals literalBytes exceptRanges
+    auxData sections
+} {
+    if {![dict exists $stats $key]} {
+	error "missing key \"$key\" in \"$stats\""
+    }
+}
+if {[dict get $stats procBodies] != 1} {
+    error "expected 1 proc body, got [dict get $stats procBodies]"
+}
+if {[dict get $stats byteCodes] != 2} {
+    error "expected 2 ByteCodes, got [dict get $stats byteCodes]"
+}
+if {[dict get $stats exceptRanges] < 2} {
+    error "expected catch and loop ranges, got [dict get $stats exceptRanges]"
+}
+if {![dict exists $stats instructions done]} {
+    error "no done instruction in [dict get $stats instructions]"
+}
+dict for {section bytes} [dict get $stats sections] {
+    if {$bytes <= 0} {
+	error "no bytes in section \"$section\""
+    }
+}
+
+# With -lazyprocs, the proc table is a section of its own.
+set stats [compiler::compile -lazyprocs -stats $in $out]
+if {![dict exists $stats sections proctable]} {
+    error "no proctable section in [dict get $stats sections]"
+}
+file delete $in $out
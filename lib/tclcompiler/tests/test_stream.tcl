@@ -0,0 +1,57 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests streamed compiles (compiler::compile -stream). The
+# script is made large enough to be split into several units, with a proc
+# defined in one unit and called in a later one, and a command spanning
+# many lines.
+
+package require compiler
+
+set in   stream.tcl
+set out  stream.tbc
+set chan [open $in w]
+
+puts $chan {
+    proc streamed {args} {
+	global result
+	lappend result [llength $args]
+    }
+    set result {}
+}
+for {set i 0} {$i < 4000} {incr i} {
+    puts $chan "set data($i) {[string repeat x 40] $i}"
+}
+puts $chan "streamed \\"
+for {set i 0} {$i < 2000} {incr i} {
+    puts $chan "    $i \\"
+}
+puts $chan "    end"
+puts $chan {
+    lappend result [array size data]
+    foreach i {0 1999 3999} { lappend result [lindex $data($i) end] }
+}
+close $chan
+
+# Reference result, from source.
+source $in
+set expected $result
+unset result data
+rename streamed {}
+
+# Generate the bytecode; it must hold several units.
+compiler::compile -stream $in $out
+set chan [open $out]
+set units [regexp -all -line {::bceval \{$} [read $chan]]
+close $chan
+if {$units < 2} {
+    error "expected several units, got $units"
+}
+
+# Run it, must give the same result.
+source $out
+if {$result ne $expected} {
+    error "streamed code returned \"$result\", expected \"$expected\""
+}
+file delete $in $out
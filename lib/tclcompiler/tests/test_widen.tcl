@@ -0,0 +1,342 @@
+# Copyright (c) 2018 ActiveState Software Inc.
+# Released under the BSD-3 license. See LICENSE file for details.
+#
+
+# This script tests the widening of the push instructions of precompiled
+# procs. With more than 256 literals, the pushes of the proc literals grow
+# from push1 to push4, and the code after them moves. Two scripts are
+# compiled: one without jumps, whose proc pushes are widened one by one
+# (WidenPushInstructions), and one defining procs inside if, while, catch
+# and switch bodies, whose push1 and jump1 instructions are all widened
+# by the jump rewrite of UpdateByteCodes.
+#
+# Each script is also compiled with "proc" renamed, which the compiler
+# leaves as Tcl compiled it. Both outputs are read back with the reference
+# decoder in tbcdecode.tcl and their instructions matched one to one, the
+# sizes coming from tcl::unsupported::getbytecode. Every command, exception
+# range, jump and jump table arm of the widened bytecodes must cover the
+# instructions it covered before.
+#
+# The output for the script without jumps is also compared with the one of
+# the previous implementation (ShiftByteCodes, which moved the code once
+# per widened instruction), recorded below for the Tcl patchlevels it was
+# generated with. That implementation always compacted the literals, hence
+# -compactliterals. The script with jumps is not compared: the previous
+# implementation misplaced the ends of commands and ranges there.
+
+package require compiler
+source [file join [file dirname [info script]] tbcdecode.tcl]
+
+# The CRC-32 and length of the output for the script without jumps, from
+# the signature on, by Tcl patchlevel, as written by the previous
+# implementation.
+array set golden {
+    8.6.15 {0x0b07fce8 31318}
+}
+
+set in  widen.tcl
+set out widen.tbc
+
+# Padding, so that the proc literals added by the compiler are past 255.
+set padding {}
+for {set i 0} {$i < 300} {incr i} {
+    append padding [list set pad$i value$i] \n
+}
+
+# The script without jumps.
+set linear $padding
+for {set i 0} {$i < 100} {incr i} {
+    append linear [list proc top$i {x} "return \[list \$x $i\]"] \n
+}
+
+# The script with jumps.
+set branchy $padding
+append branchy {
+    set n 0
+    if {$n == 0} {
+	proc inIf {} { return if }
+    } else {
+	proc inElse {} { return else }
+    }
+    while {$n < 2} {
+	proc inWhile {} { return while }
+	incr n
+	if {$n > 5} break
+	proc afterBreak {} { return after }
+    }
+    catch {
+	proc inCatch {} { return catch }
+	error boom
+    }
+    set kind b
+    switch -exact -- $kind {
+	a { proc armA {} { return a } }
+	b { proc armB {} { return b } }
+	default { proc armOther {} { return other } }
+    }
+}
+# Long branches, for the 4 byte jumps.
+set branch {}
+for {set i 0} {$i < 50} {incr i} {
+    append branch [list set long$i $i] \n
+}
+append branchy [list if {$n < 0} $branch else $branch] \n
+for {set i 0} {$i < 100} {incr i} {
+    append branchy [list proc top$i {x} "return \[list \$x $i\]"] \n
+    if {$i % 10 == 0} {
+	append branchy [list if {$n > 0} [list proc cond$i {} "return $i"]] \n
+    }
+}
+
+# Compiles a script in a fresh interpreter, so that the output does not
+# depend on the literals of earlier compiles. Returns the output, and the
+# instructions of the script as Tcl compiles it in that interpreter.
+proc compileFresh {script args} {
+    global in out
+    set chan [open $in w]
+    puts -nonewline $chan $script
+    close $chan
+    set child [interp create]
+    $child eval [list set auto_path $::auto_path]
+    $child eval package require compiler
+    $child eval [list compiler::compile {*}$args $in $out]
+    set instructions [dict get [$child eval \
+	    [list tcl::unsupported::getbytecode script $script]] instructions]
+    interp delete $child
+    set chan [open $out rb]
+    set data [read $chan]
+    close $chan
+    file delete $in $out
+    return [list $data $instructions]
+}
+
+# Records the name and size of each opcode of 'code', whose instructions
+# Tcl listed in 'instructions'. The 4 byte jumps follow the 1 byte ones in
+# Tcl's instruction table.
+proc calibrate {code instructions} {
+    global opName opSize
+    array unset opName
+    array unset opSize
+    set pcs [dict keys $instructions]
+    lappend pcs [string length $code]
+    foreach pc [lrange $pcs 0 end-1] next [lrange $pcs 1 end] \
+	    instruction [dict values $instructions] {
+	binary scan $code @${pc}cu opcode
+	set name [lindex $instruction 0]
+	if {[info exists opName($opcode)] && (($opName($opcode) ne $name)
+		|| ($opSize($opcode) != $next - $pc))} {
+	    error "calibration: opcode $opcode at $pc is $name,\
+		    [expr {$next - $pc}] bytes, not $opName($opcode),\
+		    $opSize($opcode) bytes"
+	}
+	set opName($opcode) $name
+	set opSize($opcode) [expr {$next - $pc}]
+    }
+    foreach opcode [array names opName] {
+	if {$opName($opcode) in {jump1 jumpTrue1 jumpFalse1}} {
+	    set wide [expr {$opcode + 1}]
+	    set name [string replace $opName($opcode) end end 4]
+	    if {[info exists opName($wide)]
+		    && (($opName($wide) ne $name) || ($opSize($wide) != 5))} {
+		error "calibration: opcode $wide is not $name"
+	    }
+	    set opName($wide) $name
+	    set opSize($wide) 5
+	}
+    }
+}
+
+# Splits bytecodes into instructions. Returns a list of {pc name operand},
+# the operand being the literal index of a push, the target of a jump and
+# the aux data index of a jump table.
+proc instructions {code} {
+    global opName opSize
+    set result {}
+    set pc 0
+    while {$pc < [string length $code]} {
+	binary scan $code @${pc}cu opcode
+	if {![info exists opName($opcode)]} {
+	    error "opcode $opcode at $pc not calibrated"
+	}
+	set operand {}
+	switch -exact -- $opName($opcode) {
+	    push1 {
+		binary scan $code @[expr {$pc + 1}]cu operand
+	    }
+	    push4 - jumpTable {
+		binary scan $code @[expr {$pc + 1}]Iu operand
+	    }
+	    jump1 - jumpTrue1 - jumpFalse1 {
+		binary scan $code @[expr {$pc + 1}]c offset
+		set operand [expr {$pc + $offset}]
+	    }
+	    jump4 - jumpTrue4 - jumpFalse4 {
+		binary scan $code @[expr {$pc + 1}]I offset
+		set operand [expr {$pc + $offset}]
+	    }
+	}
+	lappend result [list $pc $opName($opcode) $operand]
+	incr pc $opSize($opcode)
+    }
+    if {$pc != [string length $code]} {
+	error "the last instruction runs past the end of the code"
+    }
+    return $result
+}
+
+# Checks that an offset of the widened bytecodes is the relocated one.
+proc same {what old new} {
+    global map
+    if {![info exists map($old)]} {
+	error "$what: $old is not an instruction boundary"
+    }
+    if {$map($old) != $new} {
+	error "$what: expected $map($old), got $new"
+    }
+}
+
+# Compiles a script, and checks its widened bytecodes against those of
+# the same script with "proc" renamed. Returns the output, and the number
+# of jumps, jump tables and exception ranges.
+proc check {what script} {
+    global map
+
+    lassign [compileFresh [string map {proc Proc} $script] -compactliterals] \
+	    image instructions
+    set plain [dict get [tbcdecode::decode $image] bytecode]
+    calibrate [dict get $plain code] $instructions
+    lassign [compileFresh $script -compactliterals] image
+    set wide [dict get [tbcdecode::decode $image] bytecode]
+
+    set old [instructions [dict get $plain code]]
+    set new [instructions [dict get $wide code]]
+    if {[llength $old] != [llength $new]} {
+	error "$what: [llength $old] instructions became [llength $new]"
+    }
+
+    # Map the offsets of the instructions, and of the end of the code.
+    array unset map
+    set jumps {}
+    set tables {}
+    set pushed {}
+    foreach o $old n $new {
+	lassign $o oldPc oldName oldOperand
+	lassign $n newPc newName newOperand
+	if {[string trimright $oldName 14] ne [string trimright $newName 14]} {
+	    error "$what: $oldName at $oldPc became $newName"
+	}
+	set map($oldPc) $newPc
+	switch -glob -- $newName {
+	    jump? - jumpTrue? - jumpFalse? {
+		lappend jumps $newPc $oldOperand $newOperand
+	    }
+	    jumpTable {
+		lappend tables $oldPc $oldOperand $newPc $newOperand
+	    }
+	    push? {
+		lappend pushed $newOperand
+	    }
+	}
+    }
+    set map([string length [dict get $plain code]]) \
+	    [string length [dict get $wide code]]
+
+    foreach {pc oldTarget newTarget} $jumps {
+	same "$what: jump at $pc" $oldTarget $newTarget
+    }
+    foreach {oldPc oldIndex newPc newIndex} $tables {
+	set oldArms [lindex [dict get $plain auxData] $oldIndex 1]
+	set newArms [lindex [dict get $wide auxData] $newIndex 1]
+	if {[dict keys $oldArms] ne [dict keys $newArms]} {
+	    error "$what: jump table at $newPc changed its keys"
+	}
+	dict for {key offset} $oldArms {
+	    same "$what: jump table at $newPc, arm $key" \
+		    [expr {$oldPc + $offset}] \
+		    [expr {$newPc + [dict get $newArms $key]}]
+	}
+    }
+
+    set oldRanges [dict get $plain exceptRanges]
+    set newRanges [dict get $wide exceptRanges]
+    if {[llength $oldRanges] != [llength $newRanges]} {
+	error "$what: the number of exception ranges changed"
+    }
+    set i 0
+    foreach o $oldRanges n $newRanges {
+	lassign $o type nesting start length break continue catch
+	lassign $n newType newNesting newStart newLength newBreak \
+		newContinue newCatch
+	if {($type ne $newType) || ($nesting != $newNesting)} {
+	    error "$what: range $i changed its type or nesting"
+	}
+	same "$what: range $i start" $start $newStart
+	same "$what: range $i end" [expr {$start + $length}] \
+		[expr {$newStart + $newLength}]
+	if {$type eq "L"} {
+	    same "$what: range $i break" $break $newBreak
+	    if {$continue >= 0} {
+		same "$what: range $i continue" $continue $newContinue
+	    }
+	} else {
+	    same "$what: range $i catch" $catch $newCatch
+	}
+	incr i
+    }
+
+    set start 0
+    set newStart 0
+    set i 0
+    foreach delta [dict get $plain codeDelta] \
+	    length [dict get $plain codeLength] \
+	    newDelta [dict get $wide codeDelta] \
+	    newLength [dict get $wide codeLength] {
+	incr start $delta
+	incr newStart $newDelta
+	same "$what: command $i start" $start $newStart
+	same "$what: command $i end" [expr {$start + $length}] \
+		[expr {$newStart + $newLength}]
+	incr i
+    }
+
+    # Every proc body is pushed, with push4 as the literals are past 255.
+    set procs [lsearch -all -index 0 [dict get $wide literals] p]
+    if {[llength $procs] < 100} {
+	error "$what: expected at least 100 precompiled procs,\
+		got [llength $procs]"
+    }
+    foreach index $procs {
+	if {$index ni $pushed} {
+	    error "$what: proc literal $index is not pushed"
+	}
+	if {$index < 256} {
+	    error "$what: proc literal $index did not need push4"
+	}
+    }
+
+    return [list $image [expr {[llength $jumps] / 3}] \
+	    [expr {[llength $tables] / 4}] [llength $newRanges]]
+}
+
+lassign [check "without jumps" $linear] image numJumps
+if {$numJumps} {
+    error "the script without jumps has $numJumps jumps"
+}
+lassign [check "with jumps" $branchy] branchyImage numJumps numTables \
+	numRanges
+if {!$numJumps || !$numTables || ($numRanges < 2)} {
+    error "expected jumps, a jump table and loop and catch ranges"
+}
+
+# Compare with the previous implementation.
+set signature [string first "\nTclPro ByteCode " $image]
+set data [string range $image $signature+1 end]
+set patchlevel [info patchlevel]
+if {[info exists golden($patchlevel)]} {
+    lassign $golden($patchlevel) crc length
+    if {([zlib crc32 $data] != $crc) || ([string length $data] != $length)} {
+	error "output differs from the previous implementation"
+    }
+} else {
+    puts "no recorded output for Tcl $patchlevel, comparison skipped"
+}
@@ -37,6 +37,99 @@
 
 #define MAX_RANGE_SIZE 100
 
+/*
+ * A checkpoint of the character index of a script: the number of
+ * characters before a byte offset.  Checkpoints are taken at the first
+ * character boundary at or after each multiple of CHAR_CHECK_STEP bytes.
+ */
+
+typedef struct CharCheck {
+    int byte;			/* Byte offset of the checkpoint. */
+    int chars;			/* Number of characters before it. */
+} CharCheck;
+
+#define CHAR_CHECK_STEP 1024
+
+/*
+ * The index of a script, speeding up the conversions between bytes,
+ * characters and lines.  The "parse" command keeps the indices of the
+ * last few scripts it was asked about, so that repeated lookups in the
+ * same script do not scan it again.  An entry holds a reference to its
+ * script object, and remembers the string it indexed, in case the
+ * string rep of the object is regenerated.  The line starts and the
+ * character checkpoints are only made when first needed, and the latter
+ * never for a pure ASCII script, where bytes and characters agree.
+ */
+
+typedef struct ScriptIndex {
+    Tcl_Obj *scriptObj;		/* The script indexed, NULL if the entry is
+				 * not in use. */
+    char *bytes;		/* The string rep indexed. */
+    int length;			/* Its length, in bytes. */
+    int isAscii;		/* Whether the script is pure ASCII. */
+    int numLines;		/* The number of lines, the number of
+				 * newlines plus one. */
+    int *lineStarts;		/* The byte offset of the start of each
+				 * line; lineStarts[0] is 0.  NULL if not
+				 * made yet. */
+    int numChecks;		/* The number of character checkpoints. */
+    CharCheck *charChecks;	/* The character checkpoints; charChecks[k]
+				 * is the one for k*CHAR_CHECK_STEP. NULL if
+				 * not made yet. */
+} ScriptIndex;
+
+#define INDEX_CACHE_SIZE 4
+
+/*
+ * Scripts shorter than this are not indexed by the commands converting
+ * offsets within ranges (countnewline, charindex, charlength), scanning
+ * the range is cheaper than building an index nobody else may use.
+ * "parse line" and "parse lineoffset" always index the script.
+ */
+
+#define INDEX_MIN_LENGTH 4096
+
+/*
+ * The names of the token types, as used in parse trees.
+ */
+
+static char *tokenTypes[] = {
+    "word", "expand", "simple", "text", "backslash", "command",
+    "variable", "subexpr", "operator", NULL
+};
+
+#define NUM_TOKEN_TYPES 9
+
+/*
+ * The per interp data of the "parse" command.
+ */
+
+typedef struct ParseData {
+    ScriptIndex indexCache[INDEX_CACHE_SIZE];
+				/* The indices of the last scripts asked
+				 * about. */
+    int nextEntry;		/* The entry of indexCache to reuse next. */
+    Tcl_Obj *typeObjs[NUM_TOKEN_TYPES];
+				/* The names of the token types, shared by
+				 * all flat token lists. */
+    int handleCount;		/* Used to name the parse handles. */
+} ParseData;
+
+/*
+ * A parse handle, made by "parse open".  It holds a script and its
+ * index, with the line starts made upfront, for the life of the handle,
+ * so that the subcommands of the handle neither look up the script in
+ * the cache of the parse command nor convert it to a string again.
+ */
+
+typedef struct ParseHandle {
+    ParseData *dataPtr;		/* The data of the parse command, preserved
+				 * while the handle exists. */
+    ScriptIndex index;		/* The script of the handle, and its
+				 * index. */
+    Tcl_Command token;		/* The command of the handle. */
+} ParseHandle;
+
 /*
  * name and version of this package
  */
@@ -57,14 +150,48 @@ EXTERN int Tclparser_Init _ANSI_ARGS_((Tcl_Interp *interp));
 
 static int	ParseMakeTokenList _ANSI_ARGS_((char *script,
 		    Tcl_Parse *parsePtr, int index, Tcl_Obj **resultPtr));
+static void	ParseDeleteData _ANSI_ARGS_((ClientData clientData));
+static void	ParseDeleteHandle _ANSI_ARGS_((ClientData clientData));
+static void	ParseFreeData _ANSI_ARGS_((char *blockPtr));
+static void	ParseFreeScriptIndex _ANSI_ARGS_((ScriptIndex *indexPtr));
+static int	ParseFindChar _ANSI_ARGS_((ScriptIndex *indexPtr,
+		    int offset));
+static int	ParseFindLine _ANSI_ARGS_((ScriptIndex *indexPtr,
+		    int offset));
+static ScriptIndex *ParseGetScriptIndex _ANSI_ARGS_((ParseData *dataPtr,
+		    Tcl_Obj *scriptObj, int create));
+static void	ParseInitScriptIndex _ANSI_ARGS_((ScriptIndex *indexPtr,
+		    Tcl_Obj *scriptObj));
+static int	ParseIsAscii _ANSI_ARGS_((CONST char *bytes, int length));
+static int	ParseGetTokenType _ANSI_ARGS_((Tcl_Token *tokenPtr));
+static Tcl_Obj *ParseMakeFlatTokens _ANSI_ARGS_((ParseData *dataPtr,
+		    char *script, Tcl_Parse *parsePtr));
+static Tcl_Obj *ParseMakeErrorCode _ANSI_ARGS_((Tcl_Interp *interp,
+		    char *script, Tcl_Parse *parsePtr));
 static Tcl_Obj *ParseMakeRange _ANSI_ARGS_((char *script, CONST char *start,
 		    int end));
+static Tcl_Obj *ParseMakeTree _ANSI_ARGS_((char *script,
+		    Tcl_Parse *parsePtr));
+static int	ParseHandleObjCmd _ANSI_ARGS_((ClientData clientData,
+		    Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
+static int	ParseInvoke _ANSI_ARGS_((Tcl_Interp *interp,
+		    ParseData *dataPtr, ParseHandle *handlePtr, int option,
+		    int objc, Tcl_Obj *CONST objv[]));
 static int	ParseObjCmd _ANSI_ARGS_((ClientData clientData,
 		    Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]));
+static int	ParseOpen _ANSI_ARGS_((Tcl_Interp *interp,
+		    ParseData *dataPtr, Tcl_Obj *scriptObj));
+static void	ParseWrongNumArgs _ANSI_ARGS_((Tcl_Interp *interp,
+		    ParseHandle *handlePtr, Tcl_Obj *CONST objv[],
+		    char *message));
 static void	ParseSetErrorCode _ANSI_ARGS_((Tcl_Interp *interp,
 		    char *script, Tcl_Parse *parsePtr));
-static int	ParseCommand _ANSI_ARGS_((Tcl_Interp *interp, char *script, 
-		    int index, int length));
+static int	ParseCommand _ANSI_ARGS_((Tcl_Interp *interp,
+		    ParseData *dataPtr, char *script, int index, int length,
+		    int flat));
+static int	ParseCommands _ANSI_ARGS_((Tcl_Interp *interp,
+		    ParseData *dataPtr, char *script, int index, int length,
+		    int flat));
 static int	ParseExpr _ANSI_ARGS_((Tcl_Interp *interp, char *script, 
 		    int index, int length));
 static int	ParseList _ANSI_ARGS_((Tcl_Interp *interp, char *script, 
@@ -73,13 +200,19 @@ static int	ParseVarName _ANSI_ARGS_((Tcl_Interp *interp, char *script,
 		    int index, int length));
 static int	ParseGetString _ANSI_ARGS_((Tcl_Interp *interp, char *script, 
 		    int index, int length));
-static int	ParseCharIndex _ANSI_ARGS_((Tcl_Interp *interp, char *script,
-		    int index, int length));
-static int	ParseCharLength _ANSI_ARGS_((Tcl_Interp *interp, char *script,
-		    int index, int length));
+static int	ParseCharIndex _ANSI_ARGS_((Tcl_Interp *interp,
+		    char *script, ScriptIndex *indexPtr, int index,
+		    int length));
+static int	ParseCharLength _ANSI_ARGS_((Tcl_Interp *interp,
+		    char *script, ScriptIndex *indexPtr, int index,
+		    int length));
 static int	ParseCountNewline _ANSI_ARGS_((Tcl_Interp *interp,
-		    char *script, int scriptLength, Tcl_Obj *rangePtr1,
-		    Tcl_Obj *rangePtr2));
+		    char *script, int scriptLength, ScriptIndex *indexPtr,
+		    Tcl_Obj *rangePtr1, Tcl_Obj *rangePtr2));
+static int	ParseLine _ANSI_ARGS_((Tcl_Interp *interp,
+		    ScriptIndex *indexPtr, int index));
+static int	ParseLineOffset _ANSI_ARGS_((Tcl_Interp *interp,
+		    ScriptIndex *indexPtr, int line));
 static int	ParseGetIndexAndLength _ANSI_ARGS_((Tcl_Interp *interp, 
 		    Tcl_Obj *rangePtr, int scriptLen, int *index,
 		    int *length));
@@ -104,15 +237,43 @@ int
 Tclparser_Init(interp)
     Tcl_Interp *interp;
 {
+    ParseData *dataPtr;
+    int i;
+
     if (Tcl_InitStubs(interp, "8.1", 0) == NULL) {
 	return TCL_ERROR;
     }
 
-    Tcl_CreateObjCommand(interp, "parse", ParseObjCmd, NULL, NULL);
+    dataPtr = (ParseData *) ckalloc(sizeof(ParseData));
+    memset((VOID *) dataPtr, 0, sizeof(ParseData));
+    for (i = 0; i < NUM_TOKEN_TYPES; i++) {
+	dataPtr->typeObjs[i] = Tcl_NewStringObj(tokenTypes[i], -1);
+	Tcl_IncrRefCount(dataPtr->typeObjs[i]);
+    }
+    Tcl_CreateObjCommand(interp, "parse", ParseObjCmd, (ClientData) dataPtr,
+	    ParseDeleteData);
 
     return Tcl_PkgProvide(interp, packageName, packageVersion);
 }
 
+/*
+ * The subcommands of "parse" and of the parse handles.  "open" is only a
+ * subcommand of "parse", "close" only one of the handles.
+ */
+
+static char *parseOptions[] = {
+     "command", "commands", "expr", "varname", "list",
+     "getrange", "getstring", "charindex", "charlength",
+     "countnewline", "line", "lineoffset", "flatcommand",
+     "flatcommands", "open", "close", NULL
+};
+enum parseOptions {
+    PARSE_COMMAND, PARSE_COMMANDS, PARSE_EXPR, PARSE_VARNAME,
+    PARSE_LIST, PARSE_GET_RANGE, PARSE_GET_STR, PARSE_CHAR_INDEX,
+    PARSE_CHAR_LEN, PARSE_COUNT_NWLNE, PARSE_LINE, PARSE_LINE_OFFSET,
+    PARSE_FLAT_COMMAND, PARSE_FLAT_COMMANDS, PARSE_OPEN, PARSE_CLOSE
+};
+
 /*
  *----------------------------------------------------------------------
  *
@@ -124,59 +285,159 @@ Tclparser_Init(interp)
  *	A standard Tcl result.
  *
  * Side effects:
- *	None.
+ *	"parse open" creates a parse handle.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-ParseObjCmd(dummy, interp, objc, objv)
-    ClientData dummy;		/* Not used. */
+ParseObjCmd(clientData, interp, objc, objv)
+    ClientData clientData;	/* The ParseData of the command. */
     Tcl_Interp *interp;		/* Current interpreter. */
     int objc;			/* Number of arguments. */
     Tcl_Obj *CONST objv[];	/* Argument objects. */
 {
-    int option, index, length, scriptLength;
-    char *script;
-
-    static char *options[] = {
-	 "command", "expr", "varname", "list",
-	 "getrange", "getstring", "charindex", "charlength",
-	 "countnewline", NULL
-    };
-    enum options {
-	PARSE_COMMAND, PARSE_EXPR, PARSE_VARNAME, PARSE_LIST, 
-	PARSE_GET_RANGE, PARSE_GET_STR, PARSE_CHAR_INDEX, PARSE_CHAR_LEN, 
-	PARSE_COUNT_NWLNE
-    };
+    ParseData *dataPtr = (ParseData *) clientData;
+    int option;
 
     if (objc < 3) {
 	Tcl_WrongNumArgs(interp, 1, objv, "option arg ?arg ...?");
 	return TCL_ERROR;
     }
-    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0, &option)
-	    != TCL_OK) {
+    if (Tcl_GetIndexFromObj(interp, objv[1], parseOptions, "option", 0,
+	    &option) != TCL_OK) {
+    	return TCL_ERROR;
+    }
+
+    switch ((enum parseOptions) option) {
+	case PARSE_OPEN:
+	    if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "string");
+		return TCL_ERROR;
+	    }
+	    return ParseOpen(interp, dataPtr, objv[2]);
+	case PARSE_CLOSE:
+	    Tcl_AppendResult(interp, "bad option \"close\": ",
+		    "only parse handles can be closed", (char *) NULL);
+	    return TCL_ERROR;
+	default:
+	    return ParseInvoke(interp, dataPtr, NULL, option, objc, objv);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseHandleObjCmd --
+ *
+ *	This function implements the command of a parse handle.  It
+ *	takes the subcommands of "parse", without their script argument,
+ *	which is the script of the handle, and "close".
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	"close" deletes the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseHandleObjCmd(clientData, interp, objc, objv)
+    ClientData clientData;	/* The ParseHandle of the command. */
+    Tcl_Interp *interp;		/* Current interpreter. */
+    int objc;			/* Number of arguments. */
+    Tcl_Obj *CONST objv[];	/* Argument objects. */
+{
+    ParseHandle *handlePtr = (ParseHandle *) clientData;
+    int option;
+
+    if (objc < 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], parseOptions, "option", 0,
+	    &option) != TCL_OK) {
     	return TCL_ERROR;
     }
 
+    switch ((enum parseOptions) option) {
+	case PARSE_OPEN:
+	    Tcl_AppendResult(interp, "bad option \"open\": ",
+		    "use \"parse open\" to open a script", (char *) NULL);
+	    return TCL_ERROR;
+	case PARSE_CLOSE:
+	    if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 2, objv, NULL);
+		return TCL_ERROR;
+	    }
+	    Tcl_DeleteCommandFromToken(interp, handlePtr->token);
+	    return TCL_OK;
+	default:
+	    return ParseInvoke(interp, handlePtr->dataPtr, handlePtr, option,
+		    objc, objv);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseInvoke --
+ *
+ *	Runs a subcommand of "parse", or of a parse handle.  The
+ *	arguments of the subcommand follow the script for "parse", and
+ *	the subcommand for a handle.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseInvoke(interp, dataPtr, handlePtr, option, objc, objv)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    ParseData *dataPtr;		/* The data of the parse command. */
+    ParseHandle *handlePtr;	/* The handle invoked, NULL for "parse". */
+    int option;			/* The subcommand. */
+    int objc;			/* Number of arguments. */
+    Tcl_Obj *CONST objv[];	/* Argument objects. */
+{
+    ScriptIndex *indexPtr;
+    int index, length, scriptLength, first;
+    char *script;
+
     /*
      * Check the number arguments passed to the command and
      * extract information (script, index, length) depending
-     * upon the option selected.
+     * upon the option selected.  first is the index of the first
+     * argument after the script.
      */
 
-    script = Tcl_GetStringFromObj(objv[2], &scriptLength);
+    if (handlePtr != NULL) {
+	script = handlePtr->index.bytes;
+	scriptLength = handlePtr->index.length;
+	first = 2;
+    } else {
+	script = Tcl_GetStringFromObj(objv[2], &scriptLength);
+	first = 3;
+    }
 
-    switch ((enum options) option) {
+    switch ((enum parseOptions) option) {
 	case PARSE_GET_RANGE:
-	    if (objc == 3) {
+	    if (objc == first) {
 		index = 0;
 		length = scriptLength;
-	    } else if (objc == 5) {
-		if (Tcl_GetIntFromObj(interp, objv[3], &index) != TCL_OK) {
+	    } else if (objc == first + 2) {
+		if (Tcl_GetIntFromObj(interp, objv[first], &index) != TCL_OK) {
 		    return TCL_ERROR;
 		}
-		if (Tcl_GetIntFromObj(interp, objv[4], &length) != TCL_OK) {
+		if (Tcl_GetIntFromObj(interp, objv[first + 1], &length)
+			!= TCL_OK) {
 		    return TCL_ERROR;
 		}
 		if (index < 0) {
@@ -190,31 +451,55 @@ ParseObjCmd(dummy, interp, objc, objv)
 		    length = scriptLength - index;
 		}
 	    } else {
-		Tcl_WrongNumArgs(interp, 2, objv, "string ?index length?");
+		ParseWrongNumArgs(interp, handlePtr, objv,
+			"string ?index length?");
 		return TCL_ERROR;
 	    }
 	    Tcl_SetObjResult(interp, ParseMakeRange(script, script + index,
 		    length));
 	    return TCL_OK;
 
+	case PARSE_COMMANDS:
+	case PARSE_FLAT_COMMANDS:
+	    if (objc == first) {
+		index = 0;
+		length = scriptLength;
+	    } else if (objc == first + 1) {
+		if (ParseGetIndexAndLength(interp, objv[first], scriptLength,
+			&index, &length) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+	    } else {
+		ParseWrongNumArgs(interp, handlePtr, objv, "string ?range?");
+		return TCL_ERROR;
+	    }
+	    return ParseCommands(interp, dataPtr, script, index, length,
+		    (option == PARSE_FLAT_COMMANDS));
+
 	case PARSE_COMMAND:
+	case PARSE_FLAT_COMMAND:
 	case PARSE_EXPR:
 	case PARSE_VARNAME:
 	case PARSE_LIST:
 	case PARSE_GET_STR: 
 	case PARSE_CHAR_INDEX:
-	case PARSE_CHAR_LEN: {
-	    if (objc != 4) {
-		Tcl_WrongNumArgs(interp, 2, objv, "string range");
+	case PARSE_CHAR_LEN:
+	case PARSE_LINE: {
+	    if (objc != first + 1) {
+		ParseWrongNumArgs(interp, handlePtr, objv, "string range");
 		return TCL_ERROR;
 	    }
-	    if (ParseGetIndexAndLength(interp, objv[3], scriptLength,  
+	    if (ParseGetIndexAndLength(interp, objv[first], scriptLength,  
 		&index, &length) != TCL_OK) {
 		return TCL_ERROR;	
 	    }	    
-	    switch ((enum options) option) {
+	    switch ((enum parseOptions) option) {
 		case PARSE_COMMAND:
-		    return ParseCommand(interp, script, index, length);
+		    return ParseCommand(interp, dataPtr, script, index,
+			    length, 0);
+		case PARSE_FLAT_COMMAND:
+		    return ParseCommand(interp, dataPtr, script, index,
+			    length, 1);
 		case PARSE_EXPR:
 		    return ParseExpr(interp, script, index, length);
 		case PARSE_VARNAME:
@@ -224,11 +509,33 @@ ParseObjCmd(dummy, interp, objc, objv)
 		case PARSE_GET_STR:
 		    return ParseGetString(interp, script, index, length);
 		case PARSE_CHAR_INDEX:
-		    return ParseCharIndex(interp, script, index, length);
 		case PARSE_CHAR_LEN:
-		    return ParseCharLength(interp, script, index, length);
+		    if (handlePtr != NULL) {
+			indexPtr = &handlePtr->index;
+		    } else {
+			indexPtr = ParseGetScriptIndex(dataPtr, objv[2],
+				(scriptLength >= INDEX_MIN_LENGTH));
+		    }
+		    if (option == PARSE_CHAR_INDEX) {
+			return ParseCharIndex(interp, script, indexPtr,
+				index, length);
+		    }
+		    return ParseCharLength(interp, script, indexPtr, index,
+			    length);
+		case PARSE_LINE:
+		    if (handlePtr != NULL) {
+			indexPtr = &handlePtr->index;
+		    } else {
+			indexPtr = ParseGetScriptIndex(dataPtr, objv[2], 1);
+		    }
+		    return ParseLine(interp, indexPtr, index);
+		case PARSE_COMMANDS:
+		case PARSE_FLAT_COMMANDS:
 		case PARSE_GET_RANGE:
 		case PARSE_COUNT_NWLNE:
+		case PARSE_LINE_OFFSET:
+		case PARSE_OPEN:
+		case PARSE_CLOSE:
 		    /* No Op - This will suppress compiler warnings */
 		    break;
 	    }
@@ -236,21 +543,153 @@ ParseObjCmd(dummy, interp, objc, objv)
 	}
 	case PARSE_COUNT_NWLNE: {
 	    Tcl_Obj *range2;
-	    if (objc == 5) {
-		range2 = objv[4];
-	    } else if (objc == 4) {
+	    if (objc == first + 2) {
+		range2 = objv[first + 1];
+	    } else if (objc == first + 1) {
 		range2 = NULL;
 	    } else {
-		Tcl_WrongNumArgs(interp, 2, objv, "string range ?range?");
+		ParseWrongNumArgs(interp, handlePtr, objv,
+			"string range ?range?");
+		return TCL_ERROR;
+	    }
+	    if (handlePtr != NULL) {
+		indexPtr = &handlePtr->index;
+	    } else {
+		indexPtr = ParseGetScriptIndex(dataPtr, objv[2],
+			(scriptLength >= INDEX_MIN_LENGTH));
+	    }
+	    return ParseCountNewline(interp, script, scriptLength, indexPtr,
+		    objv[first], range2);
+	}
+	case PARSE_LINE_OFFSET: {
+	    int line;
+	    if (objc != first + 1) {
+		ParseWrongNumArgs(interp, handlePtr, objv, "string line");
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetIntFromObj(interp, objv[first], &line) != TCL_OK) {
 		return TCL_ERROR;
 	    }
-	    return ParseCountNewline(interp, script, scriptLength,
-		    objv[3], range2);
+	    if (handlePtr != NULL) {
+		indexPtr = &handlePtr->index;
+	    } else {
+		indexPtr = ParseGetScriptIndex(dataPtr, objv[2], 1);
+	    }
+	    return ParseLineOffset(interp, indexPtr, line);
 	}
+	case PARSE_OPEN:
+	case PARSE_CLOSE:
+	    /* Handled by the callers. */
+	    break;
     }
     return TCL_ERROR;
 }
-
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseWrongNumArgs --
+ *
+ *	Leave the "wrong # args" message of a subcommand in the interp.
+ *	The usage message of the subcommand starts with the script
+ *	argument, which is left out for a parse handle.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The interp's result is set.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ParseWrongNumArgs(interp, handlePtr, objv, message)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    ParseHandle *handlePtr;	/* The handle invoked, NULL for "parse". */
+    Tcl_Obj *CONST objv[];	/* Argument objects. */
+    char *message;		/* The usage, starting with "string ". */
+{
+    if (handlePtr != NULL) {
+	message += sizeof("string ") - 1;
+    }
+    Tcl_WrongNumArgs(interp, 2, objv, message);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseOpen --
+ *
+ *	Make a parse handle for a script, with its own command.  The
+ *	handle holds a reference to the script, and its index, with the
+ *	ASCII flag and the line starts computed upfront.
+ *
+ * Results:
+ *	A standard Tcl result.  The interp's result is set to the fully
+ *	qualified name of the command of the handle, in the global
+ *	namespace, so that it works from any namespace.
+ *
+ * Side effects:
+ *	Creates the command of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseOpen(interp, dataPtr, scriptObj)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    ParseData *dataPtr;		/* The data of the parse command. */
+    Tcl_Obj *scriptObj;		/* The script of the handle. */
+{
+    ParseHandle *handlePtr;
+    Tcl_CmdInfo info;
+    char name[TCL_INTEGER_SPACE + 8];
+
+    do {
+	sprintf(name, "::parse%d", dataPtr->handleCount++);
+    } while (Tcl_GetCommandInfo(interp, name, &info));
+
+    handlePtr = (ParseHandle *) ckalloc(sizeof(ParseHandle));
+    handlePtr->dataPtr = dataPtr;
+    Tcl_Preserve((ClientData) dataPtr);
+    ParseInitScriptIndex(&handlePtr->index, scriptObj);
+    ParseFindLine(&handlePtr->index, 0);	/* Makes the line starts. */
+    handlePtr->token = Tcl_CreateObjCommand(interp, name, ParseHandleObjCmd,
+	    (ClientData) handlePtr, ParseDeleteHandle);
+
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseDeleteHandle --
+ *
+ *	Release a parse handle, when its command is deleted.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Frees the index of the handle, and releases its script and the
+ *	data of the parse command.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ParseDeleteHandle(clientData)
+    ClientData clientData;  /* The ParseHandle of the command. */
+{
+    ParseHandle *handlePtr = (ParseHandle *) clientData;
+
+    ParseFreeScriptIndex(&handlePtr->index);
+    Tcl_Release((ClientData) handlePtr->dataPtr);
+    ckfree((char *) handlePtr);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -266,6 +705,9 @@ ParseObjCmd(dummy, interp, objc, objv)
  *	of the parse tree where each node is a list in the form:
  *	<type> <range> <subTree>.
  *
+ *	If flat is set, the parse tree is replaced by a flat list of
+ *	the tokens, made by ParseMakeFlatTokens.
+ *
  * Results:
  *	A standard Tcl result.
  *
@@ -276,16 +718,18 @@ ParseObjCmd(dummy, interp, objc, objv)
  */
 
 static int 
-ParseCommand(interp, script, index, length)
+ParseCommand(interp, dataPtr, script, index, length, flat)
     Tcl_Interp *interp;		/* Current interpreter. */
+    ParseData *dataPtr;		/* The data of the parse command. */
     char *script;		/* Script to parse. */
     int index;			/* Index to the starting point of the 
 				 * script. */
     int length;			/* Byte length of script be parsed. */
+    int flat;			/* Whether to return the tokens as a flat
+				 * list. */
 {
-    Tcl_Obj *resultPtr, *listPtr, *tokenPtr;
+    Tcl_Obj *resultPtr;
     Tcl_Parse parse;
-    int  i;
     CONST char *start, *end;
 
     start = script + index;
@@ -297,7 +741,6 @@ ParseCommand(interp, script, index, length)
     }
 
     resultPtr = Tcl_GetObjResult(interp);
-    i = 0;
     if (parse.commentStart) {
 	Tcl_ListObjAppendElement(interp, resultPtr,
 		ParseMakeRange(script, parse.commentStart, parse.commentSize));
@@ -310,16 +753,107 @@ ParseCommand(interp, script, index, length)
     end = parse.commandStart + parse.commandSize;
     Tcl_ListObjAppendElement(interp, resultPtr, 
 	    ParseMakeRange(script, end, length - (int) (end - start)));
-    listPtr = Tcl_NewListObj(0, NULL);
-    while (i < parse.numTokens) {
-	i = ParseMakeTokenList(script, &parse, i, &tokenPtr);
-	Tcl_ListObjAppendElement(NULL, listPtr, tokenPtr);
-    }
-    Tcl_ListObjAppendElement(interp, resultPtr, listPtr);
+    Tcl_ListObjAppendElement(interp, resultPtr, flat
+	    ? ParseMakeFlatTokens(dataPtr, script, &parse)
+	    : ParseMakeTree(script, &parse));
     Tcl_SetObjResult(interp, resultPtr);
     Tcl_FreeParse(&parse);
     return TCL_OK;
 }
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseCommands --
+ *
+ *	This function parses all of the commands in a range of a script
+ *	at once, saving the callers walking the range with "parse command"
+ *	a call per command.  This routine returns a list with an element
+ *	per command, of the form: <commentRange> <commandRange> <parseTree>,
+ *	as returned by ParseCommand.  A command that cannot be parsed is
+ *	reported by an element of the form: error <errorCode> <range>, where
+ *	the errorCode is the one "parse command" would set and the range
+ *	covers the text skipped.  Parsing resumes after the next newline or
+ *	semicolon not preceded by a backslash, as the checker does.
+ *
+ *	If flat is set, the parse trees are replaced by flat lists of
+ *	the tokens, made by ParseMakeFlatTokens.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseCommands(interp, dataPtr, script, index, length, flat)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    ParseData *dataPtr;		/* The data of the parse command. */
+    char *script;		/* Script to parse. */
+    int index;			/* Index to the starting point of the 
+				 * script. */
+    int length;			/* Byte length of script be parsed. */
+    int flat;			/* Whether to return the tokens as flat
+				 * lists. */
+{
+    Tcl_Obj *resultPtr, *objv[3];
+    Tcl_Parse parse;
+    CONST char *start, *end, *last, *p;
+
+    resultPtr = Tcl_NewListObj(0, NULL);
+    start = script + index;
+    last = start + length;
+
+    while (start < last) {
+	if (Tcl_ParseCommand(interp, start, (int) (last - start), 0, &parse)
+		!= TCL_OK) {
+	    /*
+	     * Skip to the next thing that looks like the end of a command.
+	     */
+
+	    objv[0] = Tcl_NewStringObj("error", 5);
+	    objv[1] = ParseMakeErrorCode(interp, script, &parse);
+	    Tcl_ResetResult(interp);
+
+	    p = (parse.term > start) ? parse.term : start;
+	    for (p++; p < last; p++) {
+		if (((*p == '\n') || (*p == ';')) && (p[-1] != '\\')) {
+		    break;
+		}
+	    }
+	    end = (p < last) ? p + 1 : last;
+	    objv[2] = ParseMakeRange(script, start, (int) (end - start));
+	    Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewListObj(3, objv));
+	    start = end;
+	    continue;
+	}
+
+	if (parse.commentStart) {
+	    objv[0] = ParseMakeRange(script, parse.commentStart,
+		    parse.commentSize);
+	} else {
+	    objv[0] = ParseMakeRange(script, script, 0);
+	}
+	objv[1] = ParseMakeRange(script, parse.commandStart,
+		parse.commandSize);
+	objv[2] = flat ? ParseMakeFlatTokens(dataPtr, script, &parse)
+		: ParseMakeTree(script, &parse);
+	Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewListObj(3, objv));
+
+	end = parse.commandStart + parse.commandSize;
+	Tcl_FreeParse(&parse);
+	if (end <= start) {
+	    break;
+	}
+	start = end;
+    }
+
+    Tcl_SetObjResult(interp, resultPtr);
+    return TCL_OK;
+}
 
 /*
  *----------------------------------------------------------------------
@@ -506,6 +1040,33 @@ ParseSetErrorCode(interp, script, parsePtr)
     Tcl_Interp *interp;		/* Current interpreter. */
     char *script;		/* Script to parse. */
     Tcl_Parse *parsePtr;	/* Parse state. */
+{
+    Tcl_SetObjErrorCode(interp, ParseMakeErrorCode(interp, script, parsePtr));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseMakeErrorCode --
+ *
+ *	Make the standard parser error form of a parse error, a list
+ *	of the form: PARSE <type> <offset> <message>.  The message is
+ *	taken from the interp's result.
+ *
+ * Results:
+ *	Returns a newly allocated list object.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ParseMakeErrorCode(interp, script, parsePtr)
+    Tcl_Interp *interp;		/* Current interpreter. */
+    char *script;		/* Script to parse. */
+    Tcl_Parse *parsePtr;	/* Parse state. */
 {
     Tcl_Obj *objv[4];
     char *type;
@@ -552,7 +1113,7 @@ ParseSetErrorCode(interp, script, parsePtr)
 	objv[2] = Tcl_NewIntObj(0);
     }
     objv[3] = Tcl_GetObjResult(interp);
-    Tcl_SetObjErrorCode(interp, Tcl_NewListObj(4, objv));
+    return Tcl_NewListObj(4, objv);
 }
 
 /*
@@ -586,38 +1147,8 @@ ParseMakeTokenList(script, parsePtr, index, resultPtrPtr)
     Tcl_Token *tokenPtr = parsePtr->tokenPtr + index;
     Tcl_Obj *objv[3];
     int start;
-    char *type;
 
-    switch (tokenPtr->type) {
-	case TCL_TOKEN_WORD:
-	    type = "word";
-	    break;
-        case TCL_TOKEN_EXPAND_WORD:
-            type = "expand";
-	    break;
-	case TCL_TOKEN_SIMPLE_WORD:
-	    type = "simple";
-	    break;
-	case TCL_TOKEN_TEXT:
-	    type = "text";
-	    break;
-	case TCL_TOKEN_BS:
-	    type = "backslash";
-	    break;
-	case TCL_TOKEN_COMMAND:
-	    type = "command";
-	    break;
-	case TCL_TOKEN_VARIABLE:
-	    type = "variable";
-	    break;
-	case TCL_TOKEN_SUB_EXPR:
-	    type = "subexpr";
-	    break;
-	case TCL_TOKEN_OPERATOR:
-	    type = "operator";
-	    break;
-    }
-    objv[0] = Tcl_NewStringObj(type, -1);
+    objv[0] = Tcl_NewStringObj(tokenTypes[ParseGetTokenType(tokenPtr)], -1);
     objv[1] = ParseMakeRange(script, tokenPtr->start, tokenPtr->size);
     objv[2] = Tcl_NewListObj(0, NULL);
     start = index;
@@ -631,6 +1162,133 @@ ParseMakeTokenList(script, parsePtr, index, resultPtrPtr)
     return index;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseMakeFlatTokens --
+ *
+ *	Make the flat list representation of the tokens of a command:
+ *	four elements per token, in the order of Tcl_Parse, of the
+ *	form <type> <start> <size> <numComponents>.  The components of
+ *	a token are the numComponents tokens after it, so the next word
+ *	of a command starts numComponents + 1 tokens after a word.
+ *	Unlike the parse tree, this needs no list per token or range,
+ *	and the type names are shared.
+ *
+ * Results:
+ *	Returns a newly allocated list object.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ParseMakeFlatTokens(dataPtr, script, parsePtr)
+    ParseData *dataPtr;		/* The data of the parse command. */
+    char *script;		/* Pointer to start of script being parsed. */
+    Tcl_Parse *parsePtr;	/* Parse information. */
+{
+    Tcl_Token *tokenPtr;
+    Tcl_Obj **objv, *listPtr;
+    int i;
+
+    if (parsePtr->numTokens == 0) {
+	return Tcl_NewListObj(0, NULL);
+    }
+    objv = (Tcl_Obj **) ckalloc(4 * parsePtr->numTokens * sizeof(Tcl_Obj *));
+    for (i = 0; i < parsePtr->numTokens; i++) {
+	tokenPtr = parsePtr->tokenPtr + i;
+	objv[4*i] = dataPtr->typeObjs[ParseGetTokenType(tokenPtr)];
+	objv[4*i+1] = Tcl_NewIntObj(tokenPtr->start - script);
+	objv[4*i+2] = Tcl_NewIntObj(tokenPtr->size);
+	objv[4*i+3] = Tcl_NewIntObj(tokenPtr->numComponents);
+    }
+    listPtr = Tcl_NewListObj(4 * parsePtr->numTokens, objv);
+    ckfree((char *) objv);
+    return listPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseGetTokenType --
+ *
+ *	Map the type of a token to its index in tokenTypes.
+ *
+ * Results:
+ *	Returns the index of the name of the type.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseGetTokenType(tokenPtr)
+    Tcl_Token *tokenPtr;	/* The token. */
+{
+    switch (tokenPtr->type) {
+	case TCL_TOKEN_WORD:
+	    return 0;
+        case TCL_TOKEN_EXPAND_WORD:
+            return 1;
+	case TCL_TOKEN_SIMPLE_WORD:
+	    return 2;
+	case TCL_TOKEN_TEXT:
+	    return 3;
+	case TCL_TOKEN_BS:
+	    return 4;
+	case TCL_TOKEN_COMMAND:
+	    return 5;
+	case TCL_TOKEN_VARIABLE:
+	    return 6;
+	case TCL_TOKEN_SUB_EXPR:
+	    return 7;
+	case TCL_TOKEN_OPERATOR:
+	    return 8;
+	default:
+	    panic("unexpected token type from Tcl_ParseCommand");
+    }
+    return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseMakeTree --
+ *
+ *	Make the list representation of the parse tree of a command, a
+ *	list with the token list of each of its words.
+ *
+ * Results:
+ *	Returns a newly allocated list object.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ParseMakeTree(script, parsePtr)
+    char *script;		/* Pointer to start of script being parsed. */
+    Tcl_Parse *parsePtr;	/* Parse information. */
+{
+    Tcl_Obj *listPtr, *tokenPtr;
+    int i;
+
+    listPtr = Tcl_NewListObj(0, NULL);
+    i = 0;
+    while (i < parsePtr->numTokens) {
+	i = ParseMakeTokenList(script, parsePtr, i, &tokenPtr);
+	Tcl_ListObjAppendElement(NULL, listPtr, tokenPtr);
+    }
+    return listPtr;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -698,30 +1356,36 @@ ParseGetString(interp, script, index, length)
  * ParseCharIndex --
  *
  *	Converts byte oriented index values into character oriented
- *	index values.
+ *	index values.  Uses the index of the script if it has one; the
+ *	callers index scripts large enough to be worth it.
  *
  * Results:
  *	A standard Tcl result.
  *
  * Side effects:
- *	The interp's result is set.
+ *	The interp's result is set.  May make the character checkpoints
+ *	of the index.
  *
  *----------------------------------------------------------------------
  */
 
 static int 
-ParseCharIndex(interp, script, index, length)
+ParseCharIndex(interp, script, indexPtr, index, length)
     Tcl_Interp *interp;	    /* Current interpreter. */
     char *script;	    /* Script to parse. */
+    ScriptIndex *indexPtr;  /* The index of the script, or NULL. */
     int index;		    /* Index to the starting point of the 
 			     * script. */
     int length;	    /* Byte length of script be parsed. */ 
 {
-    Tcl_Obj *resultPtr;
+    int numChars;
 
-    resultPtr = Tcl_GetObjResult(interp);
-    resultPtr = Tcl_NewLongObj(Tcl_NumUtfChars(script, index));
-    Tcl_SetObjResult(interp, resultPtr);
+    if (indexPtr != NULL) {
+	numChars = ParseFindChar(indexPtr, index);
+    } else {
+	numChars = Tcl_NumUtfChars(script, index);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewLongObj(numChars));
     return TCL_OK;
 }
 
@@ -730,32 +1394,48 @@ ParseCharIndex(interp, script, index, length)
  *
  * ParseCharLength --
  *
- *	Converts the given byte length into a character count.
+ *	Converts the given byte length into a character count.  Uses
+ *	the index of the script if it has one and the range starts on a
+ *	character.
  *
  * Results:
  *	A standard Tcl result.
  *
  * Side effects:
- *	The interp's result is set.
+ *	The interp's result is set.  May make the character checkpoints
+ *	of the index.
  *
  *----------------------------------------------------------------------
  */
 
 static int 
-ParseCharLength(interp, script, index, length)
+ParseCharLength(interp, script, indexPtr, index, length)
     Tcl_Interp *interp;	    /* Current interpreter. */
     char *script;	    /* Script to parse. */
+    ScriptIndex *indexPtr;  /* The index of the script, or NULL. */
     int index;		    /* Index to the starting point of the 
 			     * script. */
     int length;	    /* Byte length of script be parsed. */ 
 {
-    Tcl_Obj *resultPtr;
+    int numChars;
 
-    resultPtr = Tcl_GetObjResult(interp);
-    resultPtr = Tcl_NewLongObj(Tcl_NumUtfChars(script+index, length));
-    Tcl_SetObjResult(interp, resultPtr);
+    if ((indexPtr != NULL) && indexPtr->isAscii) {
+	numChars = length;
+    } else if ((indexPtr != NULL) && ((script[index] & 0xC0) != 0x80)) {
+	/*
+	 * A byte that is not a UTF-8 continuation byte always starts a
+	 * character, so counting the characters before each end of the
+	 * range gives the same result as counting those in it.
+	 */
+
+	numChars = ParseFindChar(indexPtr, index + length)
+		- ParseFindChar(indexPtr, index);
+    } else {
+	numChars = Tcl_NumUtfChars(script + index, length);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewLongObj(numChars));
     return TCL_OK;
-;}
+}
 
 /*
  *----------------------------------------------------------------------
@@ -775,25 +1455,30 @@ ParseCharLength(interp, script, index, length)
  *	verify this.  Use the ParseGetIndexAndRange to validate
  *	the data.
  *
+ *	The count is taken from the line index of the script if it has
+ *	one, else the range is scanned.
+ *
  * Results:
  *	A standard Tcl result.
  *
  * Side effects:
  *	The interp's result is set to the number of newlines counted.
+ *	May make the line starts of the index.
  *
  *----------------------------------------------------------------------
  */
 
 static int 
-ParseCountNewline(interp, script, scriptLength, rangePtr1, rangePtr2)
+ParseCountNewline(interp, script, scriptLength, indexPtr, rangePtr1,
+	rangePtr2)
     Tcl_Interp *interp;	    /* Current interpreter. */
     char *script;	    /* Script to parse. */
-    int scriptLength;
+    int scriptLength;	    /* Its length, in bytes. */
+    ScriptIndex *indexPtr;  /* The index of the script, or NULL. */
     Tcl_Obj *rangePtr1;	    /* Begin counting newlines with this range. */
     Tcl_Obj *rangePtr2;	    /* Possibly NULL, otherwise used to terminate
 			     * newline counting */
 {
-    Tcl_Obj *resultPtr;
     char *subStr;
     char *endStr;
     int offset, index1, index2;
@@ -855,22 +1540,449 @@ ParseCountNewline(interp, script, scriptLength, rangePtr1, rangePtr2)
 	length = length1;
     }
 
-    subStr = (script + offset);
-    endStr = (subStr + length);
     numNewline = 0;
-    while (subStr < endStr) {
-	if (*subStr == '\n') {
-	    numNewline++;
+    if (length > 0) {
+	if (indexPtr != NULL) {
+	    numNewline = ParseFindLine(indexPtr, offset + length)
+		    - ParseFindLine(indexPtr, offset);
+	} else {
+	    subStr = (script + offset);
+	    endStr = (subStr + length);
+	    while ((subStr = memchr(subStr, '\n',
+		    (size_t) (endStr - subStr))) != NULL) {
+		numNewline++;
+		subStr++;
+	    }
 	}
-	subStr++;
     }
-    
-    resultPtr = Tcl_GetObjResult(interp);
-    resultPtr = Tcl_NewIntObj(numNewline);
-    Tcl_SetObjResult(interp, resultPtr);
- 
+
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(numNewline));
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseLine --
+ *
+ *	Find the line holding a byte of a script.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The interp's result is set to the number of the line, starting
+ *	at 1.  May make the line starts of the index.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseLine(interp, indexPtr, index)
+    Tcl_Interp *interp;	    /* Current interpreter. */
+    ScriptIndex *indexPtr;  /* The index of the script. */
+    int index;		    /* Byte offset in the script. */
+{
+    Tcl_SetObjResult(interp,
+	    Tcl_NewIntObj(ParseFindLine(indexPtr, index) + 1));
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseLineOffset --
+ *
+ *	Find the range of a line of a script.  Line numbers start at 1,
+ *	numbers out of the script are set to the closest line.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The interp's result is set to the range of the line, without
+ *	its newline.  May make the line starts of the index.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseLineOffset(interp, indexPtr, line)
+    Tcl_Interp *interp;	    /* Current interpreter. */
+    ScriptIndex *indexPtr;  /* The index of the script. */
+    int line;		    /* The number of the line. */
+{
+    int start, end;
+
+    ParseFindLine(indexPtr, 0);		/* Makes the line starts. */
+    if (line < 1) {
+	line = 1;
+    } else if (line > indexPtr->numLines) {
+	line = indexPtr->numLines;
+    }
+    start = indexPtr->lineStarts[line - 1];
+    if (line < indexPtr->numLines) {
+	end = indexPtr->lineStarts[line] - 1;
+    } else {
+	end = indexPtr->length;
+    }
+    Tcl_SetObjResult(interp, ParseMakeRange(indexPtr->bytes,
+	    indexPtr->bytes + start, end - start));
     return TCL_OK;
 }
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseGetScriptIndex --
+ *
+ *	Find the index of a script in the cache of the parse command,
+ *	and, if asked to, start one when it is not there, replacing the
+ *	oldest entry of the cache.
+ *
+ * Results:
+ *	Returns the index, or NULL if the script is not indexed and
+ *	create is 0.
+ *
+ * Side effects:
+ *	May start an index, and hold a reference to the script.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static ScriptIndex *
+ParseGetScriptIndex(dataPtr, scriptObj, create)
+    ParseData *dataPtr;	    /* The data of the parse command. */
+    Tcl_Obj *scriptObj;	    /* Script to find the index of. */
+    int create;		    /* Whether to index the script if it is not
+			     * in the cache. */
+{
+    ScriptIndex *indexPtr;
+    char *script;
+    int i, length;
+
+    script = Tcl_GetStringFromObj(scriptObj, &length);
+    for (i = 0; i < INDEX_CACHE_SIZE; i++) {
+	indexPtr = &dataPtr->indexCache[i];
+	if ((indexPtr->scriptObj == scriptObj)
+		&& (indexPtr->bytes == script)
+		&& (indexPtr->length == length)) {
+	    return indexPtr;
+	}
+    }
+    if (!create) {
+	return NULL;
+    }
+
+    indexPtr = &dataPtr->indexCache[dataPtr->nextEntry];
+    dataPtr->nextEntry = (dataPtr->nextEntry + 1) % INDEX_CACHE_SIZE;
+    ParseFreeScriptIndex(indexPtr);
+    ParseInitScriptIndex(indexPtr, scriptObj);
+    return indexPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseInitScriptIndex --
+ *
+ *	Start the index of a script.  Only the ASCII flag is computed,
+ *	the line starts and character checkpoints are made when first
+ *	needed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Holds a reference to the script.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ParseInitScriptIndex(indexPtr, scriptObj)
+    ScriptIndex *indexPtr;  /* The index to start. */
+    Tcl_Obj *scriptObj;	    /* Script to index. */
+{
+    indexPtr->scriptObj = scriptObj;
+    Tcl_IncrRefCount(scriptObj);
+    indexPtr->bytes = Tcl_GetStringFromObj(scriptObj, &indexPtr->length);
+    indexPtr->isAscii = ParseIsAscii(indexPtr->bytes, indexPtr->length);
+    indexPtr->numLines = 0;
+    indexPtr->lineStarts = NULL;
+    indexPtr->numChecks = 0;
+    indexPtr->charChecks = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseFreeScriptIndex --
+ *
+ *	Free the index of a script, if the entry is in use.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Releases the script, and frees its line starts and character
+ *	checkpoints.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ParseFreeScriptIndex(indexPtr)
+    ScriptIndex *indexPtr;  /* The index to free. */
+{
+    if (indexPtr->scriptObj == NULL) {
+	return;
+    }
+    Tcl_DecrRefCount(indexPtr->scriptObj);
+    indexPtr->scriptObj = NULL;
+    if (indexPtr->lineStarts != NULL) {
+	ckfree((char *) indexPtr->lineStarts);
+	indexPtr->lineStarts = NULL;
+    }
+    if (indexPtr->charChecks != NULL) {
+	ckfree((char *) indexPtr->charChecks);
+	indexPtr->charChecks = NULL;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseIsAscii --
+ *
+ *	Check whether a string is pure ASCII.  The bytes are or'ed
+ *	together a block at a time, a loop compilers turn into vector
+ *	code, and checked at the end of each block.
+ *
+ * Results:
+ *	Returns 1 if no byte of the string has its high bit set, else 0.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseIsAscii(bytes, length)
+    CONST char *bytes;	    /* The string to check. */
+    int length;		    /* Its length, in bytes. */
+{
+    CONST unsigned char *p = (CONST unsigned char *) bytes;
+    unsigned char bits;
+    int i, n;
+
+    while (length > 0) {
+	n = (length < 256) ? length : 256;
+	bits = 0;
+	for (i = 0; i < n; i++) {
+	    bits |= p[i];
+	}
+	if (bits & 0x80) {
+	    return 0;
+	}
+	p += n;
+	length -= n;
+    }
+    return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseFindChar --
+ *
+ *	Count the characters before a byte of an indexed script, as
+ *	Tcl_NumUtfChars would.  For an ASCII script that is the byte
+ *	offset itself, else the count starts at the closest checkpoint
+ *	of the character index, which is made on first use.
+ *
+ * Results:
+ *	Returns the number of characters.
+ *
+ * Side effects:
+ *	May make the character checkpoints of the script.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseFindChar(indexPtr, offset)
+    ScriptIndex *indexPtr;  /* The index of the script. */
+    int offset;		    /* Byte offset in the script. */
+{
+    CONST char *p, *end;
+    CharCheck *checkPtr;
+    Tcl_UniChar ch;
+    int k, numChars;
+
+    if (indexPtr->isAscii) {
+	return offset;
+    }
+
+    if (indexPtr->charChecks == NULL) {
+	/*
+	 * Step through the characters as Tcl_NumUtfChars does, noting
+	 * the first character boundary at or after every step.
+	 */
+
+	indexPtr->numChecks = indexPtr->length / CHAR_CHECK_STEP + 1;
+	indexPtr->charChecks = (CharCheck *)
+		ckalloc(indexPtr->numChecks * sizeof(CharCheck));
+	p = indexPtr->bytes;
+	end = p + indexPtr->length;
+	numChars = 0;
+	for (k = 0; k < indexPtr->numChecks; k++) {
+	    while (p < indexPtr->bytes + k * CHAR_CHECK_STEP) {
+		p += Tcl_UtfToUniChar(p, &ch);
+		numChars++;
+	    }
+	    if (p > end) {
+		p = end;
+	    }
+	    indexPtr->charChecks[k].byte = (int) (p - indexPtr->bytes);
+	    indexPtr->charChecks[k].chars = numChars;
+	}
+    }
+
+    k = offset / CHAR_CHECK_STEP;
+    if (k >= indexPtr->numChecks) {
+	k = indexPtr->numChecks - 1;
+    }
+    checkPtr = &indexPtr->charChecks[k];
+    if ((checkPtr->byte > offset) && (k > 0)) {
+	checkPtr--;
+    }
+    return checkPtr->chars + Tcl_NumUtfChars(indexPtr->bytes + checkPtr->byte,
+	    offset - checkPtr->byte);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseFindLine --
+ *
+ *	Find the line holding a byte of an indexed script, by a binary
+ *	search of the line starts, which are made on first use.
+ *
+ * Results:
+ *	Returns the number of the line, starting at 0.
+ *
+ * Side effects:
+ *	May make the line starts of the script.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseFindLine(indexPtr, offset)
+    ScriptIndex *indexPtr;  /* The index of the script. */
+    int offset;		    /* Byte offset in the script. */
+{
+    CONST char *p, *end;
+    int low, high, middle, numLines;
+
+    if (indexPtr->lineStarts == NULL) {
+	/*
+	 * Count the lines first, to allocate the line starts at their
+	 * size.
+	 */
+
+	end = indexPtr->bytes + indexPtr->length;
+	numLines = 1;
+	for (p = indexPtr->bytes;
+		(p = memchr(p, '\n', (size_t) (end - p))) != NULL; p++) {
+	    numLines++;
+	}
+	indexPtr->numLines = numLines;
+	indexPtr->lineStarts = (int *) ckalloc(numLines * sizeof(int));
+	indexPtr->lineStarts[0] = 0;
+	numLines = 1;
+	for (p = indexPtr->bytes;
+		(p = memchr(p, '\n', (size_t) (end - p))) != NULL; p++) {
+	    indexPtr->lineStarts[numLines++] = (int) (p + 1 - indexPtr->bytes);
+	}
+    }
+
+    /*
+     * Find the last line starting at or before the offset.
+     */
+
+    low = 0;
+    high = indexPtr->numLines - 1;
+    while (low < high) {
+	middle = (low + high + 1) / 2;
+	if (indexPtr->lineStarts[middle] <= offset) {
+	    low = middle;
+	} else {
+	    high = middle - 1;
+	}
+    }
+    return low;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseDeleteData --
+ *
+ *	Release the data of the parse command, when it is deleted.
+ *	The parse handles still open keep using it until they are
+ *	deleted too.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The data is freed by ParseFreeData, once no handle uses it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ParseDeleteData(clientData)
+    ClientData clientData;  /* The ParseData of the command. */
+{
+    Tcl_EventuallyFree(clientData, ParseFreeData);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseFreeData --
+ *
+ *	Free the data of the parse command.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Frees the script indices and releases their scripts, and the
+ *	names of the token types.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ParseFreeData(blockPtr)
+    char *blockPtr;	    /* The ParseData of the command. */
+{
+    ParseData *dataPtr = (ParseData *) blockPtr;
+    int i;
+
+    for (i = 0; i < INDEX_CACHE_SIZE; i++) {
+	ParseFreeScriptIndex(&dataPtr->indexCache[i]);
+    }
+    for (i = 0; i < NUM_TOKEN_TYPES; i++) {
+	Tcl_DecrRefCount(dataPtr->typeObjs[i]);
+    }
+    ckfree((char *) dataPtr);
+}
 
 /*
  *----------------------------------------------------------------------
@@ -1216,7 +1216,34 @@ proc ::tclapp::wrapengine::Put {compile license src dst} {
 	} {
 	    log::log debug "Compile internal ($requested)"
 
-	    uplevel #0 [list ::compiler::compile -preamble $license $nativesrc $dst]
+	    # Compile in memory and write the image into the
+	    # destination ourselves. Errors of the compiler name the
+	    # line only, add the file, and the destination gets the
+	    # permissions of the source, as compiler::compile did. The
+	    # image is written as raw bytes, with the platform's line
+	    # endings, again as compiler::compile did.
+
+	    set in [open $nativesrc r]
+	    set script [read $in]
+	    close $in
+
+	    if {[catch {
+		uplevel #0 [list ::compiler::compileString -preamble $license -- $script]
+	    } image]} {
+		return -code error -errorinfo "$::errorInfo\n    (file \"$nativesrc\")" \
+		    "Compile of \"$nativesrc\" failed: $image"
+	    }
+
+	    set out [open $dst w]
+	    fconfigure $out -encoding binary
+	    puts -nonewline $out $image
+	    close $out
+
+	    global tcl_platform
+	    if {$tcl_platform(platform) eq "unix"} {
+		file attributes $dst -permissions \
+		    [file attributes $nativesrc -permissions]
+	    }
 	} else {
 	    variable cprefix
 	    variable compdir